@@ -0,0 +1,80 @@
+#pragma once
+#include "config.hpp"
+#include "memory_budget.hpp"
+#include "storage_engine.hpp"
+#include "workload.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace kv {
+
+// a model the tuner looks at in a round
+struct OpenModel {
+  std::string name;
+  std::shared_ptr<StorageEngine> engine;
+};
+
+// one change of a setting, a line of the model's tuning.log
+struct TuningDecision {
+  std::string setting;
+  double from, to;
+  std::string why;
+};
+
+// picks the settings of each model from its workload (workload.hpp): the
+// size and bloom filters of its new segments, how much garbage gets a
+// segment compacted (Tuning) and its share of the memory budget. once per
+// interval the first caller of due() runs a round over the open models, the
+// workload since the round before decides. the changes go to the engine, to
+// the model's tuning.json, which its next open starts from, and as json lines
+// with the workload behind them to its tuning.log
+class AutoTuner {
+  struct Model {
+    std::shared_ptr<WorkloadStats> stats = std::make_shared<WorkloadStats>();
+    WorkloadSnapshot seen; // at the last round
+    Tuning tuning;
+    size_t share = 0;    // bytes of the memory budget
+    bool loaded = false; // tuning.json was looked at
+  };
+
+  const Config &config;
+  MemoryBudget &memory;
+  std::atomic<uint64_t> last_round;
+  std::mutex mu; // guards models, held over a round
+  std::map<std::string, Model> models;
+
+  std::string dirOf(const std::string &model) const;
+  Tuning defaults() const;
+  void load(const std::string &model, Model &m);
+  void save(const std::string &model, const Model &m);
+  void decide(StorageEngine &engine, const WorkloadSnapshot &w, Tuning &t,
+              std::vector<TuningDecision> &out);
+
+public:
+  AutoTuner(const Config &config, MemoryBudget &memory);
+  // the stats the engine of model counts into and, unless tuning is off, the
+  // settings tuned for it before
+  void prepare(const std::string &model, StorageOptions &opts);
+  // true for the first caller once the interval is over, it runs the round
+  bool due();
+  void round(const std::vector<OpenModel> &open);
+  // the model was deleted
+  void forget(const std::string &model);
+
+  struct Report {
+    Tuning tuning;
+    size_t share;
+    WorkloadSnapshot workload; // since the server started
+    std::vector<std::string> log; // the last lines of tuning.log
+  };
+  // the models the tuner knows, log_lines of their tuning.log each
+  std::map<std::string, Report> report(size_t log_lines);
+};
+
+} // namespace kv
@@ -0,0 +1,136 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kv {
+
+// where a value kept out of line is, a REC_BLOB record stores this (encoded)
+// in place of the value
+struct BlobRef {
+  uint32_t file = 0;
+  uint64_t offset = 0;
+  uint64_t len = 0;
+  uint32_t crc = 0; // of the whole value
+};
+
+constexpr size_t BLOB_REF_SIZE = 24;
+void encodeBlobRef(std::string &out, const BlobRef &ref);
+bool decodeBlobRef(std::string_view in, BlobRef &ref);
+
+// one append only blob_<id>.blob file, open while a handle or the store has it
+struct BlobFile {
+  uint32_t id;
+  std::string path;
+  int fd = -1;
+  std::atomic<uint64_t> end{0}; // bytes handed out
+
+  BlobFile(uint32_t id, const std::string &path, int fd, uint64_t end)
+      : id(id), path(path), fd(fd), end(end) {}
+  ~BlobFile();
+};
+
+// a value to be read piece by piece, e.g. for a range request. it keeps the
+// blob file open, so the value stays readable even if it is overwritten and
+// collected meanwhile. a value stored inline comes in the same kind of handle
+class BlobHandle {
+  std::shared_ptr<BlobFile> file; // null for an inline value
+  uint64_t offset = 0;
+  uint64_t len = 0;
+  std::string inline_val;
+  uint8_t rec_flags = 0;
+
+public:
+  BlobHandle() = default;
+  BlobHandle(std::shared_ptr<BlobFile> file, uint64_t offset, uint64_t len,
+             uint8_t flags)
+      : file(std::move(file)), offset(offset), len(len), rec_flags(flags) {}
+  BlobHandle(std::string val, uint8_t flags)
+      : len(val.size()), inline_val(std::move(val)), rec_flags(flags) {}
+
+  uint64_t size() const { return len; }
+  uint8_t flags() const { return rec_flags; } // RecordFlags, no REC_BLOB
+  // appends the n bytes of the value from at on to out (fewer at its end),
+  // false on a read error
+  bool read(uint64_t at, size_t n, std::string &out) const;
+};
+
+class BlobStore;
+
+// a value streamed into the blob log without having all of it in memory.
+// it has room for exactly the length it was opened with, the writes fill it
+// in order. StorageEngine::put_blob stores it under a key, the space of one
+// dropped before that is garbage
+class BlobWriter {
+  BlobStore *store;
+  std::shared_ptr<BlobFile> file;
+  BlobRef ref;
+  uint64_t done = 0;
+  bool failed = false;
+  bool kept = false;
+
+public:
+  BlobWriter(BlobStore *store, std::shared_ptr<BlobFile> file, uint64_t offset,
+             uint64_t len);
+  ~BlobWriter();
+  BlobWriter(const BlobWriter &) = delete;
+  BlobWriter &operator=(const BlobWriter &) = delete;
+
+  // false on a write error or past the length
+  bool write(std::string_view chunk);
+  bool complete() const { return !failed && done == ref.len; }
+  uint64_t size() const { return ref.len; }
+  // the finished value, after this the writer no longer owns its space
+  const BlobRef &keep() {
+    kept = true;
+    return ref;
+  }
+};
+
+// the values of a model that are too big to go into its segments. they are
+// appended to blob_<id>.blob files next to the segments, which get replaced
+// by a new one once they reach file_size. the index stays small and dense
+// and compaction only moves the refs, the big values are written once and
+// read straight out of their file.
+// compaction reports the refs it dropped, the garbage of every file is
+// counted in blobs.dead and a file goes away once all of it is garbage.
+// a blob file is never rewritten, the partly dead ones stay as they are
+class BlobStore {
+  std::string dir;
+  uint64_t file_size;
+  std::mutex mu; // guards files, active and dead
+  std::map<uint32_t, std::shared_ptr<BlobFile>> files;
+  // takes the new values, null until the first one after an open (the files
+  // from before may be shared with a snapshot)
+  std::shared_ptr<BlobFile> active;
+  uint32_t next_id = 1;
+  std::map<uint32_t, uint64_t> dead; // garbage bytes per file
+
+  std::shared_ptr<BlobFile> reserve(uint64_t len, uint64_t &offset);
+  void collect();
+  void saveDead();
+
+public:
+  BlobStore(const std::string &dir, uint64_t file_size);
+  // appends val, false if it could not be written
+  bool put(std::string_view val, BlobRef &ref);
+  // room for a value of len bytes, null if no file could be created
+  std::unique_ptr<BlobWriter> open(uint64_t len);
+  // the whole value, false on read errors or a crc mismatch
+  bool get(const BlobRef &ref, std::string &out);
+  bool get(const BlobRef &ref, char *out);
+  bool handle(const BlobRef &ref, uint8_t flags, BlobHandle &out);
+  // the values nothing points at any more, their files go once all dead
+  void release(const std::vector<BlobRef> &refs);
+  // hard links every blob file (and blobs.dead) into dest. the new values
+  // go to a new file from here on, so the linked ones are not appended to
+  bool linkInto(const std::string &dest);
+};
+
+} // namespace kv
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <utility>
+
+namespace kv {
+
+// caller owned read buffer for StorageEngine::get_into. a whole record is read
+// into it and value() points at the value inside, so nothing gets copied (for a
+// mmap'd segment value() points into the mapping, kept open). the storage only
+// ever grows, a reused buffer makes the reads allocation free
+class Buffer {
+  std::unique_ptr<char[]> storage;
+  size_t cap = 0;
+  std::string_view val;
+  std::string_view rec_clock;
+  uint8_t rec_flags = 0;
+  uint64_t rec_expires = 0;
+  uint64_t rec_version = 0;
+  // what value() points into when that is not storage, a mapped segment a
+  // compaction could drop meanwhile
+  std::shared_ptr<const void> pinned;
+
+public:
+  Buffer(size_t initial = 4096) { reserve(initial); }
+
+  // room for n bytes, the old content is dropped when it has to grow
+  char *reserve(size_t n) {
+    if (n > cap) {
+      size_t next = cap ? cap : 64;
+      while (next < n)
+        next *= 2;
+      storage.reset(new char[next]);
+      cap = next;
+    }
+    return storage.get();
+  }
+
+  char *data() { return storage.get(); }
+  size_t capacity() const { return cap; }
+
+  // the value of the last successful read, valid until the next one
+  std::string_view value() const { return val; }
+  uint8_t flags() const { return rec_flags; }
+  // the version vector of a versioned record, empty otherwise
+  std::string_view clock() const { return rec_clock; }
+  uint64_t expires_at() const { return rec_expires; } // 0 never
+  uint64_t version() const { return rec_version; }    // see RecordView
+  void set_value(std::string_view v, uint8_t f, std::string_view c = {},
+                 uint64_t expires = 0, uint64_t version = 0) {
+    val = v;
+    rec_flags = f;
+    rec_clock = c;
+    rec_expires = expires;
+    rec_version = version;
+  }
+  void pin(std::shared_ptr<const void> owner) { pinned = std::move(owner); }
+  void clear() {
+    pinned.reset();
+    val = {};
+    rec_clock = {};
+    rec_expires = 0;
+    rec_version = 0;
+  }
+};
+
+} // namespace kv
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace kv {
+
+enum class BulkFormat {
+  JsonLines, // an object per line, every member is a key and its value
+  Csv        // key,value per line, both may be "quoted"
+};
+
+struct BulkOptions {
+  BulkFormat format = BulkFormat::JsonLines;
+  size_t threads = 0;            // 0 uses every core
+  size_t run_bytes = 64 << 20;   // input sorted in memory at once, per thread
+  size_t segment_size = 64 << 20;
+};
+
+struct BulkStats {
+  size_t lines = 0;
+  size_t bad_lines = 0; // could not be parsed, skipped
+  size_t records = 0;   // written, only the last value of every key
+  size_t segments = 0;
+  size_t bytes = 0; // of the segment files
+};
+
+// builds finished segments (.kv, .idx and .bf) out of a big input without
+// going through an engine, StorageEngine::attach then adds them to the model.
+// the input is cut into runs that get parsed, hash partitioned, sorted by key
+// and spilled to disk on all the cores. every partition then merges its part
+// of the runs straight into segments, a later line wins over an earlier one
+// with the same key. all the files live in staging, which goes away with the
+// loader (attached segments were moved out of it)
+class BulkLoader {
+  struct Run {
+    std::string path;
+    std::vector<uint64_t> starts; // offset of every partition, then the end
+  };
+
+  std::string staging;
+  BulkOptions opts;
+  size_t threads;
+  std::mutex mu; // guards runs and the stats while building
+  std::vector<Run> runs;
+  std::vector<std::string> built; // paths without the extension
+
+  bool spill(const std::string &chunk, uint64_t run_no, BulkStats &stats);
+  bool merge(size_t partition, const std::vector<int> &fds,
+             std::vector<std::string> &out, BulkStats &stats);
+
+public:
+  BulkLoader(const std::string &staging, const BulkOptions &opts);
+  ~BulkLoader();
+  // false if the staging files could not be written
+  bool build(std::istream &in, BulkStats &stats);
+  const std::vector<std::string> &segments() const { return built; }
+};
+
+} // namespace kv
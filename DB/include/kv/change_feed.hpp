@@ -0,0 +1,66 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kv {
+
+// a Merge event has the operands as its value (see describeOperands)
+enum class ChangeOp : uint8_t { Put, Erase, Merge };
+
+// one write of a model, in the order the index saw them
+struct ChangeEvent {
+  uint64_t seq = 0; // increasing, also across reopens of the model
+  ChangeOp op;
+  uint8_t flags; // RecordFlags of the value
+  std::string key;
+  std::string value;
+};
+
+using ChangeEventPtr = std::shared_ptr<const ChangeEvent>;
+
+// the recent writes of one model, for the change streams. a fixed ring of the
+// last `capacity` events: writers claim a sequence number with one atomic add
+// and swap their event into its slot, readers never block the writers and a
+// reader that got lapped finds out from the sequence number in the slot
+class ChangeFeed {
+  std::vector<std::shared_ptr<ChangeEvent>> ring;
+  size_t mask;
+  uint64_t first;            // sequence number of the first event
+  std::atomic<uint64_t> next; // sequence number of the next event
+
+  // told about every publish, e.g. to wake up whoever streams the changes
+  std::mutex listen_mu;
+  std::vector<std::shared_ptr<std::function<void()>>> listeners;
+  std::atomic<bool> has_listeners{false};
+
+public:
+  ChangeFeed(size_t capacity, uint64_t first_seq);
+
+  static std::shared_ptr<ChangeEvent> make(ChangeOp op, std::string_view key,
+                                           std::string_view value,
+                                           uint8_t flags);
+  // appends ev and returns its sequence number. callers publishing changes of
+  // the same key have to be serialized (the index lock does that)
+  uint64_t publish(std::shared_ptr<ChangeEvent> ev);
+
+  enum class ReadStatus { Ok, Gap };
+  // appends the events from seq `from` on (at most max of them) to out and
+  // moves from past them. Gap if from was overwritten already, oldest() is
+  // where the history starts then
+  ReadStatus read(uint64_t &from, size_t max, std::vector<ChangeEventPtr> &out);
+  uint64_t head() const { return next.load() - 1; } // last one handed out
+  uint64_t oldest() const;
+  size_t capacity() const { return ring.size(); }
+
+  // adds fn unless it is there already
+  void listen(const std::shared_ptr<std::function<void()>> &fn);
+};
+
+} // namespace kv
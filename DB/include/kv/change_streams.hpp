@@ -0,0 +1,75 @@
+#pragma once
+#include "change_feed.hpp"
+#include "model_registry.hpp"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+namespace kv {
+
+// which changes a subscriber wants, empty fields match everything
+struct StreamFilter {
+  std::string key;    // only this key
+  std::string prefix; // only the keys starting with this
+  bool matches(std::string_view k) const {
+    if (!key.empty() && k != key)
+      return false;
+    return k.substr(0, prefix.size()) == prefix;
+  }
+};
+
+// where the messages of a subscriber go (a websocket for the server). send
+// must not block, returning false drops the subscriber
+struct StreamSink {
+  std::function<bool(const std::string &msg)> send;
+  std::function<void(const std::string &reason)> close;
+};
+
+// fans the change feeds of the models out to the subscribers. one pump thread
+// does all of them, it wakes up on every publish of a feed somebody listens to
+class ChangeStreams {
+  struct Subscriber {
+    EngineHandle engine; // keeps the model and its feed open
+    ChangeFeed *feed;
+    uint64_t cursor; // next sequence number to send
+    StreamFilter filter;
+    StreamSink sink;
+  };
+  struct Signal {
+    std::mutex mu;
+    std::condition_variable cv;
+    bool pending = false;
+    bool stop = false;
+  };
+
+  std::mutex mu; // guards subs, held by the pump while it sends
+  std::unordered_map<uint64_t, Subscriber> subs;
+  uint64_t next_id = 1;
+  // shared with the feeds, they may outlive this
+  std::shared_ptr<Signal> signal;
+  std::shared_ptr<std::function<void()>> wake;
+  std::thread pump;
+
+  void run();
+  bool deliver(Subscriber &s);
+  static std::string encode(const ChangeEvent &ev);
+
+public:
+  ChangeStreams();
+  ~ChangeStreams();
+  // since is the last sequence number the client has seen, 0 for only the
+  // changes from now on. 0 if the model has no change feed
+  uint64_t subscribe(EngineHandle engine, uint64_t since, StreamFilter filter,
+                     StreamSink sink);
+  void unsubscribe(uint64_t id);
+  size_t size();
+};
+
+} // namespace kv
@@ -0,0 +1,157 @@
+#pragma once
+#include "config.hpp"
+#include "model_registry.hpp"
+#include "thread_pool.hpp"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace kv {
+
+// the version of a value in the cluster: a counter per node that coordinated
+// a write of it, the wall clock time of the newest write and whether that one
+// was a delete. stored with the record (REC_CLOCK)
+struct VersionVector {
+  std::map<uint16_t, uint64_t> counters;
+  uint64_t timestamp = 0; // ms since the epoch
+  bool deleted = false;
+
+  enum class Order { Before, After, Equal, Concurrent };
+  Order compare(const VersionVector &o) const;
+  // this one is the value to keep: it descends from o, or the two are
+  // concurrent and this one was written last
+  bool newer_than(const VersionVector &o) const;
+  void merge(const VersionVector &o); // the counters only
+
+  std::string encode() const;
+  static bool decode(std::string_view in, VersionVector &out);
+  // the form handed to the clients (X-Context), hex of encode()
+  std::string context() const;
+  static bool from_context(std::string_view hex, VersionVector &out);
+};
+
+// consistent hashing: every node owns `vnodes` positions on a 64 bit ring, a
+// key belongs to the nodes found walking clockwise from its hash
+class HashRing {
+  std::vector<std::pair<uint64_t, uint16_t>> tokens; // sorted by position
+  size_t nodes;
+
+public:
+  HashRing(const std::vector<std::string> &names, size_t vnodes);
+  static uint64_t position(std::string_view model, std::string_view key);
+  // every node once, in the order of the walk from pos
+  std::vector<uint16_t> walk(uint64_t pos) const;
+};
+
+// replicas per key, and the replies a read or acks a write waits for
+struct Quorum {
+  size_t n, r, w;
+};
+
+// what a read found, clock is merged over all the replies so a write with it
+// as context supersedes everything the reader saw
+struct ClusterValue {
+  bool found = false;
+  std::string value;
+  uint8_t flags = 0;
+  VersionVector clock;
+};
+
+struct ClusterNodeStatus {
+  std::string addr;
+  bool self = false;
+  bool up = false;
+  size_t hinted_bytes = 0; // writes held here until it is back
+};
+
+// Dynamo style cluster mode. every node takes requests, the coordinator sends
+// a key to the first n nodes of its walk on the ring and waits for r replies
+// (reads) or w acks (writes). a node that is down is replaced by the next one
+// on the walk, which keeps the write as a hint and hands it over once the node
+// is back. conflicting versions resolve last writer wins, reads repair the
+// replicas they found behind
+class Cluster {
+  struct Peer {
+    std::string addr, host, port;
+    std::mutex mu;         // guards idle and down_until
+    std::vector<int> idle; // pooled connections
+    uint64_t down_until = 0;
+    ~Peer();
+  };
+  struct Conn {
+    int fd;
+    std::thread thread;
+    std::atomic<bool> done{false};
+  };
+  struct Stored; // one node's copy of a key
+
+  ModelRegistry &registry;
+  const Config &config;
+  uint16_t self;
+  HashRing ring;
+  std::vector<std::unique_ptr<Peer>> peers;
+  std::atomic<uint64_t> counter; // this node's entries in the clocks
+  // serializes the read-compare-write of a key's version on this node
+  std::array<std::mutex, 64> key_locks;
+  ThreadPool fanout; // the calls to the other nodes
+  std::atomic<bool> stop{false};
+
+  int listen_fd = -1;
+  std::thread acceptor;
+  std::mutex conns_mu;
+  std::list<Conn> conns;
+
+  std::mutex hint_mu; // guards the hint files
+  std::thread handoff;
+
+  bool up(uint16_t node);
+  void mark_down(uint16_t node);
+  bool call(uint16_t node, char type, const std::string &req,
+            std::string &reply);
+  std::string handle(char type, const std::string &req, char &reply_type);
+  void accept_loop();
+  void serve(Conn &conn);
+
+  bool apply_local(const std::string &model, std::string_view key,
+                   std::string_view val, uint8_t flags, uint64_t expires_at,
+                   const VersionVector &clock);
+  bool get_local(const std::string &model, std::string_view key, Stored &out);
+  void add_hint(uint16_t node, const std::string &req);
+  void handoff_loop();
+  bool write(const std::string &model, std::string_view key,
+             std::string_view val, uint8_t flags, uint64_t ttl_ms,
+             VersionVector clock, const Quorum &q);
+
+public:
+  Cluster(ModelRegistry &registry, const Config &config);
+  ~Cluster();
+  bool start();
+  Quorum defaults() const;
+  // false if the quorum was not reached
+  bool put(const std::string &model, std::string_view key,
+           std::string_view val, bool is_json, uint64_t ttl_ms,
+           const VersionVector *context, const Quorum &q);
+  bool erase(const std::string &model, std::string_view key,
+             const VersionVector *context, const Quorum &q);
+  bool get(const std::string &model, std::string_view key, const Quorum &q,
+           ClusterValue &out);
+  // every live key of the model on the nodes that answer, complete is false
+  // if some did not
+  std::vector<std::pair<std::string, ClusterValue>>
+  scan(const std::string &model, bool &complete);
+  void create(const std::string &model);
+  void drop(const std::string &model);
+  std::vector<ClusterNodeStatus> status();
+};
+
+} // namespace kv
@@ -1,20 +1,60 @@
 #pragma once
 #include <cstddef>
+#include <map>
 #include <string>
+#include <vector>
 
 namespace kv {
 
 // the main config object
 struct Config {
-  std::string data_dir;  // the directory where all the segments will live
-  size_t segment_size;   // the size of each segments
-  std::string file_ext;  // extension of the file
-  std::string index_ext; // new
-  std::string bloom_ext; // new
-  size_t bloom_bits_kb;  // new
-  size_t bloom_hashes;   // new
-  size_t thread_pool_sz; // new
+  std::string data_dir;       // the directory where all the segments will live
+  size_t segment_size;        // the size of each segments
+  std::string file_ext;       // extension of the file
+  std::string index_ext;      // new
+  std::string bloom_ext;      // new
+  size_t bloom_bits_kb;       // new
+  size_t bloom_hashes;        // new
+  size_t thread_pool_sz;      // http threads, also open the models at start
+  size_t scan_concurrency;    // whole model and range reads at once
+  size_t scan_queue_depth;    // more of them waiting, the next get a 429
+  size_t bulk_concurrency;    // bulk loads, snapshots and restores at once
+  size_t bulk_queue_depth;    // more of them waiting
+  size_t max_open_models;     // engines kept open at once by the server
+  size_t memory_budget;       // bytes of indexes and filters kept, 0 no cap
+  std::string io_engine;      // "uring" or "pread"
+  size_t io_queue_depth;      // io_uring submission queue size
+  size_t checkpoint_interval; // bytes appended between index checkpoints
+  double compact_dead_ratio;  // garbage share that gets a segment compacted
+  size_t auto_tune_interval;  // ms between the tuning rounds, 0 off
+  size_t change_feed_size;    // recent writes per model for /changes, 0 off
+  size_t blob_threshold;      // values from this size on go to the blob log
+  bool preallocate_segments;  // allocate the segment files up front
+  bool direct_io;             // hash appends bypass the page cache
+  std::string engine;         // storage of the new models, "hash" or "lsm"
+  std::map<std::string, std::string> model_engines; // per model overrides
+  size_t http_port;           // where the api listens
+  size_t resp_port;           // the redis protocol, 0 off
+  size_t resp_threads;        // its event loops
+  double trace_sample_rate;   // share of the requests traced, 0 off
+  size_t replication_port;    // ships the logs to the replicas, 0 off
+  std::string replicate_from; // "host:port" of the leader, makes a replica
+  size_t replica_max_lag_ms;  // replica reads fail when further behind
+  // cluster mode: "host:port" of every node's cluster port, the same list on
+  // all of them. empty runs a single node
+  std::vector<std::string> cluster_nodes;
+  size_t cluster_self;        // which of cluster_nodes this one is
+  size_t cluster_vnodes;      // ring positions per node
+  size_t cluster_n;           // default replicas per key
+  size_t cluster_r;           // default replies a read waits for
+  size_t cluster_w;           // default acks a write waits for
+  size_t cluster_timeout_ms;  // how long a node gets to answer
+  std::string hints_dir;      // writes kept for nodes that were down
+  // hard linked model snapshots, on the same file system as data_dir
+  std::string snapshot_dir;
   static Config load(std::string conf_path);
+  // the engine a new model gets, an existing one keeps the kind of its files
+  const std::string &engine_of(const std::string &model) const;
 };
 
 } // namespace kv
@@ -0,0 +1,131 @@
+#pragma once
+#include "blob_store.hpp"
+#include "buffer.hpp"
+#include "change_feed.hpp"
+#include "io_engine.hpp"
+#include "segment_manager.hpp"
+#include "storage_engine.hpp"
+#include "timing_wheel.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kv {
+
+struct ScanBatch; // the records a worker of scan_records hands over
+
+// the log structured engine: records are appended to segments and every key
+// has an entry in the in-memory index of its segment
+class HashEngine : public StorageEngine {
+  StorageOptions opts;
+  std::shared_ptr<IoEngine> io;
+  SegmentMgr seg_mgr;
+  std::string dir; // where the files are at
+  std::shared_mutex ind_mu;
+  BlobStore blobs; // the big values
+
+  std::atomic<size_t> since_checkpoint{0};
+  std::atomic<bool> checkpoint_queued{false};
+
+  // TTL timers of the keys, advanced by the callers at most once per tick
+  TimingWheel wheel;
+  std::atomic<uint64_t> last_expire_tick{0};
+
+  std::unique_ptr<ChangeFeed> feed; // null if the options turned it off
+  WorkloadStats *stats;             // of opts, may be null
+  // the garbage share that gets a segment compacted, the options' until the
+  // engine is tuned
+  std::atomic<double> dead_ratio;
+
+  // a merge operand is appended with a link to the record of its key before
+  // it, a read follows the links and folds them. a compaction keeps only the
+  // newest record of a key, so it folds every chain first: the merges hold
+  // merge_gate shared and while compacting is set they read and put instead
+  std::shared_mutex merge_gate;
+  std::mutex compact_mu;
+  std::atomic<int> compacting{0};
+  std::atomic<size_t> merges{1}; // appended since the last fold, 1 on open
+  // the scans hold it shared, a compaction skips its round while one runs:
+  // the records they read have to stay where the index points
+  std::shared_mutex scan_mu;
+
+  // async writes still in flight, the destructor waits for them
+  std::mutex pending_mu;
+  std::condition_variable pending_cv;
+  size_t pending = 0;
+
+  void read_record(const SegmentOffset &off, std::string key, GetCallback cb);
+  bool read_latest(std::string_view key, Buffer &out, RecordView &view);
+  bool read_at(const SegmentOffset &off, Buffer &out, RecordView &view);
+  bool fold(std::string_view key, const SegmentOffset &head, Buffer &out,
+            RecordView &view, std::vector<std::pair<size_t, size_t>> &chain);
+  bool collapse(std::string_view key, const SegmentOffset &head);
+  bool fold_merges();
+  size_t write(std::string_view key, std::string_view val, uint8_t flags,
+               uint64_t expires_at, std::string_view clock, uint64_t version,
+               std::shared_ptr<ChangeEvent> ev);
+  size_t apply_merge(const RecordView &view);
+  bool separate(std::string_view &val, uint8_t &flags, std::string &ref);
+  void drop_blob(std::string_view ref);
+  void appended(size_t bytes, bool may_block);
+  void maintain();
+  std::shared_ptr<ChangeEvent> change(std::string_view key,
+                                      std::string_view val, bool is_json);
+  bool isLatest(std::string_view key, size_t seg_id, size_t offset);
+  void
+  scan_segment(const ScanSegment &seg,
+               const std::function<void(std::unique_ptr<ScanBatch>)> &emit);
+
+protected:
+  bool commit_batch(const std::vector<BatchOp> &ops) override;
+
+public:
+  HashEngine(const std::string &dir, const StorageOptions &opts);
+  HashEngine(const std::string &dir, size_t seg_size,
+             std::shared_ptr<IoEngine> io = nullptr);
+  ~HashEngine();
+  const char *name() const override { return "hash"; }
+  void checkpoint() override;
+  size_t compact(double min_dead_ratio = 0.0) override;
+  // links the segments (see SegmentMgr) and the blob files
+  bool snapshot(const std::string &dest) override;
+  bool attach(const std::vector<std::string> &segments) override;
+  void expire() override;
+  bool tune(const Tuning &t) override;
+  size_t data_bytes() override;
+  ChangeFeed *changes() override { return feed.get(); }
+  TailStatus tail(LogPosition &pos, std::string &out, size_t max) override;
+  bool apply(std::string_view records) override;
+  uint64_t put(std::string_view key, std::string_view val,
+               bool is_json = false, uint64_t ttl_ms = 0,
+               std::string_view clock = {}) override;
+  bool get_into(std::string_view key, Buffer &out) override;
+  bool get_blob(std::string_view key, BlobHandle &out) override;
+  std::unique_ptr<BlobWriter> open_blob(uint64_t len) override;
+  uint64_t put_blob(std::string_view key, BlobWriter &blob,
+                    bool is_json = false, uint64_t ttl_ms = 0) override;
+  bool erase(std::string_view key) override;
+  bool merge(std::string_view key, MergeOp op,
+             std::string_view operand) override;
+  void scan_records(const RecordFn &fn) override;
+  TailStatus scan_keys(LogPosition &pos, size_t limit, size_t max,
+                       std::vector<std::string> &out) override;
+
+  // the callbacks run on the I/O engine's completion thread (or inline with
+  // the pread engine)
+  using StorageEngine::get_async;
+  using StorageEngine::put_async;
+  void get_async(const std::string &key, GetCallback cb) override;
+  void put_async(const std::string &key, const std::string &val, bool is_json,
+                 PutCallback cb) override;
+};
+
+} // namespace kv
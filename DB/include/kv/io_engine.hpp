@@ -0,0 +1,125 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <linux/io_uring.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace kv {
+
+// completion of one I/O, res is the number of bytes moved or -errno. for reads
+// data points at the bytes read, it is only valid until the callback returns.
+// callbacks may queue more I/O but must not wait on it (no *_sync calls)
+using IoCallback = std::function<void(long res, const char *data)>;
+
+// the backend doing the disk I/O of the segments
+class IoEngine {
+public:
+  virtual ~IoEngine() = default;
+
+  // reads len bytes at off into a buffer owned by the engine
+  virtual void read(int fd, size_t len, uint64_t off, IoCallback cb) = 0;
+  // writes buf[0..len) at off, buf has to stay alive until cb is called
+  virtual void write(int fd, const char *buf, size_t len, uint64_t off,
+                     IoCallback cb) = 0;
+  // files the engine should keep registered while they are open
+  virtual void register_file(int) {}
+  virtual void unregister_file(int) {}
+  virtual const char *name() const = 0;
+
+  // blocking versions, these return once the I/O is done
+  virtual long read_sync(int fd, char *buf, size_t len, uint64_t off);
+  virtual long write_sync(int fd, const char *buf, size_t len, uint64_t off);
+
+  // "uring" or "pread", falls back to pread if io_uring is not usable
+  static std::shared_ptr<IoEngine> create(const std::string &kind,
+                                          unsigned queue_depth);
+};
+
+// plain blocking pread/pwrite, the callback runs on the calling thread
+class PreadEngine : public IoEngine {
+public:
+  void read(int fd, size_t len, uint64_t off, IoCallback cb) override;
+  void write(int fd, const char *buf, size_t len, uint64_t off,
+             IoCallback cb) override;
+  long read_sync(int fd, char *buf, size_t len, uint64_t off) override;
+  long write_sync(int fd, const char *buf, size_t len, uint64_t off) override;
+  const char *name() const override { return "pread"; }
+};
+
+// io_uring through the raw syscalls, the segment files and a pool of read
+// buffers are registered with the kernel. one reaper thread runs all the
+// completions, so a deep queue does not need a thread per request
+class UringEngine : public IoEngine {
+  struct Op {
+    IoCallback cb;
+    int buf_index = -1;         // registered buffer used by a read
+    std::vector<char> heap_buf; // reads that do not fit a registered buffer
+    // what it moves, a short read or write is queued again for the rest
+    uint8_t opcode = 0;
+    int fd = -1;
+    const char *addr = nullptr;
+    size_t len = 0;
+    uint64_t off = 0;
+    size_t done = 0;
+  };
+
+  int ring_fd = -1;
+  unsigned entries = 0;
+
+  // the mmap'd rings
+  void *sq_ptr = nullptr, *cq_ptr = nullptr;
+  size_t sq_len = 0, cq_len = 0, sqes_len = 0;
+  unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_mask = nullptr;
+  unsigned *sq_array = nullptr;
+  unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+  io_uring_sqe *sqes = nullptr;
+  io_uring_cqe *cqes = nullptr;
+
+  std::mutex mu; // guards the submission ring, ops, files and buffers
+  std::condition_variable space_cv;
+  std::vector<Op> ops; // indexed by the sqe user_data
+  std::vector<uint32_t> free_ops;
+
+  // fd -> slot in the registered file table
+  bool files_registered = false;
+  std::unordered_map<int, int> file_slots;
+  std::vector<int> free_file_slots;
+
+  // registered read buffers
+  bool bufs_registered = false;
+  size_t buf_size = 16 * 1024;
+  std::vector<char> buf_mem;
+  std::vector<int> free_bufs;
+
+  std::thread reaper;
+
+  void setup_registrations(unsigned max_files, unsigned nbufs);
+  void submit(uint8_t opcode, int fd, const char *addr, size_t len,
+              uint64_t off, Op op);
+  void queue(uint32_t id);
+  int flush(std::vector<Op> &failed);
+  void push(std::unique_lock<std::mutex> &lock, bool wait);
+  void reap();
+
+public:
+  UringEngine(unsigned queue_depth);
+  ~UringEngine();
+  bool ok() const { return ring_fd >= 0; }
+
+  void read(int fd, size_t len, uint64_t off, IoCallback cb) override;
+  void write(int fd, const char *buf, size_t len, uint64_t off,
+             IoCallback cb) override;
+  long read_sync(int fd, char *buf, size_t len, uint64_t off) override;
+  void register_file(int fd) override;
+  void unregister_file(int fd) override;
+  const char *name() const override { return "uring"; }
+};
+
+} // namespace kv
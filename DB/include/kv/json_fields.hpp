@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kv {
+
+// the dotted paths of ?fields=a,b.c, split at the dots
+using FieldPaths = std::vector<std::vector<std::string>>;
+
+// false if a path is empty or has an empty part
+bool parseFields(std::string_view spec, FieldPaths &out);
+
+// the members of the json object doc at paths, nested the way they are in
+// doc ({"b": {"c": ...}} for b.c). the paths go through objects only, the
+// ones doc does not have are left out. the members off the paths are skipped
+// while parsing, they never get a tree built. false if doc is no object
+bool projectFields(std::string_view doc, const FieldPaths &paths,
+                   std::string &out);
+
+// applies the json merge patch (RFC 7396) patch to doc, an empty doc is a
+// missing one. false if doc or patch is no json
+bool mergePatch(std::string_view doc, std::string_view patch,
+                std::string &out);
+
+} // namespace kv
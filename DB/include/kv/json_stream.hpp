@@ -0,0 +1,101 @@
+#pragma once
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace kv {
+
+// writes one json object member by member and hands it to the sink in chunks,
+// so a whole model can be serialized without building a json tree first
+class JsonStreamWriter {
+  std::function<void(std::string_view)> sink;
+  std::string buf;
+  size_t chunk_size;
+  bool first = true;
+
+  void maybe_flush() {
+    if (buf.size() >= chunk_size)
+      flush();
+  }
+
+public:
+  JsonStreamWriter(std::function<void(std::string_view)> sink,
+                   size_t chunk_size = 64 * 1024)
+      : sink(std::move(sink)), chunk_size(chunk_size) {
+    buf.reserve(chunk_size + 1024);
+  }
+
+  // appends s as a quoted json string
+  static void escape(std::string &out, std::string_view s) {
+    out.push_back('"');
+    for (unsigned char c : s) {
+      switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\r':
+        out += "\\r";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+        if (c < 0x20) {
+          char tmp[8];
+          std::snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+          out += tmp;
+        } else {
+          out.push_back(static_cast<char>(c));
+        }
+      }
+    }
+    out.push_back('"');
+  }
+
+  void begin_object() { buf.push_back('{'); }
+
+  // member whose value is already valid json text, copied as is
+  void raw_member(std::string_view key, std::string_view json) {
+    if (!first)
+      buf.push_back(',');
+    first = false;
+    escape(buf, key);
+    buf.push_back(':');
+    buf.append(json.data(), json.size());
+    maybe_flush();
+  }
+
+  // member whose value is plain text, written as a json string
+  void string_member(std::string_view key, std::string_view text) {
+    if (!first)
+      buf.push_back(',');
+    first = false;
+    escape(buf, key);
+    buf.push_back(':');
+    escape(buf, text);
+    maybe_flush();
+  }
+
+  void end_object() {
+    buf.push_back('}');
+    flush();
+  }
+
+  void flush() {
+    if (buf.empty())
+      return;
+    sink(buf);
+    buf.clear();
+  }
+};
+
+} // namespace kv
@@ -0,0 +1,216 @@
+#pragma once
+#include "bloomfilter.hpp"
+#include "buffer.hpp"
+#include "change_feed.hpp"
+#include "segment.hpp"
+#include "storage_engine.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace kv {
+
+// the list of the runs of a model and the oldest WAL still needed, rewritten
+// (atomicWrite) whenever a run comes or goes
+constexpr const char *LSM_MANIFEST = "lsm.manifest";
+constexpr uint64_t LSM_MANIFEST_MAGIC = 0x3130304d534c4b44ull; // "DKLSM001"
+constexpr uint64_t LSM_RUN_MAGIC = 0x3130305453534b44ull;      // "DKSST001"
+
+// one immutable run_<id>.sst: the records of a key range sorted by key, one
+// version per key (tombstones too). behind them a sparse index with the first
+// key of every block of ~4KB, the last key, the bloom filter bits and a footer:
+//   [data_end][index_end][bloom_bits][records][hashes u32][crc u32][magic]
+// the crc covers the index and the bloom bits, the records have their own.
+// the file is mmap'd, a lookup is a bloom check, a binary search of the index
+// and a walk over one block
+class SortedRun {
+  uint64_t id;
+  std::string path;
+  int fd = -1;
+  const char *map = nullptr;
+  size_t map_len = 0;
+  size_t data_end = 0;
+  uint64_t records = 0;
+  std::vector<std::pair<std::string_view, uint64_t>> index; // into the map
+  std::string_view last;
+  BloomFilter bloom;
+  std::atomic<bool> obsolete{false}; // compacted away, the file goes with it
+  MemoryBudget *budget;              // gets the index and bloom bytes
+  std::string model;
+
+  size_t indexBytes() const {
+    return index.capacity() * sizeof(index[0]) + bloom.size() / 8;
+  }
+
+public:
+  SortedRun(uint64_t id, const std::string &path,
+            MemoryBudget *budget = nullptr);
+  ~SortedRun();
+  SortedRun(const SortedRun &) = delete;
+  SortedRun &operator=(const SortedRun &) = delete;
+
+  bool valid() const { return map != nullptr; }
+  uint64_t getId() const { return id; }
+  size_t size() const { return map_len; }
+  uint64_t count() const { return records; }
+  std::string_view smallest() const {
+    return index.empty() ? std::string_view() : index.front().first;
+  }
+  std::string_view largest() const { return last; }
+  bool overlaps(std::string_view from, std::string_view to) const {
+    return !(largest() < from || to < smallest());
+  }
+  // the records, back to back like in a segment
+  std::string_view data() const { return {map, data_end}; }
+  // the whole record of key (maybe a tombstone), it points into the map
+  bool find(std::string_view key, uint64_t hash,
+            std::string_view &record) const;
+  // offset of the first record with a key >= from
+  size_t seek(std::string_view from) const;
+  void retire() { obsolete = true; }
+};
+
+// writes a run record by record, they have to come in key order
+class RunBuilder {
+  std::string path;
+  int fd = -1;
+  std::string pending; // not yet written
+  uint64_t written = 0;
+  uint64_t block_start = 0;
+  std::string index, last;
+  std::vector<uint64_t> hashes;
+  bool failed = false;
+
+  void drain();
+
+public:
+  explicit RunBuilder(const std::string &path);
+  ~RunBuilder();
+  void add(std::string_view record, std::string_view key);
+  size_t size() const { return written + pending.size(); }
+  bool empty() const { return hashes.empty(); }
+  // the index, bloom filter and footer, synced. false on any write error
+  bool finish();
+};
+
+// the records of a memtable, key -> encoded record
+struct Memtable {
+  std::map<std::string, std::string, std::less<>> records;
+  size_t bytes = 0;
+  size_t charged = 0;     // of the bytes, the ones on the memory budget
+  uint64_t first_wal = 0; // the oldest WAL that has records of it
+};
+
+// the runs of every level, replaced as a whole when a flush or compaction
+// installs its output. L0 holds the flushed memtables newest first and their
+// keys overlap, the deeper levels are sorted by key and do not
+struct LsmVersion {
+  std::vector<std::vector<std::shared_ptr<SortedRun>>> levels;
+};
+
+// the log structured merge engine: writes go to a WAL and a sorted memtable,
+// a full memtable is flushed into a run of L0 and the background merges the
+// runs into bigger ones level by level. only the memtables and the sparse run
+// indexes are in memory, so the key count is not bounded by it, and a key
+// range is one merge of sorted cursors.
+// the blob log, tail shipping and bulk attach stay with HashEngine
+class LsmEngine : public StorageEngine {
+  StorageOptions opts;
+  std::string dir;
+  std::string model; // for the memory budget
+
+  std::shared_mutex mu; // guards mem, imm and version
+  std::shared_ptr<Memtable> mem;
+  // the full ones waiting for their flush, oldest first
+  std::deque<std::shared_ptr<const Memtable>> imm;
+  std::shared_ptr<const LsmVersion> version;
+  std::condition_variable_any room_cv; // writers wait here for the flushes
+
+  std::mutex write_mu; // serializes the WAL appends
+  int wal_fd = -1;
+  uint64_t wal_id = 0;
+  std::atomic<uint64_t> next_id{1}; // of the runs and the WALs
+  uint64_t wal_floor = 0;           // the older WALs are flushed
+
+  std::mutex maint_mu; // one flush or compaction at a time
+  std::atomic<bool> maint_queued{false};
+  std::vector<std::string> compact_at; // round robin position per level
+
+  std::unique_ptr<ChangeFeed> feed; // null if the options turned it off
+
+  // background jobs still queued, the destructor waits for them
+  std::mutex pending_mu;
+  std::condition_variable pending_cv;
+  size_t pending = 0;
+
+  // a record for the memtable and its change event
+  struct Insert {
+    std::string_view key, record;
+    std::shared_ptr<ChangeEvent> ev;
+  };
+
+  bool open_wal();
+  void replay(const std::string &path);
+  bool write(std::string_view key, std::string_view record,
+             std::shared_ptr<ChangeEvent> ev);
+  bool write(std::string_view data, std::vector<Insert> &inserts);
+  void switch_memtable();
+  void schedule();
+  void maintain();
+  bool flush_one();
+  size_t compact_one();
+  size_t merge_into(size_t level, std::vector<std::shared_ptr<SortedRun>> in,
+                    bool major);
+  void install(const std::vector<std::shared_ptr<SortedRun>> &removed,
+               size_t level, std::vector<std::shared_ptr<SortedRun>> added,
+               const std::shared_ptr<const Memtable> &flushed);
+  void save_manifest(const LsmVersion &v);
+  std::shared_ptr<SortedRun> new_run(RunBuilder &builder, uint64_t id);
+  uint64_t level_limit(size_t level) const;
+  std::string path_of(const char *kind, uint64_t id) const;
+  void charge(Memtable &m, bool all);
+  std::shared_ptr<ChangeEvent> change(std::string_view key,
+                                      std::string_view val, bool is_json);
+  std::shared_ptr<ChangeEvent> merged(std::string_view key,
+                                      std::string_view val);
+
+protected:
+  bool commit_batch(const std::vector<BatchOp> &ops) override;
+
+public:
+  LsmEngine(const std::string &dir, const StorageOptions &opts);
+  ~LsmEngine();
+  const char *name() const override { return "lsm"; }
+  // flushes the memtables
+  void checkpoint() override;
+  // 0 merges every run into the bottom level, otherwise it does what the
+  // level sizes call for. returns the runs merged
+  size_t compact(double min_dead_ratio = 0.0) override;
+  // flushes and links the runs, the writes after the flush are not in it
+  bool snapshot(const std::string &dest) override;
+  ChangeFeed *changes() override { return feed.get(); }
+  bool apply(std::string_view records) override;
+  uint64_t put(std::string_view key, std::string_view val,
+               bool is_json = false, uint64_t ttl_ms = 0,
+               std::string_view clock = {}) override;
+  bool get_into(std::string_view key, Buffer &out) override;
+  bool erase(std::string_view key) override;
+  bool merge(std::string_view key, MergeOp op,
+             std::string_view operand) override;
+  void scan_records(const RecordFn &fn) override;
+  void scan_range(std::string_view from, std::string_view to, size_t limit,
+                  const RecordFn &fn) override;
+};
+
+} // namespace kv
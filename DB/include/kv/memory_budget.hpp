@@ -0,0 +1,93 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace kv {
+
+enum class MemoryKind : uint8_t {
+  Index,    // the hash indexes of the segments, the sparse indexes of runs
+  Bloom,    // the bloom filters of both
+  Memtable, // the lsm memtables, current and waiting for their flush
+};
+constexpr size_t MEMORY_KINDS = 3;
+
+// the model the files in dir belong to, for the per model counts
+inline std::string modelOfDir(const std::string &dir) {
+  std::filesystem::path p(dir);
+  if (!p.has_filename())
+    p = p.parent_path();
+  return p.filename().string();
+}
+
+// something holding memory it can give back and load again when needed
+class Evictable {
+public:
+  virtual ~Evictable() = default;
+  // when it was last used (ms), 0 if it can not be evicted right now
+  virtual uint64_t lastUsed() = 0;
+  // drops what it can, returns the bytes freed (0 if it was busy)
+  virtual size_t evict() = 0;
+};
+
+// the memory of every model of the process, by kind. whatever holds memory
+// charges it here and releases it when it goes; once the total goes over the
+// limit the least recently used evictables are dropped until it is back under
+// ~90% of it. a model can have a share of the limit: what it holds up to its
+// share is only evicted once the other models have nothing left to give. a
+// limit of 0 only counts
+class MemoryBudget {
+  struct Tracked {
+    std::string model;
+    MemoryKind kind;
+  };
+
+  size_t limit;
+  std::mutex mu; // guards the counters and the tracked, held while evicting
+  size_t used = 0;
+  std::map<std::string, std::array<size_t, MEMORY_KINDS>, std::less<>> models;
+  std::unordered_map<Evictable *, Tracked> tracked;
+  std::map<std::string, size_t, std::less<>> shares;
+  uint64_t evictions = 0, evicted_bytes = 0;
+  std::atomic<bool> shrinking{false};
+
+  void subtract(std::string_view model, MemoryKind kind, size_t bytes);
+  void shrink();
+
+public:
+  explicit MemoryBudget(size_t limit) : limit(limit) {}
+  void charge(std::string_view model, MemoryKind kind, size_t bytes);
+  void release(std::string_view model, MemoryKind kind, size_t bytes);
+  // e may be evicted from now on, its freed bytes come off model and kind.
+  // untrack before e goes, it waits for an eviction of e in progress
+  void track(Evictable *e, std::string_view model, MemoryKind kind);
+  void untrack(Evictable *e);
+  // evicts if over the limit, for when something became evictable since the
+  // charge that went over it
+  void settle();
+  // bytes of the limit model keeps before the others, 0 for none
+  void setShare(std::string_view model, size_t bytes);
+
+  size_t limitBytes() const { return limit; }
+  struct ModelUsage {
+    std::string model;
+    std::array<size_t, MEMORY_KINDS> bytes;
+    size_t share;
+  };
+  struct Report {
+    size_t used;
+    uint64_t evictions, evicted_bytes;
+    std::vector<ModelUsage> models;
+  };
+  Report report();
+};
+
+} // namespace kv
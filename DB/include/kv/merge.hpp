@@ -0,0 +1,67 @@
+#pragma once
+#include "segment.hpp"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kv {
+
+// what a merge operand does to the value of its key. the operands are json:
+// an integer for Add, an array of the elements for Append and Union
+enum class MergeOp : uint8_t {
+  Add = 1,    // adds to the integer value
+  Append = 2, // appends the elements to the array value
+  Union = 3,  // adds the elements the array value does not have yet
+};
+
+// "add", "append" or "union"
+bool parseMergeOp(std::string_view name, MergeOp &op);
+const char *mergeOpName(MergeOp op);
+bool validOperand(MergeOp op, std::string_view operand);
+
+// where the record before a merge operand of the hash engine is, so a read
+// can walk back to the value the operands apply to. the lsm engine finds it
+// by key and leaves it empty
+struct MergeLink {
+  uint64_t segment_id = 0; // 0: there is none, the key was missing
+  uint64_t entry = 0;      // the packIndex entry of the record there
+};
+
+// the value of a REC_MERGE record: the link, then the operands oldest first,
+// each as [op u8][len u32][json] (what appendOperand adds)
+void appendOperand(std::string &out, MergeOp op, std::string_view operand);
+void encodeMergeValue(std::string &out, MergeLink prev, MergeOp op,
+                      std::string_view operand);
+// the same with operands already encoded (by combineOperands)
+void encodeMergeValue(std::string &out, MergeLink prev,
+                      std::string_view operands);
+bool decodeMergeValue(std::string_view val, MergeLink &prev,
+                      std::string_view &operands);
+
+// the operands of lists (oldest first) as one list, neighbours of the same op
+// folded into one operand
+void combineOperands(const std::vector<std::string_view> &lists,
+                     std::string &out);
+// the json value base (nullopt if missing) with the operands of lists applied
+// in order. an operand does nothing to a value it does not fit: 7 with an
+// Append stays 7. false if base is not json, out is base as it is then and
+// none of the operands apply
+bool foldOperands(std::optional<std::string_view> base,
+                  const std::vector<std::string_view> &lists,
+                  std::string &out);
+
+// the value of the change event of a merge, {"add":5} for one operand and
+// an array of those for more
+std::string describeOperands(std::string_view operands);
+
+// the versions of one key newest first, merge operands from the front on.
+// a record that is not one ends them and is their base, with nothing behind
+// them the base is missing if complete (nothing older can be anywhere) and
+// unknown otherwise. out gets one record for all of them: a plain json value
+// once the base is known, the operands combined into one if not
+void foldRecords(const std::vector<RecordView> &versions, bool complete,
+                 uint64_t now, std::string &out);
+
+} // namespace kv
@@ -0,0 +1,66 @@
+#pragma once
+#include "auto_tuner.hpp"
+#include "config.hpp"
+#include "io_engine.hpp"
+#include "memory_budget.hpp"
+#include "storage_engine.hpp"
+#include "thread_pool.hpp"
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace kv {
+
+// handle given out to the request handlers, the engine stays alive for as long
+// as somebody is holding one (even if the model got deleted or evicted)
+using EngineHandle = std::shared_ptr<StorageEngine>;
+
+// process wide registry of the open model engines
+// - engines are opened lazily, opening one model never blocks the others
+// - at most `capacity` engines are kept open, idle ones are evicted LRU first
+// - a removed model can not be acquired until its last engine is gone and its
+//   files are deleted, so no second engine ever opens on the same files
+class ModelRegistry {
+  struct Slot {
+    std::mutex open_mu; // held while this model's engine is opened or closed
+    EngineHandle engine;
+    bool in_lru = false;
+    std::list<std::string>::iterator lru_pos;
+    bool deleting = false; // set by remove, under open_mu and mu
+    bool reaped = false;   // its files are gone, under open_mu
+  };
+
+  const Config &config;
+  size_t capacity;
+  std::shared_ptr<IoEngine> io; // one queue shared by all the models
+  ThreadPool background;        // index checkpoints of all the models
+  MemoryBudget memory;          // indexes, filters and memtables of all
+  AutoTuner tuner;              // their settings and shares of memory
+  std::mutex mu; // guards slots and lru, never held while doing disk I/O
+  std::unordered_map<std::string, std::shared_ptr<Slot>> slots;
+  std::list<std::string> lru; // open engines, front is the most recently used
+  std::vector<std::string> removing; // models waiting for their files to go
+
+  std::string model_dir(const std::string &model) const;
+  void touch(const std::string &model, const std::shared_ptr<Slot> &slot,
+             std::list<std::shared_ptr<Slot>> &victims);
+  void close_idle(std::list<std::shared_ptr<Slot>> &victims);
+  std::vector<OpenModel> open_models();
+  void reap();
+
+public:
+  ModelRegistry(const Config &config, size_t capacity);
+  ~ModelRegistry();
+  EngineHandle acquire(const std::string &model);
+  bool remove(const std::string &model);
+  void prewarm(size_t threads);
+  size_t open_count();
+  MemoryBudget &memory_budget() { return memory; }
+  AutoTuner &auto_tuner() { return tuner; }
+};
+
+} // namespace kv
@@ -0,0 +1,80 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace kv {
+
+// the plain tcp bits shared by the servers talking to each other (log
+// shipping, the cluster). messages are frames: [type u8][len u32][payload]
+
+// -1 if the host is not reachable. reads time out after timeout_ms
+int connectTo(const std::string &host, const std::string &port,
+              int timeout_ms);
+// a listening socket on every interface, -1 on errors
+int listenOn(uint16_t port);
+// "host:port" split at the last colon
+bool splitHostPort(const std::string &addr, std::string &host,
+                   std::string &port);
+
+bool sendAll(int fd, const char *p, size_t n);
+bool recvAll(int fd, char *p, size_t n);
+// head and body go out back to back, so a big body is not copied once more
+bool sendFrame(int fd, char type, std::string_view head,
+               std::string_view body = {});
+bool recvFrame(int fd, char &type, std::string &payload);
+
+// the fields inside a payload, host byte order (both ends run this code)
+inline void putU8(std::string &out, uint8_t v) {
+  out += static_cast<char>(v);
+}
+inline void putU32(std::string &out, uint32_t v) {
+  out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+inline void putU64(std::string &out, uint64_t v) {
+  out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+inline void putStr(std::string &out, std::string_view s) {
+  putU32(out, static_cast<uint32_t>(s.size()));
+  out += s;
+}
+
+// reads the fields back, ok() turns false (and stays) once one runs past the
+// end, the reads after that return zeros
+class WireReader {
+  std::string_view buf;
+  bool good = true;
+
+  const char *take(size_t n) {
+    if (!good || buf.size() < n) {
+      good = false;
+      return nullptr;
+    }
+    const char *p = buf.data();
+    buf.remove_prefix(n);
+    return p;
+  }
+  template <typename T> T num() {
+    T v{};
+    if (const char *p = take(sizeof(T)))
+      std::memcpy(&v, p, sizeof(T));
+    return v;
+  }
+
+public:
+  explicit WireReader(std::string_view buf) : buf(buf) {}
+  bool ok() const { return good; }
+  std::string_view rest() const { return buf; }
+  uint8_t u8() { return num<uint8_t>(); }
+  uint32_t u32() { return num<uint32_t>(); }
+  uint64_t u64() { return num<uint64_t>(); }
+  std::string_view str() {
+    uint32_t n = u32();
+    const char *p = take(n);
+    return p ? std::string_view(p, n) : std::string_view();
+  }
+};
+
+} // namespace kv
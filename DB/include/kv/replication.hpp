@@ -0,0 +1,117 @@
+#pragma once
+#include "config.hpp"
+#include "model_registry.hpp"
+#include "segment_manager.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace kv {
+
+// log shipping between two servers over plain tcp. a replica keeps one
+// connection per model to the leader, the leader streams that model's
+// segment appends over it and the replica appends the very same records to
+// its own segments. the frames are [type u8][len u32][payload]:
+//   replica -> leader
+//     'L'  list the models, answered with 'M' and the names one per line
+//     'T'  tail a model: [segment u64][offset u64][crc u32][model name]
+//   leader -> replica, on a tail connection
+//     'D'  [caught up u8][segment u64][offset u64][crc u32][records], the
+//          position is the one after the records. an empty one every
+//          REPL_HEARTBEAT_MS while there is nothing to ship
+//     'R'  the position is gone (compacted or the leader lost it), the log
+//          starts over from the oldest segment
+//     'G'  no such model
+
+// what the leader knows about one of its replicas
+struct ReplicaLink {
+  std::string peer;
+  std::string model;
+  LogPosition pos; // shipped up to here
+};
+
+// leader side, one thread per replica connection
+class ReplicationServer {
+  struct Conn {
+    int fd;
+    std::thread thread;
+    std::atomic<bool> done{false};
+    ReplicaLink link;
+  };
+
+  ModelRegistry &registry;
+  const Config &config;
+  int listen_fd = -1;
+  std::atomic<bool> stop{false};
+  std::thread acceptor;
+  std::mutex mu; // guards conns and their links
+  std::list<Conn> conns;
+
+  void accept_loop();
+  void serve(Conn &conn);
+  void ship(Conn &conn, const std::string &model, LogPosition pos);
+
+public:
+  ReplicationServer(ModelRegistry &registry, const Config &config);
+  ~ReplicationServer();
+  bool start(uint16_t port);
+  std::vector<ReplicaLink> replicas();
+};
+
+// how far a replica is with one model
+struct ReplicaModelStatus {
+  std::string model;
+  bool connected = false;
+  bool resyncing = false;
+  LogPosition pos;     // applied up to here of the leader's log
+  uint64_t lag_ms = 0; // since it last caught up, UINT64_MAX if it never did
+};
+
+// follower side: mirrors every model of the leader into the local registry,
+// the local engines then only take the shipped writes
+class Replica {
+  struct Model {
+    std::string name;
+    std::thread thread;
+    std::atomic<bool> done{false};
+    std::mutex mu; // guards the fields below
+    int fd = -1;   // the open connection, shut down to stop it
+    bool connected = false;
+    bool resyncing = false;
+    LogPosition pos;
+    uint64_t caught_up_at = 0; // ms, 0 never
+  };
+
+  ModelRegistry &registry;
+  const Config &config;
+  std::string host, port;
+  std::atomic<bool> stop{false};
+  std::thread manager;
+  std::mutex mu; // guards models
+  std::map<std::string, std::unique_ptr<Model>> models;
+
+  int connect_leader();
+  void manage();
+  void follow(Model &m);
+  bool stream(Model &m, int fd);
+  void finish_resync(const EngineHandle &engine,
+                     const std::unordered_set<uint64_t> &seen);
+  void save_pos(const std::string &model, const LogPosition &pos);
+
+public:
+  Replica(ModelRegistry &registry, const Config &config);
+  ~Replica();
+  // false if the model is further behind the leader than the config allows
+  bool fresh(const std::string &model);
+  std::vector<ReplicaModelStatus> status();
+};
+
+} // namespace kv
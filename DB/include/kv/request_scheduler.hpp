@@ -0,0 +1,61 @@
+#pragma once
+#include "thread_pool.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+namespace kv {
+
+// the expensive kinds of requests, each with its own limits. the point
+// requests (one key) are not scheduled, they run inline on the http threads
+enum class RequestClass : uint8_t {
+  Scan, // a whole model or a key range, maybe filtered by a search
+  Bulk, // bulk loads, snapshots and restores
+};
+
+struct ClassLimits {
+  size_t running = 1; // at once on the pool
+  size_t queued = 0;  // waiting for one of those, the next ones are refused
+};
+
+// keeps the expensive requests off the http threads: they run on a pool of
+// their own, at most `running` of a class at once and `queued` more waiting.
+// a request past that is refused (a 429) instead of piling up, so the point
+// reads always find a free http thread however many scans come in
+class RequestScheduler {
+  static constexpr size_t CLASSES = 2;
+
+  struct Class {
+    ClassLimits limits;
+    TaskPriority prio;
+    size_t running = 0;
+    std::deque<std::function<void()>> waiting;
+    uint64_t done = 0, refused = 0;
+    double avg_ms = 0; // moving average of the run time, for retry_after
+  };
+
+  std::mutex mu;
+  Class classes[CLASSES];
+  ThreadPool pool; // running of every class, the last member so it drains
+                   // its jobs before the rest goes
+
+  void start(RequestClass c, std::function<void()> job);
+
+public:
+  RequestScheduler(ClassLimits scan, ClassLimits bulk);
+  // runs job on the pool, now or when a slot of its class is free. false if
+  // the class is full, job is not run then
+  bool submit(RequestClass c, std::function<void()> job);
+  // seconds until a refused request of the class likely finds room
+  uint64_t retry_after(RequestClass c);
+
+  struct Stats {
+    size_t running, queued;
+    uint64_t done, refused;
+  };
+  Stats stats(RequestClass c);
+};
+
+} // namespace kv
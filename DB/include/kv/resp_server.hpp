@@ -0,0 +1,54 @@
+#pragma once
+#include "config.hpp"
+#include "model_registry.hpp"
+#include "thread_pool.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace kv {
+
+struct RespConn;
+struct RespLoop;
+struct RespScanDone;
+
+// the redis protocol (RESP2) on a port of its own, for the clients that speak
+// it already. a few event loops (epoll) share the connections, each one runs
+// the commands of its connections itself, right against the StorageEngine of
+// the model. a loop reads all a connection sent, runs every complete command
+// of it in order and writes all the replies at once, so a pipelining client
+// gets many commands through per read and write. a SCAN step runs on a pool
+// of its own (scan_concurrency threads), the connection waits for it and the
+// others of the loop go on. commands:
+//   SELECT model   the model of the commands after it, "0" to start with
+//   GET, SET (EX, PX, NX, XX), DEL, MGET, MSET (all or none), SCAN (MATCH,
+//   COUNT), PING, ECHO, QUIT and an empty COMMAND for the client libraries
+class RespServer {
+  ModelRegistry &registry;
+  const Config &config;
+  bool read_only; // a replica, the writes fail
+  int listen_fd = -1;
+  int wake_fd = -1; // an eventfd, readable once the loops should stop
+  std::atomic<bool> stop{false};
+  std::vector<std::unique_ptr<RespLoop>> loop_state; // one per loop
+  std::vector<std::thread> loops;
+  std::unique_ptr<ThreadPool> scans;
+
+  void run(RespLoop &loop);
+  bool serve(RespConn &c);
+  void execute(RespConn &c, const std::vector<std::string_view> &args);
+  EngineHandle engine(RespConn &c, bool create);
+  void scan(RespConn &c, const std::vector<std::string_view> &args);
+  void scanned(RespConn &c, RespScanDone &done);
+
+public:
+  RespServer(ModelRegistry &registry, const Config &config, bool read_only);
+  ~RespServer();
+  bool start(uint16_t port, size_t threads);
+};
+
+} // namespace kv
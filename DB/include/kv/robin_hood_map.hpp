@@ -4,6 +4,7 @@
 #include <fmt/core.h>
 #include <optional>
 #include <string_view>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -19,7 +20,13 @@ public:
   bool put(const Key &key, const Val &val);
   std::optional<Val> get(const Key &key) const;
   bool erase(const Key &key);
+  // drops every entry and gives the buckets back
+  void reset();
   size_t size() const noexcept { return _map_size; }
+  // memory held by the buckets
+  size_t bytes() const noexcept {
+    return _buckets.capacity() * sizeof(_MapEntry);
+  }
   void print_map() const;
   std::vector<std::pair<Key, Val>> get_all() const;
 
@@ -35,8 +42,14 @@ private:
   size_t _map_size = 0;
   void _rehash();
 
-  size_t _ideal_hash(std::string_view key) const {
-    return (HashFunc(key) % _buckets.size());
+  // arithmetic keys are hashed over their bytes, no string gets built
+  size_t _ideal_hash(const Key &key) const {
+    if constexpr (std::is_arithmetic_v<Key>) {
+      std::string_view bytes(reinterpret_cast<const char *>(&key), sizeof(key));
+      return (HashFunc(bytes) % _buckets.size());
+    } else {
+      return (HashFunc(key) % _buckets.size());
+    }
   }
 };
 
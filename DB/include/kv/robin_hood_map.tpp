@@ -32,6 +32,13 @@ RobinHoodMap<K, V, H>::RobinHoodMap(size_t def_size) {
   _map_size = 0;
 }
 
+template <typename K, typename V, uint64_t (*H)(std::string_view)>
+void RobinHoodMap<K, V, H>::reset() {
+  // a swap, assigning keeps the capacity
+  std::vector<_MapEntry>(26, _MapEntry{}).swap(_buckets);
+  _map_size = 0;
+}
+
 // utility func to print the hash map
 template <typename K, typename V, uint64_t (*H)(std::string_view)>
 void RobinHoodMap<K, V, H>::print_map() const {
@@ -74,7 +81,7 @@ bool RobinHoodMap<Key, Val, Hashfunc>::put(const Key &key, const Val &val) {
   }
 
   // the hash of the key
-  size_t ind = _ideal_hash(std::to_string(key));
+  size_t ind = _ideal_hash(key);
   size_t curr_probe_len = 0;
   _MapEntry to_insert = _MapEntry{key, val, 0, true};
 
@@ -107,7 +114,7 @@ bool RobinHoodMap<Key, Val, Hashfunc>::put(const Key &key, const Val &val) {
 // get function in the hash map
 template <typename K, typename V, uint64_t (*H)(std::string_view)>
 std::optional<V> RobinHoodMap<K, V, H>::get(const K &key) const {
-  size_t ind = _ideal_hash(std::to_string(key));
+  size_t ind = _ideal_hash(key);
   size_t curr_probe_dist = 0;
 
   // iterating in the _buckets
@@ -131,7 +138,7 @@ std::optional<V> RobinHoodMap<K, V, H>::get(const K &key) const {
 // we will also implement backward shift deletion instead of tombstone
 template <typename K, typename V, uint64_t (*H)(std::string_view)>
 bool RobinHoodMap<K, V, H>::erase(const K &key) {
-  size_t ind = _ideal_hash(std::to_string(key));
+  size_t ind = _ideal_hash(key);
   size_t curr_probe_dist = 0;
 
   while (true) {
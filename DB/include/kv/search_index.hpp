@@ -1,10 +1,13 @@
 // include/kv/search_index.hpp
 #pragma once
+#include "merge.hpp"
 #include "storage_engine.hpp"
 #include <cctype>
 #include <nlohmann/json.hpp>
 #include <string>
+#include <string_view>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace kv {
@@ -38,28 +41,9 @@ private:
   // Add a document to a term's posting list
   void addToTerm(const std::string &term, const std::string &docId) {
     std::string termKey = index_prefix + term;
-    auto existing = storage.get(termKey);
-
-    nlohmann::json postings;
-    if (existing) {
-      postings = nlohmann::json::parse(*existing);
-    } else {
-      postings = nlohmann::json::array();
-    }
-
-    // Check if docId is already in the postings
-    bool found = false;
-    for (const auto &id : postings) {
-      if (id == docId) {
-        found = true;
-        break;
-      }
-    }
-
-    if (!found) {
-      postings.push_back(docId);
-      storage.put(termKey, postings.dump());
-    }
+    // a set union operand, the posting list is not read here
+    storage.merge(termKey, MergeOp::Union,
+                  nlohmann::json::array({docId}).dump());
   }
 
 public:
@@ -148,29 +132,32 @@ public:
 
   // Remove a document from the index
   void removeDocument(const std::string &docId) {
-    // Find all terms that reference this document
-    auto all_keys = storage.get_all();
+    // Find all terms that reference this document, the scan only copies the
+    // postings (and runs across the segments)
+    std::vector<std::pair<std::string, std::string>> all_keys;
+    storage.scan([&](std::string_view key, std::string_view val, uint8_t) {
+      if (key.substr(0, index_prefix.size()) == index_prefix)
+        all_keys.emplace_back(key, val);
+    });
 
     for (const auto &pair : all_keys) {
-      if (pair.first.find(index_prefix) == 0) {
-        nlohmann::json postings = nlohmann::json::parse(pair.second);
-        nlohmann::json newPostings = nlohmann::json::array();
-        bool changed = false;
-
-        for (const auto &id : postings) {
-          if (id != docId) {
-            newPostings.push_back(id);
-          } else {
-            changed = true;
-          }
+      nlohmann::json postings = nlohmann::json::parse(pair.second);
+      nlohmann::json newPostings = nlohmann::json::array();
+      bool changed = false;
+
+      for (const auto &id : postings) {
+        if (id != docId) {
+          newPostings.push_back(id);
+        } else {
+          changed = true;
         }
+      }
 
-        if (changed) {
-          if (newPostings.empty()) {
-            storage.erase(pair.first);
-          } else {
-            storage.put(pair.first, newPostings.dump());
-          }
+      if (changed) {
+        if (newPostings.empty()) {
+          storage.erase(pair.first);
+        } else {
+          storage.put(pair.first, newPostings.dump());
         }
       }
     }
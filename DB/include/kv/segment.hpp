@@ -1,52 +1,304 @@
 #pragma once
 #include "bloomfilter.hpp"
+#include "io_engine.hpp"
+#include "memory_budget.hpp"
 #include "robin_hood_map.hpp"
+#include "timing_wheel.hpp"
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
-#include <fstream>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 namespace kv {
 
+class Segment;
+
 struct SegmentOffset {
   size_t segment_id;
   size_t offset;
+  int fd;      // the segment's open data file
+  size_t size; // whole record size on disk, 0 if the index does not know it
+
+  // the newest record of the key is a tombstone (or expired)
+  bool deleted = false;
+  // the whole segment if it is mmap'd, empty otherwise
+  std::string_view map;
+  // keeps the fd and the mapping open while the record is read
+  std::shared_ptr<Segment> owner;
+  // the record is a merge operand, reading the value means folding it
+  bool merge = false;
+};
+
+// a local index entry packs the record offset (low 40 bits) and its size (the
+// next 22 bits) into one word, so a point read knows how much to read. size 0
+// means unknown: .idx files from before, or records too big for the field.
+// the top bit marks a tombstone, a lookup stops there without reading it, the
+// one below it a merge operand (see merge.hpp)
+constexpr unsigned IDX_OFFSET_BITS = 40;
+constexpr uint64_t IDX_OFFSET_MASK = (1ull << IDX_OFFSET_BITS) - 1;
+constexpr uint64_t IDX_SIZE_MASK = (1ull << 22) - 1;
+constexpr uint64_t IDX_MERGE = 1ull << 62;
+constexpr uint64_t IDX_TOMBSTONE = 1ull << 63;
+
+inline uint64_t packIndex(size_t offset, size_t size, bool deleted = false,
+                          bool merge = false) {
+  uint64_t sz = size <= IDX_SIZE_MASK ? size : 0;
+  return (static_cast<uint64_t>(offset) & IDX_OFFSET_MASK) |
+         (sz << IDX_OFFSET_BITS) | (deleted ? IDX_TOMBSTONE : 0) |
+         (merge ? IDX_MERGE : 0);
+}
+// first pair of a checkpointed .idx file, its second half is the covered offset
+constexpr uint64_t IDX_MAGIC = 0x3230305844494b44ull; // "DKIDX002"
+// the files from before IDX_MERGE, their sizes had 23 bits
+constexpr uint64_t IDX_MAGIC_V1 = 0x3130305844494b44ull; // "DKIDX001"
+// starts the (hash, expiry) pairs of the keys with a TTL, after the entries
+constexpr uint64_t IDX_TTL_MAGIC = 0x3130304c54544b44ull; // "DKTTL001"
+// right after the header, its second half is SegmentCheckpoint::version
+constexpr uint64_t IDX_VERSION_MAGIC = 0x3130305245564b44ull; // "DKVER001"
+
+inline size_t indexOffset(uint64_t entry) { return entry & IDX_OFFSET_MASK; }
+inline size_t indexSize(uint64_t entry) {
+  return (entry >> IDX_OFFSET_BITS) & IDX_SIZE_MASK;
+}
+inline bool indexDeleted(uint64_t entry) { return entry & IDX_TOMBSTONE; }
+inline bool indexMerge(uint64_t entry) { return entry & IDX_MERGE; }
+
+// bits of RecordHeader::flags, a record without REC_ALIVE is a tombstone
+enum RecordFlags : uint8_t {
+  REC_TOMBSTONE = 0x00,
+  REC_ALIVE = 0x01,
+  REC_JSON = 0x02, // value is json text that was already validated on write
+  REC_TTL = 0x04,  // has an expiry time in the header extension
+  REC_CLOCK = 0x08, // has a version vector in the header extension
+  REC_BLOB = 0x10,  // the value is an encoded BlobRef (see blob_store.hpp)
+  REC_VERSION = 0x20, // has the version of the write in the extension
+  REC_MERGE = 0x40,   // a merge operand, the value is in merge.hpp
+  REC_BATCH = 0x40,   // with REC_PADDING: the header of a batch, see below
+  REC_PADDING = 0x80, // filler over a hole found by recovery, never indexed
 };
 
 struct RecordHeader {
   uint32_t key_len;
   uint32_t val_len;
   uint8_t flags;
-  uint8_t reserved;
+  uint8_t reserved; // length of the header extension, 0 for plain records
   uint32_t record_len;
 };
 
+// bytes before the key (or the extension): record_len, key_len, val_len,
+// flags, reserved
+constexpr size_t RECORD_HEADER_SIZE = 14;
+// the extension sits between the header and the key, its fields come in the
+// order of their flags:
+//   REC_TTL     -> uint64_t expiry time, ms since the epoch
+//   REC_CLOCK   -> uint8_t length, then that many bytes of version vector
+//   REC_VERSION -> uint64_t version of the key, from the engine's sequence
+constexpr size_t RECORD_TTL_SIZE = sizeof(uint64_t);
+constexpr size_t RECORD_VERSION_SIZE = sizeof(uint64_t);
+// the whole extension has to fit its uint8_t length
+constexpr size_t RECORD_MAX_CLOCK =
+    255 - RECORD_TTL_SIZE - 1 - RECORD_VERSION_SIZE;
+
 struct Record {
   char *key;
   char *val;
 };
 
+// a decoded record, the views point into the buffer it was decoded from
+struct RecordView {
+  uint32_t record_len; // bytes after the record_len field itself
+  uint8_t flags;
+  uint64_t expires_at = 0; // ms since the epoch, 0 never expires
+  std::string_view clock;  // version vector, empty for unversioned records
+  // the version the write gave the key, 1 for a live record from before the
+  // versions and 0 for a tombstone
+  uint64_t version = 0;
+  std::string_view key;
+  std::string_view val;
+  size_t size() const { return sizeof(uint32_t) + record_len; }
+  bool expired(uint64_t now_ms) const {
+    return expires_at != 0 && expires_at <= now_ms;
+  }
+};
+
+enum class DecodeStatus {
+  Ok,
+  Short,  // buf ends before the record does, view.record_len tells how much
+  Corrupt // bad lengths or crc mismatch
+};
+
+// serializes a whole record (header, key, val, crc) into out, expires_at != 0
+// gives it a TTL, a clock (at most RECORD_MAX_CLOCK bytes) a version vector
+// and version != 0 the version of the key
+void encodeRecord(std::string &out, std::string_view key, std::string_view val,
+                  uint8_t flags, uint64_t expires_at = 0,
+                  std::string_view clock = {}, uint64_t version = 0);
+// parses the record at the start of buf, the crc is only checked with verify
+DecodeStatus decodeRecord(const char *buf, size_t len, RecordView &view,
+                          bool verify = true);
+// a tombstone of the old erase (flags flipped in place, so its crc is off),
+// view comes from decodeRecord without verify
+bool legacyTombstone(const char *buf, const RecordView &view);
+
+// a batch is written as one frame: a header record (REC_PADDING | REC_BATCH,
+// no key, the value holds the count, length and crc of the records behind it)
+// and the records of the batch right after it, with one append. everything
+// that walks the records skips the header like any padding, recovery keeps
+// the records of a batch only if all of them are there
+constexpr size_t BATCH_HEADER_VALUE = 3 * sizeof(uint32_t);
+inline bool batchHeader(uint8_t flags) {
+  return (flags & (REC_PADDING | REC_BATCH)) == (REC_PADDING | REC_BATCH);
+}
+void encodeBatchHeader(std::string &out, uint32_t count,
+                       std::string_view records);
+// true if the records framed by the batch header view are all in body (avail
+// bytes) and intact. len is their length either way, 0 for a bad header
+bool batchIntact(const RecordView &view, const char *body, size_t avail,
+                 size_t &len);
+
+// writes path.tmp, syncs it and renames it over path
+void atomicWrite(const std::string &path,
+                 const std::vector<std::pair<const void *, size_t>> &parts);
+
 struct RecordFooter {
   char *padding;
 };
 
-class Segment {
+// the direct appends (Segment::writeDirect) go out in whole blocks of this,
+// the last one padded with zeros. such a file gets a footer in the last bytes
+// of its last block when it closes, with the end of the records before it
+constexpr size_t DIRECT_BLOCK = 4096;
+constexpr uint64_t SEGMENT_FOOTER_MAGIC = 0x444e454745534b44ull; // "DKSEGEND"
+struct SegmentFooter {
+  uint64_t magic;
+  uint64_t end;
+};
+
+// reserves the blocks of the first len bytes of the file without changing its
+// size, so the appends neither allocate nor fragment it. false if the file
+// system cannot
+bool preallocateFile(int fd, size_t len);
+
+// a copy of the index and bloom filter, taken under the locks and written to
+// disk after them
+struct SegmentCheckpoint {
+  size_t covered = 0;   // every record before this offset is in entries
+  uint64_t version = 0; // none of those records has a newer version
+  std::vector<std::pair<uint64_t, uint64_t>> entries;
+  std::vector<std::pair<uint64_t, uint64_t>> expiry;
+  std::vector<char> bloom;
+};
+
+// the .bf and .idx files holding cp for the segment at path (no extension),
+// for segments built without opening them (bulk_loader.hpp)
+void writeSegmentFiles(const std::string &path, const SegmentCheckpoint &cp);
+
+// a closed segment with a budget can drop its index (evict()) once the .idx
+// on disk is current, the next lookup reads it back. the bloom filter stays,
+// so the keys it does not have never bring the index back
+class Segment : public Evictable {
   size_t id;
   std::string seg_file_path, ind_file_path, bf_file_path;
-  RobinHoodMap<uint64_t, size_t> local_ind;
-  std::fstream data;
+  RobinHoodMap<uint64_t, uint64_t> local_ind; // hash -> packIndex entry
+  RobinHoodMap<uint64_t, uint64_t> expiry;    // hash -> expiry of TTL keys
+  std::shared_ptr<IoEngine> io;
+  int fd = -1;    // data file, all the reads and writes go through io
+  size_t end = 0; // bytes handed out by reserve
   BloomFilter bf;
+  std::atomic<size_t> inflight{0};     // reserved but not yet indexed
+  std::atomic<size_t> checkpointed{0}; // offset covered by the .idx on disk
+  std::atomic<size_t> dead{0};         // bytes of unreachable records
+  std::atomic<bool> retired{false};    // replaced by its compacted copy
+  const char *map = nullptr;           // read only mapping once sealed
+  size_t map_len = 0;
+  size_t preallocated = 0; // bytes of blocks reserved for the appends
+  // the newest version of the records as far as recovery saw, and the
+  // engine's version clock that bounds the ones appended since
+  std::atomic<uint64_t> top_version{0};
+  const std::atomic<uint64_t> *versions = nullptr;
+
+  // the appends of direct io, one at a time (SegmentMgr::append): the second
+  // descriptor of the file and the bytes of the last block written so far
+  int dfd = -1;
+  std::string staged;
+  size_t staged_at = 0; // where the staged bytes end, 0 not loaded yet
+
+  MemoryBudget *budget = nullptr;     // null: no accounting, never evicted
+  std::string model;                  // of the dir, for the budget
+  std::shared_mutex res_mu;           // the index against its eviction
+  std::atomic<bool> tracked{false};   // sealed, evictable from now on
+  std::atomic<bool> resident{true};   // the index is in memory
+  std::atomic<uint64_t> last_used{0}; // ms
+  size_t index_charged = 0;           // index bytes charged to the budget
+
+  template <typename Fn> auto withIndex(bool exclusive, Fn &&fn);
+  size_t indexBytes() const { return local_ind.bytes() + expiry.bytes(); }
+  void chargeIndex();
+  bool evictable() const;
+  size_t recover(size_t from);
+  void addToIndex(uint64_t hash, size_t offset, size_t size, bool deleted,
+                  uint64_t expires_at, bool merge = false);
+  void writeIndexFile(const SegmentCheckpoint &cp);
+  void writeBloomFile(const SegmentCheckpoint &cp);
+  void fillCheckpoint(SegmentCheckpoint &cp, size_t covered);
+  void finishDirect();
 
 public:
-  Segment(size_t id, const std::string &dir, size_t segsize);
+  // bloom_bits sizes the filter of a segment that has no .bf yet, 0 for the
+  // default
+  Segment(size_t id, const std::string &dir, std::shared_ptr<IoEngine> io,
+          MemoryBudget *budget = nullptr, size_t bloom_bits = 0);
   ~Segment();
-  size_t appendRecord(uint64_t hash, std::string_view key,
-                      std::string_view val);
+  size_t getId() const { return id; }
+  int fileDescriptor() const { return fd; }
+  size_t size() const { return end; }
+  size_t reserve(size_t len);
+  bool preallocate(size_t len);
+  long writeDirect(const char *data, size_t len, size_t offset);
+  void resume();
+  void indexRecord(uint64_t hash, size_t offset, size_t size,
+                   bool deleted = false, uint64_t expires_at = 0,
+                   bool merge = false);
+  void indexBatched(uint64_t hash, size_t offset, size_t size,
+                    bool deleted = false, uint64_t expires_at = 0);
+  void batchDone();
+  void abandon(size_t offset, size_t len);
+  void seal();
+  std::string_view mapped() const { return {map, map_len}; }
+  bool expire(uint64_t hash, uint64_t expires_at);
+  void timers(std::vector<ExpiryTimer> &out);
+  void markDead(size_t bytes) { dead += bytes; }
+  size_t deadBytes() const { return dead; }
+  void retire();
+  void waitIdle() const;
+  bool idle() const { return inflight.load() == 0; }
+  size_t checkpointedUpTo() const { return checkpointed; }
+  // set by the manager right after the segment opens
+  void versionsFrom(const std::atomic<uint64_t> *clock) { versions = clock; }
+  uint64_t topVersion() const { return top_version; }
+  bool snapshot(SegmentCheckpoint &cp);
+  void writeCheckpoint(const SegmentCheckpoint &cp);
   void loadBloom();
   void saveBloom();
-  void loadIndex();
+  // reload reads an evicted index back, the rest is in memory already
+  void loadIndex(bool reload = false);
   void saveIndex();
-  bool lookup(uint64_t hash, SegmentOffset &out);
+  // false_hits counts the lookups the bloom filter let through to an index
+  // that does not have the key
+  bool lookup(uint64_t hash, SegmentOffset &out,
+              uint64_t *false_hits = nullptr);
+  std::optional<uint64_t> indexEntry(uint64_t hash);
+  // the (hash, entry) pairs of the keys whose newest record here is a merge
+  // operand
+  void mergeEntries(std::vector<std::pair<uint64_t, uint64_t>> &out);
+  uint64_t lastUsed() override;
+  size_t evict() override;
 };
 
 } // namespace kv
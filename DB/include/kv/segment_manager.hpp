@@ -1,26 +1,152 @@
 #pragma once
+#include "io_engine.hpp"
 #include "segment.hpp"
+#include "thread_pool.hpp"
+#include "timing_wheel.hpp"
+#include "workload.hpp"
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 namespace kv {
 
+// where a record was (or is going to be) written
+struct AppendSlot {
+  Segment *seg = nullptr;
+  size_t offset = 0;
+};
+
+// a spot in the append log of a model, where a replica goes on from. crc is
+// the checksum of the record ending at offset, a compaction rewrites the
+// segment under the same id and that shows up as a mismatch
+struct LogPosition {
+  uint64_t segment_id = 0; // 0 starts at the oldest segment
+  uint64_t offset = 0;
+  uint32_t crc = 0;
+};
+
+// a record of the log as SegmentMgr::walk hands it over: its view, its bytes
+// and where it is. false stops the walk after it
+using LogFn = std::function<bool(const RecordView &view, std::string_view rec,
+                                 size_t segment_id, size_t offset)>;
+
+// gets the values (encoded BlobRefs) of the REC_BLOB records a compaction
+// dropped, once the compacted segment is in place
+using BlobsDroppedFn = std::function<void(const std::vector<std::string> &)>;
+
+// how the segment files are written, see StorageOptions
+struct SegmentFiles {
+  bool preallocate = false;
+  bool direct = false;
+  ThreadPool *background = nullptr; // makes the next file ahead, if set
+  size_t bloom_bits_per_key = 0;
+  size_t record_bytes = 0;
+  // the engine's version clock, the checkpoints of the segments keep it as
+  // the bound of the versions they hold
+  const std::atomic<uint64_t> *versions = nullptr;
+};
+
+// a segment as a scan sees it: pinned, its records up to end and its
+// mapping if it is sealed
+struct ScanSegment {
+  std::shared_ptr<Segment> seg;
+  std::string_view map;
+  size_t end = 0;
+};
+
+enum class TailStatus {
+  Drained, // copied everything that is written so far
+  More,    // stopped at the size limit, there is more
+  Lost,    // the position is not in the log any more, start over from {}
+  Unsupported // the engine has no log to ship (LsmEngine)
+};
+
 class SegmentMgr {
-  std::vector<Segment *> closed;
-  Segment *current;
-  std::mutex mu;
-  size_t max_size;
+  // shared so a reader holding a SegmentOffset keeps a compacted away
+  // segment open until it is done
+  std::vector<std::shared_ptr<Segment>> closed;
+  std::shared_ptr<Segment> current;
+  std::mutex mu;             // serializes the appends
+  std::shared_mutex list_mu; // guards current and closed against rotation
+  std::mutex maint_mu;       // one checkpoint or compaction at a time
+  std::atomic<size_t> max_size; // of the segments started from now on
   std::string dir;
   size_t next_id = 1;
+  std::shared_ptr<IoEngine> io;
+  MemoryBudget *budget; // handed to the segments, may be null
+  BlobsDroppedFn blobs_dropped;
+  SegmentFiles files;
+  // the segment the next file was asked for in, and whether that is running
+  size_t spare_for = 0;
+  std::shared_ptr<std::atomic<bool>> spare_busy =
+      std::make_shared<std::atomic<bool>>(false);
+  // the bloom filters of the new segments, see tune()
+  std::atomic<size_t> bloom_per_key, record_bytes;
+  WorkloadStats *lookups = nullptr; // counts the bloom filter checks, if set
+
+  std::shared_ptr<Segment> find(size_t id);
+  bool olderHas(uint64_t hash, size_t id);
+  bool newerHas(uint64_t hash, size_t id);
+  bool compactSegment(const std::shared_ptr<Segment> &seg,
+                      std::shared_mutex &ind_mu);
+  AppendSlot place(size_t len);
+  std::shared_ptr<Segment> nextSegment();
+  size_t bloomBits(size_t bytes) const;
+  void rotate();
+  void finishAttach();
 
 public:
-  SegmentMgr(const std::string &dir, size_t segment_size);
+  SegmentMgr(const std::string &dir, size_t segment_size,
+             std::shared_ptr<IoEngine> io, MemoryBudget *budget = nullptr,
+             SegmentFiles files = {});
   ~SegmentMgr();
-  size_t append(uint64_t hash, std::string_view key, std::string_view val);
+  AppendSlot reserve(size_t len);
+  AppendSlot append(std::string_view record);
   bool lookup(uint64_t hash, SegmentOffset &out);
+  // every segment oldest first, for reading all of them
+  std::vector<ScanSegment> segments();
+  // bytes of the records the index still points at, about
+  size_t liveBytes();
+  // the newest version of a record in the segments, as far as their
+  // checkpoints and the replayed records tell
+  uint64_t topVersion();
+  // the size and bloom filter sizing (as in SegmentFiles) of the segments
+  // started from now on, compacted ones included
+  void tune(size_t segment_size, size_t bloom_bits_per_key,
+            size_t record_bytes);
+  // set before the first lookup
+  void countLookups(WorkloadStats *stats) { lookups = stats; }
+  // the record of a packIndex entry of segment id, for following the link of
+  // a merge operand. false if the segment is gone
+  bool locate(size_t id, uint64_t entry, SegmentOffset &out);
+  // the newest records of the keys that end in a merge operand, the caller
+  // holds its index lock
+  void mergeHeads(std::vector<SegmentOffset> &out);
+  void checkpoint(std::shared_mutex &ind_mu);
+  bool expire(const ExpiryTimer &t);
+  void markDead(size_t segment_id, size_t bytes);
+  void timers(std::vector<ExpiryTimer> &out);
+  size_t compact(std::shared_mutex &ind_mu, double min_dead_ratio);
+  TailStatus tail(LogPosition &pos, std::string &out, size_t max);
+  TailStatus walk(LogPosition &pos, size_t max, const LogFn &fn);
+  // also gets the unfinished snapshot dir, to add more files to it
+  bool snapshot(std::shared_mutex &ind_mu, const std::string &dest,
+                const std::function<bool(const std::string &)> &also = {});
+  // set before the first compaction
+  void onBlobsDropped(BlobsDroppedFn fn) { blobs_dropped = std::move(fn); }
+  bool attach(const std::vector<std::string> &paths);
 };
 
+// a new model at dir with the files of a snapshot, which stay shared with it.
+// false if dir exists already or the links failed
+bool restoreSnapshot(const std::string &snapshot, const std::string &dir);
+
 } // namespace kv
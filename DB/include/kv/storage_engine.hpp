@@ -1,25 +1,242 @@
 #pragma once
+#include "blob_store.hpp"
+#include "buffer.hpp"
+#include "change_feed.hpp"
+#include "io_engine.hpp"
+#include "memory_budget.hpp"
+#include "merge.hpp"
 #include "segment_manager.hpp"
+#include "thread_pool.hpp"
+#include "workload.hpp"
+#include <array>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <optional>
-#include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 namespace kv {
 
+// callback for the scans, gets every live record and its RecordFlags
+using ScanFn = std::function<void(std::string_view key, std::string_view val,
+                                  uint8_t flags)>;
+// the same with the whole decoded record
+using RecordFn = std::function<void(const RecordView &rec)>;
+// completion of get_async: the value (nullopt if missing) and its RecordFlags
+using GetCallback =
+    std::function<void(std::optional<std::string> val, uint8_t flags)>;
+// completion of put_async, false if the record could not be written
+using PutCallback = std::function<void(bool ok)>;
+// what update does with a key: gets its value (nullopt if missing) and its
+// RecordFlags, returns the new value or nullopt to leave the key as it is
+using UpdateFn = std::function<std::optional<std::string>(
+    std::optional<std::string_view> val, uint8_t flags)>;
+
+// outcome of the conditional writes
+enum class WriteStatus {
+  Ok,
+  Conflict, // the key was not at the version asked for
+  Failed,   // the record could not be written
+};
+struct WriteResult {
+  WriteStatus status;
+  uint64_t version; // the new one if Ok, the current one (0 missing) if not
+};
+
+// one write of write_batch
+struct BatchOp {
+  std::string key;
+  std::string val; // empty erases the key
+  bool is_json = false;
+  uint64_t ttl_ms = 0;
+  // the version the key has to be at for the batch to go through, 0 for a
+  // missing key
+  std::optional<uint64_t> if_version;
+  uint64_t version = 0; // set by write_batch, as in WriteResult
+};
+
+// per engine knobs, whoever opens the engine fills them from the Config
+struct StorageOptions {
+  size_t segment_size = 64 * 1024 * 1024;
+  // bytes appended between two index checkpoints, bounds the log tail
+  // replayed after a crash
+  size_t checkpoint_interval = 4 * 1024 * 1024;
+  std::shared_ptr<IoEngine> io;     // a pread engine if empty
+  ThreadPool *background = nullptr; // runs the checkpoints, inline if null
+  MemoryBudget *memory = nullptr;   // counts (and evicts) indexes, if set
+  // closed segments with this share of garbage get compacted after a
+  // checkpoint, 0 turns it off
+  double compact_dead_ratio = 0.5;
+  // recent writes kept for the change streams, 0 turns the feed off
+  size_t change_feed_size = 0;
+  // values of this size and up go to the blob log instead of the segments,
+  // 0 keeps all of them inline
+  size_t blob_threshold = 1024 * 1024;
+  // the blocks of a segment file are allocated whole when it starts, the
+  // next one ahead of time with a background pool
+  bool preallocate = false;
+  // the appends of the hash engine bypass the page cache (O_DIRECT), as
+  // block aligned writes one at a time
+  bool direct_io = false;
+  // bloom filter bits per key of the new hash segments, sized for the keys
+  // of record_bytes that fill one. 0 gives every segment the same 8K bits
+  size_t bloom_bits_per_key = 0;
+  size_t record_bytes = 0;
+  // counts the reads and writes of the model, if set (see workload.hpp)
+  std::shared_ptr<WorkloadStats> workload = nullptr;
+};
+
+// the settings the auto tuner (auto_tuner.hpp) picks for a model, they are
+// the StorageOptions of the same names. they apply to what the engine does
+// from now on, the segments there already stay as they are
+struct Tuning {
+  size_t segment_size = 0;
+  size_t bloom_bits_per_key = 0;
+  size_t record_bytes = 0;
+  double compact_dead_ratio = 0;
+};
+
+// what the server needs of a model's storage, there are two kinds of it:
+// - HashEngine (hash_engine.hpp): an append log with every key in an
+//   in-memory hash index, one disk read per get
+// - LsmEngine (lsm_engine.hpp): a memtable and sorted runs, for models with
+//   more keys than fit the memory and for reads of key ranges
+// the defaults below are built on the other functions, an engine overrides
+// them where it can do better
 class StorageEngine {
-  SegmentMgr seg_mgr;
-  std::string dir; // where the files are at
-  std::shared_mutex ind_mu;
+  // the write locks of the keys, striped. recursive for the put of update
+  std::array<std::recursive_mutex, 64> key_locks;
+  // the last version handed out, it starts at the time so it keeps growing
+  // over a restart
+  std::atomic<uint64_t> last_version;
+  std::atomic<bool> dropped{false};
+
+  uint64_t current_version(std::string_view key);
+
+protected:
+  // put, erase, put_blob, merge and apply (the replicas) hold it over their
+  // write, so an update never loses a write made between its read and its
+  // put. put_async does not take it
+  std::recursive_mutex &key_lock(std::string_view key);
+  // the version of a write, every live record the engine writes gets one
+  uint64_t next_version() { return ++last_version; }
+  // the last one handed out, no record written so far has a newer one
+  const std::atomic<uint64_t> &version_clock() const { return last_version; }
+  // the engines call it with the newest version they recovered, so a clock
+  // that went back (or a burst of over 1024 writes a ms before the restart)
+  // never gives a key a version it had already
+  void seed_version(uint64_t version);
+  // writes the records of ops (their versions set) so that either all or
+  // none of them are there after a crash, the key locks are held
+  virtual bool commit_batch(const std::vector<BatchOp> &ops) = 0;
 
 public:
-  StorageEngine(const std::string &dir, size_t seg_size);
-  void put(const std::string &key, const std::string &val);
-  std::optional<std::string> get(const std::string &key);
-  bool erase(const std::string &key);
-  std::vector<std::pair<std::string, std::string>> get_all() const;
+  StorageEngine();
+  virtual ~StorageEngine() = default;
+
+  // opens the engine of the model at dir, kind is "hash" or "lsm". a model
+  // that has files already stays with the kind they are of
+  static std::shared_ptr<StorageEngine> open(const std::string &kind,
+                                             const std::string &dir,
+                                             const StorageOptions &opts);
+  virtual const char *name() const = 0;
+  // set when the model is deleted, whoever keeps the engine for long (the
+  // change streams, replication) lets go of it once it sees this
+  void retire() { dropped = true; }
+  bool retired() const { return dropped; }
+
+  // ttl_ms != 0 makes the key expire that many ms from now, a clock stores
+  // the value as that version (see cluster.hpp). returns the version of the
+  // key the write made, 0 for an erase or if the record could not be written
+  virtual uint64_t put(std::string_view key, std::string_view val,
+                       bool is_json = false, uint64_t ttl_ms = 0,
+                       std::string_view clock = {}) = 0;
+  virtual bool get_into(std::string_view key, Buffer &out) = 0;
+  virtual bool erase(std::string_view key) = 0;
+  virtual void scan_records(const RecordFn &fn) = 0;
+  // the records with from <= key < to (no end if to is empty) in key order,
+  // at most limit of them (0 for all)
+  virtual void scan_range(std::string_view from, std::string_view to,
+                          size_t limit, const RecordFn &fn);
+  // the keys of the live records after pos in log order, each at its newest
+  // record: at most limit of them out of about max bytes of the log. pos
+  // moves past them, Drained once the log is done. Unsupported if the engine
+  // has no log, scan_range pages through the keys then
+  virtual TailStatus scan_keys(LogPosition &pos, size_t limit, size_t max,
+                               std::vector<std::string> &out);
+
+  virtual void checkpoint() = 0;
+  virtual size_t compact(double min_dead_ratio = 0.0) = 0;
+  // hard links the model's files as they are now into dest
+  virtual bool snapshot(const std::string &dest) = 0;
+  // adds segments built by a BulkLoader, their keys win over the ones
+  // written before. the change feed does not see them
+  virtual bool attach(const std::vector<std::string> &segments);
+  virtual void expire() {}
+  // takes the settings of t, false if the engine has none of them to change
+  virtual bool tune(const Tuning &) { return false; }
+  // bytes of live records in the files, 0 if the engine does not know
+  virtual size_t data_bytes() { return 0; }
+  virtual ChangeFeed *changes() = 0;
+  // the append log, read by the replicas and applied to theirs
+  virtual TailStatus tail(LogPosition &pos, std::string &out, size_t max);
+  virtual bool apply(std::string_view records) = 0;
+
+  // the value for reading it in pieces, without loading all of it
+  virtual bool get_blob(std::string_view key, BlobHandle &out);
+  // streams a value of len bytes into the blob log (whatever its size),
+  // put_blob then stores it under key once it is complete and returns the
+  // version, as put does. null if the engine has no blob log
+  virtual std::unique_ptr<BlobWriter> open_blob(uint64_t len);
+  virtual uint64_t put_blob(std::string_view key, BlobWriter &blob,
+                            bool is_json = false, uint64_t ttl_ms = 0);
+
+  // non blocking versions, the callbacks may run on the I/O engine's
+  // completion thread (or inline)
+  virtual void get_async(const std::string &key, GetCallback cb);
+  virtual void put_async(const std::string &key, const std::string &val,
+                         bool is_json, PutCallback cb);
+  std::future<std::optional<std::string>> get_async(const std::string &key);
+  std::future<bool> put_async(const std::string &key, const std::string &val,
+                              bool is_json = false);
+
+  std::optional<std::string> get(std::string_view key, bool *is_json = nullptr);
+  // read-modify-write of key under its write lock (see UpdateFn), the new
+  // value keeps what is left of the TTL unless ttl_ms gives it a new one.
+  // a Conflict if fn left the key as it is
+  WriteStatus update(std::string_view key, const UpdateFn &fn,
+                     bool is_json = false, uint64_t ttl_ms = 0);
+  // applies a merge operand (valid for op, see validOperand) to the value of
+  // key and gives it a new version. the result is json (unless the value was
+  // not, see foldOperands) and has no TTL. the default reads and rewrites the
+  // value under the key's lock, the engines append the operand alone and fold
+  // it in when the key is read
+  virtual bool merge(std::string_view key, MergeOp op,
+                     std::string_view operand);
+  // put and erase only if the key is at version (0: only if it is missing),
+  // the check and the write happen under the key's lock
+  WriteResult put_if(std::string_view key, std::string_view val,
+                     uint64_t version, bool is_json = false,
+                     uint64_t ttl_ms = 0);
+  WriteResult erase_if(std::string_view key, uint64_t version);
+  // put_blob only if the key is at version, checked as in put_if
+  WriteResult put_blob_if(std::string_view key, BlobWriter &blob,
+                          uint64_t version, bool is_json = false,
+                          uint64_t ttl_ms = 0);
+  // all of ops or none: the conditions are checked against the keys as they
+  // are before the batch and every op gets its new version. on a Conflict
+  // the ops with a condition get the version their key is at instead. a
+  // later op on the same key wins
+  WriteStatus write_batch(std::vector<BatchOp> &ops);
+  void scan(const ScanFn &fn);
+  std::vector<std::pair<std::string, std::string>> get_all();
 };
 
 } // namespace kv
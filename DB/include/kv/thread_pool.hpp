@@ -1,24 +1,78 @@
 #pragma once
+#include <atomic>
 #include <condition_variable>
+#include <cstddef>
+#include <deque>
 #include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace kv {
 
+// which jobs go first: a worker runs every High job it can find (its own or
+// stolen) before any Normal one, and those before any Background one
+enum class TaskPriority : uint8_t {
+  High,      // a request is waiting on it, e.g. the reads of a quorum get
+  Normal,    // the default
+  Background // checkpoints, compaction, index loads, read repair
+};
+
+// a deque of jobs per worker and priority. the jobs queued by a worker go to
+// its own deque, the ones from outside are spread round robin. an idle worker
+// steals from the back of the others, so one busy queue does not hold up the
+// rest and there is no lock all of them meet on. the workers only sleep on
+// the shared condition variable when every deque is empty
 class ThreadPool {
+  static constexpr size_t PRIORITIES = 3;
+
+  struct Queue {
+    std::mutex mu;
+    std::deque<std::function<void()>> jobs[PRIORITIES];
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues; // one per worker
   std::vector<std::thread> workers;
-  std::queue<std::function<void()>> tasks;
-  std::mutex mu;
+  std::atomic<size_t> queued{0}; // jobs in all the deques
+  std::atomic<size_t> next{0};   // round robin of the outside submitters
+  std::mutex mu;                 // for the sleeping workers
   std::condition_variable cv;
+  size_t sleeping = 0;
   bool stop = false;
 
+  size_t home();
+  bool pop(size_t self, std::function<void()> &job);
+  void wake(size_t jobs);
+  void run(size_t self);
+
 public:
   ThreadPool(size_t threads);
+  // runs the jobs queued so far, then joins the workers
   ~ThreadPool();
-  void enqueue(std::function<void()> job);
+  void enqueue(std::function<void()> job,
+               TaskPriority prio = TaskPriority::Normal);
+  // queues all of them under one lock and wakes as many workers as there are
+  // jobs (at most), instead of one lock and wakeup per job
+  void enqueue_batch(std::vector<std::function<void()>> jobs,
+                     TaskPriority prio = TaskPriority::Normal);
+  size_t size() const { return workers.size(); }
+
+  // runs fn on the pool, the future gets its result (or exception)
+  template <typename Fn>
+  auto submit(Fn &&fn, TaskPriority prio = TaskPriority::Normal)
+      -> std::future<std::invoke_result_t<std::decay_t<Fn>>> {
+    using Result = std::invoke_result_t<std::decay_t<Fn>>;
+    // std::function needs a copyable job, the task itself is move only
+    auto task =
+        std::make_shared<std::packaged_task<Result()>>(std::forward<Fn>(fn));
+    auto result = task->get_future();
+    enqueue([task] { (*task)(); }, prio);
+    return result;
+  }
 };
 
 } // namespace kv
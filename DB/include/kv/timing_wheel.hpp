@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace kv {
+
+// a key with a TTL, it fires once its expiry time has passed
+struct ExpiryTimer {
+  uint64_t hash;       // the key's hash
+  size_t segment_id;   // segment holding the record that set the TTL
+  uint64_t expires_at; // ms since the epoch
+};
+
+// hierarchical timing wheel, LEVELS wheels of SLOTS slots each. level 0 has
+// one slot per tick, every level above covers SLOTS times the span of the one
+// below and gets cascaded down as the time gets there. adding a timer and
+// firing it are O(1), nothing ever walks all the timers
+class TimingWheel {
+  static constexpr unsigned SLOT_BITS = 6;
+  static constexpr unsigned SLOTS = 1u << SLOT_BITS;
+  static constexpr unsigned LEVELS = 4; // 64^4 ticks, ~194 days of seconds
+
+  std::mutex mu;
+  uint64_t tick_ms;
+  uint64_t now_tick; // last tick that was processed
+  size_t count = 0;
+  std::vector<ExpiryTimer> slots[LEVELS][SLOTS];
+
+  void place(const ExpiryTimer &t);
+  void cascade(unsigned level);
+
+public:
+  TimingWheel(uint64_t tick_ms, uint64_t start_ms);
+  void add(const ExpiryTimer &t);
+  // moves the wheel up to now_ms, the timers that are due go into due
+  void advance(uint64_t now_ms, std::vector<ExpiryTimer> &due);
+  size_t size();
+};
+
+} // namespace kv
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace kv {
+
+// sampled per request tracing. a TraceRequest at the start of a handler picks
+// (at the sampling rate) whether the request is traced, then every TraceSpan
+// the thread goes through until it ends is recorded into a ring of the
+// thread's own. dumpTrace() turns the rings into chrome trace json, which
+// chrome://tracing and ui.perfetto.dev open. with a request that is not
+// sampled a span costs one thread_local check
+
+// the request traced on this thread, 0 for none
+inline thread_local uint64_t trace_request = 0;
+
+uint64_t traceNowNs();
+// the share of the requests traced, 0 (off) to 1. can change at any time
+void setTraceRate(double rate);
+double traceRate();
+// every span still in the rings as {"traceEvents": [...]}, clear drops them
+std::string dumpTrace(bool clear = false);
+
+// one finished span. name has to be a literal, only the pointer is kept
+void traceRecord(const char *name, uint64_t start_ns, uint64_t end_ns,
+                 const char *arg, uint64_t value);
+
+class TraceSpan {
+  const char *name;
+  uint64_t start = 0;
+  const char *arg = nullptr;
+  uint64_t value = 0;
+
+public:
+  explicit TraceSpan(const char *name) : name(name) {
+    if (trace_request)
+      start = traceNowNs();
+  }
+  ~TraceSpan() { end(); }
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+  // a number shown with the span, e.g. how many segments a lookup probed
+  void note(const char *key, uint64_t v) {
+    arg = key;
+    value = v;
+  }
+  // ends it before the scope does
+  void end() {
+    if (start && trace_request)
+      traceRecord(name, start, traceNowNs(), arg, value);
+    start = 0;
+  }
+};
+
+// the span of a whole request, it decides whether the request is sampled. a
+// nested one (e.g. a handler that runs another) belongs to the outer one
+class TraceRequest {
+  const char *name;
+  uint64_t start = 0; // set when this one started a sampled trace
+
+public:
+  explicit TraceRequest(const char *name);
+  ~TraceRequest();
+  TraceRequest(const TraceRequest &) = delete;
+  TraceRequest &operator=(const TraceRequest &) = delete;
+};
+
+} // namespace kv
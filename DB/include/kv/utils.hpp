@@ -1,5 +1,6 @@
 // utils.hpp
 #pragma once
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 
@@ -50,9 +51,10 @@ static const uint32_t CRC32_TABLE[256] = {
     0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
     0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d};
 
-// Compute CRC‑32 (IEEE 802.3) over `data[0..length)`
-inline uint32_t crc32(const uint8_t *data, size_t length) {
-  uint32_t crc = 0xFFFFFFFFu;
+// Compute CRC‑32 (IEEE 802.3) over `data[0..length)`. prev is the crc of the
+// bytes before, for checksumming something that comes in pieces
+inline uint32_t crc32(const uint8_t *data, size_t length, uint32_t prev = 0) {
+  uint32_t crc = prev ^ 0xFFFFFFFFu;
   for (size_t i = 0; i < length; ++i) {
     uint8_t idx = static_cast<uint8_t>(crc ^ data[i]);
     crc = (crc >> 8) ^ CRC32_TABLE[idx];
@@ -60,4 +62,12 @@ inline uint32_t crc32(const uint8_t *data, size_t length) {
   return crc ^ 0xFFFFFFFFu;
 }
 
+// wall clock in milliseconds since the epoch, what record expiry times use
+inline uint64_t nowMs() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count());
+}
+
 } // namespace utils
@@ -0,0 +1,58 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace kv {
+
+// sizes are counted in powers of two: bucket i has the ones below 2^i
+constexpr size_t SIZE_BUCKETS = 32;
+using SizeHistogram = std::array<uint64_t, SIZE_BUCKETS>;
+
+// the counts of a WorkloadStats at one point, two of them subtract into the
+// workload in between
+struct WorkloadSnapshot {
+  uint64_t reads = 0, misses = 0; // misses are reads of a missing key
+  uint64_t writes = 0, erases = 0, merges = 0;
+  uint64_t key_bytes = 0, value_bytes = 0; // of the reads that hit and writes
+  uint64_t sized = 0;                      // how many of those
+  // segments whose bloom filter was asked by a lookup, and how many of those
+  // let a key through that the segment did not have
+  uint64_t bloom_checks = 0, bloom_false = 0;
+  SizeHistogram key_sizes{}, value_sizes{};
+
+  uint64_t ops() const { return reads + writes + erases + merges; }
+  double readShare() const;
+  double missRate() const;
+  double bloomFalseRate() const;
+  size_t meanKey() const;
+  size_t meanValue() const;
+  // the size q (0 to 1) of the keys or values are below, rounded up to a
+  // power of two
+  static size_t quantile(const SizeHistogram &h, double q);
+  WorkloadSnapshot operator-(const WorkloadSnapshot &before) const;
+};
+
+// what a model is asked to do, counted by its engine as it goes. relaxed
+// counters, whoever reads them gets a close enough picture. it outlives the
+// engine: the registry keeps it over closes of the model (auto_tuner.hpp)
+class WorkloadStats {
+  std::atomic<uint64_t> reads{0}, misses{0}, writes{0}, erases{0}, merges{0};
+  std::atomic<uint64_t> key_bytes{0}, value_bytes{0}, sized{0};
+  std::atomic<uint64_t> bloom_checks{0}, bloom_false{0};
+  std::array<std::atomic<uint64_t>, SIZE_BUCKETS> key_sizes{}, value_sizes{};
+
+  void sizes(size_t key_len, size_t val_len);
+
+public:
+  // val_len is only looked at if found
+  void read(size_t key_len, bool found, size_t val_len);
+  void write(size_t key_len, size_t val_len);
+  void erase() { erases.fetch_add(1, std::memory_order_relaxed); }
+  void merge() { merges.fetch_add(1, std::memory_order_relaxed); }
+  void bloom(uint64_t checks, uint64_t false_hits);
+  WorkloadSnapshot snapshot() const;
+};
+
+} // namespace kv
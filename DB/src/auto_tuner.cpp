@@ -0,0 +1,302 @@
+#include "../include/kv/auto_tuner.hpp"
+#include "../include/kv/segment.hpp"
+#include "../include/kv/utils.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace kv {
+
+// a round with fewer operations of a model leaves its settings as they are
+static constexpr uint64_t MIN_OPS = 1000;
+// the segments are sized for about this many of them to hold the live data,
+// within a quarter and 4 times the configured size
+static constexpr size_t SEGMENTS_PER_MODEL = 8;
+static constexpr size_t MIN_SEGMENT_SIZE = 1024 * 1024;
+// bloom filter bits per key: the usual, for models that hardly read, for
+// ones whose reads often miss (a miss asks the filter of every segment) and
+// how many more when the filters let through more than they should
+static constexpr size_t BLOOM_BITS = 10;
+static constexpr size_t BLOOM_BITS_FEW_READS = 6;
+static constexpr size_t BLOOM_BITS_MISSES = 16;
+static constexpr size_t BLOOM_BITS_MORE = 6;
+// what a record takes besides its key and value, about
+static constexpr size_t RECORD_OVERHEAD = 32;
+// the share of the memory budget handed out to the models by their reads
+static constexpr double SHARED_BUDGET = 0.5;
+
+// of a filter with bits per key and the 4 hashes of the segments
+static double expectedFalseRate(size_t bits) {
+  return std::pow(1 - std::exp(-4.0 / static_cast<double>(bits)), 4);
+}
+
+static std::string percent(double r) {
+  return std::to_string(static_cast<int>(r * 100 + 0.5)) + "%";
+}
+
+// the sizes and counts go out as integers
+static json number(double v) {
+  if (v == std::floor(v) && v >= 0)
+    return static_cast<uint64_t>(v);
+  return v;
+}
+
+static json describe(const WorkloadSnapshot &w) {
+  return {{"reads", w.reads},
+          {"misses", w.misses},
+          {"writes", w.writes},
+          {"erases", w.erases},
+          {"merges", w.merges},
+          {"read_share", w.readShare()},
+          {"miss_rate", w.missRate()},
+          {"bloom_false_rate", w.bloomFalseRate()},
+          {"key_p50", WorkloadSnapshot::quantile(w.key_sizes, 0.5)},
+          {"key_p99", WorkloadSnapshot::quantile(w.key_sizes, 0.99)},
+          {"value_p50", WorkloadSnapshot::quantile(w.value_sizes, 0.5)},
+          {"value_p99", WorkloadSnapshot::quantile(w.value_sizes, 0.99)}};
+}
+
+AutoTuner::AutoTuner(const Config &config, MemoryBudget &memory)
+    : config(config), memory(memory), last_round(utils::nowMs()) {}
+
+// the same place as the registry's
+std::string AutoTuner::dirOf(const std::string &model) const {
+  return config.data_dir + "/" + model;
+}
+
+Tuning AutoTuner::defaults() const {
+  return {config.segment_size, 0, 0, config.compact_dead_ratio};
+}
+
+void AutoTuner::load(const std::string &model, Model &m) {
+  std::ifstream in(dirOf(model) + "/tuning.json");
+  json j = json::parse(in, nullptr, false);
+  if (!j.is_object())
+    return; // none yet (or cut short), the defaults it is
+  m.tuning.segment_size = j.value("segment_size", m.tuning.segment_size);
+  m.tuning.bloom_bits_per_key = j.value("bloom_bits_per_key", size_t{0});
+  m.tuning.record_bytes = j.value("record_bytes", size_t{0});
+  m.tuning.compact_dead_ratio =
+      j.value("compact_dead_ratio", m.tuning.compact_dead_ratio);
+  m.share = j.value("cache_share", size_t{0});
+  memory.setShare(model, m.share);
+}
+
+void AutoTuner::save(const std::string &model, const Model &m) {
+  json j = {{"segment_size", m.tuning.segment_size},
+            {"bloom_bits_per_key", m.tuning.bloom_bits_per_key},
+            {"record_bytes", m.tuning.record_bytes},
+            {"compact_dead_ratio", m.tuning.compact_dead_ratio},
+            {"cache_share", m.share}};
+  std::string text = j.dump();
+  atomicWrite(dirOf(model) + "/tuning.json", {{text.data(), text.size()}});
+}
+
+void AutoTuner::prepare(const std::string &model, StorageOptions &opts) {
+  std::lock_guard lock(mu);
+  Model &m = models[model];
+  opts.workload = m.stats;
+  if (config.auto_tune_interval == 0)
+    return;
+  if (!m.loaded) {
+    m.tuning = defaults();
+    load(model, m);
+    m.loaded = true;
+  }
+  opts.segment_size = m.tuning.segment_size;
+  opts.bloom_bits_per_key = m.tuning.bloom_bits_per_key;
+  opts.record_bytes = m.tuning.record_bytes;
+  opts.compact_dead_ratio = m.tuning.compact_dead_ratio;
+}
+
+bool AutoTuner::due() {
+  if (config.auto_tune_interval == 0)
+    return false;
+  uint64_t now = utils::nowMs();
+  uint64_t last = last_round.load();
+  return now - last >= config.auto_tune_interval &&
+         last_round.compare_exchange_strong(last, now);
+}
+
+// the settings of one model for the workload w, the ones that change go to
+// out with the reason
+void AutoTuner::decide(StorageEngine &engine, const WorkloadSnapshot &w,
+                       Tuning &t, std::vector<TuningDecision> &out) {
+  auto change = [&out](const char *setting, auto &field, auto to,
+                       std::string why) {
+    if (field == to)
+      return;
+    out.push_back({setting, static_cast<double>(field),
+                   static_cast<double>(to), std::move(why)});
+    field = to;
+  };
+  double reads = w.readShare();
+  bool read_heavy = reads > 0.8, write_heavy = reads < 0.3;
+
+  // bigger segments for mostly writes: fewer rotations and fewer files to
+  // compact, the reads of a big model ask fewer filters
+  size_t base = config.segment_size;
+  size_t live = engine.data_bytes();
+  size_t want = live / SEGMENTS_PER_MODEL * (write_heavy ? 2 : 1);
+  size_t size = MIN_SEGMENT_SIZE;
+  while (size * 2 <= want)
+    size *= 2;
+  size_t lo = std::min(std::max(base / 4, MIN_SEGMENT_SIZE), base * 4);
+  size = std::clamp(size, lo, base * 4);
+  change("segment_size", t.segment_size, size,
+         std::to_string(live >> 10) + " KB live" +
+             (write_heavy ? ", " + percent(1 - reads) + " of the ops write"
+                          : std::string()));
+
+  // the filters are sized for the records that fill a segment, the record
+  // size only moves when it is off by half
+  if (w.sized) {
+    size_t rec = w.meanKey() + w.meanValue() + RECORD_OVERHEAD;
+    if (!t.record_bytes || rec > 2 * t.record_bytes ||
+        2 * rec < t.record_bytes)
+      change("record_bytes", t.record_bytes, rec,
+             "mean key " + std::to_string(w.meanKey()) + " and value " +
+                 std::to_string(w.meanValue()) + " bytes");
+  }
+  size_t bits = BLOOM_BITS;
+  std::string why = percent(reads) + " of the ops read, " +
+                    percent(w.missRate()) + " of those miss";
+  if (reads < 0.1) {
+    bits = BLOOM_BITS_FEW_READS;
+  } else if (w.missRate() > 0.3) {
+    bits = BLOOM_BITS_MISSES;
+  }
+  // the untuned filters have a fixed size, nothing to expect of them
+  double expected = t.bloom_bits_per_key
+                        ? expectedFalseRate(t.bloom_bits_per_key)
+                        : 1;
+  if (w.bloom_checks >= MIN_OPS && w.bloomFalseRate() > 2 * expected &&
+      reads >= 0.1) {
+    bits += BLOOM_BITS_MORE;
+    why = "the filters let " + percent(w.bloomFalseRate()) + " through, " +
+          percent(expected) + " expected";
+  }
+  if (t.record_bytes)
+    change("bloom_bits_per_key", t.bloom_bits_per_key, bits, why);
+
+  // compacting sooner keeps the files of a read heavy model small, later
+  // rewrites less of a write heavy one. off stays off
+  double ratio = config.compact_dead_ratio;
+  if (ratio > 0 && read_heavy)
+    ratio *= 0.6;
+  else if (ratio > 0 && write_heavy)
+    ratio = std::min(0.9, ratio * 1.5);
+  change("compact_dead_ratio", t.compact_dead_ratio, ratio,
+         percent(reads) + " of the ops read");
+}
+
+// the workload of every open model since the last round decides its
+// settings, the reads of all of them their shares of the memory budget
+void AutoTuner::round(const std::vector<OpenModel> &open) {
+  std::lock_guard lock(mu);
+  struct Seen {
+    const OpenModel *open;
+    Model *model;
+    WorkloadSnapshot w;
+  };
+  std::vector<Seen> seen;
+  uint64_t reads = 0;
+  for (const auto &o : open) {
+    auto it = models.find(o.name);
+    if (it == models.end() || !it->second.loaded)
+      continue;
+    WorkloadSnapshot now = it->second.stats->snapshot();
+    seen.push_back({&o, &it->second, now - it->second.seen});
+    it->second.seen = now;
+    if (seen.back().w.ops() >= MIN_OPS)
+      reads += seen.back().w.reads;
+  }
+
+  size_t budget =
+      static_cast<size_t>(memory.limitBytes() * SHARED_BUDGET);
+  uint64_t at = utils::nowMs();
+  for (auto &s : seen) {
+    Model &m = *s.model;
+    std::vector<TuningDecision> out;
+    bool busy = s.w.ops() >= MIN_OPS;
+    if (busy) {
+      Tuning t = m.tuning;
+      decide(*s.open->engine, s.w, t, out);
+      // an engine without any of the settings keeps the defaults
+      if (!out.empty() && !s.open->engine->tune(t))
+        out.clear();
+      else
+        m.tuning = t;
+    }
+    // the share follows the reads once it is off by a quarter
+    size_t share = busy && budget && reads
+                       ? static_cast<size_t>(static_cast<double>(budget) *
+                                             s.w.reads / reads)
+                       : 0;
+    if (share > m.share + m.share / 4 || share + share / 4 < m.share) {
+      out.push_back(
+          {"cache_share", static_cast<double>(m.share),
+           static_cast<double>(share),
+           busy ? percent(reads ? static_cast<double>(s.w.reads) / reads : 0) +
+                      " of the reads"
+                : "fewer than " + std::to_string(MIN_OPS) + " ops"});
+      m.share = share;
+      memory.setShare(s.open->name, share);
+    }
+    if (out.empty())
+      continue;
+    save(s.open->name, m);
+    std::ofstream log(dirOf(s.open->name) + "/tuning.log", std::ios::app);
+    json workload = describe(s.w);
+    for (const auto &d : out) {
+      json line = {{"at", at},
+                   {"setting", d.setting},
+                   {"from", number(d.from)},
+                   {"to", number(d.to)},
+                   {"why", d.why},
+                   {"workload", workload}};
+      log << line.dump() << '\n';
+    }
+  }
+}
+
+void AutoTuner::forget(const std::string &model) {
+  std::lock_guard lock(mu);
+  models.erase(model);
+  memory.setShare(model, 0);
+}
+
+std::map<std::string, AutoTuner::Report> AutoTuner::report(size_t log_lines) {
+  std::lock_guard lock(mu);
+  std::map<std::string, Report> out;
+  for (const auto &[name, m] : models) {
+    Report &r = out[name];
+    r.tuning = m.loaded ? m.tuning : defaults();
+    r.share = m.share;
+    r.workload = m.stats->snapshot();
+    std::ifstream in(dirOf(name) + "/tuning.log");
+    std::deque<std::string> last;
+    std::string line;
+    while (log_lines && std::getline(in, line)) {
+      last.push_back(std::move(line));
+      if (last.size() > log_lines)
+        last.pop_front();
+    }
+    r.log.assign(last.begin(), last.end());
+  }
+  return out;
+}
+
+} // namespace kv
@@ -0,0 +1,303 @@
+#include "../include/kv/blob_store.hpp"
+#include "../include/kv/segment.hpp" // atomicWrite
+#include "../include/kv/utils.hpp"   // crc32
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace kv {
+
+// file id, offset, length and crc, little endian like the records
+void encodeBlobRef(std::string &out, const BlobRef &ref) {
+  out.resize(BLOB_REF_SIZE);
+  char *p = out.data();
+  std::memcpy(p, &ref.file, sizeof(ref.file));
+  std::memcpy(p + 4, &ref.offset, sizeof(ref.offset));
+  std::memcpy(p + 12, &ref.len, sizeof(ref.len));
+  std::memcpy(p + 20, &ref.crc, sizeof(ref.crc));
+}
+
+bool decodeBlobRef(std::string_view in, BlobRef &ref) {
+  if (in.size() != BLOB_REF_SIZE)
+    return false;
+  const char *p = in.data();
+  std::memcpy(&ref.file, p, sizeof(ref.file));
+  std::memcpy(&ref.offset, p + 4, sizeof(ref.offset));
+  std::memcpy(&ref.len, p + 12, sizeof(ref.len));
+  std::memcpy(&ref.crc, p + 20, sizeof(ref.crc));
+  return true;
+}
+
+BlobFile::~BlobFile() {
+  if (fd >= 0)
+    ::close(fd);
+}
+
+// the blob files are plain pread/pwrite, big sequential I/O does not gain
+// anything from the segments' engine
+static bool readAll(int fd, char *buf, size_t len, uint64_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t r = ::pread(fd, buf + done, len - done, off + done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    done += static_cast<size_t>(r);
+  }
+  return true;
+}
+
+static bool writeAll(int fd, const char *buf, size_t len, uint64_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t w = ::pwrite(fd, buf + done, len - done, off + done);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    done += static_cast<size_t>(w);
+  }
+  return true;
+}
+
+bool BlobHandle::read(uint64_t at, size_t n, std::string &out) const {
+  if (at >= len)
+    return true;
+  n = static_cast<size_t>(std::min<uint64_t>(n, len - at));
+  if (!file) {
+    out.append(inline_val, at, n);
+    return true;
+  }
+  size_t old = out.size();
+  out.resize(old + n);
+  if (readAll(file->fd, out.data() + old, n, offset + at))
+    return true;
+  out.resize(old);
+  return false;
+}
+
+BlobWriter::BlobWriter(BlobStore *store, std::shared_ptr<BlobFile> file,
+                       uint64_t offset, uint64_t len)
+    : store(store), file(std::move(file)) {
+  ref.file = this->file->id;
+  ref.offset = offset;
+  ref.len = len;
+}
+
+// the space of a value that was never stored is garbage. the file is made to
+// cover it, so its size still counts the space when it is reopened
+BlobWriter::~BlobWriter() {
+  if (kept || ref.len == 0)
+    return;
+  if (done < ref.len) {
+    char zero = 0;
+    writeAll(file->fd, &zero, 1, ref.offset + ref.len - 1);
+  }
+  store->release({ref});
+}
+
+bool BlobWriter::write(std::string_view chunk) {
+  if (failed || chunk.size() > ref.len - done ||
+      !writeAll(file->fd, chunk.data(), chunk.size(), ref.offset + done)) {
+    failed = true;
+    return false;
+  }
+  ref.crc = utils::crc32(reinterpret_cast<const uint8_t *>(chunk.data()),
+                         chunk.size(), ref.crc);
+  done += chunk.size();
+  return true;
+}
+
+// opens the blob files already there, the fully dead ones (of a crash right
+// before they were removed) go right away
+BlobStore::BlobStore(const std::string &dir, uint64_t file_size)
+    : dir(dir), file_size(file_size) {
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    std::string name = entry.path().filename().string();
+    if (entry.path().extension() != ".blob" || name.rfind("blob_", 0) != 0)
+      continue;
+    uint32_t id;
+    try {
+      id = static_cast<uint32_t>(std::stoul(name.substr(5)));
+    } catch (const std::exception &) {
+      continue;
+    }
+    int fd = ::open(entry.path().c_str(), O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0) {
+      if (fd >= 0)
+        ::close(fd);
+      continue;
+    }
+    files[id] = std::make_shared<BlobFile>(id, entry.path().string(), fd,
+                                           static_cast<uint64_t>(st.st_size));
+    if (id >= next_id)
+      next_id = id + 1;
+  }
+
+  // pairs of file id and dead bytes
+  std::ifstream in(dir + "/blobs.dead", std::ios::binary);
+  uint64_t pair[2];
+  while (in.read(reinterpret_cast<char *>(pair), sizeof(pair))) {
+    if (files.count(static_cast<uint32_t>(pair[0])))
+      dead[static_cast<uint32_t>(pair[0])] = pair[1];
+  }
+  std::lock_guard lock(mu);
+  collect();
+}
+
+// hands out len bytes at the end of the active file, the caller writes them
+std::shared_ptr<BlobFile> BlobStore::reserve(uint64_t len, uint64_t &offset) {
+  std::lock_guard lock(mu);
+  if (!active || active->end >= file_size) {
+    uint32_t id = next_id++;
+    std::string path = dir + "/blob_" + std::to_string(id) + ".blob";
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+      return nullptr;
+    active = std::make_shared<BlobFile>(id, path, fd, 0);
+    files[id] = active;
+  }
+  offset = active->end.fetch_add(len);
+  return active;
+}
+
+bool BlobStore::put(std::string_view val, BlobRef &ref) {
+  uint64_t offset;
+  auto file = reserve(val.size(), offset);
+  if (!file)
+    return false;
+  ref.file = file->id;
+  ref.offset = offset;
+  ref.len = val.size();
+  ref.crc =
+      utils::crc32(reinterpret_cast<const uint8_t *>(val.data()), val.size());
+  if (writeAll(file->fd, val.data(), val.size(), offset))
+    return true;
+  // nothing points at it, a writer cleans up the same way
+  BlobWriter(this, file, offset, val.size());
+  return false;
+}
+
+std::unique_ptr<BlobWriter> BlobStore::open(uint64_t len) {
+  uint64_t offset;
+  auto file = reserve(len, offset);
+  if (!file)
+    return nullptr;
+  return std::make_unique<BlobWriter>(this, std::move(file), offset, len);
+}
+
+bool BlobStore::get(const BlobRef &ref, char *out) {
+  std::shared_ptr<BlobFile> file;
+  {
+    std::lock_guard lock(mu);
+    auto it = files.find(ref.file);
+    if (it == files.end())
+      return false;
+    file = it->second;
+  }
+  return readAll(file->fd, out, ref.len, ref.offset) &&
+         utils::crc32(reinterpret_cast<const uint8_t *>(out), ref.len) ==
+             ref.crc;
+}
+
+bool BlobStore::get(const BlobRef &ref, std::string &out) {
+  out.resize(ref.len);
+  return get(ref, out.data());
+}
+
+bool BlobStore::handle(const BlobRef &ref, uint8_t flags, BlobHandle &out) {
+  std::lock_guard lock(mu);
+  auto it = files.find(ref.file);
+  if (it == files.end())
+    return false;
+  out = BlobHandle(it->second, ref.offset, ref.len, flags);
+  return true;
+}
+
+void BlobStore::release(const std::vector<BlobRef> &refs) {
+  if (refs.empty())
+    return;
+  std::lock_guard lock(mu);
+  for (const auto &ref : refs) {
+    if (files.count(ref.file))
+      dead[ref.file] += ref.len;
+  }
+  collect();
+}
+
+// removes the files that are garbage all the way through, except the active
+// one which still takes values. the readers holding one keep it open. the
+// caller holds mu
+void BlobStore::collect() {
+  for (auto it = dead.begin(); it != dead.end();) {
+    auto file = files.find(it->first);
+    if (file == files.end()) {
+      it = dead.erase(it);
+      continue;
+    }
+    if (file->second == active || it->second < file->second->end) {
+      ++it;
+      continue;
+    }
+    std::error_code ec;
+    std::filesystem::remove(file->second->path, ec);
+    files.erase(file);
+    it = dead.erase(it);
+  }
+  saveDead();
+}
+
+// the caller holds mu
+void BlobStore::saveDead() {
+  std::vector<uint64_t> pairs;
+  for (const auto &[id, bytes] : dead) {
+    pairs.push_back(id);
+    pairs.push_back(bytes);
+  }
+  std::string path = dir + "/blobs.dead";
+  if (pairs.empty()) {
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    return;
+  }
+  atomicWrite(path, {{pairs.data(), pairs.size() * sizeof(uint64_t)}});
+}
+
+bool BlobStore::linkInto(const std::string &dest) {
+  std::vector<std::shared_ptr<BlobFile>> linked;
+  {
+    std::lock_guard lock(mu);
+    active = nullptr;
+    for (const auto &[id, file] : files)
+      linked.push_back(file);
+  }
+  std::error_code ec;
+  for (const auto &file : linked) {
+    std::string name = std::filesystem::path(file->path).filename().string();
+    std::filesystem::create_hard_link(file->path, dest + "/" + name, ec);
+    if (ec)
+      return false;
+  }
+  std::error_code missing;
+  std::filesystem::create_hard_link(dir + "/blobs.dead", dest + "/blobs.dead",
+                                    missing);
+  return true;
+}
+
+} // namespace kv
@@ -0,0 +1,81 @@
+#include "../include/kv/bulk_loader.hpp"    // builds the segments
+#include "../include/kv/config.hpp"         // Your database Config class
+#include "../include/kv/storage_engine.hpp" // attaches them to the model
+#include "../include/kv/utils.hpp"          // nowMs
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+namespace fs = std::filesystem;
+
+// loads a big JSONL or CSV file into a model of a server that is not running
+// (a running one takes the same through POST /{model}/_bulk):
+//   bulk_load [-c config] [--csv] [-j threads] <model> <file, - for stdin>
+static int usage() {
+  std::cerr << "usage: bulk_load [-c config] [--csv] [-j threads] <model> "
+               "<file|->\n";
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  std::string conf = "./config/db.conf";
+  kv::BulkOptions opts;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-' && argv[i][1]; ++i) {
+    if (!std::strcmp(argv[i], "--csv"))
+      opts.format = kv::BulkFormat::Csv;
+    else if (!std::strcmp(argv[i], "-c") && i + 1 < argc)
+      conf = argv[++i];
+    else if (!std::strcmp(argv[i], "-j") && i + 1 < argc)
+      opts.threads = std::strtoull(argv[++i], nullptr, 10);
+    else
+      return usage();
+  }
+  if (argc - i != 2)
+    return usage();
+  std::string model = argv[i], input = argv[i + 1];
+
+  kv::Config config = kv::Config::load(conf);
+  opts.segment_size = config.segment_size;
+  std::ifstream file;
+  if (input != "-") {
+    file.open(input, std::ios::binary);
+    if (!file) {
+      std::cerr << "can not open " << input << '\n';
+      return 1;
+    }
+  }
+  std::istream &in = input == "-" ? std::cin : file;
+
+  // the engine opens first: it clears out the staging dirs of loads that
+  // died, this one's included if it came later
+  std::string dir = config.data_dir + "/" + model;
+  kv::StorageOptions engine_opts;
+  engine_opts.segment_size = config.segment_size;
+  auto engine =
+      kv::StorageEngine::open(config.engine_of(model), dir, engine_opts);
+  if (std::string(engine->name()) != "hash") {
+    std::cerr << model << " is an lsm model, bulk loads build hash segments\n";
+    return 1;
+  }
+  auto start = std::chrono::steady_clock::now();
+  kv::BulkLoader loader(dir + "/.bulk-" + std::to_string(utils::nowMs()),
+                        opts);
+  kv::BulkStats stats;
+  if (!loader.build(in, stats) || !engine->attach(loader.segments())) {
+    std::cerr << "bulk load failed\n";
+    return 1;
+  }
+  auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            start)
+                  .count();
+  std::cout << stats.lines << " lines (" << stats.bad_lines << " bad), "
+            << stats.records << " keys in " << stats.segments
+            << " segments, " << (stats.bytes >> 20) << " MB in " << secs
+            << " s\n";
+  return 0;
+}
@@ -0,0 +1,475 @@
+#include "../include/kv/bulk_loader.hpp"
+#include "../include/kv/bloomfilter.hpp"
+#include "../include/kv/hash_func.hpp"
+#include "../include/kv/segment.hpp"
+#include "../include/kv/thread_pool.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace kv {
+
+// a spilled entry: [key_len u32][val_len u32][flags u8][seq u64][key][val]
+static constexpr size_t ENTRY_HEADER = 2 * sizeof(uint32_t) + 1 + 8;
+// read and write buffers of the run and segment files
+static constexpr size_t IO_BUFFER = 1 << 20;
+static constexpr size_t MERGE_BUFFER = 64 << 10;
+// the segments open their bloom filters with this many hashes
+static constexpr size_t BLOOM_HASHES = 4;
+static constexpr size_t BLOOM_BITS_PER_KEY = 8;
+
+static bool writeAll(int fd, const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = ::write(fd, p, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    p += w;
+    n -= static_cast<size_t>(w);
+  }
+  return true;
+}
+
+// ============================ PARSING ========================================
+
+// one parsed record, key and value are in the run's arena
+struct Entry {
+  uint32_t part;
+  uint32_t key_len, val_len;
+  uint8_t flags;
+  uint64_t seq; // input order, the biggest one of a key wins
+  size_t key_off, val_off;
+};
+
+// a csv field at pos, "quoted" ones may hold commas and "" for a quote. pos
+// ends up after the field and its comma
+static bool csvField(std::string_view line, size_t &pos, std::string &out) {
+  out.clear();
+  if (pos < line.size() && line[pos] == '"') {
+    for (++pos; pos < line.size(); ++pos) {
+      if (line[pos] != '"') {
+        out += line[pos];
+      } else if (pos + 1 < line.size() && line[pos + 1] == '"') {
+        out += '"';
+        ++pos;
+      } else {
+        break;
+      }
+    }
+    if (pos >= line.size())
+      return false; // not closed
+    ++pos;
+    if (pos < line.size() && line[pos] != ',')
+      return false;
+  } else {
+    size_t comma = line.find(',', pos);
+    out.assign(line.substr(pos, comma - pos));
+    pos = comma == std::string_view::npos ? line.size() : comma;
+  }
+  if (pos < line.size())
+    ++pos; // the comma
+  return true;
+}
+
+// ============================ LOADER =========================================
+
+BulkLoader::BulkLoader(const std::string &staging, const BulkOptions &opts)
+    : staging(staging), opts(opts), threads(opts.threads) {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  if (this->opts.run_bytes == 0)
+    this->opts.run_bytes = 64 << 20;
+}
+
+BulkLoader::~BulkLoader() {
+  std::error_code ec;
+  std::filesystem::remove_all(staging, ec);
+}
+
+// parses a chunk of whole lines, sorts it by (partition, key, seq) and
+// writes it out as a run
+bool BulkLoader::spill(const std::string &chunk, uint64_t run_no,
+                       BulkStats &stats) {
+  std::string arena;
+  std::vector<Entry> entries;
+  size_t lines = 0, bad = 0;
+  auto add = [&](std::string_view key, std::string_view val, uint8_t flags,
+                 uint64_t seq) {
+    Entry e;
+    e.part = static_cast<uint32_t>((fnv1a(key) >> 32) % threads);
+    e.key_len = static_cast<uint32_t>(key.size());
+    e.val_len = static_cast<uint32_t>(val.size());
+    e.flags = flags;
+    e.seq = seq;
+    e.key_off = arena.size();
+    arena.append(key);
+    e.val_off = arena.size();
+    arena.append(val);
+    entries.push_back(e);
+  };
+
+  std::string key, val;
+  size_t pos = 0;
+  while (pos < chunk.size()) {
+    size_t nl = chunk.find('\n', pos);
+    if (nl == std::string::npos)
+      nl = chunk.size();
+    std::string_view line(chunk.data() + pos, nl - pos);
+    pos = nl + 1;
+    if (!line.empty() && line.back() == '\r')
+      line.remove_suffix(1);
+    if (line.empty())
+      continue;
+    uint64_t seq = run_no << 32 | lines++;
+
+    if (opts.format == BulkFormat::Csv) {
+      size_t at = 0;
+      if (!csvField(line, at, key) || at == 0 || line[at - 1] != ',' ||
+          !csvField(line, at, val) || at != line.size()) {
+        ++bad;
+        continue;
+      }
+      add(key, val, 0, seq);
+      continue;
+    }
+    auto json = nlohmann::json::parse(line, nullptr, false);
+    if (json.is_discarded() || !json.is_object()) {
+      ++bad;
+      continue;
+    }
+    // dump() output is valid json, flagged like the POST handler does
+    for (const auto &[k, v] : json.items())
+      add(k, v.dump(), REC_JSON, seq);
+  }
+
+  std::sort(entries.begin(), entries.end(),
+            [&arena](const Entry &a, const Entry &b) {
+              if (a.part != b.part)
+                return a.part < b.part;
+              int c = std::string_view(arena).substr(a.key_off, a.key_len)
+                          .compare(std::string_view(arena).substr(
+                              b.key_off, b.key_len));
+              return c != 0 ? c < 0 : a.seq < b.seq;
+            });
+
+  Run run;
+  run.path = staging + "/run_" + std::to_string(run_no);
+  int fd = ::open(run.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0)
+    return false;
+  std::string buf;
+  uint64_t written = 0;
+  bool ok = true;
+  size_t next = 0;
+  for (size_t p = 0; p < threads; ++p) {
+    run.starts.push_back(written + buf.size());
+    for (; next < entries.size() && entries[next].part == p; ++next) {
+      const Entry &e = entries[next];
+      char hdr[ENTRY_HEADER];
+      std::memcpy(hdr, &e.key_len, sizeof(e.key_len));
+      std::memcpy(hdr + 4, &e.val_len, sizeof(e.val_len));
+      hdr[8] = static_cast<char>(e.flags);
+      std::memcpy(hdr + 9, &e.seq, sizeof(e.seq));
+      buf.append(hdr, sizeof(hdr));
+      buf.append(arena, e.key_off, e.key_len);
+      buf.append(arena, e.val_off, e.val_len);
+      if (buf.size() >= IO_BUFFER) {
+        ok = ok && writeAll(fd, buf.data(), buf.size());
+        written += buf.size();
+        buf.clear();
+      }
+    }
+  }
+  ok = ok && writeAll(fd, buf.data(), buf.size());
+  written += buf.size();
+  run.starts.push_back(written);
+  ::close(fd);
+
+  std::lock_guard lock(mu);
+  stats.lines += lines;
+  stats.bad_lines += bad;
+  runs.push_back(std::move(run));
+  return ok;
+}
+
+namespace {
+
+// reads one partition of a run, entry by entry
+struct RunCursor {
+  int fd;
+  uint64_t pos, end; // file offsets still to read
+  std::string buf;
+  size_t at = 0; // the next entry in buf
+  std::string_view key, val;
+  uint8_t flags = 0;
+  uint64_t seq = 0;
+
+  // makes sure buf has n bytes from at, false at the end of the partition
+  bool fill(size_t n) {
+    if (buf.size() - at >= n)
+      return true;
+    buf.erase(0, at);
+    at = 0;
+    size_t want = std::min<uint64_t>(std::max(n, MERGE_BUFFER), end - pos);
+    if (buf.size() + want < n)
+      return false;
+    size_t have = buf.size();
+    buf.resize(have + want);
+    size_t done = 0;
+    while (done < want) {
+      ssize_t r = ::pread(fd, buf.data() + have + done, want - done,
+                          static_cast<off_t>(pos + done));
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        return false;
+      done += static_cast<size_t>(r);
+    }
+    pos += want;
+    return true;
+  }
+
+  bool next() {
+    if (!fill(ENTRY_HEADER))
+      return false;
+    uint32_t klen, vlen;
+    std::memcpy(&klen, buf.data() + at, sizeof(klen));
+    std::memcpy(&vlen, buf.data() + at + 4, sizeof(vlen));
+    if (!fill(ENTRY_HEADER + klen + vlen))
+      return false;
+    const char *p = buf.data() + at;
+    flags = static_cast<uint8_t>(p[8]);
+    std::memcpy(&seq, p + 9, sizeof(seq));
+    key = std::string_view(p + ENTRY_HEADER, klen);
+    val = std::string_view(p + ENTRY_HEADER + klen, vlen);
+    at += ENTRY_HEADER + klen + vlen;
+    return true;
+  }
+};
+
+// appends records to a segment file being built and keeps its index
+class SegmentWriter {
+  std::string path;
+  int fd = -1;
+  std::string buf, record;
+  size_t size = 0;
+  SegmentCheckpoint cp;
+
+public:
+  explicit SegmentWriter(std::string path_) : path(std::move(path_)) {
+    fd = ::open((path + ".kv").c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  }
+  ~SegmentWriter() {
+    if (fd >= 0)
+      ::close(fd);
+  }
+  bool ok() const { return fd >= 0; }
+  size_t bytes() const { return size + buf.size(); }
+  size_t records() const { return cp.entries.size(); }
+
+  bool add(std::string_view key, std::string_view val, uint8_t flags) {
+    encodeRecord(record, key, val, flags);
+    cp.entries.emplace_back(fnv1a(key), packIndex(bytes(), record.size()));
+    buf += record;
+    if (buf.size() < IO_BUFFER)
+      return true;
+    bool written = writeAll(fd, buf.data(), buf.size());
+    size += buf.size();
+    buf.clear();
+    return written;
+  }
+
+  // the data first, then the index that claims it
+  bool finish() {
+    bool written = writeAll(fd, buf.data(), buf.size()) && ::fsync(fd) == 0;
+    size += buf.size();
+    buf.clear();
+    cp.covered = size;
+    BloomFilter bf(std::max<size_t>(8 * 1024, cp.entries.size() *
+                                                  BLOOM_BITS_PER_KEY),
+                   BLOOM_HASHES);
+    for (const auto &[hash, entry] : cp.entries)
+      bf.add(hash);
+    cp.bloom.resize(bf.size());
+    for (size_t i = 0; i < bf.size(); ++i)
+      cp.bloom[i] = bf.getBit(i);
+    writeSegmentFiles(path, cp);
+    return written && std::filesystem::exists(path + ".idx");
+  }
+};
+
+} // namespace
+
+// merges the partition of every run into segments, only the newest entry of
+// a key makes it
+bool BulkLoader::merge(size_t partition, const std::vector<int> &fds,
+                       std::vector<std::string> &out, BulkStats &stats) {
+  std::vector<RunCursor> cursors(runs.size());
+  auto later = [](const RunCursor *a, const RunCursor *b) {
+    int c = a->key.compare(b->key);
+    return c != 0 ? c > 0 : a->seq > b->seq;
+  };
+  std::priority_queue<RunCursor *, std::vector<RunCursor *>, decltype(later)>
+      heap(later);
+  for (size_t i = 0; i < runs.size(); ++i) {
+    RunCursor &c = cursors[i];
+    c.fd = fds[i];
+    c.pos = runs[i].starts[partition];
+    c.end = runs[i].starts[partition + 1];
+    if (c.next())
+      heap.push(&c);
+  }
+
+  std::unique_ptr<SegmentWriter> seg;
+  size_t records = 0, bytes = 0;
+  bool ok = true;
+  auto emit = [&](std::string_view key, std::string_view val, uint8_t flags) {
+    if (!seg) {
+      out.push_back(staging + "/seg_" + std::to_string(partition) + "_" +
+                    std::to_string(out.size()));
+      seg = std::make_unique<SegmentWriter>(out.back());
+      ok = ok && seg->ok();
+    }
+    ok = ok && seg->add(key, val, flags);
+    if (seg->bytes() >= opts.segment_size) {
+      ok = ok && seg->finish();
+      records += seg->records();
+      bytes += seg->bytes();
+      seg.reset();
+    }
+  };
+
+  std::string key, val;
+  uint8_t flags = 0;
+  bool have = false;
+  while (!heap.empty() && ok) {
+    RunCursor *c = heap.top();
+    heap.pop();
+    if (have && c->key != key)
+      emit(key, val, flags);
+    key.assign(c->key);
+    val.assign(c->val);
+    flags = c->flags;
+    have = true;
+    if (c->next())
+      heap.push(c);
+  }
+  if (have && ok)
+    emit(key, val, flags);
+  if (seg) {
+    ok = ok && seg->finish();
+    records += seg->records();
+    bytes += seg->bytes();
+  }
+
+  std::lock_guard lock(mu);
+  stats.records += records;
+  stats.bytes += bytes;
+  return ok;
+}
+
+bool BulkLoader::build(std::istream &in, BulkStats &stats) {
+  std::error_code ec;
+  std::filesystem::create_directories(staging, ec);
+  if (ec)
+    return false;
+
+  // the runs, at most one per thread in memory
+  bool ok = true;
+  {
+    ThreadPool pool(threads);
+    std::mutex wait_mu;
+    std::condition_variable cv;
+    size_t inflight = 0;
+    std::string carry;
+    for (uint64_t run_no = 0; in; ++run_no) {
+      std::string chunk = std::move(carry);
+      size_t have = chunk.size();
+      chunk.resize(have + opts.run_bytes);
+      in.read(chunk.data() + have,
+              static_cast<std::streamsize>(opts.run_bytes));
+      chunk.resize(have + static_cast<size_t>(in.gcount()));
+      carry.clear();
+      // the partial line at the end goes with the next run
+      if (in) {
+        size_t nl = chunk.rfind('\n');
+        if (nl == std::string::npos) {
+          carry = std::move(chunk); // a line longer than a run
+          continue;
+        }
+        carry.assign(chunk, nl + 1, std::string::npos);
+        chunk.resize(nl + 1);
+      }
+      if (chunk.empty())
+        continue;
+      std::unique_lock lock(wait_mu);
+      cv.wait(lock, [&] { return inflight < threads; });
+      if (!ok)
+        break;
+      ++inflight;
+      lock.unlock();
+      pool.enqueue([&, run_no, chunk = std::move(chunk)] {
+        bool spilled = spill(chunk, run_no, stats);
+        std::lock_guard done(wait_mu);
+        ok = ok && spilled;
+        --inflight;
+        cv.notify_all();
+      });
+    }
+    std::unique_lock lock(wait_mu);
+    cv.wait(lock, [&] { return inflight == 0; });
+  }
+  // the pool is gone, nobody writes ok any more
+  if (!ok || in.bad())
+    return false;
+
+  // the partitions merge in parallel, every run file opened once
+  std::vector<int> fds;
+  for (const auto &run : runs) {
+    fds.push_back(::open(run.path.c_str(), O_RDONLY | O_CLOEXEC));
+    ok = ok && fds.back() >= 0;
+  }
+  std::vector<std::vector<std::string>> parts(threads);
+  if (ok) {
+    std::vector<char> merged(threads);
+    {
+      ThreadPool pool(threads);
+      for (size_t p = 0; p < threads; ++p)
+        pool.enqueue([&, p] { merged[p] = merge(p, fds, parts[p], stats); });
+    }
+    ok = std::all_of(merged.begin(), merged.end(), [](char m) { return m; });
+  }
+  for (int fd : fds) {
+    if (fd >= 0)
+      ::close(fd);
+  }
+  for (const auto &run : runs)
+    std::filesystem::remove(run.path, ec);
+  if (!ok)
+    return false;
+  // keys do not repeat across partitions, their order does not matter
+  for (auto &segs : parts)
+    built.insert(built.end(), segs.begin(), segs.end());
+  stats.segments = built.size();
+  return true;
+}
+
+} // namespace kv
@@ -0,0 +1,78 @@
+#include "../include/kv/change_feed.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kv {
+
+// the capacity gets rounded up to a power of two
+ChangeFeed::ChangeFeed(size_t capacity, uint64_t first_seq)
+    : first(first_seq ? first_seq : 1), next(first) {
+  size_t cap = 1;
+  while (cap < capacity)
+    cap <<= 1;
+  ring.resize(cap);
+  mask = cap - 1;
+}
+
+std::shared_ptr<ChangeEvent> ChangeFeed::make(ChangeOp op,
+                                              std::string_view key,
+                                              std::string_view value,
+                                              uint8_t flags) {
+  auto ev = std::make_shared<ChangeEvent>();
+  ev->op = op;
+  ev->flags = flags;
+  ev->key = key;
+  ev->value = value;
+  return ev;
+}
+
+uint64_t ChangeFeed::publish(std::shared_ptr<ChangeEvent> ev) {
+  uint64_t seq = next.fetch_add(1);
+  ev->seq = seq;
+  std::atomic_store(&ring[seq & mask], std::move(ev));
+  if (has_listeners.load(std::memory_order_relaxed)) {
+    std::lock_guard lock(listen_mu);
+    for (auto &fn : listeners)
+      (*fn)();
+  }
+  return seq;
+}
+
+uint64_t ChangeFeed::oldest() const {
+  uint64_t n = next.load();
+  return n - first > ring.size() ? n - ring.size() : first;
+}
+
+ChangeFeed::ReadStatus ChangeFeed::read(uint64_t &from, size_t max,
+                                        std::vector<ChangeEventPtr> &out) {
+  if (from < first)
+    return ReadStatus::Gap;
+  for (size_t n = 0; n < max && from < next.load(); ++n) {
+    std::shared_ptr<const ChangeEvent> ev =
+        std::atomic_load(&ring[from & mask]);
+    if (!ev || ev->seq < from)
+      break; // claimed but not stored yet, the next read gets it
+    if (ev->seq > from)
+      return ReadStatus::Gap; // lapped by the writers
+    out.push_back(std::move(ev));
+    ++from;
+  }
+  return ReadStatus::Ok;
+}
+
+void ChangeFeed::listen(const std::shared_ptr<std::function<void()>> &fn) {
+  std::lock_guard lock(listen_mu);
+  if (std::find(listeners.begin(), listeners.end(), fn) == listeners.end())
+    listeners.push_back(fn);
+  has_listeners = true;
+}
+
+} // namespace kv
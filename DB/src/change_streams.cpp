@@ -0,0 +1,151 @@
+#include "../include/kv/change_streams.hpp"
+#include "../include/kv/json_stream.hpp"
+#include "../include/kv/segment.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace kv {
+
+// events sent to one subscriber before moving on to the next one
+static constexpr size_t STREAM_BATCH = 256;
+
+ChangeStreams::ChangeStreams() : signal(std::make_shared<Signal>()) {
+  // only captures the signal, a feed calling it after we are gone is fine
+  wake = std::make_shared<std::function<void()>>([sig = signal] {
+    {
+      std::lock_guard lock(sig->mu);
+      sig->pending = true;
+    }
+    sig->cv.notify_one();
+  });
+  pump = std::thread([this] { run(); });
+}
+
+ChangeStreams::~ChangeStreams() {
+  {
+    std::lock_guard lock(signal->mu);
+    signal->stop = true;
+  }
+  signal->cv.notify_one();
+  pump.join();
+}
+
+uint64_t ChangeStreams::subscribe(EngineHandle engine, uint64_t since,
+                                  StreamFilter filter, StreamSink sink) {
+  ChangeFeed *feed = engine ? engine->changes() : nullptr;
+  if (!feed)
+    return 0;
+  Subscriber s{std::move(engine), feed, since ? since + 1 : feed->head() + 1,
+               std::move(filter), std::move(sink)};
+  // resuming from further back than the feed remembers (or from before the
+  // model was reopened), the client has to reload the model and goes on from
+  // the newest change
+  if (s.cursor < feed->oldest() || s.cursor > feed->head() + 1) {
+    s.cursor = feed->head() + 1;
+    s.sink.send("{\"op\":\"reset\",\"seq\":" + std::to_string(s.cursor - 1) +
+                "}");
+  }
+  feed->listen(wake);
+  uint64_t id;
+  {
+    std::lock_guard lock(mu);
+    id = next_id++;
+    subs.emplace(id, std::move(s));
+  }
+  (*wake)(); // sends whatever it resumed from
+  return id;
+}
+
+// after this returns the subscriber's sink is not used any more
+void ChangeStreams::unsubscribe(uint64_t id) {
+  std::lock_guard lock(mu);
+  subs.erase(id);
+}
+
+size_t ChangeStreams::size() {
+  std::lock_guard lock(mu);
+  return subs.size();
+}
+
+void ChangeStreams::run() {
+  while (true) {
+    {
+      std::unique_lock lock(signal->mu);
+      // the timeout only matters for a publish racing with the wait
+      signal->cv.wait_for(lock, std::chrono::milliseconds(500), [this] {
+        return signal->pending || signal->stop;
+      });
+      if (signal->stop)
+        return;
+      signal->pending = false;
+    }
+    bool more = false;
+    std::lock_guard lock(mu);
+    for (auto it = subs.begin(); it != subs.end();) {
+      if (!deliver(it->second)) {
+        it = subs.erase(it);
+        continue;
+      }
+      more |= it->second.cursor <= it->second.feed->head();
+      ++it;
+    }
+    if (more) {
+      std::lock_guard sig_lock(signal->mu);
+      signal->pending = true;
+    }
+  }
+}
+
+// sends the next batch of matching changes. a subscriber more than half the
+// ring behind is too slow to keep up and gets cut off before it would miss
+// anything, it can come back with the last seq it got
+bool ChangeStreams::deliver(Subscriber &s) {
+  if (s.engine->retired()) {
+    s.sink.close("model deleted"); // lets go of the engine and its files
+    return false;
+  }
+  uint64_t head = s.feed->head();
+  if (head >= s.cursor && head - s.cursor >= s.feed->capacity() / 2) {
+    s.sink.close("too slow, resume from " + std::to_string(s.cursor - 1));
+    return false;
+  }
+  std::vector<ChangeEventPtr> events;
+  if (s.feed->read(s.cursor, STREAM_BATCH, events) ==
+      ChangeFeed::ReadStatus::Gap) {
+    s.sink.close("too slow, resume from " + std::to_string(s.cursor - 1));
+    return false;
+  }
+  for (const auto &ev : events) {
+    if (s.filter.matches(ev->key) && !s.sink.send(encode(*ev)))
+      return false;
+  }
+  return true;
+}
+
+// {"seq":N,"op":"put","key":"...","value":...}, json values go out as they
+// are. a merge has its operands as the value ({"add":5})
+std::string ChangeStreams::encode(const ChangeEvent &ev) {
+  std::string out = "{\"seq\":" + std::to_string(ev.seq) + ",\"op\":";
+  out += ev.op == ChangeOp::Put     ? "\"put\""
+         : ev.op == ChangeOp::Merge ? "\"merge\""
+                                    : "\"erase\"";
+  out += ",\"key\":";
+  JsonStreamWriter::escape(out, ev.key);
+  if (ev.op != ChangeOp::Erase) {
+    out += ",\"value\":";
+    if (ev.flags & REC_JSON)
+      out += ev.value;
+    else
+      JsonStreamWriter::escape(out, ev.value);
+  }
+  out += '}';
+  return out;
+}
+
+} // namespace kv
@@ -0,0 +1,931 @@
+#include "../include/kv/cluster.hpp"
+#include "../include/kv/buffer.hpp"
+#include "../include/kv/hash_func.hpp"
+#include "../include/kv/net.hpp"
+#include "../include/kv/segment.hpp"
+#include "../include/kv/utils.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace kv {
+
+// clock entries kept per value, the smallest counters go first past that
+static constexpr size_t MAX_CLOCK_ENTRIES = 16;
+// open connections kept per node
+static constexpr size_t MAX_IDLE = 8;
+// a node that failed a call is left alone this long
+static constexpr uint64_t DOWN_MS = 1000;
+// how often the held hints are offered to their nodes
+static constexpr uint64_t HANDOFF_MS = 1000;
+static constexpr uint32_t NO_HINT = UINT32_MAX;
+
+// one node's copy of a key, unversioned records have an empty clock
+struct Cluster::Stored {
+  std::string value;
+  uint8_t flags = 0;
+  uint64_t expires_at = 0;
+  VersionVector clock;
+};
+
+// ============================ VERSIONS =======================================
+
+VersionVector::Order VersionVector::compare(const VersionVector &o) const {
+  bool less = false, greater = false;
+  auto a = counters.begin();
+  auto b = o.counters.begin();
+  while (a != counters.end() || b != o.counters.end()) {
+    if (b == o.counters.end() ||
+        (a != counters.end() && a->first < b->first)) {
+      greater = true; // only this one saw that node
+      ++a;
+    } else if (a == counters.end() || b->first < a->first) {
+      less = true;
+      ++b;
+    } else {
+      less |= a->second < b->second;
+      greater |= a->second > b->second;
+      ++a;
+      ++b;
+    }
+  }
+  if (less && greater)
+    return Order::Concurrent;
+  if (less)
+    return Order::Before;
+  return greater ? Order::After : Order::Equal;
+}
+
+bool VersionVector::newer_than(const VersionVector &o) const {
+  switch (compare(o)) {
+  case Order::After:
+    return true;
+  case Order::Before:
+  case Order::Equal:
+    return false;
+  case Order::Concurrent:
+    break;
+  }
+  // same time on both, every node has to pick the same one
+  if (timestamp != o.timestamp)
+    return timestamp > o.timestamp;
+  return encode() > o.encode();
+}
+
+void VersionVector::merge(const VersionVector &o) {
+  for (const auto &[node, n] : o.counters) {
+    uint64_t &mine = counters[node];
+    mine = std::max(mine, n);
+  }
+  // a lost entry only makes an old version look concurrent, the timestamp
+  // settles those
+  while (counters.size() > MAX_CLOCK_ENTRIES) {
+    auto smallest = std::min_element(
+        counters.begin(), counters.end(),
+        [](const auto &x, const auto &y) { return x.second < y.second; });
+    counters.erase(smallest);
+  }
+}
+
+// [deleted u8][timestamp u64][count u8][node u32, counter u64]...
+std::string VersionVector::encode() const {
+  std::string out;
+  putU8(out, deleted ? 1 : 0);
+  putU64(out, timestamp);
+  putU8(out, static_cast<uint8_t>(counters.size()));
+  for (const auto &[node, n] : counters) {
+    putU32(out, node);
+    putU64(out, n);
+  }
+  return out;
+}
+
+bool VersionVector::decode(std::string_view in, VersionVector &out) {
+  WireReader r(in);
+  out = VersionVector();
+  out.deleted = r.u8() != 0;
+  out.timestamp = r.u64();
+  size_t n = r.u8();
+  for (size_t i = 0; i < n && r.ok(); ++i) {
+    uint32_t node = r.u32();
+    out.counters[static_cast<uint16_t>(node)] = r.u64();
+  }
+  return r.ok() && !in.empty();
+}
+
+std::string VersionVector::context() const {
+  static const char *digits = "0123456789abcdef";
+  std::string raw = encode(), out;
+  for (unsigned char c : raw) {
+    out += digits[c >> 4];
+    out += digits[c & 15];
+  }
+  return out;
+}
+
+bool VersionVector::from_context(std::string_view hex, VersionVector &out) {
+  if (hex.size() % 2)
+    return false;
+  auto nibble = [](char c) {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    return -1;
+  };
+  std::string raw;
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    int hi = nibble(hex[i]), lo = nibble(hex[i + 1]);
+    if (hi < 0 || lo < 0)
+      return false;
+    raw += static_cast<char>(hi << 4 | lo);
+  }
+  return decode(raw, out);
+}
+
+// ============================ RING ===========================================
+
+// spreads the fnv1a hashes over the whole ring (splitmix64 finalizer)
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+HashRing::HashRing(const std::vector<std::string> &names, size_t vnodes)
+    : nodes(names.size()) {
+  for (size_t n = 0; n < names.size(); ++n) {
+    for (size_t v = 0; v < vnodes; ++v)
+      tokens.emplace_back(mix(fnv1a(names[n] + "#" + std::to_string(v))),
+                          static_cast<uint16_t>(n));
+  }
+  std::sort(tokens.begin(), tokens.end());
+}
+
+uint64_t HashRing::position(std::string_view model, std::string_view key) {
+  std::string s(model);
+  s += '\0';
+  s += key;
+  return mix(fnv1a(s));
+}
+
+std::vector<uint16_t> HashRing::walk(uint64_t pos) const {
+  std::vector<uint16_t> out;
+  std::vector<bool> seen(nodes);
+  auto it = std::lower_bound(tokens.begin(), tokens.end(),
+                             std::make_pair(pos, uint16_t{0}));
+  for (size_t i = 0; i < tokens.size() && out.size() < nodes; ++i, ++it) {
+    if (it == tokens.end())
+      it = tokens.begin();
+    if (!seen[it->second]) {
+      seen[it->second] = true;
+      out.push_back(it->second);
+    }
+  }
+  return out;
+}
+
+// ============================ WIRE ===========================================
+
+// the requests between the nodes, answered with 'K' (and the reply) or 'E':
+//   'P' put   [model][key][value][flags u8][expires_at u64][clock][hint u32]
+//   'G' get   [model][key] -> [found u8][value][flags u8][expires u64][clock]
+//   'S' scan  [model] -> [count u32] then count times [key] and a 'G' reply
+//   'C' create a model, 'X' drop it [model]
+// strings are [len u32][bytes]. hint is the node a stand-in holds it for
+
+static std::string putRequest(std::string_view model, std::string_view key,
+                              std::string_view val, uint8_t flags,
+                              uint64_t expires_at, std::string_view clock,
+                              uint32_t hint) {
+  std::string req;
+  putStr(req, model);
+  putStr(req, key);
+  putStr(req, val);
+  putU8(req, flags);
+  putU64(req, expires_at);
+  putStr(req, clock);
+  putU32(req, hint);
+  return req;
+}
+
+static void putStored(std::string &out, bool found, std::string_view val,
+                      uint8_t flags, uint64_t expires_at,
+                      std::string_view clock) {
+  putU8(out, found ? 1 : 0);
+  putStr(out, val);
+  putU8(out, flags);
+  putU64(out, expires_at);
+  putStr(out, clock);
+}
+
+static bool validModel(std::string_view name) {
+  return !name.empty() && name != "." && name != ".." &&
+         name.find('/') == std::string_view::npos;
+}
+
+static void sleepMs(uint64_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// counts the answers of a fan out, shared with the calls that outlive it
+struct Tally {
+  std::mutex mu;
+  std::condition_variable cv;
+  size_t ok = 0, failed = 0;
+  std::vector<std::pair<uint16_t, std::string>> replies;
+
+  void finish(uint16_t node, bool success, std::string reply) {
+    {
+      std::lock_guard lock(mu);
+      if (success) {
+        ++ok;
+        replies.emplace_back(node, std::move(reply));
+      } else {
+        ++failed;
+      }
+    }
+    cv.notify_all();
+  }
+  // until want of total succeeded (true) or can not any more
+  bool wait(size_t want, size_t total, uint64_t timeout_ms) {
+    std::unique_lock lock(mu);
+    cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&] {
+      return ok >= want || ok + (total - ok - failed) < want;
+    });
+    return ok >= want;
+  }
+};
+
+// one write going out to its nodes, the calls may outlive the request
+struct PendingWrite {
+  std::string model, key, val, clock;
+  uint8_t flags = 0;
+  uint64_t expires_at = 0;
+  std::vector<uint16_t> spares; // stand ins not taken yet, in ring order
+  std::atomic<size_t> next_spare{0};
+  Tally tally;
+
+  std::string request(uint32_t hint) const {
+    return putRequest(model, key, val, flags, expires_at, clock, hint);
+  }
+};
+
+// ============================ CLUSTER ========================================
+
+Cluster::Cluster(ModelRegistry &registry, const Config &config)
+    : registry(registry), config(config),
+      self(static_cast<uint16_t>(config.cluster_self)),
+      ring(config.cluster_nodes, std::max<size_t>(config.cluster_vnodes, 1)),
+      counter(utils::nowMs() << 10), fanout(16) {
+  for (const auto &addr : config.cluster_nodes) {
+    auto p = std::make_unique<Peer>();
+    p->addr = addr;
+    splitHostPort(addr, p->host, p->port);
+    peers.push_back(std::move(p));
+  }
+}
+
+Cluster::~Cluster() {
+  stop = true;
+  if (listen_fd >= 0)
+    ::shutdown(listen_fd, SHUT_RDWR); // wakes up the accept
+  if (acceptor.joinable())
+    acceptor.join();
+  if (listen_fd >= 0)
+    ::close(listen_fd);
+  for (auto &c : conns)
+    ::shutdown(c.fd, SHUT_RDWR);
+  for (auto &c : conns) {
+    c.thread.join();
+    ::close(c.fd);
+  }
+  if (handoff.joinable())
+    handoff.join();
+  // the peers close their pooled connections once fanout is drained
+}
+
+Cluster::Peer::~Peer() {
+  for (int fd : idle)
+    ::close(fd);
+}
+
+bool Cluster::start() {
+  if (self >= peers.size()) {
+    std::cerr << "cluster: cluster_self is not in cluster_nodes\n";
+    return false;
+  }
+  int port = std::atoi(peers[self]->port.c_str());
+  listen_fd = listenOn(static_cast<uint16_t>(port));
+  if (listen_fd < 0) {
+    std::cerr << "cluster: can not listen on port " << port << ": "
+              << std::strerror(errno) << '\n';
+    return false;
+  }
+  std::error_code ec;
+  fs::create_directories(config.hints_dir, ec);
+  acceptor = std::thread([this] { accept_loop(); });
+  handoff = std::thread([this] { handoff_loop(); });
+  return true;
+}
+
+Quorum Cluster::defaults() const {
+  size_t n = std::clamp<size_t>(config.cluster_n, 1, peers.size());
+  return {n, std::clamp<size_t>(config.cluster_r, 1, n),
+          std::clamp<size_t>(config.cluster_w, 1, n)};
+}
+
+bool Cluster::up(uint16_t node) {
+  if (node == self)
+    return true;
+  Peer &p = *peers[node];
+  std::lock_guard lock(p.mu);
+  return utils::nowMs() >= p.down_until;
+}
+
+void Cluster::mark_down(uint16_t node) {
+  Peer &p = *peers[node];
+  std::lock_guard lock(p.mu);
+  p.down_until = utils::nowMs() + DOWN_MS;
+  for (int fd : p.idle)
+    ::close(fd);
+  p.idle.clear();
+}
+
+// one request to a node and its reply, the node itself is served inline.
+// false if it failed or said no
+bool Cluster::call(uint16_t node, char type, const std::string &req,
+                   std::string &reply) {
+  char reply_type;
+  if (node == self) {
+    reply = handle(type, req, reply_type);
+    return reply_type == 'K';
+  }
+  Peer &p = *peers[node];
+  // a pooled connection may have been closed by a restart of the node, that
+  // one gets a second try on a new one
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    int fd = -1;
+    {
+      std::lock_guard lock(p.mu);
+      if (!p.idle.empty()) {
+        fd = p.idle.back();
+        p.idle.pop_back();
+      }
+    }
+    bool pooled = fd >= 0;
+    if (!pooled)
+      fd = connectTo(p.host, p.port,
+                     static_cast<int>(config.cluster_timeout_ms));
+    if (fd < 0)
+      break;
+    if (!sendFrame(fd, type, req) || !recvFrame(fd, reply_type, reply)) {
+      ::close(fd);
+      if (pooled)
+        continue;
+      break;
+    }
+    {
+      std::lock_guard lock(p.mu);
+      if (p.idle.size() < MAX_IDLE) {
+        p.idle.push_back(fd);
+        fd = -1;
+      }
+    }
+    if (fd >= 0)
+      ::close(fd);
+    return reply_type == 'K';
+  }
+  mark_down(node);
+  return false;
+}
+
+void Cluster::accept_loop() {
+  while (!stop) {
+    int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (stop)
+        return;
+      if (errno != EINTR && errno != ECONNABORTED)
+        sleepMs(100);
+      continue;
+    }
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    std::lock_guard lock(conns_mu);
+    for (auto it = conns.begin(); it != conns.end();) {
+      if (!it->done) {
+        ++it;
+        continue;
+      }
+      it->thread.join();
+      ::close(it->fd);
+      it = conns.erase(it);
+    }
+    Conn &c = conns.emplace_back();
+    c.fd = fd;
+    c.thread = std::thread([this, &c] {
+      serve(c);
+      c.done = true;
+    });
+  }
+}
+
+// the requests of one peer connection, one after the other
+void Cluster::serve(Conn &conn) {
+  char type, reply_type;
+  std::string req;
+  while (!stop && recvFrame(conn.fd, type, req)) {
+    std::string reply = handle(type, req, reply_type);
+    if (!sendFrame(conn.fd, reply_type, reply))
+      return;
+  }
+}
+
+std::string Cluster::handle(char type, const std::string &req,
+                            char &reply_type) {
+  WireReader in(req);
+  std::string model(in.str());
+  std::string reply;
+  reply_type = 'E';
+  if (!in.ok() || !validModel(model))
+    return reply;
+
+  if (type == 'P') {
+    std::string_view key = in.str(), val = in.str();
+    uint8_t flags = in.u8();
+    uint64_t expires_at = in.u64();
+    std::string_view clock = in.str();
+    uint32_t hint = in.u32();
+    VersionVector vv;
+    if (!in.ok() || !VersionVector::decode(clock, vv))
+      return reply;
+    if (hint != NO_HINT && hint < peers.size() && hint != self) {
+      // standing in for a node that is down
+      add_hint(static_cast<uint16_t>(hint),
+               putRequest(model, key, val, flags, expires_at, clock, NO_HINT));
+    } else if (!apply_local(model, key, val, flags, expires_at, vv)) {
+      return reply;
+    }
+  } else if (type == 'G') {
+    std::string_view key = in.str();
+    if (!in.ok())
+      return reply;
+    Stored s;
+    bool found = get_local(model, key, s);
+    putStored(reply, found, s.value, s.flags, s.expires_at,
+              found ? s.clock.encode() : std::string());
+  } else if (type == 'S') {
+    std::string body;
+    uint32_t count = 0;
+    std::error_code ec;
+    EngineHandle engine = fs::is_directory(config.data_dir + "/" + model, ec)
+                              ? registry.acquire(model)
+                              : nullptr;
+    if (engine) {
+      engine->scan_records([&](const RecordView &rec) {
+        putStr(body, rec.key);
+        putStored(body, true, rec.val, rec.flags, rec.expires_at, rec.clock);
+        ++count;
+      });
+    }
+    putU32(reply, count);
+    reply += body;
+  } else if (type == 'C') {
+    std::error_code ec;
+    fs::create_directories(config.data_dir + "/" + model, ec);
+  } else if (type == 'X') {
+    // handlers still holding the engine keep it, the files go after them
+    registry.remove(model);
+  } else {
+    return reply;
+  }
+  reply_type = 'K';
+  return reply;
+}
+
+// stores a version on this node unless it already has that one or a newer
+// one. concurrent versions: the one written last stays, with both clocks
+bool Cluster::apply_local(const std::string &model, std::string_view key,
+                          std::string_view val, uint8_t flags,
+                          uint64_t expires_at, const VersionVector &clock) {
+  std::error_code ec;
+  fs::create_directories(config.data_dir + "/" + model, ec);
+  EngineHandle engine = registry.acquire(model);
+  if (!engine)
+    return false;
+  std::lock_guard lock(key_locks[fnv1a(key) % key_locks.size()]);
+  thread_local Buffer buf;
+  VersionVector stored;
+  bool have = engine->get_into(key, buf) &&
+              VersionVector::decode(buf.clock(), stored);
+  if (have && !clock.newer_than(stored))
+    return true; // an old one, or the same one again
+  VersionVector next = clock;
+  if (have)
+    next.merge(stored);
+  // the expiry is absolute, it stays the same on every node
+  uint64_t now = utils::nowMs();
+  uint64_t ttl_ms = 0;
+  if (expires_at)
+    ttl_ms = expires_at > now ? expires_at - now : 1;
+  engine->put(key, val, flags & REC_JSON, ttl_ms, next.encode());
+  return true;
+}
+
+bool Cluster::get_local(const std::string &model, std::string_view key,
+                        Stored &out) {
+  std::error_code ec;
+  if (!fs::is_directory(config.data_dir + "/" + model, ec))
+    return false;
+  EngineHandle engine = registry.acquire(model);
+  thread_local Buffer buf;
+  if (!engine || !engine->get_into(key, buf))
+    return false;
+  out.value.assign(buf.value());
+  out.flags = buf.flags();
+  out.expires_at = buf.expires_at();
+  if (!VersionVector::decode(buf.clock(), out.clock))
+    out.clock = VersionVector(); // written before the cluster, oldest of all
+  return true;
+}
+
+// ============================ COORDINATOR ====================================
+
+// sends the version to the first n nodes of the key's walk, a node that is
+// down gets a stand-in from further along that keeps it as a hint
+bool Cluster::write(const std::string &model, std::string_view key,
+                    std::string_view val, uint8_t flags, uint64_t ttl_ms,
+                    VersionVector clock, const Quorum &q) {
+  auto w = std::make_shared<PendingWrite>();
+  w->model = model;
+  w->key = key;
+  w->val = val;
+  w->flags = flags;
+  uint64_t now = utils::nowMs();
+  w->expires_at = ttl_ms ? now + ttl_ms : 0;
+  // this node's entry goes past everything it handed out before, so a write
+  // with a context always descends from it
+  uint64_t &mine = clock.counters[self];
+  mine = std::max(mine + 1, ++counter);
+  clock.timestamp = now;
+  clock.merge(VersionVector()); // trims it to the size limit
+  w->clock = clock.encode();
+
+  auto order = ring.walk(HashRing::position(model, key));
+  size_t n = std::min(q.n, order.size());
+  std::vector<std::pair<uint16_t, uint16_t>> targets; // node, home
+  size_t spare = n;
+  for (size_t i = 0; i < n; ++i) {
+    if (up(order[i])) {
+      targets.emplace_back(order[i], order[i]);
+      continue;
+    }
+    while (spare < order.size() && !up(order[spare]))
+      ++spare;
+    if (spare < order.size())
+      targets.emplace_back(order[spare++], order[i]);
+    else
+      add_hint(order[i], w->request(NO_HINT)); // nobody to stand in
+  }
+  w->spares.assign(order.begin() + static_cast<ptrdiff_t>(spare),
+                   order.end());
+
+  for (auto [node, home] : targets) {
+    fanout.enqueue(
+        [this, w, node = node, home = home] {
+          std::string reply;
+          bool ok = call(node, 'P', w->request(node == home ? NO_HINT : home),
+                         reply);
+          // a node that just went away, the next free one stands in
+          while (!ok) {
+            size_t i = w->next_spare++;
+            if (i >= w->spares.size())
+              break;
+            if (up(w->spares[i]))
+              ok = call(w->spares[i], 'P', w->request(home), reply);
+          }
+          // the coordinator holds on to it then, it only does not count
+          if (!ok)
+            add_hint(home, w->request(NO_HINT));
+          w->tally.finish(node, ok, {});
+        },
+        TaskPriority::High);
+  }
+  return w->tally.wait(std::min(q.w, n), targets.size(),
+                       2 * config.cluster_timeout_ms);
+}
+
+bool Cluster::put(const std::string &model, std::string_view key,
+                  std::string_view val, bool is_json, uint64_t ttl_ms,
+                  const VersionVector *context, const Quorum &q) {
+  VersionVector clock = context ? *context : VersionVector();
+  clock.deleted = false;
+  return write(model, key, val, is_json ? REC_JSON : 0, ttl_ms,
+               std::move(clock), q);
+}
+
+// a delete is a version too (an empty value marked deleted), so a late copy
+// of an older value can not bring the key back
+bool Cluster::erase(const std::string &model, std::string_view key,
+                    const VersionVector *context, const Quorum &q) {
+  VersionVector clock = context ? *context : VersionVector();
+  clock.deleted = true;
+  return write(model, key, {}, 0, 0, std::move(clock), q);
+}
+
+static bool parseStored(WireReader &in, bool &found, std::string_view &val,
+                        uint8_t &flags, uint64_t &expires_at,
+                        VersionVector &clock) {
+  found = in.u8() != 0;
+  val = in.str();
+  flags = in.u8();
+  expires_at = in.u64();
+  std::string_view c = in.str();
+  if (!in.ok())
+    return false;
+  if (!found || !VersionVector::decode(c, clock))
+    clock = VersionVector();
+  return true;
+}
+
+// asks the first n nodes of the key's walk that are up, the newest of the
+// first r answers wins. the ones that answered with something older get it
+bool Cluster::get(const std::string &model, std::string_view key,
+                  const Quorum &q, ClusterValue &out) {
+  auto order = ring.walk(HashRing::position(model, key));
+  size_t n = std::min(q.n, order.size());
+  std::vector<uint16_t> homes;
+  for (size_t i = 0; i < n; ++i) {
+    if (up(order[i]))
+      homes.push_back(order[i]);
+  }
+  size_t r = std::min(q.r, n);
+  if (homes.size() < r)
+    return false;
+
+  std::string req;
+  putStr(req, model);
+  putStr(req, key);
+  auto tally = std::make_shared<Tally>();
+  std::vector<std::function<void()>> reads;
+  for (uint16_t node : homes) {
+    reads.push_back([this, tally, node, req] {
+      std::string reply;
+      bool ok = call(node, 'G', req, reply);
+      tally->finish(node, ok, std::move(reply));
+    });
+  }
+  fanout.enqueue_batch(std::move(reads), TaskPriority::High);
+  if (!tally->wait(r, homes.size(), 2 * config.cluster_timeout_ms))
+    return false;
+  std::vector<std::pair<uint16_t, std::string>> replies;
+  {
+    std::lock_guard lock(tally->mu);
+    replies = tally->replies;
+  }
+
+  std::vector<std::pair<uint16_t, std::optional<Stored>>> copies;
+  const Stored *best = nullptr;
+  for (auto &[node, reply] : replies) {
+    WireReader in(reply);
+    Stored s;
+    bool found;
+    std::string_view val;
+    if (!parseStored(in, found, val, s.flags, s.expires_at, s.clock))
+      continue;
+    if (!found) {
+      copies.emplace_back(node, std::nullopt);
+      continue;
+    }
+    s.value.assign(val);
+    copies.emplace_back(node, std::move(s));
+  }
+  out = ClusterValue();
+  for (auto &[node, s] : copies) {
+    if (!s)
+      continue;
+    out.clock.merge(s->clock);
+    if (!best || s->clock.newer_than(best->clock))
+      best = &*s;
+  }
+  if (!best)
+    return true;
+  out.found = !best->clock.deleted;
+  out.value = best->value;
+  out.flags = best->flags;
+
+  // read repair, in the background
+  std::string enc = best->clock.encode();
+  for (auto &[node, s] : copies) {
+    if (s && !best->clock.newer_than(s->clock))
+      continue;
+    fanout.enqueue(
+        [this, node = node,
+         req = putRequest(model, key, best->value, best->flags,
+                          best->expires_at, enc, NO_HINT)] {
+          std::string reply;
+          call(node, 'P', req, reply);
+        },
+        TaskPriority::Background);
+  }
+  return true;
+}
+
+std::vector<std::pair<std::string, ClusterValue>>
+Cluster::scan(const std::string &model, bool &complete) {
+  std::string req;
+  putStr(req, model);
+  auto tally = std::make_shared<Tally>();
+  std::vector<std::function<void()>> reads;
+  for (uint16_t node = 0; node < peers.size(); ++node) {
+    if (!up(node))
+      continue;
+    reads.push_back([this, tally, node, req] {
+      std::string reply;
+      bool ok = call(node, 'S', req, reply);
+      tally->finish(node, ok, std::move(reply));
+    });
+  }
+  size_t asked = reads.size();
+  fanout.enqueue_batch(std::move(reads), TaskPriority::High);
+  tally->wait(asked, asked, 2 * config.cluster_timeout_ms);
+  std::vector<std::pair<uint16_t, std::string>> replies;
+  {
+    std::lock_guard lock(tally->mu);
+    replies = tally->replies;
+  }
+  complete = replies.size() == peers.size();
+
+  std::map<std::string, Stored> newest;
+  for (auto &[node, reply] : replies) {
+    WireReader in(reply);
+    uint32_t count = in.u32();
+    for (uint32_t i = 0; i < count && in.ok(); ++i) {
+      std::string key(in.str());
+      Stored s;
+      bool found;
+      std::string_view val;
+      if (!parseStored(in, found, val, s.flags, s.expires_at, s.clock))
+        break;
+      auto it = newest.find(key);
+      if (it != newest.end() && !s.clock.newer_than(it->second.clock))
+        continue;
+      s.value.assign(val);
+      newest[key] = std::move(s);
+    }
+  }
+  std::vector<std::pair<std::string, ClusterValue>> out;
+  for (auto &[key, s] : newest) {
+    if (s.clock.deleted)
+      continue;
+    ClusterValue v;
+    v.found = true;
+    v.value = std::move(s.value);
+    v.flags = s.flags;
+    v.clock = std::move(s.clock);
+    out.emplace_back(key, std::move(v));
+  }
+  return out;
+}
+
+// on every node that is up, best effort
+void Cluster::create(const std::string &model) {
+  std::string req, reply;
+  putStr(req, model);
+  for (uint16_t node = 0; node < peers.size(); ++node) {
+    if (up(node))
+      call(node, 'C', req, reply);
+  }
+}
+
+void Cluster::drop(const std::string &model) {
+  std::string req, reply;
+  putStr(req, model);
+  for (uint16_t node = 0; node < peers.size(); ++node) {
+    if (up(node))
+      call(node, 'X', req, reply);
+  }
+}
+
+std::vector<ClusterNodeStatus> Cluster::status() {
+  std::vector<ClusterNodeStatus> out;
+  for (uint16_t node = 0; node < peers.size(); ++node) {
+    ClusterNodeStatus s;
+    s.addr = peers[node]->addr;
+    s.self = node == self;
+    s.up = up(node);
+    std::string path = config.hints_dir + "/" + std::to_string(node);
+    std::error_code ec;
+    for (const char *ext : {".hints", ".hints.sending"}) {
+      auto size = fs::file_size(path + ext, ec);
+      if (!ec)
+        s.hinted_bytes += size;
+    }
+    out.push_back(s);
+  }
+  return out;
+}
+
+// ============================ HINTED HANDOFF =================================
+
+// hints of a node go to hints_dir/<node>.hints as [len u32][put request]
+void Cluster::add_hint(uint16_t node, const std::string &req) {
+  std::string entry;
+  putU32(entry, static_cast<uint32_t>(req.size()));
+  entry += req;
+  std::lock_guard lock(hint_mu);
+  std::ofstream out(config.hints_dir + "/" + std::to_string(node) + ".hints",
+                    std::ios::binary | std::ios::app);
+  out.write(entry.data(), static_cast<std::streamsize>(entry.size()));
+}
+
+// offers the hints to their nodes. the file being sent is moved aside so new
+// hints keep coming in meanwhile, what did not go through goes back in front
+void Cluster::handoff_loop() {
+  while (!stop) {
+    for (uint64_t slept = 0; slept < HANDOFF_MS && !stop; slept += 100)
+      sleepMs(100);
+    for (uint16_t node = 0; node < peers.size() && !stop; ++node) {
+      if (node == self || !up(node))
+        continue;
+      std::string path = config.hints_dir + "/" + std::to_string(node) +
+                         ".hints";
+      std::string sending = path + ".sending";
+      std::error_code ec;
+      {
+        std::lock_guard lock(hint_mu);
+        if (!fs::exists(sending, ec)) {
+          if (!fs::exists(path, ec))
+            continue;
+          fs::rename(path, sending, ec);
+          if (ec)
+            continue;
+        }
+      }
+      std::string data;
+      {
+        std::ifstream in(sending, std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(in),
+                    std::istreambuf_iterator<char>());
+      }
+      size_t pos = 0;
+      while (pos + sizeof(uint32_t) <= data.size() && !stop) {
+        uint32_t len;
+        std::memcpy(&len, data.data() + pos, sizeof(len));
+        if (pos + sizeof(len) + len > data.size()) {
+          pos = data.size(); // torn by a crash, the rest is lost
+          break;
+        }
+        std::string reply;
+        if (!call(node, 'P', data.substr(pos + sizeof(len), len), reply))
+          break;
+        pos += sizeof(len) + len;
+      }
+
+      std::lock_guard lock(hint_mu);
+      if (pos < data.size()) {
+        std::string rest = data.substr(pos);
+        {
+          std::ifstream in(path, std::ios::binary);
+          rest.append(std::istreambuf_iterator<char>(in),
+                      std::istreambuf_iterator<char>());
+        }
+        std::ofstream out(path + ".tmp", std::ios::binary | std::ios::trunc);
+        out.write(rest.data(), static_cast<std::streamsize>(rest.size()));
+        out.close();
+        fs::rename(path + ".tmp", path, ec);
+      }
+      fs::remove(sending, ec);
+    }
+  }
+}
+
+} // namespace kv
@@ -2,6 +2,7 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <nlohmann/json.hpp>
 
 using json = nlohmann::json;
@@ -35,10 +36,50 @@ Config Config::load(std::string conf_path) {
   c.bloom_bits_kb = j.value("bloom_bits_kb", 8);
   c.bloom_hashes = j.value("bloom_hashes", 4);
   c.thread_pool_sz = j.value("thread_pool_size", 4);
+  c.scan_concurrency = j.value("scan_concurrency", 2);
+  c.scan_queue_depth = j.value("scan_queue_depth", 16);
+  c.bulk_concurrency = j.value("bulk_concurrency", 1);
+  c.bulk_queue_depth = j.value("bulk_queue_depth", 2);
+  c.max_open_models = j.value("max_open_models", 256);
+  c.memory_budget = j.value("memory_budget_mb", size_t{0}) * 1024 * 1024;
+  c.io_engine = j.value("io_engine", "uring");
+  c.io_queue_depth = j.value("io_queue_depth", 256);
+  c.checkpoint_interval =
+      j.value("checkpoint_interval_mb", size_t{4}) * 1024 * 1024;
+  c.compact_dead_ratio = j.value("compaction_dead_ratio", 0.5);
+  c.auto_tune_interval = j.value("auto_tune_interval_s", size_t{60}) * 1000;
+  c.change_feed_size = j.value("change_feed_size", 1024);
+  c.blob_threshold = j.value("blob_threshold_kb", size_t{1024}) * 1024;
+  c.preallocate_segments = j.value("preallocate_segments", true);
+  c.direct_io = j.value("direct_io", false);
+  c.engine = j.value("engine", "hash");
+  c.model_engines =
+      j.value("model_engines", std::map<std::string, std::string>{});
+  c.http_port = j.value("http_port", 8008);
+  c.resp_port = j.value("resp_port", 0);
+  c.resp_threads = j.value("resp_threads", 2);
+  c.trace_sample_rate = j.value("trace_sample_rate", 0.0);
+  c.replication_port = j.value("replication_port", 0);
+  c.replicate_from = j.value("replicate_from", "");
+  c.replica_max_lag_ms = j.value("replica_max_lag_ms", 5000);
+  c.cluster_nodes = j.value("cluster_nodes", std::vector<std::string>{});
+  c.cluster_self = j.value("cluster_self", 0);
+  c.cluster_vnodes = j.value("cluster_vnodes", 64);
+  c.cluster_n = j.value("cluster_n", 3);
+  c.cluster_r = j.value("cluster_r", 2);
+  c.cluster_w = j.value("cluster_w", 2);
+  c.cluster_timeout_ms = j.value("cluster_timeout_ms", 1000);
+  c.hints_dir = j.value("hints_dir", c.data_dir + ".hints");
+  c.snapshot_dir = j.value("snapshot_dir", c.data_dir + ".snapshots");
 
   std::cout << "the config is loaded with the data directory as: " << c.data_dir
             << '\n';
   return c;
 }
 
+const std::string &Config::engine_of(const std::string &model) const {
+  auto it = model_engines.find(model);
+  return it != model_engines.end() ? it->second : engine;
+}
+
 } // namespace kv
@@ -0,0 +1,1278 @@
+#include "../include/kv/hash_engine.hpp"
+#include "../include/kv/hash_func.hpp"
+#include "../include/kv/merge.hpp"
+#include "../include/kv/trace.hpp"
+#include "../include/kv/utils.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace kv {
+
+// resolution of the TTL timing wheel
+static constexpr uint64_t EXPIRE_TICK_MS = 1000;
+// a read that folds this many merge operands writes the value it got, so the
+// next reads start from there
+static constexpr size_t MERGE_COLLAPSE_DEPTH = 16;
+
+HashEngine::HashEngine(const std::string &dir, const StorageOptions &opts)
+    : opts(opts),
+      io(opts.io ? opts.io : std::make_shared<PreadEngine>()),
+      seg_mgr(dir, opts.segment_size, io, opts.memory,
+              {opts.preallocate, opts.direct_io, opts.background,
+               opts.bloom_bits_per_key, opts.record_bytes, &version_clock()}),
+      dir(dir),
+      blobs(dir, opts.segment_size), wheel(EXPIRE_TICK_MS, utils::nowMs()),
+      // the sequence numbers start from the clock, so the ones of an earlier
+      // open of the model are always smaller
+      feed(opts.change_feed_size
+               ? std::make_unique<ChangeFeed>(opts.change_feed_size,
+                                              utils::nowMs() << 10)
+               : nullptr),
+      stats(opts.workload.get()), dead_ratio(opts.compact_dead_ratio) {
+  seg_mgr.countLookups(stats);
+  seed_version(seg_mgr.topVersion());
+  // the TTLs of the keys on disk go back on the wheel, the ones already past
+  // fire on the first expire()
+  std::vector<ExpiryTimer> timers;
+  seg_mgr.timers(timers);
+  for (const auto &t : timers)
+    wheel.add(t);
+  seg_mgr.onBlobsDropped([this](const std::vector<std::string> &vals) {
+    std::vector<BlobRef> refs(vals.size());
+    for (size_t i = 0; i < vals.size(); ++i)
+      decodeBlobRef(vals[i], refs[i]);
+    blobs.release(refs);
+  });
+}
+
+HashEngine::HashEngine(const std::string &dir, size_t seg_size,
+                       std::shared_ptr<IoEngine> io)
+    : HashEngine(dir, StorageOptions{seg_size, 4 * 1024 * 1024, std::move(io),
+                                     nullptr}) {}
+
+HashEngine::~HashEngine() {
+  // the async writes and queued checkpoints still need the engine, the
+  // segments write their final checkpoint when they close
+  std::unique_lock lock(pending_mu);
+  pending_cv.wait(lock, [this] { return pending == 0; });
+}
+
+// checkpoints the index and bloom filter of every segment that changed
+void HashEngine::checkpoint() {
+  since_checkpoint = 0;
+  seg_mgr.checkpoint(ind_mu);
+}
+
+// the blob files are linked after the segments, every value their records
+// point at was written before them
+bool HashEngine::snapshot(const std::string &dest) {
+  return seg_mgr.snapshot(ind_mu, dest, [this](const std::string &tmp) {
+    return blobs.linkInto(tmp);
+  });
+}
+
+bool HashEngine::attach(const std::vector<std::string> &segments) {
+  return seg_mgr.attach(segments);
+}
+
+// rewrites the closed segments with at least min_dead_ratio of garbage, 0
+// compacts all of them. the merge operands are folded first, the ones
+// written while it runs are folded right away (see merge). one runs at a
+// time, a second one could compact the chains the first is still folding.
+// nor does one run under a scan (see scan_mu), a later checkpoint retries
+size_t HashEngine::compact(double min_dead_ratio) {
+  std::unique_lock one(compact_mu, std::try_to_lock);
+  if (!one)
+    return 0;
+  std::unique_lock no_scans(scan_mu, std::try_to_lock);
+  if (!no_scans)
+    return 0;
+  ++compacting;
+  {
+    std::unique_lock drain(merge_gate);
+  }
+  size_t done = 0;
+  if (merges.exchange(0) == 0 || fold_merges())
+    done = seg_mgr.compact(ind_mu, min_dead_ratio);
+  else
+    ++merges; // a chain is left, it would lose the records under it
+  --compacting;
+  return done;
+}
+
+// the periodic work after an interval of appends
+void HashEngine::maintain() {
+  checkpoint();
+  double ratio = dead_ratio;
+  if (ratio > 0)
+    compact(ratio);
+}
+
+// the segments started from now on get the size and bloom filters of t, the
+// compactions after the next checkpoint its ratio
+bool HashEngine::tune(const Tuning &t) {
+  seg_mgr.tune(t.segment_size, t.bloom_bits_per_key, t.record_bytes);
+  dead_ratio = t.compact_dead_ratio;
+  return true;
+}
+
+size_t HashEngine::data_bytes() { return seg_mgr.liveBytes(); }
+
+// fires the TTL timers that are due: their index entries become tombstones,
+// so the expired keys stop costing reads and compaction drops their records.
+// the callers drive it, only the first call in a tick does any work
+void HashEngine::expire() {
+  uint64_t now = utils::nowMs();
+  uint64_t tick = now / EXPIRE_TICK_MS;
+  uint64_t last = last_expire_tick.load();
+  if (tick <= last || !last_expire_tick.compare_exchange_strong(last, tick))
+    return;
+  std::vector<ExpiryTimer> due;
+  wheel.advance(now, due);
+  if (due.empty())
+    return;
+  std::unique_lock lock(ind_mu);
+  for (const auto &t : due)
+    seg_mgr.expire(t);
+}
+
+// counts the appended bytes and starts a checkpoint once a whole interval
+// went by. may_block says the caller can run it itself if there is no pool
+// (the I/O completion thread can not, the checkpoint waits on it)
+void HashEngine::appended(size_t bytes, bool may_block) {
+  if (since_checkpoint.fetch_add(bytes) + bytes < opts.checkpoint_interval)
+    return;
+  if (!opts.background && !may_block)
+    return; // the next blocking put picks it up
+  if (checkpoint_queued.exchange(true))
+    return;
+  if (!opts.background) {
+    maintain();
+    checkpoint_queued = false;
+    return;
+  }
+  {
+    std::lock_guard lock(pending_mu);
+    ++pending;
+  }
+  opts.background->enqueue(
+      [this] {
+        maintain();
+        checkpoint_queued = false;
+        std::lock_guard lock(pending_mu);
+        if (--pending == 0)
+          pending_cv.notify_all();
+      },
+      TaskPriority::Background);
+}
+
+// the change feed event of a write, null if the feed is off
+std::shared_ptr<ChangeEvent> HashEngine::change(std::string_view key,
+                                                std::string_view val,
+                                                bool is_json) {
+  if (!feed)
+    return nullptr;
+  return ChangeFeed::make(val.empty() ? ChangeOp::Erase : ChangeOp::Put, key,
+                          val, is_json ? REC_JSON : 0);
+}
+
+// the value goes to the blob log if it is big enough: val becomes the
+// encoded ref (kept in ref) and flags get REC_BLOB. false if it could not be
+// written there
+bool HashEngine::separate(std::string_view &val, uint8_t &flags,
+                          std::string &ref) {
+  if (!opts.blob_threshold || val.size() < opts.blob_threshold)
+    return true;
+  BlobRef blob;
+  if (!blobs.put(val, blob))
+    return false;
+  encodeBlobRef(ref, blob);
+  val = ref;
+  flags |= REC_BLOB;
+  return true;
+}
+
+// the value of a REC_BLOB record that did not make it into the log
+void HashEngine::drop_blob(std::string_view ref) {
+  BlobRef blob;
+  if (decodeBlobRef(ref, blob))
+    blobs.release({blob});
+}
+
+// copies the records appended after pos, for shipping them to a replica. the
+// values in the blob log go inline, a replica keeps a blob log of its own
+TailStatus HashEngine::tail(LogPosition &pos, std::string &out, size_t max) {
+  TailStatus st = seg_mgr.tail(pos, out, max);
+  size_t at = 0;
+  RecordView view;
+  while (at < out.size() &&
+         decodeRecord(out.data() + at, out.size() - at, view, false) ==
+             DecodeStatus::Ok &&
+         !(view.flags & REC_BLOB))
+    at += view.size();
+  if (at == out.size())
+    return st;
+
+  std::string inlined(out, 0, at), val, record;
+  while (at < out.size()) {
+    decodeRecord(out.data() + at, out.size() - at, view, false);
+    std::string_view rec(out.data() + at, view.size());
+    at += view.size();
+    BlobRef ref;
+    if (!(view.flags & REC_BLOB)) {
+      inlined += rec;
+      continue;
+    }
+    // a value that is gone was collected along with its record, a newer
+    // version of the key comes later in the log
+    if (!decodeBlobRef(view.val, ref) || !blobs.get(ref, val))
+      continue;
+    encodeRecord(record, view.key, val,
+                 view.flags & ~(REC_BLOB | REC_TTL | REC_CLOCK | REC_VERSION),
+                 view.expires_at, view.clock,
+                 (view.flags & REC_VERSION) ? view.version : 0);
+    inlined += record;
+  }
+  out = std::move(inlined);
+  return st;
+}
+
+// appends records shipped from another engine's log as they are, in their
+// order. false if one of them is damaged, the ones before it are applied
+bool HashEngine::apply(std::string_view records) {
+  expire();
+  size_t pos = 0;
+  while (pos < records.size()) {
+    RecordView view;
+    if (decodeRecord(records.data() + pos, records.size() - pos, view) !=
+        DecodeStatus::Ok)
+      return false;
+    std::string_view record = records.substr(pos, view.size());
+    pos += view.size();
+    if (view.flags & REC_PADDING)
+      continue;
+    // the leader's versions, the clock stays ahead of what is stored here
+    seed_version(view.version);
+    if (view.flags & REC_MERGE) {
+      size_t n = apply_merge(view);
+      if (!n)
+        return false;
+      appended(n, true);
+      continue;
+    }
+    std::lock_guard key_guard(key_lock(view.key));
+    // values come inline, the big ones go to this engine's blob log
+    thread_local std::string ref, local;
+    std::string_view val = view.val;
+    uint8_t flags = view.flags & REC_JSON;
+    if ((view.flags & REC_ALIVE) && !(view.flags & REC_BLOB)) {
+      if (!separate(val, flags, ref))
+        return false;
+      if (flags & REC_BLOB) {
+        encodeRecord(local, view.key, val, flags, view.expires_at,
+                     view.clock,
+                     (view.flags & REC_VERSION) ? view.version : 0);
+        record = local;
+      }
+    }
+
+    uint64_t hash = fnv1a(view.key);
+    bool deleted = !(view.flags & REC_ALIVE);
+    SegmentOffset old;
+    bool had = false;
+    if (deleted) {
+      std::shared_lock lock(ind_mu);
+      had = seg_mgr.lookup(hash, old);
+    }
+    AppendSlot slot = seg_mgr.append(record);
+    if (!slot.seg) {
+      if (flags & REC_BLOB)
+        drop_blob(val);
+      return false;
+    }
+    auto ev = change(view.key, deleted ? std::string_view() : view.val,
+                     view.flags & REC_JSON);
+    {
+      std::unique_lock lock(ind_mu);
+      slot.seg->indexRecord(hash, slot.offset, record.size(), deleted,
+                            view.expires_at);
+      if (ev)
+        feed->publish(std::move(ev));
+    }
+    if (view.expires_at && !deleted)
+      wheel.add({hash, slot.seg->getId(), view.expires_at});
+    if (had)
+      seg_mgr.markDead(old.segment_id, old.size);
+    appended(record.size(), true);
+  }
+  return true;
+}
+
+// the put functtion implementation
+// is_json marks the value as already validated json text, so readers can
+// hand it out as is
+uint64_t HashEngine::put(std::string_view key, std::string_view val,
+                         bool is_json, uint64_t ttl_ms,
+                         std::string_view clock) {
+  expire();
+  std::lock_guard key_guard(key_lock(key));
+  uint64_t expires_at = ttl_ms ? utils::nowMs() + ttl_ms : 0;
+  bool deleted = val.empty() && clock.empty();
+  uint64_t version = deleted ? 0 : next_version();
+  size_t n = write(key, val, is_json ? REC_JSON : 0, expires_at, clock,
+                   version, change(key, val, is_json));
+  if (!n)
+    return 0;
+  if (stats)
+    deleted ? stats->erase() : stats->write(key.size(), val.size());
+  appended(n, true);
+  return version;
+}
+
+// appends the record of a write and points the index at it, the caller holds
+// the key's lock. returns its size, 0 if it could not be written
+size_t HashEngine::write(std::string_view key, std::string_view val,
+                         uint8_t flags, uint64_t expires_at,
+                         std::string_view clock, uint64_t version,
+                         std::shared_ptr<ChangeEvent> ev) {
+  uint64_t hash = fnv1a(key);
+  bool deleted = val.empty() && clock.empty();
+  // the whole record is built in memory and written with one I/O, the buffer
+  // is kept per thread so a put does not allocate. a big value is written to
+  // the blob log first and the record points at it, the merge operands stay
+  // inline
+  thread_local std::string record, ref;
+  std::string_view stored = val;
+  if (!(flags & REC_MERGE) && !separate(stored, flags, ref))
+    return 0;
+  encodeRecord(record, key, stored, flags, expires_at, clock, version);
+  AppendSlot slot = seg_mgr.append(record);
+  if (!slot.seg) {
+    if (flags & REC_BLOB)
+      drop_blob(ref);
+    return 0;
+  }
+  {
+    // lock the that thing, only for the index update. the change feed gets
+    // the writes in the same order as the index
+    std::unique_lock lock(ind_mu);
+    slot.seg->indexRecord(hash, slot.offset, record.size(), deleted,
+                          expires_at, flags & REC_MERGE);
+    if (ev)
+      feed->publish(std::move(ev));
+  }
+  if (expires_at && !deleted)
+    wheel.add({hash, slot.seg->getId(), expires_at});
+  return record.size();
+}
+
+// appends the operand with a link to the newest record of the key, nothing
+// is read. while a compaction runs it is folded in right away instead. the
+// gate comes after the key's lock: a put may run a compaction under it
+bool HashEngine::merge(std::string_view key, MergeOp op,
+                       std::string_view operand) {
+  expire();
+  std::lock_guard key_guard(key_lock(key));
+  std::shared_lock gate(merge_gate);
+  if (compacting) {
+    gate.unlock();
+    return StorageEngine::merge(key, op, operand);
+  }
+  MergeLink link;
+  SegmentOffset off;
+  {
+    std::shared_lock lock(ind_mu);
+    if (seg_mgr.lookup(fnv1a(key), off))
+      link = {off.segment_id, packIndex(off.offset, off.size)};
+  }
+  thread_local std::string val, operands;
+  operands.clear();
+  appendOperand(operands, op, operand);
+  encodeMergeValue(val, link, operands);
+  auto ev = feed ? ChangeFeed::make(ChangeOp::Merge, key,
+                                    describeOperands(operands), REC_JSON)
+                 : nullptr;
+  ++merges;
+  size_t n = write(key, val, REC_MERGE, 0, {}, next_version(), std::move(ev));
+  gate.unlock();
+  if (n && stats)
+    stats->merge();
+  if (n)
+    appended(n, true);
+  return n != 0;
+}
+
+// a merge operand shipped from another engine's log, its link points into
+// that one. it gets a link to the key's record here instead, or is folded in
+// right away while a compaction runs
+size_t HashEngine::apply_merge(const RecordView &view) {
+  MergeLink link;
+  std::string_view operands;
+  if (!decodeMergeValue(view.val, link, operands))
+    return 0;
+  auto ev = feed ? ChangeFeed::make(ChangeOp::Merge, view.key,
+                                    describeOperands(operands), REC_JSON)
+                 : nullptr;
+  thread_local std::string val;
+  std::lock_guard key_guard(key_lock(view.key));
+  std::shared_lock gate(merge_gate);
+  if (compacting) {
+    gate.unlock();
+    thread_local Buffer buf;
+    std::optional<std::string_view> base;
+    if (get_into(view.key, buf))
+      base = buf.value();
+    uint8_t flags = foldOperands(base, {operands}, val) ? REC_JSON : 0;
+    return write(view.key, val, flags, 0, {}, view.version, std::move(ev));
+  }
+  link = {};
+  SegmentOffset off;
+  {
+    std::shared_lock lock(ind_mu);
+    if (seg_mgr.lookup(fnv1a(view.key), off))
+      link = {off.segment_id, packIndex(off.offset, off.size)};
+  }
+  encodeMergeValue(val, link, operands);
+  ++merges;
+  return write(view.key, val, REC_MERGE, 0, {}, view.version, std::move(ev));
+}
+
+void HashEngine::put_async(const std::string &key, const std::string &val,
+                           bool is_json, PutCallback cb) {
+  uint64_t hash = fnv1a(key);
+  auto record = std::make_shared<std::string>();
+  // a big value goes to the blob log right here, only the record is async
+  std::string ref;
+  std::string_view stored = val;
+  uint8_t flags = is_json ? REC_JSON : 0;
+  if (!separate(stored, flags, ref)) {
+    if (cb)
+      cb(false);
+    return;
+  }
+  bool deleted = val.empty();
+  encodeRecord(*record, key, stored, flags, 0, {},
+               deleted ? 0 : next_version());
+  auto ev = change(key, val, is_json);
+  if (stats)
+    deleted ? stats->erase() : stats->write(key.size(), val.size());
+  auto done = [this, record, ev, deleted, hash, ref = std::move(ref),
+               cb = std::move(cb)](AppendSlot slot, bool ok) mutable {
+    if (ok) {
+      std::unique_lock lock(ind_mu);
+      slot.seg->indexRecord(hash, slot.offset, record->size(), deleted);
+      if (ev)
+        feed->publish(std::move(ev));
+    } else if (!ref.empty()) {
+      drop_blob(ref);
+    }
+    if (ok)
+      appended(record->size(), false);
+    if (cb)
+      cb(ok);
+  };
+  if (opts.direct_io) {
+    // the direct appends go out one at a time under the append lock, there
+    // is nothing to overlap
+    AppendSlot slot = seg_mgr.append(*record);
+    done(slot, slot.seg != nullptr);
+    return;
+  }
+  AppendSlot slot = seg_mgr.reserve(record->size());
+  {
+    std::lock_guard lock(pending_mu);
+    ++pending;
+  }
+  io->write(slot.seg->fileDescriptor(), record->data(), record->size(),
+            slot.offset,
+            [this, record, slot,
+             done = std::move(done)](long res, const char *) mutable {
+              bool ok = res == static_cast<long>(record->size());
+              if (!ok)
+                slot.seg->abandon(slot.offset, record->size());
+              done(slot, ok);
+              std::lock_guard lock(pending_mu);
+              if (--pending == 0)
+                pending_cv.notify_all();
+            });
+}
+
+// how much a point read fetches when the index does not know the record size
+static constexpr size_t FIRST_READ = 4096;
+
+// checks a record read back for key and hands the value out, a value in the
+// blob log is read from there
+static void finishRead(BlobStore &blobs, const std::string &key,
+                       const GetCallback &cb, const char *buf, size_t len) {
+  RecordView view;
+  if (decodeRecord(buf, len, view) != DecodeStatus::Ok)
+    return cb(std::nullopt, 0); // data corruption!
+  // If tombstone (or expired), treat as not found
+  if (!(view.flags & REC_ALIVE) || view.expired(utils::nowMs()))
+    return cb(std::nullopt, 0);
+  // verify key matches, two keys may share the hash
+  if (view.key != key)
+    return cb(std::nullopt, 0);
+  if (!(view.flags & REC_BLOB))
+    return cb(std::string(view.val), view.flags);
+  BlobRef ref;
+  std::string val;
+  if (!decodeBlobRef(view.val, ref) || !blobs.get(ref, val))
+    return cb(std::nullopt, 0);
+  cb(std::move(val), view.flags & ~REC_BLOB);
+}
+
+// reads the record at off, in one read when the index knows its size.
+// otherwise most records fit the first read and the bigger ones need a second
+// one of their exact size
+void HashEngine::read_record(const SegmentOffset &off, std::string key,
+                             GetCallback cb) {
+  size_t first = off.size ? off.size : FIRST_READ;
+  io->read(off.fd, first, off.offset,
+           [this, off, first, key = std::move(key),
+            cb = std::move(cb)](long res, const char *data) mutable {
+             if (res <= 0)
+               return cb(std::nullopt, 0);
+             size_t got = static_cast<size_t>(res);
+             RecordView view;
+             auto st = decodeRecord(data, got, view, false);
+             if (st != DecodeStatus::Short || got < first)
+               return finishRead(blobs, key, cb, data, got);
+
+             size_t need = view.size();
+             io->read(off.fd, need, off.offset,
+                      [this, need, key = std::move(key), cb = std::move(cb)](
+                          long res2, const char *data2) {
+                        if (res2 != static_cast<long>(need))
+                          return cb(std::nullopt, 0);
+                        finishRead(blobs, key, cb, data2, need);
+                      });
+           });
+}
+
+void HashEngine::get_async(const std::string &key, GetCallback cb) {
+  uint64_t hash = fnv1a(key);
+  SegmentOffset off;
+  {
+    // scope for shared lock
+    std::shared_lock lock(ind_mu);
+    if (!seg_mgr.lookup(hash, off)) {
+      lock.unlock();
+      if (stats)
+        stats->read(key.size(), false, 0);
+      return cb(std::nullopt, 0);
+    }
+  }
+  // folding the operands takes a read per link, those are done right here
+  if (off.merge)
+    return StorageEngine::get_async(key, std::move(cb));
+  if (stats)
+    cb = [stats = stats, key_len = key.size(),
+          cb = std::move(cb)](std::optional<std::string> val, uint8_t flags) {
+      stats->read(key_len, val.has_value(), val ? val->size() : 0);
+      cb(std::move(val), flags);
+    };
+  read_record(off, key, std::move(cb));
+}
+
+// finds the newest record of key, false if it is missing. the record is
+// read straight into out and decoded in place (or not read at all when its
+// segment is mapped), view points into one of them. merge operands come back
+// folded into a plain record
+bool HashEngine::read_latest(std::string_view key, Buffer &out,
+                             RecordView &view) {
+  expire();
+  out.clear();
+  uint64_t hash = fnv1a(key);
+  SegmentOffset off, now;
+  std::vector<std::pair<size_t, size_t>> chain;
+  while (true) {
+    {
+      // scope for shared lock
+      TraceSpan wait("ind_mu wait");
+      std::shared_lock lock(ind_mu);
+      wait.end();
+      if (!seg_mgr.lookup(hash, off)) {
+        return false;
+      }
+    }
+
+    // data corruption, tombstone, expired or another key with the same hash
+    if (!read_at(off, out, view) || !(view.flags & REC_ALIVE) ||
+        view.key != key || view.expired(utils::nowMs()))
+      return false;
+    if (!(view.flags & REC_MERGE)) {
+      if (!off.map.empty())
+        out.pin(off.owner);
+      return true;
+    }
+    chain.clear();
+    TraceSpan span("fold");
+    if (!fold(key, off, out, view, chain))
+      return false;
+    span.note("operands", chain.size() + 1);
+    span.end();
+    // a compaction may have moved the records under the head meanwhile. it
+    // folds the key into a new record before, so the index tells
+    std::shared_lock lock(ind_mu);
+    if (seg_mgr.lookup(hash, now) && now.segment_id == off.segment_id &&
+        now.offset == off.offset)
+      break;
+  }
+  if (chain.size() + 1 >= MERGE_COLLAPSE_DEPTH)
+    collapse(key, off);
+  return true;
+}
+
+// reads the record at off like read_latest does, false if it could not be
+// read or is damaged
+bool HashEngine::read_at(const SegmentOffset &off, Buffer &out,
+                         RecordView &view) {
+  DecodeStatus st;
+  if (!off.map.empty()) {
+    // sealed segment, the record is decoded right out of the mapping and the
+    // value points into it
+    if (off.offset >= off.map.size())
+      return false;
+    TraceSpan span("decode mapped");
+    st = decodeRecord(off.map.data() + off.offset,
+                      off.map.size() - off.offset, view);
+  } else {
+    // one read of exactly the record when the index knows its size
+    size_t want = off.size ? off.size : FIRST_READ;
+    TraceSpan span("read");
+    long res = io->read_sync(off.fd, out.reserve(want), want, off.offset);
+    span.note("bytes", res > 0 ? static_cast<uint64_t>(res) : 0);
+    span.end();
+    if (res <= 0)
+      return false;
+    TraceSpan decode("decode");
+    st = decodeRecord(out.data(), static_cast<size_t>(res), view);
+    decode.end();
+    if (st == DecodeStatus::Short && static_cast<size_t>(res) == want) {
+      size_t need = view.size();
+      TraceSpan reread("read rest");
+      res = io->read_sync(off.fd, out.reserve(need), need, off.offset);
+      reread.end();
+      if (res != static_cast<long>(need))
+        return false;
+      TraceSpan redecode("decode");
+      st = decodeRecord(out.data(), need, view);
+    }
+  }
+  return st == DecodeStatus::Ok;
+}
+
+// view is the merge operand of key at head, its newest record. follows the
+// links down to the record the operands apply to and puts the value they
+// fold to into out, view becomes a plain json record of it with the head's
+// version and no TTL. chain gets the (segment id, size) of the records under
+// the head. a link that does not lead to a live record of key (erased,
+// expired or compacted away) ends the chain, the value is missing there
+bool HashEngine::fold(std::string_view key, const SegmentOffset &head,
+                      Buffer &out, RecordView &view,
+                      std::vector<std::pair<size_t, size_t>> &chain) {
+  uint64_t now = utils::nowMs(), version = view.version;
+  MergeLink link;
+  std::string_view operands;
+  if (!decodeMergeValue(view.val, link, operands))
+    return false;
+  std::vector<std::string> lists{std::string(operands)};
+  std::optional<std::string> base;
+  // the links only ever go back in the log, anything else is a stale one
+  std::pair<size_t, size_t> at{head.segment_id, head.offset};
+  thread_local Buffer step;
+  while (link.segment_id) {
+    std::pair<size_t, size_t> prev_at{link.segment_id,
+                                      indexOffset(link.entry)};
+    SegmentOffset off;
+    RecordView prev;
+    if (!(prev_at < at) || !seg_mgr.locate(link.segment_id, link.entry, off) ||
+        !read_at(off, step, prev) || prev.key != key ||
+        !(prev.flags & REC_ALIVE) || prev.expired(now))
+      break;
+    at = prev_at;
+    chain.emplace_back(off.segment_id, prev.size());
+    if (!(prev.flags & REC_MERGE)) {
+      BlobRef ref;
+      std::string val;
+      if (!(prev.flags & REC_BLOB))
+        base.emplace(prev.val);
+      else if (decodeBlobRef(prev.val, ref) && blobs.get(ref, val))
+        base = std::move(val);
+      break;
+    }
+    if (!decodeMergeValue(prev.val, link, operands))
+      break;
+    lists.emplace_back(operands);
+  }
+
+  std::vector<std::string_view> oldest_first(lists.rbegin(), lists.rend());
+  thread_local std::string val, record;
+  uint8_t flags = foldOperands(base, oldest_first, val) ? REC_JSON : 0;
+  encodeRecord(record, key, val, flags, 0, {}, version);
+  std::memcpy(out.reserve(record.size()), record.data(), record.size());
+  return decodeRecord(out.data(), record.size(), view) == DecodeStatus::Ok;
+}
+
+// writes the value the merge operands of key fold to, if head (the newest of
+// them) is still the newest record of the key. false if the key is locked by
+// another write or the record could not be written
+bool HashEngine::collapse(std::string_view key, const SegmentOffset &head) {
+  std::unique_lock key_guard(key_lock(key), std::try_to_lock);
+  if (!key_guard)
+    return false;
+  SegmentOffset off;
+  {
+    std::shared_lock lock(ind_mu);
+    if (!seg_mgr.lookup(fnv1a(key), off) ||
+        off.segment_id != head.segment_id || off.offset != head.offset)
+      return true; // written over since
+  }
+  thread_local Buffer buf;
+  RecordView view;
+  std::vector<std::pair<size_t, size_t>> chain;
+  if (!read_at(off, buf, view) || !(view.flags & REC_MERGE) ||
+      view.key != key || !fold(key, off, buf, view, chain))
+    return true;
+  size_t n = write(key, view.val, view.flags & REC_JSON, 0, {}, view.version,
+                   nullptr);
+  if (!n)
+    return false;
+  // the records under a merge operand were not garbage until now
+  for (const auto &[segment_id, size] : chain)
+    seg_mgr.markDead(segment_id, size);
+  appended(n, true);
+  return true;
+}
+
+// folds every key that ends in merge operands into a plain record, false if
+// one of them is left
+bool HashEngine::fold_merges() {
+  std::vector<SegmentOffset> heads;
+  {
+    std::shared_lock lock(ind_mu);
+    seg_mgr.mergeHeads(heads);
+  }
+  thread_local Buffer buf;
+  bool all = true;
+  for (const auto &head : heads) {
+    RecordView view;
+    if (!read_at(head, buf, view))
+      continue;
+    std::string key(view.key);
+    all = collapse(key, head) && all;
+  }
+  return all;
+}
+
+// reads the value of key into out, false if it is missing. a value in the
+// blob log is read into out behind its record's clock
+bool HashEngine::get_into(std::string_view key, Buffer &out) {
+  RecordView view;
+  if (!read_latest(key, out, view)) {
+    if (stats)
+      stats->read(key.size(), false, 0);
+    return false;
+  }
+  if (!(view.flags & REC_BLOB)) {
+    if (stats)
+      stats->read(key.size(), true, view.val.size());
+    out.set_value(view.val, view.flags, view.clock, view.expires_at,
+                  view.version);
+    return true;
+  }
+  BlobRef ref;
+  if (!decodeBlobRef(view.val, ref))
+    return false;
+  if (stats)
+    stats->read(key.size(), true, ref.len);
+  // the record may be in out, which the reserve drops
+  std::string clock(view.clock);
+  char *p = out.reserve(ref.len + clock.size());
+  TraceSpan span("blob read");
+  span.note("bytes", ref.len);
+  if (!blobs.get(ref, p))
+    return false;
+  span.end();
+  std::memcpy(p + ref.len, clock.data(), clock.size());
+  out.set_value({p, ref.len}, view.flags & ~REC_BLOB,
+                {p + ref.len, clock.size()}, view.expires_at, view.version);
+  return true;
+}
+
+// the value of key as a handle, a value in the blob log is not read yet
+bool HashEngine::get_blob(std::string_view key, BlobHandle &out) {
+  thread_local Buffer buf;
+  RecordView view;
+  bool found = read_latest(key, buf, view);
+  if (stats)
+    stats->read(key.size(), found, view.val.size());
+  if (!found)
+    return false;
+  BlobRef ref;
+  if (!(view.flags & REC_BLOB)) {
+    out = BlobHandle(std::string(view.val), view.flags);
+    return true;
+  }
+  return decodeBlobRef(view.val, ref) &&
+         blobs.handle(ref, view.flags & ~REC_BLOB, out);
+}
+
+std::unique_ptr<BlobWriter> HashEngine::open_blob(uint64_t len) {
+  return blobs.open(len);
+}
+
+// stores a value streamed into the blob log, 0 if it is incomplete or the
+// record could not be written
+uint64_t HashEngine::put_blob(std::string_view key, BlobWriter &blob,
+                              bool is_json, uint64_t ttl_ms) {
+  expire();
+  if (!blob.complete() || blob.size() == 0)
+    return 0;
+  std::lock_guard key_guard(key_lock(key));
+  uint64_t hash = fnv1a(key);
+  uint64_t expires_at = ttl_ms ? utils::nowMs() + ttl_ms : 0;
+  BlobRef ref = blob.keep();
+  if (stats)
+    stats->write(key.size(), blob.size());
+  std::string stored, record;
+  encodeBlobRef(stored, ref);
+  uint64_t version = next_version();
+  encodeRecord(record, key, stored, REC_BLOB | (is_json ? REC_JSON : 0),
+               expires_at, {}, version);
+  AppendSlot slot = seg_mgr.append(record);
+  if (!slot.seg) {
+    blobs.release({ref});
+    return 0;
+  }
+  // the subscribers get the value, it is read back only for them
+  std::string val;
+  auto ev = feed && blobs.get(ref, val) ? change(key, val, is_json) : nullptr;
+  {
+    std::unique_lock lock(ind_mu);
+    slot.seg->indexRecord(hash, slot.offset, record.size(), false,
+                          expires_at);
+    if (ev)
+      feed->publish(std::move(ev));
+  }
+  if (expires_at)
+    wheel.add({hash, slot.seg->getId(), expires_at});
+  appended(record.size(), true);
+  return version;
+}
+
+// erase appends a tombstone for the key like any other write, the index points
+// at it right away so the following gets do not touch the disk
+bool HashEngine::erase(std::string_view key) {
+  expire();
+  if (stats)
+    stats->erase();
+  std::lock_guard key_guard(key_lock(key));
+  uint64_t hash = fnv1a(key);
+  SegmentOffset off;
+  {
+    std::shared_lock lock(ind_mu);
+    if (!seg_mgr.lookup(hash, off)) {
+      return false;
+    }
+  }
+
+  thread_local std::string record;
+  encodeRecord(record, key, {}, REC_TOMBSTONE);
+  AppendSlot slot = seg_mgr.append(record);
+  if (!slot.seg)
+    return false;
+  auto ev = change(key, {}, false);
+  {
+    std::unique_lock lock(ind_mu);
+    slot.seg->indexRecord(hash, slot.offset, record.size(), true);
+    if (ev)
+      feed->publish(std::move(ev));
+  }
+  seg_mgr.markDead(off.segment_id, off.size);
+  appended(record.size(), true);
+  return true;
+}
+
+// the records of the batch go behind their header in one append and into the
+// index under one lock, so the readers see all of them or none. the values
+// stay inline whatever their size
+bool HashEngine::commit_batch(const std::vector<BatchOp> &ops) {
+  expire();
+  uint64_t now = utils::nowMs();
+  std::string body, record, frame;
+  std::vector<size_t> at; // of each record in body, and the end of the last
+  for (const auto &op : ops) {
+    if (stats)
+      op.val.empty() ? stats->erase()
+                     : stats->write(op.key.size(), op.val.size());
+    uint64_t expires_at =
+        op.ttl_ms && !op.val.empty() ? now + op.ttl_ms : 0;
+    encodeRecord(record, op.key, op.val, op.is_json ? REC_JSON : 0,
+                 expires_at, {}, op.version);
+    at.push_back(body.size());
+    body += record;
+  }
+  at.push_back(body.size());
+  encodeBatchHeader(frame, static_cast<uint32_t>(ops.size()), body);
+  size_t head = frame.size();
+  frame += body;
+
+  // what the erases make garbage, as erase does
+  std::vector<SegmentOffset> old;
+  {
+    std::shared_lock lock(ind_mu);
+    for (const auto &op : ops) {
+      SegmentOffset off;
+      if (op.val.empty() && seg_mgr.lookup(fnv1a(op.key), off))
+        old.push_back(off);
+    }
+  }
+  AppendSlot slot = seg_mgr.append(frame);
+  if (!slot.seg)
+    return false;
+  std::vector<std::shared_ptr<ChangeEvent>> evs;
+  for (const auto &op : ops)
+    evs.push_back(change(op.key, op.val, op.is_json));
+  {
+    std::unique_lock lock(ind_mu);
+    for (size_t i = 0; i < ops.size(); ++i) {
+      bool deleted = ops[i].val.empty();
+      slot.seg->indexBatched(fnv1a(ops[i].key), slot.offset + head + at[i],
+                             at[i + 1] - at[i], deleted,
+                             deleted || !ops[i].ttl_ms ? 0
+                                                       : now + ops[i].ttl_ms);
+      if (evs[i])
+        feed->publish(std::move(evs[i]));
+    }
+    slot.seg->batchDone();
+  }
+  slot.seg->markDead(head);
+  for (const auto &op : ops) {
+    if (!op.val.empty() && op.ttl_ms)
+      wheel.add({fnv1a(op.key), slot.seg->getId(), now + op.ttl_ms});
+  }
+  for (const auto &off : old)
+    seg_mgr.markDead(off.segment_id, off.size);
+  appended(frame.size(), true);
+  return true;
+}
+
+// what a worker of scan_records hands over: live records, their views point
+// into data (a chunk of the active segment), values or the mapping of a
+// sealed segment, which the scan keeps pinned
+struct ScanBatch {
+  std::vector<char> data;
+  std::deque<std::string> values; // folded merges and blob values
+  std::vector<RecordView> records;
+};
+
+// bytes of a segment per batch, read (or asked for ahead) at once
+static constexpr size_t SCAN_CHUNK = 1 << 20;
+// batches waiting for the consumer, per worker
+static constexpr size_t SCAN_QUEUED = 2;
+
+// asks the kernel for the pages of map from off on, so they are read in
+// while the ones before are decoded
+static void readAhead(std::string_view map, size_t off) {
+  static const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+  if (off >= map.size())
+    return;
+  size_t start = off / page * page;
+  size_t len = std::min(map.size(), off + SCAN_CHUNK) - start;
+  ::madvise(const_cast<char *>(map.data() + start), len, MADV_WILLNEED);
+}
+
+// the live records of one segment up to the end it had when the scan
+// started, in batches of about SCAN_CHUNK bytes of it. a sealed segment is
+// decoded right out of its mapping, the active one read in chunks; either
+// way the chunk after the one being decoded is already on its way
+void HashEngine::scan_segment(
+    const ScanSegment &seg,
+    const std::function<void(std::unique_ptr<ScanBatch>)> &emit) {
+  size_t seg_id = seg.seg->getId();
+  auto batch = std::make_unique<ScanBatch>();
+  // the record at offset goes into the batch if the index points at it. the
+  // merges are folded and the blobs read here, on the worker
+  auto keep = [&](const RecordView &view, size_t offset) {
+    if (!(view.flags & REC_ALIVE) || !isLatest(view.key, seg_id, offset))
+      return;
+    BlobRef ref;
+    if (view.flags & REC_MERGE) {
+      thread_local Buffer folded;
+      RecordView merged;
+      if (!read_latest(view.key, folded, merged))
+        return;
+      // its views point into folded, the batch gets a copy
+      auto &copy = batch->values.emplace_back();
+      copy.append(merged.key).append(merged.val).append(merged.clock);
+      merged.key = std::string_view(copy).substr(0, merged.key.size());
+      merged.val = std::string_view(copy).substr(merged.key.size(),
+                                                 merged.val.size());
+      merged.clock = std::string_view(copy).substr(merged.key.size() +
+                                                   merged.val.size());
+      batch->records.push_back(merged);
+    } else if (!(view.flags & REC_BLOB)) {
+      batch->records.push_back(view);
+    } else if (decodeBlobRef(view.val, ref)) {
+      auto &blob = batch->values.emplace_back();
+      if (!blobs.get(ref, blob)) {
+        batch->values.pop_back();
+        return;
+      }
+      RecordView resolved = view;
+      resolved.val = blob;
+      resolved.flags &= ~REC_BLOB;
+      batch->records.push_back(resolved);
+    }
+  };
+  auto flush = [&] {
+    if (batch->records.empty())
+      return;
+    emit(std::move(batch));
+    batch = std::make_unique<ScanBatch>();
+  };
+
+  if (!seg.map.empty()) {
+    size_t pos = 0, next_batch = 0;
+    readAhead(seg.map, 0);
+    while (pos < seg.map.size()) {
+      if (pos >= next_batch) {
+        flush();
+        next_batch = pos + SCAN_CHUNK;
+        readAhead(seg.map, next_batch);
+      }
+      RecordView view;
+      if (decodeRecord(seg.map.data() + pos, seg.map.size() - pos, view,
+                       false) != DecodeStatus::Ok)
+        break; // a torn tail or the padding of an abandoned reservation
+      keep(view, pos);
+      pos += view.size();
+    }
+    flush();
+    return;
+  }
+
+  // not mapped: the active segment, read through its own descriptor
+  int fd = seg.seg->fileDescriptor();
+  uint64_t file_off = 0;
+  size_t have = 0, pos = 0;
+  batch->data.resize(SCAN_CHUNK);
+  ::posix_fadvise(fd, 0, 2 * SCAN_CHUNK, POSIX_FADV_WILLNEED);
+  while (true) {
+    RecordView view;
+    auto st = decodeRecord(batch->data.data() + pos, have - pos, view, false);
+    if (st == DecodeStatus::Ok) {
+      keep(view, file_off - have + pos);
+      pos += view.size();
+      continue;
+    }
+    if (st == DecodeStatus::Corrupt || file_off >= seg.end)
+      break; // unwritten or torn tail
+
+    // the record runs past the chunk, it starts the next one. a batch
+    // without records keeps its buffer
+    size_t left = have - pos;
+    size_t len = std::max(SCAN_CHUNK, view.size());
+    if (batch->records.empty()) {
+      std::memmove(batch->data.data(), batch->data.data() + pos, left);
+      batch->data.resize(std::max(batch->data.size(), len));
+    } else {
+      auto next = std::make_unique<ScanBatch>();
+      next->data.resize(len);
+      std::memcpy(next->data.data(), batch->data.data() + pos, left);
+      emit(std::move(batch));
+      batch = std::move(next);
+    }
+    pos = 0;
+    have = left;
+    size_t want = std::min<uint64_t>(batch->data.size() - have,
+                                     seg.end - file_off);
+    ::posix_fadvise(fd, static_cast<off_t>(file_off + want), SCAN_CHUNK,
+                    POSIX_FADV_WILLNEED);
+    long r = io->read_sync(fd, batch->data.data() + have, want, file_off);
+    if (r <= 0)
+      break;
+    file_off += static_cast<uint64_t>(r);
+    have += static_cast<size_t>(r);
+  }
+  flush();
+}
+
+// hands the live records to fn, the key and value views are only valid
+// during the call. a record is live if the index still points at it, older
+// versions and erased keys are skipped. a key written while the scan runs
+// may come up with its old value, its new one, both or neither: whatever the
+// index has when its records are reached. the segments are split between the
+// background pool and the calling thread, which is the one running fn: the
+// workers queue batches of records for it and it scans segments of its own
+// when there are none, so the scan goes on even with every worker busy
+void HashEngine::scan_records(const RecordFn &fn) {
+  std::shared_lock no_compaction(scan_mu);
+  struct Scan {
+    std::vector<ScanSegment> segs;
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<std::unique_ptr<ScanBatch>> ready;
+    size_t next = 0;    // the segment to claim next
+    size_t left = 0;    // claimed or not, but not done
+    size_t workers = 0; // running
+    size_t max_ready = 0;
+    bool over = false; // the scan returned (or threw)
+  };
+  auto scan = std::make_shared<Scan>();
+  scan->segs = seg_mgr.segments();
+  scan->left = scan->segs.size();
+  size_t helpers = opts.background
+                       ? std::min(opts.background->size(),
+                                  scan->segs.size() - 1)
+                       : 0;
+  scan->max_ready = SCAN_QUEUED * (helpers + 1);
+
+  auto deliver = [&fn](const ScanBatch &b) {
+    for (const auto &rec : b.records)
+      fn(rec);
+  };
+  // the batches queued by the workers, in the order they came
+  auto drain = [&] {
+    std::unique_lock lock(scan->mu);
+    while (!scan->ready.empty()) {
+      auto b = std::move(scan->ready.front());
+      scan->ready.pop_front();
+      scan->cv.notify_all();
+      lock.unlock();
+      deliver(*b);
+      lock.lock();
+    }
+  };
+
+  // also on the way out of a throwing fn: the workers stop, and the jobs
+  // still queued must not touch the engine once this returns
+  struct Finish {
+    Scan &scan;
+    ~Finish() {
+      std::unique_lock lock(scan.mu);
+      scan.over = true;
+      scan.cv.notify_all();
+      scan.cv.wait(lock, [&] { return scan.workers == 0; });
+    }
+  } finish{*scan};
+
+  std::vector<std::function<void()>> jobs;
+  for (size_t n = 0; n < helpers; ++n)
+    jobs.push_back([this, scan] {
+      std::unique_lock lock(scan->mu);
+      if (scan->over)
+        return;
+      ++scan->workers;
+      while (!scan->over && scan->next < scan->segs.size()) {
+        size_t i = scan->next++;
+        lock.unlock();
+        scan_segment(scan->segs[i], [&](std::unique_ptr<ScanBatch> b) {
+          std::unique_lock queue(scan->mu);
+          scan->cv.wait(queue, [&] {
+            return scan->ready.size() < scan->max_ready || scan->over;
+          });
+          if (!scan->over)
+            scan->ready.push_back(std::move(b));
+          scan->cv.notify_all();
+        });
+        lock.lock();
+        --scan->left;
+        scan->cv.notify_all();
+      }
+      --scan->workers;
+      scan->cv.notify_all();
+    });
+  if (!jobs.empty())
+    opts.background->enqueue_batch(std::move(jobs));
+
+  std::unique_lock lock(scan->mu);
+  while (true) {
+    scan->cv.wait(lock, [&] {
+      return !scan->ready.empty() || scan->next < scan->segs.size() ||
+             scan->left == 0;
+    });
+    if (!scan->ready.empty()) {
+      lock.unlock();
+      drain();
+    } else if (scan->next < scan->segs.size()) {
+      size_t i = scan->next++;
+      lock.unlock();
+      scan_segment(scan->segs[i], [&](std::unique_ptr<ScanBatch> b) {
+        deliver(*b);
+        drain(); // the workers may be waiting for room
+      });
+      lock.lock();
+      --scan->left;
+      continue;
+    } else {
+      break;
+    }
+    lock.lock();
+  }
+}
+
+// a segment rewritten by a compaction since pos is read again from its start
+// and one compacted away is skipped, so a key may come up twice but one that
+// is there all along is not missed. records do not move during one call
+TailStatus HashEngine::scan_keys(LogPosition &pos, size_t limit, size_t max,
+                                 std::vector<std::string> &out) {
+  std::shared_lock no_compaction(scan_mu);
+  uint64_t now = utils::nowMs();
+  auto keep = [&](const RecordView &view, std::string_view, size_t seg_id,
+                  size_t offset) {
+    if ((view.flags & REC_ALIVE) && !view.expired(now) &&
+        isLatest(view.key, seg_id, offset))
+      out.emplace_back(view.key);
+    return out.size() < limit;
+  };
+  TailStatus st = seg_mgr.walk(pos, max, keep);
+  while (st == TailStatus::Lost) {
+    if (pos.offset != 0) {
+      pos = {pos.segment_id, 0, 0};
+    } else {
+      uint64_t gone = pos.segment_id;
+      pos = {};
+      for (const auto &s : seg_mgr.segments()) {
+        if (s.seg->getId() > gone) {
+          pos = {s.seg->getId(), 0, 0};
+          break;
+        }
+      }
+      if (pos.segment_id == 0)
+        return TailStatus::Drained;
+    }
+    st = seg_mgr.walk(pos, max, keep);
+  }
+  return st;
+}
+
+// true if the index entry of key is the record at offset of segment seg_id
+bool HashEngine::isLatest(std::string_view key, size_t seg_id,
+                          size_t offset) {
+  SegmentOffset off;
+  std::shared_lock lock(ind_mu);
+  return seg_mgr.lookup(fnv1a(key), off) && off.segment_id == seg_id &&
+         off.offset == offset;
+}
+
+} // namespace kv
@@ -0,0 +1,490 @@
+#include "../include/kv/io_engine.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <condition_variable>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <memory>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace kv {
+
+// ============================ GENERIC ENGINE =================================
+
+// waits for one completion, lives on the caller's stack so unlike a promise it
+// costs no allocation (the callbacks capturing it stay in std::function's
+// small buffer)
+struct SyncWait {
+  std::mutex mu;
+  std::condition_variable cv;
+  bool done = false;
+  long res = 0;
+
+  void finish(long r) {
+    std::lock_guard lock(mu);
+    res = r;
+    done = true;
+    cv.notify_one();
+  }
+  long wait() {
+    std::unique_lock lock(mu);
+    cv.wait(lock, [this] { return done; });
+    return res;
+  }
+};
+
+// default blocking read, waits for the async one and copies the bytes out
+long IoEngine::read_sync(int fd, char *buf, size_t len, uint64_t off) {
+  SyncWait w;
+  read(fd, len, off, [&w, buf](long res, const char *data) {
+    if (res > 0)
+      std::memcpy(buf, data, static_cast<size_t>(res));
+    w.finish(res);
+  });
+  return w.wait();
+}
+
+long IoEngine::write_sync(int fd, const char *buf, size_t len, uint64_t off) {
+  SyncWait w;
+  write(fd, buf, len, off, [&w](long res, const char *) { w.finish(res); });
+  return w.wait();
+}
+
+std::shared_ptr<IoEngine> IoEngine::create(const std::string &kind,
+                                           unsigned queue_depth) {
+  if (kind == "uring") {
+    auto engine = std::make_shared<UringEngine>(queue_depth);
+    if (engine->ok())
+      return engine;
+    std::cerr << "io_uring is not available, falling back to pread" << '\n';
+  }
+  return std::make_shared<PreadEngine>();
+}
+
+// ============================ PREAD ENGINE ===================================
+
+long PreadEngine::read_sync(int fd, char *buf, size_t len, uint64_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t r = ::pread(fd, buf + done, len - done, off + done);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if (r == 0)
+      break; // end of file
+    done += static_cast<size_t>(r);
+  }
+  return static_cast<long>(done);
+}
+
+long PreadEngine::write_sync(int fd, const char *buf, size_t len,
+                             uint64_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t r = ::pwrite(fd, buf + done, len - done, off + done);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    done += static_cast<size_t>(r);
+  }
+  return static_cast<long>(done);
+}
+
+void PreadEngine::read(int fd, size_t len, uint64_t off, IoCallback cb) {
+  // reused by every read of this thread
+  thread_local std::vector<char> buf;
+  if (buf.size() < len)
+    buf.resize(len);
+  long res = read_sync(fd, buf.data(), len, off);
+  cb(res, buf.data());
+}
+
+void PreadEngine::write(int fd, const char *buf, size_t len, uint64_t off,
+                        IoCallback cb) {
+  cb(write_sync(fd, buf, len, off), buf);
+}
+
+// ============================ IO_URING ENGINE ================================
+
+// user_data of the nop that wakes the reaper up for shutdown
+static constexpr uint64_t STOP_OP = UINT64_MAX;
+
+static int uring_setup(unsigned entries, io_uring_params *p) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                  min_complete, flags, nullptr, 0));
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg,
+                          unsigned nr_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+UringEngine::UringEngine(unsigned queue_depth) {
+  io_uring_params p;
+  std::memset(&p, 0, sizeof(p));
+  int fd = uring_setup(std::max(queue_depth, 8u), &p);
+  if (fd < 0)
+    return;
+
+  // map the submission and completion rings and the sqe array
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_len = cq_len = std::max(sq_len, cq_len);
+  sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED) {
+    ::close(fd);
+    return;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr = sq_ptr;
+  } else {
+    cq_ptr = mmap(nullptr, cq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED) {
+      munmap(sq_ptr, sq_len);
+      ::close(fd);
+      return;
+    }
+  }
+  sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+  void *sqe_ptr = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqe_ptr == MAP_FAILED) {
+    if (cq_ptr != sq_ptr)
+      munmap(cq_ptr, cq_len);
+    munmap(sq_ptr, sq_len);
+    ::close(fd);
+    return;
+  }
+
+  char *sq = static_cast<char *>(sq_ptr);
+  char *cq = static_cast<char *>(cq_ptr);
+  sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+  sq_mask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+  sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+  cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+  cq_mask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+  sqes = static_cast<io_uring_sqe *>(sqe_ptr);
+
+  ring_fd = fd;
+  entries = p.sq_entries;
+  // normally no more ops in flight than sq entries, the cq ring is twice as
+  // big so it does not overflow
+  ops.resize(entries);
+  for (uint32_t i = 0; i < entries; ++i)
+    free_ops.push_back(entries - 1 - i);
+
+  setup_registrations(1024, std::min(entries, 128u));
+  reaper = std::thread([this] { reap(); });
+}
+
+// registers a sparse file table and the read buffers, both are optional: if
+// the kernel or the memlock limit says no we go on with plain fds and buffers
+void UringEngine::setup_registrations(unsigned max_files, unsigned nbufs) {
+  std::vector<int> fds(max_files, -1);
+  if (uring_register(ring_fd, IORING_REGISTER_FILES, fds.data(), max_files) ==
+      0) {
+    files_registered = true;
+    for (int i = static_cast<int>(max_files) - 1; i >= 0; --i)
+      free_file_slots.push_back(i);
+  }
+
+  buf_mem.resize(static_cast<size_t>(nbufs) * buf_size);
+  std::vector<iovec> iovs(nbufs);
+  for (unsigned i = 0; i < nbufs; ++i) {
+    iovs[i].iov_base = buf_mem.data() + i * buf_size;
+    iovs[i].iov_len = buf_size;
+  }
+  if (uring_register(ring_fd, IORING_REGISTER_BUFFERS, iovs.data(), nbufs) ==
+      0) {
+    bufs_registered = true;
+    for (int i = static_cast<int>(nbufs) - 1; i >= 0; --i)
+      free_bufs.push_back(i);
+  } else {
+    buf_mem.clear();
+    buf_mem.shrink_to_fit();
+  }
+}
+
+UringEngine::~UringEngine() {
+  if (ring_fd < 0)
+    return;
+  {
+    // a nop with the stop marker, the reaper exits once it sees it
+    std::unique_lock lock(mu);
+    unsigned tail = *sq_tail;
+    unsigned idx = tail & *sq_mask;
+    io_uring_sqe *sqe = &sqes[idx];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = STOP_OP;
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    push(lock, true);
+  }
+  reaper.join();
+  munmap(sqes, sqes_len);
+  if (cq_ptr != sq_ptr)
+    munmap(cq_ptr, cq_len);
+  munmap(sq_ptr, sq_len);
+  ::close(ring_fd);
+}
+
+void UringEngine::register_file(int fd) {
+  std::lock_guard lock(mu);
+  if (!files_registered || free_file_slots.empty() || file_slots.count(fd))
+    return;
+  int slot = free_file_slots.back();
+  io_uring_files_update upd;
+  std::memset(&upd, 0, sizeof(upd));
+  upd.offset = static_cast<uint32_t>(slot);
+  upd.fds = reinterpret_cast<uint64_t>(&fd);
+  if (uring_register(ring_fd, IORING_REGISTER_FILES_UPDATE, &upd, 1) == 1) {
+    free_file_slots.pop_back();
+    file_slots[fd] = slot;
+  }
+}
+
+// has to be called before closing fd, with no I/O of it still in flight
+void UringEngine::unregister_file(int fd) {
+  std::lock_guard lock(mu);
+  auto it = file_slots.find(fd);
+  if (it == file_slots.end())
+    return;
+  int none = -1;
+  io_uring_files_update upd;
+  std::memset(&upd, 0, sizeof(upd));
+  upd.offset = static_cast<uint32_t>(it->second);
+  upd.fds = reinterpret_cast<uint64_t>(&none);
+  uring_register(ring_fd, IORING_REGISTER_FILES_UPDATE, &upd, 1);
+  free_file_slots.push_back(it->second);
+  file_slots.erase(it);
+}
+
+// queues one sqe, blocks while too many ops are in flight. callbacks running
+// on the reaper may chain more I/O, those never wait (nobody else would reap)
+// and get an extra op slot instead
+void UringEngine::submit(uint8_t opcode, int fd, const char *addr, size_t len,
+                         uint64_t off, Op op) {
+  std::unique_lock lock(mu);
+  bool on_reaper = std::this_thread::get_id() == reaper.get_id();
+  if (on_reaper) {
+    if (free_ops.empty()) {
+      free_ops.push_back(static_cast<uint32_t>(ops.size()));
+      ops.emplace_back();
+    }
+  } else {
+    space_cv.wait(lock, [&] { return !free_ops.empty(); });
+  }
+  uint32_t id = free_ops.back();
+  free_ops.pop_back();
+
+  // reads without a target pick their buffer now that we hold the lock
+  if (opcode == IORING_OP_READ && addr == nullptr) {
+    if (bufs_registered && len <= buf_size && !free_bufs.empty()) {
+      op.buf_index = free_bufs.back();
+      free_bufs.pop_back();
+      opcode = IORING_OP_READ_FIXED;
+      addr = buf_mem.data() + op.buf_index * buf_size;
+    } else {
+      op.heap_buf.resize(len);
+      addr = op.heap_buf.data();
+    }
+  }
+  op.opcode = opcode;
+  op.fd = fd;
+  op.addr = addr;
+  op.len = len;
+  op.off = off;
+  ops[id] = std::move(op);
+  queue(id);
+  push(lock, !on_reaper);
+}
+
+// writes the sqe of what is left of ops[id], under mu
+void UringEngine::queue(uint32_t id) {
+  const Op &op = ops[id];
+  unsigned tail = *sq_tail;
+  unsigned idx = tail & *sq_mask;
+  io_uring_sqe *sqe = &sqes[idx];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op.opcode;
+  sqe->fd = op.fd;
+  auto slot = file_slots.find(op.fd);
+  if (slot != file_slots.end()) {
+    sqe->fd = slot->second;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  }
+  sqe->addr = reinterpret_cast<uint64_t>(op.addr + op.done);
+  sqe->len = static_cast<uint32_t>(op.len - op.done);
+  sqe->off = op.off + op.done;
+  if (op.opcode == IORING_OP_READ_FIXED)
+    sqe->buf_index = static_cast<uint16_t>(op.buf_index);
+  sqe->user_data = id;
+  sq_array[idx] = idx;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// hands the queued sqes to the kernel, under mu. returns how many are still
+// queued because the ring is busy (EAGAIN, or EBUSY until the completions are
+// reaped), or -errno if the kernel refused them: those are taken back off the
+// ring and their ops moved to failed
+int UringEngine::flush(std::vector<Op> &failed) {
+  while (true) {
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned queued = *sq_tail - head;
+    if (queued == 0)
+      return 0;
+    int r = uring_enter(ring_fd, queued, 0, 0);
+    if (r > 0 || (r < 0 && errno == EINTR))
+      continue;
+    if (r == 0 || errno == EAGAIN || errno == EBUSY)
+      return static_cast<int>(queued);
+
+    // sqes only go in through here, under mu, so nobody takes them now
+    int err = errno;
+    for (; head != *sq_tail; ++head) {
+      uint64_t id = sqes[sq_array[head & *sq_mask]].user_data;
+      if (id == STOP_OP)
+        continue;
+      Op &op = ops[id];
+      if (op.buf_index >= 0)
+        free_bufs.push_back(op.buf_index);
+      failed.push_back(std::move(op));
+      free_ops.push_back(static_cast<uint32_t>(id));
+    }
+    __atomic_store_n(sq_tail, head - queued, __ATOMIC_RELEASE);
+    return -err;
+  }
+}
+
+// submits the queued sqes. with wait a busy ring is waited out with the lock
+// released so the reaper can drain it, the reaper itself does not wait: it
+// submits them before it waits for completions again. the ops the kernel
+// refused complete here with -errno
+void UringEngine::push(std::unique_lock<std::mutex> &lock, bool wait) {
+  std::vector<Op> failed;
+  int r;
+  while ((r = flush(failed)) > 0 && wait) {
+    lock.unlock();
+    std::this_thread::yield();
+    lock.lock();
+  }
+  if (failed.empty())
+    return;
+  lock.unlock();
+  space_cv.notify_all();
+  for (auto &op : failed) {
+    if (op.cb)
+      op.cb(r, nullptr);
+  }
+  lock.lock();
+}
+
+void UringEngine::read(int fd, size_t len, uint64_t off, IoCallback cb) {
+  Op op;
+  op.cb = std::move(cb);
+  submit(IORING_OP_READ, fd, nullptr, len, off, std::move(op));
+}
+
+// reads straight into the caller's buffer, no registered buffer and no copy
+long UringEngine::read_sync(int fd, char *buf, size_t len, uint64_t off) {
+  SyncWait w;
+  Op op;
+  op.cb = [&w](long res, const char *) { w.finish(res); };
+  submit(IORING_OP_READ, fd, buf, len, off, std::move(op));
+  return w.wait();
+}
+
+void UringEngine::write(int fd, const char *buf, size_t len, uint64_t off,
+                        IoCallback cb) {
+  Op op;
+  op.cb = std::move(cb);
+  submit(IORING_OP_WRITE, fd, buf, len, off, std::move(op));
+}
+
+// runs on the reaper thread, hands every completion to its callback
+void UringEngine::reap() {
+  bool stop = false;
+  while (!stop) {
+    // the sqes left on a busy ring (or queued again below) go first, while
+    // some are left it does not sleep on a completion that may never come
+    unsigned queued;
+    {
+      std::unique_lock lock(mu);
+      push(lock, false);
+      queued = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+    if (queued)
+      std::this_thread::yield();
+    int r = uring_enter(ring_fd, 0, queued ? 0 : 1, IORING_ENTER_GETEVENTS);
+    if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      break;
+
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const io_uring_cqe &cqe = cqes[head & *cq_mask];
+      if (cqe.user_data == STOP_OP) {
+        stop = true;
+        continue;
+      }
+      uint32_t id = static_cast<uint32_t>(cqe.user_data);
+      long res = cqe.res;
+
+      Op op;
+      const char *data;
+      {
+        std::lock_guard lock(mu);
+        Op &cur = ops[id];
+        // a short read or write goes again for the rest, as does an
+        // interrupted one. 0 is the end of the file
+        if (res == -EINTR || res == -EAGAIN ||
+            (res > 0 && cur.done + static_cast<size_t>(res) < cur.len)) {
+          cur.done += res > 0 ? static_cast<size_t>(res) : 0;
+          queue(id);
+          continue;
+        }
+        if (res >= 0)
+          res += static_cast<long>(cur.done);
+        op = std::move(cur);
+        data = op.buf_index >= 0 ? buf_mem.data() + op.buf_index * buf_size
+                                 : op.heap_buf.data();
+      }
+      if (op.cb)
+        op.cb(res, data);
+      {
+        std::lock_guard lock(mu);
+        if (op.buf_index >= 0)
+          free_bufs.push_back(op.buf_index);
+        free_ops.push_back(id);
+      }
+      space_cv.notify_one();
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+} // namespace kv
@@ -0,0 +1,100 @@
+#include "../include/kv/json_fields.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace kv {
+
+bool parseFields(std::string_view spec, FieldPaths &out) {
+  out.clear();
+  size_t pos = 0;
+  while (pos <= spec.size()) {
+    size_t comma = std::min(spec.find(',', pos), spec.size());
+    std::string_view field = spec.substr(pos, comma - pos);
+    std::vector<std::string> path;
+    size_t at = 0;
+    while (at <= field.size()) {
+      size_t dot = std::min(field.find('.', at), field.size());
+      if (dot == at)
+        return false;
+      path.emplace_back(field.substr(at, dot - at));
+      at = dot + 1;
+    }
+    out.push_back(std::move(path));
+    pos = comma + 1;
+  }
+  return !out.empty();
+}
+
+bool projectFields(std::string_view doc, const FieldPaths &paths,
+                   std::string &out) {
+  using json = nlohmann::json;
+  // the keys from the root down to the member being parsed, with the depth
+  // of each. a member is kept if its keys and a path agree as far as both go
+  std::vector<std::pair<int, std::string>> at;
+  json::parser_callback_t keep = [&paths, &at](int depth,
+                                               json::parse_event_t ev,
+                                               json &parsed) {
+    if (ev != json::parse_event_t::key)
+      return true;
+    while (!at.empty() && at.back().first >= depth)
+      at.pop_back();
+    at.emplace_back(depth, parsed.get<std::string>());
+    return std::any_of(paths.begin(), paths.end(), [&at](const auto &p) {
+      size_t n = std::min(p.size(), at.size());
+      for (size_t i = 0; i < n; ++i) {
+        if (p[i] != at[i].second)
+          return false;
+      }
+      return true;
+    });
+  };
+  json j = json::parse(doc.data(), doc.data() + doc.size(), keep, false);
+  if (!j.is_object())
+    return false;
+
+  json res = json::object();
+  for (const auto &p : paths) {
+    const json *v = &j;
+    for (const auto &part : p) {
+      auto it = v->is_object() ? v->find(part) : v->end();
+      if (it == v->end()) {
+        v = nullptr;
+        break;
+      }
+      v = &*it;
+    }
+    if (!v)
+      continue;
+    json *dst = &res;
+    for (size_t i = 0; i + 1 < p.size(); ++i)
+      dst = &(*dst)[p[i]];
+    (*dst)[p.back()] = *v;
+  }
+  out = res.dump();
+  return true;
+}
+
+bool mergePatch(std::string_view doc, std::string_view patch,
+                std::string &out) {
+  using json = nlohmann::json;
+  json p = json::parse(patch.data(), patch.data() + patch.size(), nullptr,
+                       false);
+  if (p.is_discarded())
+    return false;
+  json j;
+  if (!doc.empty()) {
+    j = json::parse(doc.data(), doc.data() + doc.size(), nullptr, false);
+    if (j.is_discarded())
+      return false;
+  }
+  j.merge_patch(p);
+  out = j.dump();
+  return true;
+}
+
+} // namespace kv
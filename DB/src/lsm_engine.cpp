@@ -0,0 +1,1168 @@
+#include "../include/kv/lsm_engine.hpp"
+#include "../include/kv/hash_func.hpp"
+#include "../include/kv/merge.hpp"
+#include "../include/kv/trace.hpp"
+#include "../include/kv/utils.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace kv {
+
+// a new sparse index entry every this many bytes of records
+static constexpr size_t RUN_BLOCK = 4096;
+// bits per key and hash functions of the run bloom filters, ~1% false
+// positives
+static constexpr size_t RUN_BLOOM_BITS = 10;
+static constexpr size_t RUN_BLOOM_HASHES = 4;
+static constexpr size_t RUN_FOOTER_SIZE = 48;
+// a run is written in chunks of this size
+static constexpr size_t RUN_WRITE_CHUNK = 1 << 20;
+// L0 runs that get merged into L1
+static constexpr size_t L0_COMPACT_RUNS = 4;
+// every level holds this many times the bytes of the one above
+static constexpr uint64_t LEVEL_FANOUT = 10;
+// full memtables waiting for their flush before the writers stall
+static constexpr size_t MAX_IMMUTABLE = 4;
+// the memtable growth put on the memory budget at once
+static constexpr size_t MEMTABLE_CHARGE_STEP = 64 * 1024;
+
+static void putU32(std::string &out, uint32_t v) {
+  out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+static void putU64(std::string &out, uint64_t v) {
+  out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+static uint32_t getU32(const char *p) {
+  uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t getU64(const char *p) {
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static bool writeAll(int fd, const char *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t w = ::write(fd, buf + done, len - done);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    done += static_cast<size_t>(w);
+  }
+  return true;
+}
+
+SortedRun::SortedRun(uint64_t id, const std::string &path,
+                     MemoryBudget *budget)
+    : id(id), path(path), bloom(1, 1), budget(budget) {
+  fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || ::fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < RUN_FOOTER_SIZE)
+    return;
+  size_t len = static_cast<size_t>(st.st_size);
+  void *p = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return;
+  const char *base = static_cast<const char *>(p);
+  size_t meta = len - RUN_FOOTER_SIZE;
+  const char *foot = base + meta;
+  uint64_t d_end = getU64(foot), i_end = getU64(foot + 8),
+           bits = getU64(foot + 16), recs = getU64(foot + 24);
+  uint32_t k = getU32(foot + 32), crc = getU32(foot + 36);
+  bool ok = getU64(foot + 40) == LSM_RUN_MAGIC && d_end <= i_end &&
+            i_end <= meta && bits && k && i_end + (bits + 7) / 8 == meta &&
+            utils::crc32(reinterpret_cast<const uint8_t *>(base + d_end),
+                         meta - d_end) == crc;
+
+  // the last key, then the (key, offset) entries
+  size_t pos = d_end;
+  if (ok && pos + sizeof(uint32_t) <= i_end) {
+    uint32_t n = getU32(base + pos);
+    pos += sizeof(uint32_t);
+    ok = pos + n <= i_end;
+    last = {base + pos, ok ? n : 0};
+    pos += n;
+  }
+  while (ok && pos < i_end) {
+    uint32_t n = pos + sizeof(uint32_t) <= i_end ? getU32(base + pos) : 0;
+    pos += sizeof(uint32_t);
+    if (pos + n + sizeof(uint64_t) > i_end) {
+      ok = false;
+      break;
+    }
+    index.emplace_back(std::string_view(base + pos, n), getU64(base + pos + n));
+    pos += n + sizeof(uint64_t);
+  }
+  if (!ok || index.empty()) {
+    ::munmap(p, len);
+    index.clear();
+    return;
+  }
+  map = base;
+  map_len = len;
+  data_end = d_end;
+  records = recs;
+  bloom = BloomFilter(bits, k);
+  const char *packed = base + i_end;
+  for (size_t i = 0; i < bits; ++i) {
+    if ((packed[i / 8] >> (i % 8)) & 1)
+      bloom.setBit(i, true);
+  }
+  // the index keys point into the map, only the entries and the bits count
+  if (budget) {
+    model = modelOfDir(std::filesystem::path(path).parent_path().string());
+    budget->charge(model, MemoryKind::Index, indexBytes());
+  }
+}
+
+SortedRun::~SortedRun() {
+  if (budget && map)
+    budget->release(model, MemoryKind::Index, indexBytes());
+  if (map)
+    ::munmap(const_cast<char *>(map), map_len);
+  if (fd >= 0)
+    ::close(fd);
+  if (obsolete) {
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+  }
+}
+
+size_t SortedRun::seek(std::string_view from) const {
+  // the block of the last index key <= from, then record by record
+  auto it = std::upper_bound(index.begin(), index.end(), from,
+                             [](std::string_view key, const auto &entry) {
+                               return key < entry.first;
+                             });
+  size_t pos = it == index.begin() ? 0 : std::prev(it)->second;
+  RecordView view;
+  while (pos < data_end &&
+         decodeRecord(map + pos, data_end - pos, view, false) ==
+             DecodeStatus::Ok &&
+         view.key < from)
+    pos += view.size();
+  return pos;
+}
+
+bool SortedRun::find(std::string_view key, uint64_t hash,
+                     std::string_view &record) const {
+  if (!map || key < smallest() || last < key || !bloom.maybeContains(hash))
+    return false;
+  size_t pos = seek(key);
+  RecordView view;
+  if (pos >= data_end ||
+      decodeRecord(map + pos, data_end - pos, view) != DecodeStatus::Ok ||
+      view.key != key)
+    return false;
+  record = {map + pos, view.size()};
+  return true;
+}
+
+RunBuilder::RunBuilder(const std::string &path) : path(path) {
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  failed = fd < 0;
+}
+
+RunBuilder::~RunBuilder() {
+  if (fd >= 0)
+    ::close(fd);
+}
+
+void RunBuilder::drain() {
+  if (!failed && !writeAll(fd, pending.data(), pending.size()))
+    failed = true;
+  written += pending.size();
+  pending.clear();
+}
+
+void RunBuilder::add(std::string_view record, std::string_view key) {
+  if (hashes.empty() || size() - block_start >= RUN_BLOCK) {
+    block_start = size();
+    putU32(index, static_cast<uint32_t>(key.size()));
+    index += key;
+    putU64(index, block_start);
+  }
+  pending += record;
+  last.assign(key);
+  hashes.push_back(fnv1a(key));
+  if (pending.size() >= RUN_WRITE_CHUNK)
+    drain();
+}
+
+bool RunBuilder::finish() {
+  uint64_t data_end = size();
+  size_t meta_at = pending.size(); // everything behind the records is pending
+  putU32(pending, static_cast<uint32_t>(last.size()));
+  pending += last;
+  pending += index;
+  uint64_t index_end = size();
+
+  uint64_t bits = std::max<uint64_t>(64, hashes.size() * RUN_BLOOM_BITS);
+  BloomFilter bf(bits, RUN_BLOOM_HASHES);
+  for (uint64_t h : hashes)
+    bf.add(h);
+  std::string packed((bits + 7) / 8, '\0');
+  for (size_t i = 0; i < bits; ++i) {
+    if (bf.getBit(i))
+      packed[i / 8] |= static_cast<char>(1 << (i % 8));
+  }
+  pending += packed;
+
+  uint32_t crc = utils::crc32(
+      reinterpret_cast<const uint8_t *>(pending.data() + meta_at),
+      pending.size() - meta_at);
+  putU64(pending, data_end);
+  putU64(pending, index_end);
+  putU64(pending, bits);
+  putU64(pending, hashes.size());
+  putU32(pending, RUN_BLOOM_HASHES);
+  putU32(pending, crc);
+  putU64(pending, LSM_RUN_MAGIC);
+  drain();
+  failed = failed || ::fsync(fd) != 0;
+  ::close(fd);
+  fd = -1;
+  return !failed;
+}
+
+// a cursor over records in key order. rank orders the cursors of a merge,
+// the lower one has the newer versions
+struct MergeSource {
+  std::string_view data;
+  size_t pos = 0;
+  size_t rank = 0;
+  RecordView view;
+
+  // decodes the record at pos, false at the end (or at a damaged record)
+  bool load() {
+    return pos < data.size() &&
+           decodeRecord(data.data() + pos, data.size() - pos, view) ==
+               DecodeStatus::Ok;
+  }
+};
+
+// hands fn the newest version of every key of the sources in key order, with
+// the whole record. fn returns false to stop. merge operands get folded onto
+// the versions under them, complete says the sources have every version
+// there is (see foldRecords)
+static void
+mergeSources(std::vector<MergeSource> &srcs, bool complete,
+             const std::function<bool(const RecordView &, std::string_view)>
+                 &fn) {
+  auto later = [&srcs](size_t a, size_t b) {
+    const MergeSource &x = srcs[a], &y = srcs[b];
+    if (x.view.key != y.view.key)
+      return x.view.key > y.view.key;
+    return x.rank > y.rank;
+  };
+  std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(
+      later);
+  for (size_t i = 0; i < srcs.size(); ++i) {
+    if (srcs[i].load())
+      heap.push(i);
+  }
+  auto next = [&](size_t i) {
+    srcs[i].pos += srcs[i].view.size();
+    if (srcs[i].load())
+      heap.push(i);
+  };
+  std::string last, folded;
+  std::vector<RecordView> versions;
+  uint64_t now = utils::nowMs();
+  bool first = true;
+  while (!heap.empty()) {
+    size_t i = heap.top();
+    heap.pop();
+    MergeSource &s = srcs[i];
+    // the older versions of the key come right after the newest
+    if (!first && s.view.key == last) {
+      next(i);
+      continue;
+    }
+    first = false;
+    last.assign(s.view.key);
+    if (!(s.view.flags & REC_MERGE)) {
+      if (!fn(s.view, s.data.substr(s.pos, s.view.size())))
+        return;
+      next(i);
+      continue;
+    }
+    // the views stay valid, the sources only move past them
+    versions.assign(1, s.view);
+    next(i);
+    while (!heap.empty() && srcs[heap.top()].view.key == last) {
+      size_t j = heap.top();
+      heap.pop();
+      if (versions.back().flags & REC_MERGE)
+        versions.push_back(srcs[j].view);
+      next(j);
+    }
+    RecordView view;
+    foldRecords(versions, complete, now, folded);
+    decodeRecord(folded.data(), folded.size(), view, false);
+    if (!fn(view, folded))
+      return;
+  }
+}
+
+// a memtable takes a record, the bytes count what went to its WAL. a merge
+// operand is folded onto the record the memtable has for its key
+static void insert(Memtable &m, std::string_view key, std::string_view record) {
+  auto it = m.records.find(key);
+  m.bytes += record.size();
+  RecordView view;
+  if (it != m.records.end() &&
+      decodeRecord(record.data(), record.size(), view, false) ==
+          DecodeStatus::Ok &&
+      (view.flags & REC_MERGE)) {
+    std::vector<RecordView> versions(2);
+    versions[0] = view;
+    decodeRecord(it->second.data(), it->second.size(), versions[1], false);
+    thread_local std::string folded;
+    foldRecords(versions, false, utils::nowMs(), folded);
+    it->second.swap(folded);
+    return;
+  }
+  if (it == m.records.end())
+    it = m.records.emplace(std::string(key), std::string()).first;
+  it->second.assign(record);
+}
+
+std::string LsmEngine::path_of(const char *kind, uint64_t id) const {
+  return dir + "/" + kind + "_" + std::to_string(id) +
+         (std::strcmp(kind, "wal") == 0 ? ".log" : ".sst");
+}
+
+// reads the manifest and opens its runs, the runs it does not list are the
+// output of a flush or compaction cut short and go. the WALs from the floor
+// on are replayed into the memtable
+LsmEngine::LsmEngine(const std::string &dir, const StorageOptions &opts)
+    : opts(opts), dir(dir), model(modelOfDir(dir)),
+      mem(std::make_shared<Memtable>()),
+      feed(opts.change_feed_size
+               ? std::make_unique<ChangeFeed>(opts.change_feed_size,
+                                              utils::nowMs() << 10)
+               : nullptr) {
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+  auto v = std::make_shared<LsmVersion>();
+  v->levels.resize(1);
+  std::set<uint64_t> listed;
+
+  // magic, WAL floor, next id, count, then (level, id) pairs and the version
+  // clock when it was written (not in the older manifests)
+  std::ifstream in(dir + "/" + LSM_MANIFEST, std::ios::binary);
+  uint64_t head[4];
+  if (in.read(reinterpret_cast<char *>(head), sizeof(head)) &&
+      head[0] == LSM_MANIFEST_MAGIC) {
+    wal_floor = head[1];
+    next_id = head[2];
+    uint64_t pair[2];
+    for (uint64_t i = 0;
+         i < head[3] && in.read(reinterpret_cast<char *>(pair), sizeof(pair));
+         ++i) {
+      auto run = std::make_shared<SortedRun>(pair[1], path_of("run", pair[1]),
+                                             opts.memory);
+      if (!run->valid()) {
+        std::cerr << "lsm: skipping damaged run " << path_of("run", pair[1])
+                  << '\n';
+        continue;
+      }
+      if (v->levels.size() <= pair[0])
+        v->levels.resize(pair[0] + 1);
+      v->levels[pair[0]].push_back(std::move(run));
+      listed.insert(pair[1]);
+    }
+    uint64_t clock;
+    if (in.read(reinterpret_cast<char *>(&clock), sizeof(clock)))
+      seed_version(clock);
+  }
+
+  std::vector<uint64_t> wals;
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    std::string name = entry.path().filename().string();
+    std::string ext = entry.path().extension().string();
+    bool is_run = name.rfind("run_", 0) == 0 && ext == ".sst";
+    bool is_wal = name.rfind("wal_", 0) == 0 && ext == ".log";
+    if (!is_run && !is_wal)
+      continue;
+    uint64_t id;
+    try {
+      id = std::stoull(name.substr(4));
+    } catch (const std::exception &) {
+      continue;
+    }
+    if (id >= next_id)
+      next_id = id + 1;
+    std::error_code rm;
+    if (is_run && !listed.count(id))
+      std::filesystem::remove(entry.path(), rm);
+    else if (is_wal && id < wal_floor)
+      std::filesystem::remove(entry.path(), rm);
+    else if (is_wal)
+      wals.push_back(id);
+  }
+  std::sort(wals.begin(), wals.end());
+  for (uint64_t id : wals)
+    replay(path_of("wal", id));
+  open_wal();
+  mem->first_wal = wals.empty() ? wal_id : wals.front();
+  charge(*mem, true);
+  version = std::move(v);
+}
+
+LsmEngine::~LsmEngine() {
+  {
+    std::unique_lock lock(pending_mu);
+    pending_cv.wait(lock, [this] { return pending == 0; });
+  }
+  // the memtable goes into a run, the next open has no WAL to replay
+  checkpoint();
+  if (opts.memory)
+    opts.memory->release(model, MemoryKind::Memtable, mem->charged);
+  if (wal_fd >= 0)
+    ::close(wal_fd);
+}
+
+// starts a new WAL for the writes from here on
+bool LsmEngine::open_wal() {
+  uint64_t id = next_id++;
+  std::string path = path_of("wal", id);
+  int fd = ::open(path.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::cerr << "lsm: cannot create " << path << '\n';
+    return false;
+  }
+  if (wal_fd >= 0)
+    ::close(wal_fd);
+  wal_fd = fd;
+  wal_id = id;
+  return true;
+}
+
+// the records of a WAL go back into the memtable, up to a torn tail. a batch
+// goes back only if all of its records made it
+void LsmEngine::replay(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  std::string data((std::istreambuf_iterator<char>(in)),
+                   std::istreambuf_iterator<char>());
+  size_t pos = 0;
+  RecordView view;
+  while (pos < data.size() &&
+         decodeRecord(data.data() + pos, data.size() - pos, view) ==
+             DecodeStatus::Ok) {
+    size_t len, body = pos + view.size();
+    if (batchHeader(view.flags)) {
+      if (!batchIntact(view, data.data() + body, data.size() - body, len))
+        return;
+    } else if (!(view.flags & REC_PADDING)) {
+      insert(*mem, view.key, {data.data() + pos, view.size()});
+      seed_version(view.version);
+    }
+    pos = body;
+  }
+}
+
+// puts the growth of m on the memory budget, in steps so a write does not
+// take the budget's lock every time. the caller holds write_mu
+void LsmEngine::charge(Memtable &m, bool all) {
+  if (!opts.memory || m.bytes <= m.charged ||
+      (!all && m.bytes - m.charged < MEMTABLE_CHARGE_STEP))
+    return;
+  opts.memory->charge(model, MemoryKind::Memtable, m.bytes - m.charged);
+  m.charged = m.bytes;
+}
+
+// the change feed event of a write, null if the feed is off
+std::shared_ptr<ChangeEvent> LsmEngine::change(std::string_view key,
+                                               std::string_view val,
+                                               bool is_json) {
+  if (!feed)
+    return nullptr;
+  return ChangeFeed::make(val.empty() ? ChangeOp::Erase : ChangeOp::Put, key,
+                          val, is_json ? REC_JSON : 0);
+}
+
+// the same for a merge operand, val is the value of its record
+std::shared_ptr<ChangeEvent> LsmEngine::merged(std::string_view key,
+                                               std::string_view val) {
+  MergeLink link;
+  std::string_view operands;
+  if (!feed || !decodeMergeValue(val, link, operands))
+    return nullptr;
+  return ChangeFeed::make(ChangeOp::Merge, key, describeOperands(operands),
+                          REC_JSON);
+}
+
+// appends record to the WAL and puts it in the memtable, a full memtable is
+// swapped for a new one and flushed. false if the WAL write failed
+bool LsmEngine::write(std::string_view key, std::string_view record,
+                      std::shared_ptr<ChangeEvent> ev) {
+  thread_local std::vector<Insert> one(1);
+  one[0] = {key, record, std::move(ev)};
+  return write(record, one);
+}
+
+// the same for the records of inserts, all in data: one WAL append and one
+// memtable lock for all of them
+bool LsmEngine::write(std::string_view data, std::vector<Insert> &inserts) {
+  {
+    // the flushes are behind, the writers wait for them so the memtables do
+    // not pile up in memory
+    std::unique_lock lock(mu);
+    room_cv.wait(lock, [this] { return imm.size() < MAX_IMMUTABLE; });
+  }
+  bool full;
+  {
+    std::lock_guard wlock(write_mu);
+    if (!writeAll(wal_fd, data.data(), data.size()))
+      return false;
+    {
+      // the change feed gets the writes in the order of the memtable
+      std::unique_lock lock(mu);
+      for (auto &in : inserts) {
+        insert(*mem, in.key, in.record);
+        if (in.ev)
+          feed->publish(std::move(in.ev));
+      }
+    }
+    full = mem->bytes >= opts.checkpoint_interval;
+    charge(*mem, full);
+    if (full)
+      switch_memtable();
+  }
+  if (full)
+    schedule();
+  return true;
+}
+
+// the caller holds write_mu
+void LsmEngine::switch_memtable() {
+  if (mem->records.empty() || !open_wal())
+    return;
+  auto next = std::make_shared<Memtable>();
+  next->first_wal = wal_id;
+  std::unique_lock lock(mu);
+  imm.push_back(std::move(mem));
+  mem = std::move(next);
+}
+
+// runs the flushes and compactions on the background pool, inline if there
+// is none
+void LsmEngine::schedule() {
+  if (maint_queued.exchange(true))
+    return;
+  if (!opts.background) {
+    maintain();
+    return;
+  }
+  {
+    std::lock_guard lock(pending_mu);
+    ++pending;
+  }
+  opts.background->enqueue(
+      [this] {
+        maintain();
+        std::lock_guard lock(pending_mu);
+        if (--pending == 0)
+          pending_cv.notify_all();
+      },
+      TaskPriority::Background);
+}
+
+void LsmEngine::maintain() {
+  std::lock_guard lock(maint_mu);
+  maint_queued = false; // a memtable filled from here on schedules another
+  while (flush_one()) {
+  }
+  while (compact_one()) {
+  }
+}
+
+uint64_t LsmEngine::level_limit(size_t level) const {
+  uint64_t limit = opts.segment_size;
+  for (size_t i = 0; i < level; ++i)
+    limit *= LEVEL_FANOUT;
+  return limit;
+}
+
+// the index, bloom filter and footer of a run that was built, null if it
+// could not be written
+std::shared_ptr<SortedRun> LsmEngine::new_run(RunBuilder &builder,
+                                              uint64_t id) {
+  std::string path = path_of("run", id);
+  std::shared_ptr<SortedRun> run;
+  if (builder.finish())
+    run = std::make_shared<SortedRun>(id, path, opts.memory);
+  if (run && run->valid())
+    return run;
+  std::cerr << "lsm: cannot write " << path << '\n';
+  std::error_code ec;
+  std::filesystem::remove(path, ec);
+  return nullptr;
+}
+
+// writes the oldest full memtable into a new L0 run, false if there is none
+// (or the run could not be written, the memtable stays for the next try)
+bool LsmEngine::flush_one() {
+  std::shared_ptr<const Memtable> m;
+  {
+    std::shared_lock lock(mu);
+    if (imm.empty())
+      return false;
+    m = imm.front();
+  }
+  uint64_t id = next_id++;
+  RunBuilder builder(path_of("run", id));
+  for (const auto &[key, record] : m->records)
+    builder.add(record, key);
+  auto run = new_run(builder, id);
+  if (!run)
+    return false;
+  install({}, 0, {run}, m);
+  return true;
+}
+
+// one merge where a level is over its size: all of L0 into L1 once it has
+// L0_COMPACT_RUNS runs, or one run of a deeper level into the next one. the
+// runs of a level take their turn round robin over the key space. returns the
+// runs merged, 0 if nothing needs it
+size_t LsmEngine::compact_one() {
+  std::shared_ptr<const LsmVersion> v;
+  {
+    std::shared_lock lock(mu);
+    v = version;
+  }
+  if (v->levels[0].size() >= L0_COMPACT_RUNS)
+    return merge_into(1, v->levels[0], false);
+  for (size_t n = 1; n < v->levels.size(); ++n) {
+    const auto &runs = v->levels[n];
+    uint64_t bytes = 0;
+    for (const auto &r : runs)
+      bytes += r->size();
+    if (runs.empty() || bytes <= level_limit(n))
+      continue;
+    if (compact_at.size() <= n)
+      compact_at.resize(n + 1);
+    auto pick = std::find_if(runs.begin(), runs.end(), [&](const auto &r) {
+      return r->smallest() > compact_at[n];
+    });
+    if (pick == runs.end())
+      pick = runs.begin();
+    compact_at[n] = std::string((*pick)->largest());
+    return merge_into(n + 1, {*pick}, false);
+  }
+  return 0;
+}
+
+// merges the runs in (newest first) with the ones of level they overlap and
+// puts the output at level. the tombstones and expired records are dropped
+// when nothing deeper can hold an older version of their key. major merges
+// every run there is, in is all of them then. returns the runs merged, 0 if
+// the output could not be written
+size_t LsmEngine::merge_into(size_t level,
+                             std::vector<std::shared_ptr<SortedRun>> in,
+                             bool major) {
+  std::shared_ptr<const LsmVersion> v;
+  {
+    std::shared_lock lock(mu);
+    v = version;
+  }
+  if (in.empty())
+    return 0;
+  bool bottom = true;
+  for (size_t n = level + 1; n < v->levels.size(); ++n)
+    bottom = bottom && v->levels[n].empty();
+  if (!major && level < v->levels.size()) {
+    std::string_view lo = in.front()->smallest(), hi = in.front()->largest();
+    for (const auto &r : in) {
+      lo = std::min(lo, r->smallest());
+      hi = std::max(hi, r->largest());
+    }
+    for (const auto &r : v->levels[level]) {
+      if (r->overlaps(lo, hi))
+        in.push_back(r);
+    }
+  }
+
+  std::vector<MergeSource> srcs(in.size());
+  for (size_t i = 0; i < in.size(); ++i) {
+    srcs[i].data = in[i]->data();
+    srcs[i].rank = i;
+  }
+  uint64_t now = utils::nowMs();
+  std::vector<std::shared_ptr<SortedRun>> out;
+  std::unique_ptr<RunBuilder> builder;
+  uint64_t id = 0;
+  bool ok = true;
+  // the output is cut into runs of about a segment
+  auto seal = [&] {
+    auto run = new_run(*builder, id);
+    builder.reset();
+    if (!run)
+      return ok = false;
+    out.push_back(std::move(run));
+    return true;
+  };
+  mergeSources(srcs, bottom, [&](const RecordView &view,
+                                 std::string_view record) {
+    if (bottom && (!(view.flags & REC_ALIVE) || view.expired(now)))
+      return true;
+    if (!builder) {
+      id = next_id++;
+      builder = std::make_unique<RunBuilder>(path_of("run", id));
+    }
+    builder->add(record, view.key);
+    return builder->size() < opts.segment_size || seal();
+  });
+  if (ok && builder)
+    seal();
+  if (!ok) {
+    for (auto &r : out)
+      r->retire();
+    return 0;
+  }
+  install(in, level, std::move(out), nullptr);
+  return in.size();
+}
+
+// swaps the inputs of a flush or compaction for its output and saves the
+// manifest. a replaced run goes once the last reader holding its version is
+// done with it. the caller holds maint_mu
+void LsmEngine::install(const std::vector<std::shared_ptr<SortedRun>> &removed,
+                        size_t level,
+                        std::vector<std::shared_ptr<SortedRun>> added,
+                        const std::shared_ptr<const Memtable> &flushed) {
+  std::shared_ptr<const LsmVersion> v;
+  {
+    std::unique_lock lock(mu);
+    auto next = std::make_shared<LsmVersion>(*version);
+    if (next->levels.size() <= level)
+      next->levels.resize(level + 1);
+    for (auto &runs : next->levels) {
+      runs.erase(std::remove_if(runs.begin(), runs.end(),
+                                [&](const auto &r) {
+                                  return std::find(removed.begin(),
+                                                   removed.end(),
+                                                   r) != removed.end();
+                                }),
+                 runs.end());
+    }
+    auto &dst = next->levels[level];
+    if (level == 0) {
+      dst.insert(dst.begin(), added.begin(), added.end());
+    } else {
+      dst.insert(dst.end(), added.begin(), added.end());
+      std::sort(dst.begin(), dst.end(), [](const auto &a, const auto &b) {
+        return a->smallest() < b->smallest();
+      });
+    }
+    while (next->levels.size() > 1 && next->levels.back().empty())
+      next->levels.pop_back();
+    // the flushed records are in the new version, readers see them in one
+    // place or the other
+    if (flushed) {
+      if (opts.memory)
+        opts.memory->release(model, MemoryKind::Memtable, flushed->charged);
+      imm.pop_front();
+      wal_floor = imm.empty() ? mem->first_wal : imm.front()->first_wal;
+    }
+    version = next;
+    v = std::move(next);
+  }
+  save_manifest(*v);
+  for (const auto &r : removed)
+    r->retire();
+  if (!flushed)
+    return;
+  room_cv.notify_all();
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    std::string name = entry.path().filename().string();
+    if (name.rfind("wal_", 0) != 0 || entry.path().extension() != ".log")
+      continue;
+    try {
+      if (std::stoull(name.substr(4)) < wal_floor)
+        std::filesystem::remove(entry.path(), ec);
+    } catch (const std::exception &) {
+    }
+  }
+}
+
+// the caller holds maint_mu
+void LsmEngine::save_manifest(const LsmVersion &v) {
+  std::vector<uint64_t> words{LSM_MANIFEST_MAGIC, wal_floor, next_id.load(),
+                              0};
+  for (size_t n = 0; n < v.levels.size(); ++n) {
+    for (const auto &r : v.levels[n]) {
+      words.push_back(n);
+      words.push_back(r->getId());
+      ++words[3];
+    }
+  }
+  // the runs only have records written before now
+  words.push_back(version_clock());
+  atomicWrite(dir + "/" + LSM_MANIFEST,
+              {{words.data(), words.size() * sizeof(uint64_t)}});
+}
+
+void LsmEngine::checkpoint() {
+  {
+    std::lock_guard wlock(write_mu);
+    switch_memtable();
+  }
+  std::lock_guard lock(maint_mu);
+  while (flush_one()) {
+  }
+}
+
+size_t LsmEngine::compact(double min_dead_ratio) {
+  checkpoint();
+  std::lock_guard lock(maint_mu);
+  if (min_dead_ratio > 0) {
+    size_t done = 0;
+    while (size_t n = compact_one())
+      done += n;
+    return done;
+  }
+  std::shared_ptr<const LsmVersion> v;
+  {
+    std::shared_lock lock(mu);
+    v = version;
+  }
+  std::vector<std::shared_ptr<SortedRun>> all;
+  for (const auto &runs : v->levels)
+    all.insert(all.end(), runs.begin(), runs.end());
+  return merge_into(std::max<size_t>(1, v->levels.size() - 1), all, true);
+}
+
+bool LsmEngine::snapshot(const std::string &dest) {
+  checkpoint();
+  std::lock_guard maint_lock(maint_mu); // no compaction swaps runs meanwhile
+  std::shared_ptr<const LsmVersion> v;
+  {
+    std::shared_lock lock(mu);
+    v = version;
+  }
+  // built next to it and renamed, a snapshot is there whole or not at all
+  std::error_code ec;
+  std::string tmp = dest + ".tmp";
+  std::filesystem::remove_all(tmp, ec);
+  std::filesystem::create_directories(tmp, ec);
+  if (ec)
+    return false;
+  std::vector<std::string> names{LSM_MANIFEST};
+  for (const auto &runs : v->levels) {
+    for (const auto &r : runs)
+      names.push_back("run_" + std::to_string(r->getId()) + ".sst");
+  }
+  for (const auto &name : names) {
+    std::filesystem::create_hard_link(dir + "/" + name, tmp + "/" + name, ec);
+    if (ec) {
+      std::filesystem::remove_all(tmp, ec);
+      return false;
+    }
+  }
+  std::filesystem::rename(tmp, dest, ec);
+  return !ec;
+}
+
+uint64_t LsmEngine::put(std::string_view key, std::string_view val,
+                        bool is_json, uint64_t ttl_ms, std::string_view clock) {
+  std::lock_guard key_guard(key_lock(key));
+  uint64_t expires_at = ttl_ms ? utils::nowMs() + ttl_ms : 0;
+  uint64_t version = val.empty() && clock.empty() ? 0 : next_version();
+  thread_local std::string record;
+  encodeRecord(record, key, val, is_json ? REC_JSON : 0, expires_at, clock,
+               version);
+  if (opts.workload)
+    version ? opts.workload->write(key.size(), val.size())
+            : opts.workload->erase();
+  return write(key, record, change(key, val, is_json)) ? version : 0;
+}
+
+// the operand goes in like a put, the memtable folds it onto the record of
+// the key it has and the reads and compactions fold it onto the older ones
+bool LsmEngine::merge(std::string_view key, MergeOp op,
+                      std::string_view operand) {
+  std::lock_guard key_guard(key_lock(key));
+  thread_local std::string operands, val, record;
+  operands.clear();
+  appendOperand(operands, op, operand);
+  encodeMergeValue(val, {}, operands);
+  encodeRecord(record, key, val, REC_MERGE, 0, {}, next_version());
+  if (opts.workload)
+    opts.workload->merge();
+  return write(key, record, merged(key, val));
+}
+
+// the memtables newest first, then the runs level by level. the record is
+// copied into out, a compaction may drop its run right after. merge operands
+// are collected on the way down and folded onto the record under them
+bool LsmEngine::get_into(std::string_view key, Buffer &out) {
+  out.clear();
+  std::string_view record;
+  std::shared_ptr<const LsmVersion> v;
+  auto copy = [&out](std::string_view rec) {
+    char *p = out.reserve(rec.size());
+    std::memcpy(p, rec.data(), rec.size());
+    return std::string_view(p, rec.size());
+  };
+  // true once rec is the record to go by, an operand is kept and the search
+  // goes on
+  std::vector<std::string> operands;
+  auto found = [&](std::string_view rec) {
+    RecordView view;
+    if (decodeRecord(rec.data(), rec.size(), view, false) ==
+            DecodeStatus::Ok &&
+        (view.flags & REC_MERGE)) {
+      operands.emplace_back(rec);
+      return false;
+    }
+    record = copy(rec);
+    return true;
+  };
+  bool done = false;
+  {
+    TraceSpan wait("mu wait");
+    std::shared_lock lock(mu);
+    wait.end();
+    TraceSpan span("memtables");
+    auto look = [&](const Memtable &m) {
+      auto it = m.records.find(key);
+      if (it != m.records.end())
+        done = found(it->second);
+    };
+    look(*mem);
+    for (auto m = imm.rbegin(); !done && m != imm.rend(); ++m)
+      look(**m);
+    v = version;
+  }
+  TraceSpan span("run lookup");
+  uint64_t hash = fnv1a(key), probed = 0;
+  std::string_view rec;
+  for (size_t n = 0; !done && n < v->levels.size(); ++n) {
+    const auto &runs = v->levels[n];
+    if (n == 0) {
+      for (auto r = runs.begin(); !done && r != runs.end(); ++r) {
+        ++probed;
+        if ((*r)->find(key, hash, rec))
+          done = found(rec);
+      }
+      continue;
+    }
+    // one run of a deeper level can have the key
+    auto r = std::upper_bound(runs.begin(), runs.end(), key,
+                              [](std::string_view k, const auto &run) {
+                                return k < run->smallest();
+                              });
+    if (r != runs.begin()) {
+      ++probed;
+      if ((*std::prev(r))->find(key, hash, rec))
+        done = found(rec);
+    }
+  }
+  span.note("runs", probed);
+  span.end();
+  if (!operands.empty()) {
+    std::vector<RecordView> versions(operands.size() + (done ? 1 : 0));
+    for (size_t i = 0; i < operands.size(); ++i)
+      decodeRecord(operands[i].data(), operands[i].size(), versions[i],
+                   false);
+    if (done)
+      decodeRecord(record.data(), record.size(), versions.back(), false);
+    thread_local std::string folded;
+    foldRecords(versions, true, utils::nowMs(), folded);
+    record = copy(folded);
+  }
+  RecordView view;
+  bool live = !record.empty() &&
+              decodeRecord(record.data(), record.size(), view, false) ==
+                  DecodeStatus::Ok &&
+              (view.flags & REC_ALIVE) && !view.expired(utils::nowMs());
+  if (opts.workload)
+    opts.workload->read(key.size(), live, live ? view.val.size() : 0);
+  if (!live)
+    return false;
+  out.set_value(view.val, view.flags, view.clock, view.expires_at,
+                view.version);
+  return true;
+}
+
+bool LsmEngine::erase(std::string_view key) {
+  if (opts.workload)
+    opts.workload->erase();
+  std::lock_guard key_guard(key_lock(key));
+  thread_local Buffer buf;
+  if (!get_into(key, buf))
+    return false;
+  thread_local std::string record;
+  encodeRecord(record, key, {}, REC_TOMBSTONE);
+  return write(key, record, change(key, {}, false));
+}
+
+// records shipped from another engine as they are. a blob ref of another
+// engine means nothing here, the values have to come inline
+bool LsmEngine::apply(std::string_view records) {
+  size_t pos = 0;
+  while (pos < records.size()) {
+    RecordView view;
+    if (decodeRecord(records.data() + pos, records.size() - pos, view) !=
+        DecodeStatus::Ok)
+      return false;
+    std::string_view record = records.substr(pos, view.size());
+    pos += view.size();
+    if (view.flags & REC_PADDING)
+      continue;
+    // keeps the clock ahead of the versions the leader sent
+    seed_version(view.version);
+    if (view.flags & REC_BLOB)
+      return false;
+    bool deleted = !(view.flags & REC_ALIVE);
+    auto ev = (view.flags & REC_MERGE)
+                  ? merged(view.key, view.val)
+                  : change(view.key, deleted ? std::string_view() : view.val,
+                           view.flags & REC_JSON);
+    if (!write(view.key, record, std::move(ev)))
+      return false;
+  }
+  return true;
+}
+
+// the batch is framed in the WAL like in a segment, see replay
+bool LsmEngine::commit_batch(const std::vector<BatchOp> &ops) {
+  uint64_t now = utils::nowMs();
+  std::string body, record, frame;
+  std::vector<size_t> at; // of each record in body, and the end of the last
+  for (const auto &op : ops) {
+    if (opts.workload)
+      op.val.empty() ? opts.workload->erase()
+                     : opts.workload->write(op.key.size(), op.val.size());
+    uint64_t expires_at =
+        op.ttl_ms && !op.val.empty() ? now + op.ttl_ms : 0;
+    encodeRecord(record, op.key, op.val, op.is_json ? REC_JSON : 0,
+                 expires_at, {}, op.version);
+    at.push_back(body.size());
+    body += record;
+  }
+  at.push_back(body.size());
+  encodeBatchHeader(frame, static_cast<uint32_t>(ops.size()), body);
+  size_t head = frame.size();
+  frame += body;
+  std::vector<Insert> inserts;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    inserts.push_back(
+        {ops[i].key,
+         std::string_view(frame).substr(head + at[i], at[i + 1] - at[i]),
+         change(ops[i].key, ops[i].val, ops[i].is_json)});
+  }
+  return write(frame, inserts);
+}
+
+void LsmEngine::scan_records(const RecordFn &fn) { scan_range({}, {}, 0, fn); }
+
+// one merge of the memtables and the runs that overlap the range. the runs
+// are read in place, the memtables are copied under the lock at most limit
+// records each: when one was cut short the merge stops at the last key it
+// copied and the next round starts after it
+void LsmEngine::scan_range(std::string_view from, std::string_view to,
+                           size_t limit, const RecordFn &fn) {
+  std::string start(from);
+  size_t left = limit;
+  while (true) {
+    std::shared_ptr<const LsmVersion> v;
+    std::vector<std::string> copies;
+    std::string stop;
+    bool cut = false;
+    {
+      std::shared_lock lock(mu);
+      v = version;
+      std::vector<const Memtable *> tables{mem.get()};
+      for (auto m = imm.rbegin(); m != imm.rend(); ++m)
+        tables.push_back(m->get());
+      for (const Memtable *m : tables) {
+        std::string &buf = copies.emplace_back();
+        size_t n = 0;
+        for (auto it = m->records.lower_bound(start);
+             it != m->records.end() && (to.empty() || it->first < to); ++it) {
+          if (limit && n == limit) {
+            std::string_view last = std::prev(it)->first;
+            if (!cut || last < stop)
+              stop = last;
+            cut = true;
+            break;
+          }
+          buf += it->second;
+          ++n;
+        }
+      }
+    }
+
+    std::vector<MergeSource> srcs;
+    for (const auto &buf : copies)
+      srcs.push_back({buf, 0, srcs.size(), {}});
+    for (size_t n = 0; n < v->levels.size(); ++n) {
+      size_t rank = srcs.size();
+      for (const auto &r : v->levels[n]) {
+        if (r->largest() < start || (!to.empty() && r->smallest() >= to))
+          continue;
+        srcs.push_back({r->data(), r->seek(start), n ? rank : srcs.size(), {}});
+      }
+    }
+
+    uint64_t now = utils::nowMs();
+    bool done = false;
+    mergeSources(srcs, true, [&](const RecordView &view, std::string_view) {
+      if (!to.empty() && view.key >= to) {
+        done = true;
+        return false;
+      }
+      if (cut && view.key > stop)
+        return false;
+      if (!(view.flags & REC_ALIVE) || view.expired(now))
+        return true;
+      fn(view);
+      if (limit && --left == 0) {
+        done = true;
+        return false;
+      }
+      return true;
+    });
+    if (done || !cut)
+      return;
+    start = stop;
+    start.push_back('\0'); // the smallest key after stop
+  }
+}
+
+} // namespace kv
@@ -1,10 +1,23 @@
+#include "../include/kv/bulk_loader.hpp"    // builds segments offline
+#include "../include/kv/change_streams.hpp" // pushes the writes to clients
+#include "../include/kv/cluster.hpp"        // dynamo style cluster mode
 #include "../include/kv/config.hpp"         // Your database Config class
+#include "../include/kv/json_fields.hpp"    // ?fields= and merge patches
+#include "../include/kv/json_stream.hpp"    // chunked json responses
+#include "../include/kv/merge.hpp"          // counters and sets, no reads
+#include "../include/kv/model_registry.hpp" // open engines of every model
+#include "../include/kv/replication.hpp"    // leader and replica sides
+#include "../include/kv/request_scheduler.hpp" // limits the heavy requests
+#include "../include/kv/resp_server.hpp"    // the redis protocol
 #include "../include/kv/storage_engine.hpp" // Your database StorageEngine class
+#include "../include/kv/trace.hpp"          // sampled request spans
+#include "../include/kv/utils.hpp"          // nowMs
 #include <cctype>
 #include <crow.h>
 #include <filesystem>
+#include <functional>
 #include <nlohmann/json.hpp>
-#include <unordered_map>
+#include <sstream>
 
 namespace fs = std::filesystem;
 
@@ -18,10 +31,109 @@ std::string to_lower(std::string data) {
   return data;
 }
 
-int main() {
-  // Load configuration
+// a name that is one path component (snapshots)
+bool valid_name(const std::string &name) {
+  return !name.empty() && name != "." && name != ".." &&
+         name.find('/') == std::string::npos;
+}
+
+// Range: bytes=a-b (or a-, or -n for the last n) of a value of size bytes,
+// false if it is not one range inside the value
+bool parse_range(const std::string &header, uint64_t size, uint64_t &first,
+                 uint64_t &last) {
+  if (header.rfind("bytes=", 0) != 0 || size == 0)
+    return false;
+  std::string spec = header.substr(6);
+  size_t dash = spec.find('-');
+  if (dash == std::string::npos || spec.find(',') != std::string::npos)
+    return false;
+  std::string a = spec.substr(0, dash), b = spec.substr(dash + 1);
+  auto number = [](const std::string &s, uint64_t &out) {
+    if (s.empty() || s.find_first_not_of("0123456789") != std::string::npos)
+      return false;
+    out = std::strtoull(s.c_str(), nullptr, 10);
+    return true;
+  };
+  uint64_t n;
+  if (a.empty()) {
+    if (!number(b, n) || n == 0)
+      return false;
+    first = n < size ? size - n : 0;
+    last = size - 1;
+    return true;
+  }
+  if (!number(a, first) || first >= size)
+    return false;
+  last = size - 1;
+  if (!b.empty() && (!number(b, n) || n < first))
+    return false;
+  if (!b.empty() && n < last)
+    last = n;
+  return true;
+}
+
+// the ETag of a key's version, the conditional writes take it back
+std::string etag(uint64_t version) {
+  return "\"" + std::to_string(version) + "\"";
+}
+
+// the version a write is conditional on: If-Match: "N" (an ETag, the quotes
+// may be left out) or If-None-Match: * for a key that must be missing, which
+// is version 0. false if one of them is there but not like that
+bool if_version(const crow::request &req, std::optional<uint64_t> &out) {
+  out.reset();
+  std::string match = req.get_header_value("If-Match");
+  std::string none = req.get_header_value("If-None-Match");
+  if (!none.empty()) {
+    if (none != "*" || !match.empty())
+      return false;
+    out = 0;
+    return true;
+  }
+  if (match.empty())
+    return true;
+  if (match.size() >= 2 && match.front() == '"' && match.back() == '"')
+    match = match.substr(1, match.size() - 2);
+  if (match.empty() ||
+      match.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  out = std::strtoull(match.c_str(), nullptr, 10);
+  return true;
+}
+
+// ?ttl=N, the seconds a write lives for: digits only and at most MAX_TTL_S.
+// false if it is there but not like that
+constexpr uint64_t MAX_TTL_S = 10ull * 365 * 24 * 3600;
+bool ttl_param(const crow::request &req, uint64_t &ttl_ms) {
+  ttl_ms = 0;
+  const char *ttl = req.url_params.get("ttl");
+  if (!ttl)
+    return true;
+  std::string s(ttl);
+  if (s.empty() || s.size() > 10 ||
+      s.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  uint64_t secs = std::strtoull(s.c_str(), nullptr, 10);
+  if (secs > MAX_TTL_S)
+    return false;
+  ttl_ms = secs * 1000;
+  return true;
+}
+
+// the reply to a conditional write that did not happen
+crow::response write_failed(const kv::WriteResult &r) {
+  if (r.status == kv::WriteStatus::Failed)
+    return crow::response(500, "Write failed");
+  crow::response res(412, "Version mismatch");
+  if (r.version)
+    res.set_header("ETag", etag(r.version));
+  return res;
+}
+
+int main(int argc, char **argv) {
+  // Load configuration, another file can be given (e.g. for a replica)
   kv::Config config;
-  config = config.load("./config/db.conf"); // Adjust path as needed
+  config = config.load(argc > 1 ? argv[1] : "./config/db.conf");
   std::cout << "config has " << config.data_dir << '\n';
 
   // creating the config data dir if not existing
@@ -38,27 +150,97 @@ int main() {
   }
 
   crow::SimpleApp app;
+  kv::setTraceRate(config.trace_sample_rate);
 
-  // Map to hold StorageEngine instances for each model
-  std::unordered_map<std::string, std::unique_ptr<kv::StorageEngine>>
-      model_engines;
+  // registry holding the StorageEngine of each model, shared by all the crow
+  // worker threads
+  kv::ModelRegistry registry(config, config.max_open_models);
+  registry.prewarm(config.thread_pool_sz);
 
   // Function to get or create StorageEngine for a model
-  auto get_engine = [&config, &model_engines](
-                        const std::string &model) -> kv::StorageEngine * {
-    auto it = model_engines.find(model);
-    if (it != model_engines.end()) {
-      return it->second.get();
-    }
-    std::string model_dir = config.data_dir + "/" + model;
-    if (!fs::exists(model_dir)) {
-      return nullptr;
-    }
-    auto engine =
-        std::make_unique<kv::StorageEngine>(model_dir, config.segment_size);
-    auto *ptr = engine.get();
-    model_engines[model] = std::move(engine);
-    return ptr;
+  auto get_engine = [&registry](const std::string &model) {
+    return registry.acquire(model);
+  };
+
+  // subscribers of /changes, declared after the registry so it goes first
+  kv::ChangeStreams streams;
+
+  // a replica mirrors the leader's models and only serves reads, a leader
+  // (or a replica, for chaining them) ships its logs on replication_port
+  std::unique_ptr<kv::Replica> replica;
+  if (!config.replicate_from.empty())
+    replica = std::make_unique<kv::Replica>(registry, config);
+  std::unique_ptr<kv::ReplicationServer> repl_server;
+  if (config.replication_port) {
+    repl_server = std::make_unique<kv::ReplicationServer>(registry, config);
+    if (!repl_server->start(static_cast<uint16_t>(config.replication_port)))
+      repl_server.reset();
+  }
+  // reads of a replica too far behind the leader fail instead of going stale
+  auto stale = [&replica](const std::string &model) {
+    return replica && !replica->fresh(model);
+  };
+
+  // cluster mode: every node takes requests and coordinates them over the
+  // nodes owning the key, the routes below hand them over to it
+  std::unique_ptr<kv::Cluster> cluster;
+  if (!config.cluster_nodes.empty()) {
+    cluster = std::make_unique<kv::Cluster>(registry, config);
+    if (!cluster->start())
+      return 1;
+  }
+  // redis clients talk to the engines right away on resp_port, which would
+  // skip the ring of a cluster
+  std::unique_ptr<kv::RespServer> resp;
+  if (config.resp_port && cluster) {
+    std::cerr << "resp: the redis port would skip the cluster, resp_port is "
+                 "ignored\n";
+  } else if (config.resp_port) {
+    resp = std::make_unique<kv::RespServer>(registry, config,
+                                            replica != nullptr);
+    if (!resp->start(static_cast<uint16_t>(config.resp_port),
+                     config.resp_threads))
+      resp.reset();
+  }
+  // scans, bulk loads and snapshots run on threads of their own, a few of
+  // each kind at once, so they can not take all of crow's threads from the
+  // point requests. crow keeps req alive until res.end(). a kind that is
+  // busy and has a full queue is refused right away
+  kv::RequestScheduler scheduler(
+      {config.scan_concurrency, config.scan_queue_depth},
+      {config.bulk_concurrency, config.bulk_queue_depth});
+  auto schedule = [&scheduler](kv::RequestClass c, crow::response &res,
+                               std::function<crow::response()> handler) {
+    bool queued = scheduler.submit(c, [&res, handler = std::move(handler)] {
+      // the client may have given up while it waited
+      if (res.is_alive())
+        res = handler();
+      res.end();
+    });
+    if (queued)
+      return;
+    res.code = 429;
+    res.set_header("Retry-After", std::to_string(scheduler.retry_after(c)));
+    res.end("Too many requests of this kind, retry later");
+  };
+
+  // ?n=&r=&w= override the configured quorum of a request
+  auto quorum = [&config, &cluster](const crow::request &req, kv::Quorum &q) {
+    q = cluster->defaults();
+    auto param = [&req](const char *name, size_t &out) {
+      if (const char *v = req.url_params.get(name))
+        out = std::strtoull(v, nullptr, 10);
+    };
+    param("n", q.n);
+    param("r", q.r);
+    param("w", q.w);
+    return q.r >= 1 && q.w >= 1 && q.r <= q.n && q.w <= q.n &&
+           q.n <= config.cluster_nodes.size();
+  };
+  // X-Context: the version a write is based on, as returned by a read
+  auto context = [](const crow::request &req, kv::VersionVector &clock) {
+    std::string hex = req.get_header_value("X-Context");
+    return hex.empty() || kv::VersionVector::from_context(hex, clock);
   };
 
   // GET / - List all models
@@ -76,10 +258,18 @@ int main() {
 
   // POST /{model} - Create model and add data if provided
   CROW_ROUTE(app, "/<string>")
-      .methods("POST"_method)([&config, &model_engines, &get_engine](
-                                  const crow::request &req, std::string model) {
+      .methods("POST"_method)([&config, &get_engine, &replica, &cluster,
+                               &quorum, &context](const crow::request &req,
+                                                  std::string model) {
+        if (replica)
+          return crow::response(403, "Read only replica");
+        kv::Quorum q;
+        kv::VersionVector clock;
+        if (cluster && !quorum(req, q))
+          return crow::response(400, "Invalid quorum");
+        if (cluster && !context(req, clock))
+          return crow::response(400, "Invalid X-Context");
         std::string model_dir = config.data_dir + "/" + model;
-        std::cout << model_dir << "-> this is the model dir" << '\n';
         if (!fs::exists(model_dir)) {
           fs::create_directory(model_dir);
         }
@@ -87,112 +277,627 @@ int main() {
         if (!engine) {
           return crow::response(500, "Failed to create engine");
         }
+        // ?ttl=N makes the written keys expire after N seconds
+        uint64_t ttl_ms;
+        if (!ttl_param(req, ttl_ms))
+          return crow::response(400, "Invalid ttl");
+        nlohmann::json json;
         if (!req.body.empty()) {
           try {
-            auto json = nlohmann::json::parse(req.body);
-            for (const auto &[key, value] : json.items()) {
-              engine->put(key, value.dump());
-            }
+            json = nlohmann::json::parse(req.body);
           } catch (const std::exception &e) {
             return crow::response(400, "Invalid JSON");
           }
         }
+        if (cluster) {
+          cluster->create(model);
+          for (const auto &[key, value] : json.items()) {
+            if (!cluster->put(model, key, value.dump(), true, ttl_ms,
+                              &clock, q))
+              return crow::response(503, "Write quorum not reached");
+          }
+          return crow::response(200, "OK");
+        }
+        for (const auto &[key, value] : json.items()) {
+          // dump() output is valid json, flag it so reads skip parsing
+          engine->put(key, value.dump(), true, ttl_ms);
+        }
         return crow::response(200, "OK");
       });
 
-  // GET /{model} - Get all data in the model, or filtered by search
+  // GET /{model} - Get all data in the model, or filtered by search.
+  // ?from=A&to=B&limit=N gives the keys A <= key < B in key order instead,
+  // at most N of them (before the search filter). ?fields=a,b.c keeps only
+  // those members of the object values
   CROW_ROUTE(app, "/<string>")
-      .methods("GET"_method)(
-          [&get_engine](const crow::request &req, std::string model) {
-            auto engine = get_engine(model);
-            if (!engine) {
-              return crow::response(404, "Model not found");
+      .methods("GET"_method)([&get_engine, &stale, &cluster,
+                              &schedule](const crow::request &req,
+                                         crow::response &res,
+                                         std::string model) {
+        auto scan = [&get_engine, &stale, &cluster, &req, model] {
+          kv::TraceRequest trace("GET /{model}");
+          auto engine = get_engine(model);
+          if (!engine) {
+            return crow::response(404, "Model not found");
+          }
+          if (stale(model))
+            return crow::response(503, "Replica is behind the leader");
+          auto search_term = req.url_params.get("search");
+          std::string lower_search = search_term ? to_lower(search_term) : "";
+          const char *from = req.url_params.get("from");
+          const char *to = req.url_params.get("to");
+          const char *limit = req.url_params.get("limit");
+          size_t max_keys = 0;
+          if (limit) {
+            try {
+              max_keys = std::stoull(limit);
+            } catch (const std::exception &e) {
+              return crow::response(400, "Invalid limit");
             }
-            auto all_data = engine->get_all();
-            nlohmann::json result = nlohmann::json::object();
-            auto search_term = req.url_params.get("search");
+          }
+          kv::FieldPaths fields;
+          const char *field_spec = req.url_params.get("fields");
+          if (field_spec && !kv::parseFields(field_spec, fields))
+            return crow::response(400, "Invalid fields");
+
+          // records go straight from the segment reads into the response
+          // body, json values are copied without parsing them again
+          crow::response reply(200);
+          reply.set_header("Content-Type", "application/json");
+          kv::JsonStreamWriter out([&reply](std::string_view chunk) {
+            reply.body.append(chunk.data(), chunk.size());
+          });
+          std::string projected;
+          auto member = [&](std::string_view key, std::string_view value,
+                            uint8_t flags) {
             if (search_term) {
-              std::string lower_search = to_lower(search_term);
-              for (const auto &[key, value_str] : all_data) {
-                // searching in the key string
-                std::string lower_key = to_lower(key);
-                if (lower_key.find(lower_search) != std::string::npos) {
-                  try {
-                    auto value_json = nlohmann::json::parse(value_str);
-                    result[key] = value_json;
-                  } catch (const std::exception &e) {
-                    result[key] = value_str;
-                  }
-                }
-                // searching in the val
-                std::string lower_val = to_lower(value_str);
-                if (lower_val.find(lower_search) != std::string::npos) {
-                  try {
-                    auto value_json = nlohmann::json::parse(value_str);
-                    result[key] = value_json;
-                  } catch (const std::exception &e) {
-                    result[key] = value_str;
-                  }
-                }
-              }
+              // searching in the key string and in the val
+              if (to_lower(std::string(key)).find(lower_search) ==
+                      std::string::npos &&
+                  to_lower(std::string(value)).find(lower_search) ==
+                      std::string::npos)
+                return;
+            }
+            // values that are no object go out whole
+            if (!fields.empty() && kv::projectFields(value, fields, projected))
+              return out.raw_member(key, projected);
+            // older records have no json flag, validate them without
+            // building a tree
+            if ((flags & kv::REC_JSON) || nlohmann::json::accept(value)) {
+              out.raw_member(key, value);
             } else {
-              for (const auto &[key, value_str] : all_data) {
-                try {
-                  auto value_json = nlohmann::json::parse(value_str);
-                  result[key] = value_json;
-                } catch (const std::exception &e) {
-                  result[key] = value_str;
-                }
-              }
+              out.string_member(key, value);
             }
-            return crow::response(result.dump());
-          });
+          };
+          out.begin_object();
+          kv::TraceSpan span("scan");
+          if (cluster) {
+            // the newest version of every key any node has
+            bool complete;
+            for (const auto &[key, v] : cluster->scan(model, complete))
+              member(key, v.value, v.flags);
+            if (!complete)
+              reply.set_header("X-Partial", "true");
+          } else if (from || to || limit) {
+            engine->scan_range(from ? from : "", to ? to : "", max_keys,
+                               [&member](const kv::RecordView &rec) {
+                                 member(rec.key, rec.val, rec.flags);
+                               });
+          } else {
+            engine->scan(member);
+          }
+          out.end_object();
+          return reply;
+        };
+        schedule(kv::RequestClass::Scan, res, scan);
+      });
 
-  // GET /{model}/{key} - Get specific key in the model
+  // GET /{model}/{key}[?fields=a,b.c] - Get specific key in the model, or
+  // only those members of it
   CROW_ROUTE(app, "/<string>/<string>")
-      .methods("GET"_method)([&get_engine](const crow::request &req,
-                                           std::string model, std::string key) {
+      .methods("GET"_method)([&get_engine, &stale, &cluster,
+                              &quorum](const crow::request &req,
+                                       std::string model, std::string key) {
+        kv::TraceRequest trace("GET /{model}/{key}");
+        kv::FieldPaths fields;
+        const char *field_spec = req.url_params.get("fields");
+        if (field_spec && !kv::parseFields(field_spec, fields))
+          return crow::response(400, "Invalid fields");
+        // the members asked for, the whole value without ?fields=
+        auto project = [&fields](std::string_view value, crow::response &res) {
+          kv::TraceSpan span("project");
+          if (!kv::projectFields(value, fields, res.body)) {
+            res.code = 400;
+            res.body = "Value is not a JSON object";
+            return;
+          }
+          res.set_header("Content-Type", "application/json");
+        };
+        if (cluster) {
+          kv::Quorum q;
+          if (!quorum(req, q))
+            return crow::response(400, "Invalid quorum");
+          kv::ClusterValue v;
+          kv::TraceSpan span("cluster get");
+          if (!cluster->get(model, key, q, v))
+            return crow::response(503, "Read quorum not reached");
+          span.end();
+          // the context to write back with, also for a missing key
+          crow::response res(v.found ? 200 : 404);
+          res.set_header("X-Context", v.clock.context());
+          if (!v.found) {
+            res.body = "Key not found";
+            return res;
+          }
+          if (!fields.empty()) {
+            project(v.value, res);
+            return res;
+          }
+          res.body = v.value;
+          if ((v.flags & kv::REC_JSON) || nlohmann::json::accept(res.body))
+            res.set_header("Content-Type", "application/json");
+          return res;
+        }
+        kv::TraceSpan open("acquire model");
         auto engine = get_engine(model);
+        open.end();
         if (!engine) {
           return crow::response(404, "Model not found");
         }
-        auto value_opt = engine->get(key);
-        if (value_opt) {
-          try {
-            auto value_json = nlohmann::json::parse(*value_opt);
-            return crow::response(value_json.dump());
-          } catch (const std::exception &e) {
-            return crow::response(*value_opt);
+        if (stale(model))
+          return crow::response(503, "Replica is behind the leader");
+        // a Range reads just that part, a value in the blob log is not
+        // loaded whole for it
+        std::string range = req.get_header_value("Range");
+        if (!range.empty()) {
+          kv::BlobHandle blob;
+          if (!engine->get_blob(key, blob))
+            return crow::response(404, "Key not found");
+          std::string size = std::to_string(blob.size());
+          uint64_t first, last;
+          if (!parse_range(range, blob.size(), first, last)) {
+            crow::response res(416);
+            res.set_header("Content-Range", "bytes */" + size);
+            return res;
           }
+          crow::response res(206);
+          if (!blob.read(first, last - first + 1, res.body))
+            return crow::response(500, "Read failed");
+          res.set_header("Content-Range", "bytes " + std::to_string(first) +
+                                              "-" + std::to_string(last) +
+                                              "/" + size);
+          return res;
+        }
+        // per thread read buffer, the value is copied once into the body
+        thread_local kv::Buffer buf;
+        kv::TraceSpan get("get_into");
+        bool found = engine->get_into(key, buf);
+        get.end();
+        if (found && !fields.empty()) {
+          crow::response res(200);
+          project(buf.value(), res);
+          if (res.code == 200)
+            res.set_header("ETag", etag(buf.version()));
+          return res;
+        }
+        if (found) {
+          crow::response res(std::string(buf.value()));
+          res.set_header("ETag", etag(buf.version()));
+          // records without the json flag are parsed to tell
+          kv::TraceSpan check("json check");
+          if ((buf.flags() & kv::REC_JSON) || nlohmann::json::accept(res.body))
+            res.set_header("Content-Type", "application/json");
+          return res;
         } else {
           return crow::response(404, "Key not found");
         }
       });
 
+  // POST /{model}/_bulk[?format=csv] - loads a JSONL (or CSV) body by
+  // building whole segments and attaching them
+  CROW_ROUTE(app, "/<string>/_bulk")
+      .methods("POST"_method)([&config, &get_engine, &replica, &cluster,
+                               &schedule](const crow::request &req,
+                                          crow::response &res,
+                                          std::string model) {
+        auto load = [&config, &get_engine, &replica, &cluster, &req, model] {
+          if (replica)
+            return crow::response(403, "Read only replica");
+          // the segments would skip the versions and the ring
+          if (cluster)
+            return crow::response(400, "Not in cluster mode");
+          if (!valid_name(model))
+            return crow::response(400, "Invalid model name");
+          std::string model_dir = config.data_dir + "/" + model;
+          fs::create_directories(model_dir);
+          auto engine = get_engine(model);
+          if (!engine)
+            return crow::response(500, "Failed to create engine");
+          if (std::string(engine->name()) != "hash")
+            return crow::response(400, "Bulk loads need a hash engine model");
+
+          kv::BulkOptions opts;
+          const char *format = req.url_params.get("format");
+          if (format && std::string(format) == "csv")
+            opts.format = kv::BulkFormat::Csv;
+          opts.segment_size = config.segment_size;
+          std::istringstream in(req.body);
+
+          kv::BulkLoader loader(model_dir + "/.bulk-" +
+                                    std::to_string(utils::nowMs()),
+                                opts);
+          kv::BulkStats stats;
+          if (!loader.build(in, stats) || !engine->attach(loader.segments()))
+            return crow::response(500, "Bulk load failed");
+          nlohmann::json j = {{"lines", stats.lines},
+                              {"bad_lines", stats.bad_lines},
+                              {"keys", stats.records},
+                              {"segments", stats.segments},
+                              {"bytes", stats.bytes}};
+          crow::response reply(j.dump());
+          reply.set_header("Content-Type", "application/json");
+          return reply;
+        };
+        schedule(kv::RequestClass::Bulk, res, load);
+      });
+
+  // POST /{model}/_batch - writes all of a JSON array of
+  // {"key", "value" | "delete": true, "ttl", "if_version"} or none of them.
+  // values are stored as JSON, if_version is a version the key has to be at
+  // (0: missing). 200 with the new versions in order, 409 with the keys whose
+  // version did not match and the version they are at
+  CROW_ROUTE(app, "/<string>/_batch")
+      .methods("POST"_method)([&config, &get_engine, &replica,
+                               &cluster](const crow::request &req,
+                                         std::string model) {
+        if (replica)
+          return crow::response(403, "Read only replica");
+        // one node's log can not hold a write to all the owners of the keys
+        if (cluster)
+          return crow::response(400, "Not in cluster mode");
+        nlohmann::json body = nlohmann::json::parse(req.body, nullptr, false);
+        if (!body.is_array() || body.empty())
+          return crow::response(400, "Expected a JSON array of writes");
+        std::vector<kv::BatchOp> ops;
+        for (const auto &w : body) {
+          kv::BatchOp op;
+          if (!w.is_object() || !w.contains("key") || !w["key"].is_string())
+            return crow::response(400, "Every write needs a key");
+          op.key = w["key"].get<std::string>();
+          bool erase = w.value("delete", false);
+          if (erase == w.contains("value"))
+            return crow::response(400, "Every write needs a value or delete");
+          if (!erase) {
+            op.val = w["value"].dump();
+            op.is_json = true;
+          }
+          if (w.contains("ttl")) {
+            if (!w["ttl"].is_number_unsigned() ||
+                w["ttl"].get<uint64_t>() > MAX_TTL_S)
+              return crow::response(400, "Invalid ttl");
+            op.ttl_ms = w["ttl"].get<uint64_t>() * 1000;
+          }
+          if (w.contains("if_version")) {
+            if (!w["if_version"].is_number_unsigned())
+              return crow::response(400, "Invalid if_version");
+            op.if_version = w["if_version"].get<uint64_t>();
+          }
+          ops.push_back(std::move(op));
+        }
+        fs::create_directories(config.data_dir + "/" + model);
+        auto engine = get_engine(model);
+        if (!engine)
+          return crow::response(500, "Failed to create engine");
+        nlohmann::json reply;
+        switch (engine->write_batch(ops)) {
+        case kv::WriteStatus::Failed:
+          return crow::response(500, "Write failed");
+        case kv::WriteStatus::Conflict: {
+          reply["conflicts"] = nlohmann::json::array();
+          for (const auto &op : ops) {
+            if (op.if_version && op.version != *op.if_version)
+              reply["conflicts"].push_back(
+                  {{"key", op.key}, {"version", op.version}});
+          }
+          crow::response res(409, reply.dump());
+          res.set_header("Content-Type", "application/json");
+          return res;
+        }
+        case kv::WriteStatus::Ok:
+          break;
+        }
+        reply["versions"] = nlohmann::json::array();
+        for (const auto &op : ops)
+          reply["versions"].push_back(op.version);
+        crow::response res(reply.dump());
+        res.set_header("Content-Type", "application/json");
+        return res;
+      });
+
+  // POST /{model}/_snapshot[?name=N] - hard links the model's files as they
+  // are now into snapshot_dir/{model}/N, the writes go on meanwhile
+  CROW_ROUTE(app, "/<string>/_snapshot")
+      .methods("POST"_method)([&config, &get_engine,
+                               &schedule](const crow::request &req,
+                                          crow::response &res,
+                                          std::string model) {
+        auto take = [&config, &get_engine, &req, model] {
+          auto engine = get_engine(model);
+          if (!engine)
+            return crow::response(404, "Model not found");
+          const char *name = req.url_params.get("name");
+          std::string snapshot = name ? name : std::to_string(utils::nowMs());
+          if (!valid_name(snapshot))
+            return crow::response(400, "Invalid snapshot name");
+          std::string path = config.snapshot_dir + "/" + model + "/" + snapshot;
+          if (fs::exists(path))
+            return crow::response(409, "Snapshot exists");
+          if (!engine->snapshot(path))
+            return crow::response(500, "Snapshot failed");
+          nlohmann::json j = {
+              {"model", model}, {"snapshot", snapshot}, {"path", path}};
+          crow::response reply(j.dump());
+          reply.set_header("Content-Type", "application/json");
+          return reply;
+        };
+        schedule(kv::RequestClass::Bulk, res, take);
+      });
+
+  // POST /{model}/_restore?snapshot=N[&to=M] - opens snapshot N of the model
+  // as model M, the model itself by default (delete it first)
+  CROW_ROUTE(app, "/<string>/_restore")
+      .methods("POST"_method)([&config, &replica,
+                               &schedule](const crow::request &req,
+                                          crow::response &res,
+                                          std::string model) {
+        auto restore = [&config, &replica, &req, model] {
+          if (replica)
+            return crow::response(403, "Read only replica");
+          const char *snapshot = req.url_params.get("snapshot");
+          const char *to = req.url_params.get("to");
+          std::string target = to ? to : model;
+          if (!snapshot || !valid_name(snapshot) || !valid_name(target))
+            return crow::response(400, "Invalid snapshot or model name");
+          std::string path = config.snapshot_dir + "/" + model + "/" + snapshot;
+          if (!fs::is_directory(path))
+            return crow::response(404, "Snapshot not found");
+          std::string target_dir = config.data_dir + "/" + target;
+          if (fs::exists(target_dir))
+            return crow::response(409, "Model exists, delete it first");
+          // links, no copies: the restored model starts new segments instead
+          // of appending to the shared files
+          if (!kv::restoreSnapshot(path, target_dir))
+            return crow::response(500, "Restore failed");
+          return crow::response(200, "Model restored");
+        };
+        schedule(kv::RequestClass::Bulk, res, restore);
+      });
+
   // DELETE /{model} - Delete the entire model
   CROW_ROUTE(app, "/<string>")
       .methods("DELETE"_method)(
-          [&config, &model_engines](const crow::request &req,
-                                    std::string model) {
-            std::string model_dir = config.data_dir + "/" + model;
-            if (fs::exists(model_dir)) {
-              model_engines.erase(model);
-              fs::remove_all(model_dir);
+          [&registry, &replica, &cluster](const crow::request &req,
+                                          std::string model) {
+            if (replica)
+              return crow::response(403, "Read only replica");
+            if (cluster) {
+              cluster->drop(model); // this node is one of them
               return crow::response(200, "Model deleted");
-            } else {
-              return crow::response(404, "Model not found");
             }
+            // the files go once the handlers still using the engine are done
+            if (registry.remove(model))
+              return crow::response(200, "Model deleted");
+            return crow::response(404, "Model not found");
           });
 
-  // DELETE /{model}/{key} - Delete specific key in the model
+  // PUT /{model}/{key}[?ttl=N] - stores the raw body as the value of key, a
+  // big one is streamed into the blob log a piece at a time. the reply has
+  // the new version as its ETag, If-Match: "N" (or If-None-Match: *) writes
+  // only if the key is still at version N (missing) and replies 412 if not
+  CROW_ROUTE(app, "/<string>/<string>")
+      .methods("PUT"_method)([&config, &get_engine, &replica, &cluster,
+                              &quorum, &context](const crow::request &req,
+                                                 std::string model,
+                                                 std::string key) {
+        if (replica)
+          return crow::response(403, "Read only replica");
+        if (req.body.empty())
+          return crow::response(400, "Empty value");
+        uint64_t ttl_ms;
+        if (!ttl_param(req, ttl_ms))
+          return crow::response(400, "Invalid ttl");
+        bool is_json =
+            req.get_header_value("Content-Type") == "application/json" &&
+            nlohmann::json::accept(req.body);
+        std::optional<uint64_t> cond;
+        if (!if_version(req, cond))
+          return crow::response(400, "Invalid If-Match");
+        if (cluster) {
+          // the nodes have versions of their own, X-Context does this there
+          if (cond)
+            return crow::response(400, "Use X-Context in cluster mode");
+          kv::Quorum q;
+          kv::VersionVector clock;
+          if (!quorum(req, q))
+            return crow::response(400, "Invalid quorum");
+          if (!context(req, clock))
+            return crow::response(400, "Invalid X-Context");
+          cluster->create(model);
+          if (!cluster->put(model, key, req.body, is_json, ttl_ms, &clock, q))
+            return crow::response(503, "Write quorum not reached");
+          return crow::response(200, "OK");
+        }
+        fs::create_directories(config.data_dir + "/" + model);
+        auto engine = get_engine(model);
+        if (!engine)
+          return crow::response(500, "Failed to create engine");
+        // crow has read the whole body by now, a big one still goes in the
+        // way a streamed upload does: piece by piece, never copied whole.
+        // an engine without a blob log stores it inline
+        size_t big = config.blob_threshold;
+        auto blob = big && req.body.size() >= big
+                        ? engine->open_blob(req.body.size())
+                        : nullptr;
+        if (!blob && cond) {
+          auto r = engine->put_if(key, req.body, *cond, is_json, ttl_ms);
+          if (r.status != kv::WriteStatus::Ok)
+            return write_failed(r);
+          crow::response res(200, "OK");
+          res.set_header("ETag", etag(r.version));
+          return res;
+        }
+        if (!blob) {
+          uint64_t version = engine->put(key, req.body, is_json, ttl_ms);
+          if (!version)
+            return crow::response(500, "Write failed");
+          crow::response res(200, "OK");
+          res.set_header("ETag", etag(version));
+          return res;
+        }
+        constexpr size_t PIECE = 1 << 20;
+        std::string_view body(req.body);
+        for (size_t at = 0; at < body.size(); at += PIECE) {
+          if (!blob->write(body.substr(at, PIECE)))
+            break;
+        }
+        // the version is checked under the key's lock once the value is in
+        // the blob log, on a conflict the writer gives its space back
+        if (cond) {
+          auto r = engine->put_blob_if(key, *blob, *cond, is_json, ttl_ms);
+          if (r.status != kv::WriteStatus::Ok)
+            return write_failed(r);
+          crow::response res(200, "OK");
+          res.set_header("ETag", etag(r.version));
+          return res;
+        }
+        uint64_t version = engine->put_blob(key, *blob, is_json, ttl_ms);
+        if (!version)
+          return crow::response(500, "Write failed");
+        crow::response res(200, "OK");
+        res.set_header("ETag", etag(version));
+        return res;
+      });
+
+  // PATCH /{model}/{key}[?ttl=N] - applies the json merge patch (RFC 7396)
+  // in the body to the value of key under the key's write lock, a missing key
+  // starts out as nothing. the key keeps its TTL unless ttl sets a new one
   CROW_ROUTE(app, "/<string>/<string>")
-      .methods("DELETE"_method)([&get_engine](const crow::request &req,
-                                              std::string model,
-                                              std::string key) {
+      .methods("PATCH"_method)([&config, &get_engine, &replica, &cluster,
+                                &quorum](const crow::request &req,
+                                         std::string model, std::string key) {
+        if (replica)
+          return crow::response(403, "Read only replica");
+        if (!nlohmann::json::accept(req.body))
+          return crow::response(400, "Invalid JSON");
+        uint64_t ttl_ms;
+        if (!ttl_param(req, ttl_ms))
+          return crow::response(400, "Invalid ttl");
+        std::string merged;
+        if (cluster) {
+          // read and write back with the version read, a write in between
+          // becomes a concurrent one (see cluster.hpp)
+          kv::Quorum q;
+          if (!quorum(req, q))
+            return crow::response(400, "Invalid quorum");
+          kv::ClusterValue v;
+          if (!cluster->get(model, key, q, v))
+            return crow::response(503, "Read quorum not reached");
+          if (!kv::mergePatch(v.found ? v.value : "", req.body, merged))
+            return crow::response(409, "Value is not JSON");
+          cluster->create(model);
+          if (!cluster->put(model, key, merged, true, ttl_ms, &v.clock, q))
+            return crow::response(503, "Write quorum not reached");
+          return crow::response(200, "OK");
+        }
+        fs::create_directories(config.data_dir + "/" + model);
+        auto engine = get_engine(model);
+        if (!engine)
+          return crow::response(500, "Failed to create engine");
+        bool not_json = false;
+        auto status = engine->update(
+            key,
+            [&](std::optional<std::string_view> val,
+                uint8_t) -> std::optional<std::string> {
+              if (!kv::mergePatch(val ? *val : std::string_view(), req.body,
+                                  merged)) {
+                not_json = true;
+                return std::nullopt;
+              }
+              return std::move(merged);
+            },
+            true, ttl_ms);
+        if (not_json)
+          return crow::response(409, "Value is not JSON");
+        if (status != kv::WriteStatus::Ok)
+          return crow::response(500, "Write failed");
+        return crow::response(200, "OK");
+      });
+
+  // POST /{model}/{key}/_merge?op=add|append|union - applies the operand in
+  // the body to the value of key without reading it: an integer to add, or
+  // an array of elements to append or to add where missing. the operand does
+  // nothing to a value of another type (see foldOperands). the value ends up
+  // without a TTL
+  CROW_ROUTE(app, "/<string>/<string>/_merge")
+      .methods("POST"_method)([&config, &get_engine, &replica, &cluster](
+                                  const crow::request &req, std::string model,
+                                  std::string key) {
+        if (replica)
+          return crow::response(403, "Read only replica");
+        // the operands have no version vector to order them with
+        if (cluster)
+          return crow::response(400, "Not in cluster mode");
+        kv::MergeOp op;
+        const char *name = req.url_params.get("op");
+        if (!name || !kv::parseMergeOp(name, op))
+          return crow::response(400, "Expected op=add, append or union");
+        if (!kv::validOperand(op, req.body))
+          return crow::response(400, op == kv::MergeOp::Add
+                                         ? "Expected an integer"
+                                         : "Expected a JSON array");
+        fs::create_directories(config.data_dir + "/" + model);
+        auto engine = get_engine(model);
+        if (!engine)
+          return crow::response(500, "Failed to create engine");
+        if (!engine->merge(key, op, req.body))
+          return crow::response(500, "Write failed");
+        return crow::response(200, "OK");
+      });
+
+  // DELETE /{model}/{key} - Delete specific key in the model, with If-Match:
+  // "N" only if it is still at version N
+  CROW_ROUTE(app, "/<string>/<string>")
+      .methods("DELETE"_method)([&get_engine, &replica, &cluster, &quorum,
+                                 &context](const crow::request &req,
+                                           std::string model, std::string key) {
+        if (replica)
+          return crow::response(403, "Read only replica");
+        std::optional<uint64_t> cond;
+        if (!if_version(req, cond))
+          return crow::response(400, "Invalid If-Match");
+        if (cluster) {
+          if (cond)
+            return crow::response(400, "Use X-Context in cluster mode");
+          kv::Quorum q;
+          kv::VersionVector clock;
+          if (!quorum(req, q))
+            return crow::response(400, "Invalid quorum");
+          if (!context(req, clock))
+            return crow::response(400, "Invalid X-Context");
+          if (!cluster->erase(model, key, &clock, q))
+            return crow::response(503, "Write quorum not reached");
+          return crow::response(200, "Key deleted");
+        }
         auto engine = get_engine(model);
         if (!engine) {
           return crow::response(404, "Model not found");
         }
+        if (cond) {
+          auto r = engine->erase_if(key, *cond);
+          if (r.status != kv::WriteStatus::Ok)
+            return write_failed(r);
+          return crow::response(200, "Key deleted");
+        }
         if (engine->erase(key)) {
           return crow::response(200, "Key deleted");
         } else {
@@ -200,7 +905,197 @@ int main() {
         }
       });
 
+  // /changes?model=M[&key=K|&prefix=P][&since=N] - websocket pushing every
+  // write of the model as {"seq","op","key","value"}
+  struct StreamRequest {
+    std::string model;
+    kv::StreamFilter filter;
+    uint64_t since = 0;
+    uint64_t id = 0;
+  };
+  CROW_WEBSOCKET_ROUTE(app, "/changes")
+      .onaccept([&config](const crow::request &req, void **userdata) {
+        const char *model = req.url_params.get("model");
+        if (!model || !fs::is_directory(config.data_dir + "/" + model))
+          return false;
+        auto *sr = new StreamRequest{model, {}};
+        if (const char *key = req.url_params.get("key"))
+          sr->filter.key = key;
+        if (const char *prefix = req.url_params.get("prefix"))
+          sr->filter.prefix = prefix;
+        if (const char *since = req.url_params.get("since"))
+          sr->since = std::strtoull(since, nullptr, 10);
+        *userdata = sr;
+        return true;
+      })
+      .onopen([&get_engine, &streams](crow::websocket::connection &conn) {
+        auto *sr = static_cast<StreamRequest *>(conn.userdata());
+        if (!sr)
+          return conn.close("bad request");
+        kv::StreamSink sink{[&conn](const std::string &msg) {
+                              conn.send_text(msg); // queued, does not block
+                              return true;
+                            },
+                            [&conn](const std::string &reason) {
+                              conn.close(reason);
+                            }};
+        sr->id = streams.subscribe(get_engine(sr->model), sr->since,
+                                   sr->filter, std::move(sink));
+        if (!sr->id)
+          conn.close("change feed is off");
+      })
+      .onclose([&streams](crow::websocket::connection &conn,
+                          const std::string &reason) {
+        auto *sr = static_cast<StreamRequest *>(conn.userdata());
+        if (!sr)
+          return;
+        if (sr->id)
+          streams.unsubscribe(sr->id);
+        conn.userdata(nullptr);
+        delete sr;
+      });
+
+  // GET /replication - the replicas of a leader and the lag of a replica
+  CROW_ROUTE(app, "/replication")
+      .methods("GET"_method)([&config, &replica, &repl_server] {
+        nlohmann::json j;
+        j["role"] = replica ? "replica" : "leader";
+        if (repl_server) {
+          j["replicas"] = nlohmann::json::array();
+          for (const auto &r : repl_server->replicas())
+            j["replicas"].push_back({{"peer", r.peer},
+                                     {"model", r.model},
+                                     {"segment", r.pos.segment_id},
+                                     {"offset", r.pos.offset}});
+        }
+        if (replica) {
+          j["leader"] = config.replicate_from;
+          j["max_lag_ms"] = config.replica_max_lag_ms;
+          j["models"] = nlohmann::json::array();
+          for (const auto &s : replica->status()) {
+            nlohmann::json m = {{"model", s.model},
+                                {"connected", s.connected},
+                                {"resyncing", s.resyncing},
+                                {"segment", s.pos.segment_id},
+                                {"offset", s.pos.offset}};
+            // null until it caught up once
+            if (s.lag_ms == UINT64_MAX)
+              m["lag_ms"] = nullptr;
+            else
+              m["lag_ms"] = s.lag_ms;
+            j["models"].push_back(m);
+          }
+        }
+        crow::response res(j.dump());
+        res.set_header("Content-Type", "application/json");
+        return res;
+      });
+
+  // GET /_trace[?clear=1] - the sampled request spans as chrome trace json,
+  // POST /_trace?rate=R samples the share R (0 to 1) of the requests from now
+  CROW_ROUTE(app, "/_trace")
+      .methods("GET"_method)([](const crow::request &req) {
+        const char *clear = req.url_params.get("clear");
+        crow::response res(kv::dumpTrace(clear && std::string(clear) == "1"));
+        res.set_header("Content-Type", "application/json");
+        return res;
+      });
+  CROW_ROUTE(app, "/_trace")
+      .methods("POST"_method)([](const crow::request &req) {
+        const char *rate = req.url_params.get("rate");
+        if (!rate)
+          return crow::response(400, "Missing rate");
+        char *end;
+        double r = std::strtod(rate, &end);
+        if (*end || !(r >= 0 && r <= 1))
+          return crow::response(400, "Invalid rate");
+        kv::setTraceRate(r);
+        return crow::response(200, "OK");
+      });
+
+  // GET /_memory - the memory of the indexes, filters and memtables by model
+  CROW_ROUTE(app, "/_memory").methods("GET"_method)([&registry] {
+    kv::MemoryBudget &budget = registry.memory_budget();
+    kv::MemoryBudget::Report r = budget.report();
+    nlohmann::json j = {{"limit", budget.limitBytes()},
+                        {"used", r.used},
+                        {"evictions", r.evictions},
+                        {"evicted_bytes", r.evicted_bytes}};
+    j["models"] = nlohmann::json::object();
+    for (const auto &m : r.models) {
+      j["models"][m.model] = {
+          {"index", m.bytes[static_cast<size_t>(kv::MemoryKind::Index)]},
+          {"bloom", m.bytes[static_cast<size_t>(kv::MemoryKind::Bloom)]},
+          {"memtable",
+           m.bytes[static_cast<size_t>(kv::MemoryKind::Memtable)]},
+          {"share", m.share}};
+    }
+    crow::response res(j.dump());
+    res.set_header("Content-Type", "application/json");
+    return res;
+  });
+
+  // GET /_tuning[?model=M] - the tuned settings of the models, their
+  // workload since the start and the last changes with the reasons
+  CROW_ROUTE(app, "/_tuning")
+      .methods("GET"_method)([&registry](const crow::request &req) {
+        const char *only = req.url_params.get("model");
+        nlohmann::json j = nlohmann::json::object();
+        for (const auto &[model, r] : registry.auto_tuner().report(20)) {
+          if (only && model != only)
+            continue;
+          const kv::WorkloadSnapshot &w = r.workload;
+          nlohmann::json log = nlohmann::json::array();
+          for (const auto &line : r.log)
+            log.push_back(nlohmann::json::parse(line, nullptr, false));
+          j[model] = {
+              {"segment_size", r.tuning.segment_size},
+              {"bloom_bits_per_key", r.tuning.bloom_bits_per_key},
+              {"record_bytes", r.tuning.record_bytes},
+              {"compact_dead_ratio", r.tuning.compact_dead_ratio},
+              {"cache_share", r.share},
+              {"workload",
+               {{"reads", w.reads},
+                {"misses", w.misses},
+                {"writes", w.writes},
+                {"erases", w.erases},
+                {"merges", w.merges},
+                {"bloom_false_rate", w.bloomFalseRate()},
+                {"key_p50", kv::WorkloadSnapshot::quantile(w.key_sizes, 0.5)},
+                {"value_p50",
+                 kv::WorkloadSnapshot::quantile(w.value_sizes, 0.5)},
+                {"value_p99",
+                 kv::WorkloadSnapshot::quantile(w.value_sizes, 0.99)}}},
+              {"log", log}};
+        }
+        if (only && j.empty())
+          return crow::response(404, "Model not found");
+        crow::response res(j.dump());
+        res.set_header("Content-Type", "application/json");
+        return res;
+      });
+
+  // GET /cluster - the nodes as this one sees them
+  CROW_ROUTE(app, "/cluster").methods("GET"_method)([&config, &cluster] {
+    if (!cluster)
+      return crow::response(404, "Not in cluster mode");
+    kv::Quorum q = cluster->defaults();
+    nlohmann::json j = {{"n", q.n}, {"r", q.r}, {"w", q.w}};
+    j["self"] = config.cluster_self;
+    j["nodes"] = nlohmann::json::array();
+    for (const auto &s : cluster->status())
+      j["nodes"].push_back({{"addr", s.addr},
+                            {"self", s.self},
+                            {"up", s.up},
+                            {"hinted_bytes", s.hinted_bytes}});
+    crow::response res(j.dump());
+    res.set_header("Content-Type", "application/json");
+    return res;
+  });
+
   // Start the app
-  app.port(8008).multithreaded().run();
+  app.port(static_cast<uint16_t>(config.http_port))
+      .concurrency(static_cast<uint16_t>(config.thread_pool_sz))
+      .run();
   return 0;
 }
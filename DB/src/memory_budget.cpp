@@ -0,0 +1,147 @@
+#include "../include/kv/memory_budget.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace kv {
+
+void MemoryBudget::charge(std::string_view model, MemoryKind kind,
+                          size_t bytes) {
+  if (bytes == 0)
+    return;
+  bool over;
+  {
+    std::lock_guard lock(mu);
+    auto it = models.find(model);
+    if (it == models.end())
+      it = models.emplace(std::string(model),
+                          std::array<size_t, MEMORY_KINDS>{})
+               .first;
+    it->second[static_cast<size_t>(kind)] += bytes;
+    used += bytes;
+    over = limit && used > limit;
+  }
+  if (over)
+    shrink();
+}
+
+void MemoryBudget::release(std::string_view model, MemoryKind kind,
+                           size_t bytes) {
+  if (bytes == 0)
+    return;
+  std::lock_guard lock(mu);
+  subtract(model, kind, bytes);
+}
+
+// the caller holds mu
+void MemoryBudget::subtract(std::string_view model, MemoryKind kind,
+                            size_t bytes) {
+  auto it = models.find(model);
+  if (it == models.end())
+    return;
+  size_t &n = it->second[static_cast<size_t>(kind)];
+  bytes = std::min(bytes, n);
+  n -= bytes;
+  used -= bytes;
+  bool empty = std::all_of(it->second.begin(), it->second.end(),
+                           [](size_t b) { return b == 0; });
+  if (empty)
+    models.erase(it);
+}
+
+void MemoryBudget::track(Evictable *e, std::string_view model,
+                         MemoryKind kind) {
+  std::lock_guard lock(mu);
+  tracked[e] = {std::string(model), kind};
+}
+
+void MemoryBudget::untrack(Evictable *e) {
+  std::lock_guard lock(mu);
+  tracked.erase(e);
+}
+
+void MemoryBudget::settle() {
+  bool over;
+  {
+    std::lock_guard lock(mu);
+    over = limit && used > limit;
+  }
+  if (over)
+    shrink();
+}
+
+void MemoryBudget::setShare(std::string_view model, size_t bytes) {
+  std::lock_guard lock(mu);
+  auto it = shares.find(model);
+  if (bytes == 0 && it != shares.end())
+    shares.erase(it);
+  else if (bytes && it != shares.end())
+    it->second = bytes;
+  else if (bytes)
+    shares.emplace(std::string(model), bytes);
+}
+
+// evicts the coldest until used is under 90% of the limit, one thread at a
+// time: first of the models over their share, then of any. mu stays held so
+// nothing tracked goes away under it; an evict only try-locks its own state,
+// so it never waits for anyone holding that
+void MemoryBudget::shrink() {
+  if (shrinking.exchange(true))
+    return; // someone else is at it
+  std::lock_guard lock(mu);
+  size_t target = limit / 10 * 9;
+  std::vector<std::pair<uint64_t, Evictable *>> cold;
+  for (auto &[e, t] : tracked) {
+    if (uint64_t last = e->lastUsed())
+      cold.emplace_back(last, e);
+  }
+  std::sort(cold.begin(), cold.end());
+  auto within_share = [this](const std::string &model) {
+    auto share = shares.find(model);
+    if (share == shares.end())
+      return false;
+    auto it = models.find(model);
+    size_t held = 0;
+    if (it != models.end())
+      for (size_t b : it->second)
+        held += b;
+    return held <= share->second;
+  };
+  for (int pass = 0; pass < 2 && used > target; ++pass) {
+    for (auto &[last, e] : cold) {
+      if (used <= target)
+        break;
+      if (!e)
+        continue; // evicted in the first pass
+      const Tracked &t = tracked[e];
+      if (pass == 0 && within_share(t.model))
+        continue;
+      size_t freed = e->evict();
+      if (freed == 0)
+        continue;
+      subtract(t.model, t.kind, freed);
+      ++evictions;
+      evicted_bytes += freed;
+      e = nullptr;
+    }
+  }
+  shrinking = false;
+}
+
+MemoryBudget::Report MemoryBudget::report() {
+  std::lock_guard lock(mu);
+  Report r{used, evictions, evicted_bytes, {}};
+  for (auto &[model, bytes] : models) {
+    auto share = shares.find(model);
+    r.models.push_back(
+        {model, bytes, share == shares.end() ? 0 : share->second});
+  }
+  return r;
+}
+
+} // namespace kv
@@ -0,0 +1,225 @@
+#include "../include/kv/merge.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kv {
+
+using json = nlohmann::json;
+
+static constexpr size_t LINK_SIZE = 2 * sizeof(uint64_t);
+static constexpr size_t OPERAND_HEAD = 1 + sizeof(uint32_t);
+
+bool parseMergeOp(std::string_view name, MergeOp &op) {
+  if (name == "add")
+    op = MergeOp::Add;
+  else if (name == "append")
+    op = MergeOp::Append;
+  else if (name == "union")
+    op = MergeOp::Union;
+  else
+    return false;
+  return true;
+}
+
+const char *mergeOpName(MergeOp op) {
+  switch (op) {
+  case MergeOp::Add:
+    return "add";
+  case MergeOp::Append:
+    return "append";
+  case MergeOp::Union:
+    return "union";
+  }
+  return "?";
+}
+
+bool validOperand(MergeOp op, std::string_view operand) {
+  json j = json::parse(operand.begin(), operand.end(), nullptr, false);
+  return op == MergeOp::Add ? j.is_number_integer() : j.is_array();
+}
+
+void appendOperand(std::string &out, MergeOp op, std::string_view operand) {
+  uint32_t len = static_cast<uint32_t>(operand.size());
+  out += static_cast<char>(op);
+  out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+  out += operand;
+}
+
+// the next operand of list at pos, false at its end (or a damaged one)
+static bool nextOperand(std::string_view list, size_t &pos, MergeOp &op,
+                        std::string_view &operand) {
+  if (list.size() - pos < OPERAND_HEAD)
+    return false;
+  uint32_t len;
+  std::memcpy(&len, list.data() + pos + 1, sizeof(len));
+  if (list.size() - pos - OPERAND_HEAD < len)
+    return false;
+  op = static_cast<MergeOp>(list[pos]);
+  operand = list.substr(pos + OPERAND_HEAD, len);
+  pos += OPERAND_HEAD + len;
+  return true;
+}
+
+void encodeMergeValue(std::string &out, MergeLink prev, MergeOp op,
+                      std::string_view operand) {
+  out.clear();
+  out.append(reinterpret_cast<const char *>(&prev.segment_id),
+             sizeof(prev.segment_id));
+  out.append(reinterpret_cast<const char *>(&prev.entry), sizeof(prev.entry));
+  appendOperand(out, op, operand);
+}
+
+void encodeMergeValue(std::string &out, MergeLink prev,
+                      std::string_view operands) {
+  out.clear();
+  out.append(reinterpret_cast<const char *>(&prev.segment_id),
+             sizeof(prev.segment_id));
+  out.append(reinterpret_cast<const char *>(&prev.entry), sizeof(prev.entry));
+  out += operands;
+}
+
+bool decodeMergeValue(std::string_view val, MergeLink &prev,
+                      std::string_view &operands) {
+  if (val.size() < LINK_SIZE)
+    return false;
+  std::memcpy(&prev.segment_id, val.data(), sizeof(prev.segment_id));
+  std::memcpy(&prev.entry, val.data() + sizeof(prev.segment_id),
+              sizeof(prev.entry));
+  operands = val.substr(LINK_SIZE);
+  return true;
+}
+
+// applies one operand to cur, null for a missing value. a value of another
+// type stays as it is, the operand does nothing to it
+static void applyOperand(json &cur, MergeOp op, std::string_view operand) {
+  json arg = json::parse(operand.begin(), operand.end(), nullptr, false);
+  switch (op) {
+  case MergeOp::Add: {
+    if (!cur.is_null() && !cur.is_number_integer())
+      break;
+    // wraps around like the two's complement it is
+    uint64_t sum = cur.is_null() ? 0 : cur.get<int64_t>();
+    sum += arg.is_number_integer() ? arg.get<int64_t>() : 0;
+    cur = static_cast<int64_t>(sum);
+    break;
+  }
+  case MergeOp::Append:
+    if (cur.is_null())
+      cur = json::array();
+    if (cur.is_array() && arg.is_array())
+      cur.insert(cur.end(), arg.begin(), arg.end());
+    break;
+  case MergeOp::Union:
+    if (cur.is_null())
+      cur = json::array();
+    if (!cur.is_array() || !arg.is_array())
+      break;
+    for (auto &e : arg) {
+      if (std::find(cur.begin(), cur.end(), e) == cur.end())
+        cur.push_back(std::move(e));
+    }
+    break;
+  }
+}
+
+void combineOperands(const std::vector<std::string_view> &lists,
+                     std::string &out) {
+  out.clear();
+  // the run of operands of one op being folded, written out when it ends
+  bool open = false;
+  MergeOp run_op = MergeOp::Add;
+  json run;
+  auto flush = [&] {
+    if (open)
+      appendOperand(out, run_op, run.dump());
+    open = false;
+  };
+  for (std::string_view list : lists) {
+    size_t pos = 0;
+    MergeOp op;
+    std::string_view operand;
+    while (nextOperand(list, pos, op, operand)) {
+      if (open && op != run_op)
+        flush();
+      if (!open) {
+        open = true;
+        run_op = op;
+        run = op == MergeOp::Add ? json(0) : json::array();
+      }
+      applyOperand(run, op, operand);
+    }
+  }
+  flush();
+}
+
+bool foldOperands(std::optional<std::string_view> base,
+                  const std::vector<std::string_view> &lists,
+                  std::string &out) {
+  json cur;
+  if (base) {
+    cur = json::parse(base->begin(), base->end(), nullptr, false);
+    if (cur.is_discarded()) {
+      out = *base;
+      return false;
+    }
+  }
+  for (std::string_view list : lists) {
+    size_t pos = 0;
+    MergeOp op;
+    std::string_view operand;
+    while (nextOperand(list, pos, op, operand))
+      applyOperand(cur, op, operand);
+  }
+  out = cur.dump();
+  return true;
+}
+
+std::string describeOperands(std::string_view operands) {
+  json all = json::array();
+  size_t pos = 0;
+  MergeOp op;
+  std::string_view operand;
+  while (nextOperand(operands, pos, op, operand)) {
+    json arg = json::parse(operand.begin(), operand.end(), nullptr, false);
+    all.push_back(json{{mergeOpName(op), std::move(arg)}});
+  }
+  return all.size() == 1 ? all[0].dump() : all.dump();
+}
+
+void foldRecords(const std::vector<RecordView> &versions, bool complete,
+                 uint64_t now, std::string &out) {
+  std::vector<std::string_view> lists;
+  size_t n = 0;
+  for (; n < versions.size() && (versions[n].flags & REC_MERGE); ++n) {
+    MergeLink link;
+    std::string_view operands;
+    if (decodeMergeValue(versions[n].val, link, operands))
+      lists.push_back(operands);
+  }
+  std::reverse(lists.begin(), lists.end());
+  const RecordView &newest = versions.front();
+  std::string val;
+  if (n == versions.size() && !complete) {
+    combineOperands(lists, val);
+    std::string operands = std::move(val);
+    encodeMergeValue(val, {}, operands);
+    encodeRecord(out, newest.key, val, REC_MERGE, 0, {}, newest.version);
+    return;
+  }
+  std::optional<std::string_view> base;
+  if (n < versions.size() && (versions[n].flags & REC_ALIVE) &&
+      !versions[n].expired(now))
+    base = versions[n].val;
+  // a merge leaves the key without a TTL
+  uint8_t flags = foldOperands(base, lists, val) ? REC_JSON : 0;
+  encodeRecord(out, newest.key, val, flags, 0, {}, newest.version);
+}
+
+} // namespace kv
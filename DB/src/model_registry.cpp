@@ -0,0 +1,242 @@
+#include "../include/kv/model_registry.hpp"
+#include "../include/kv/thread_pool.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace kv {
+
+ModelRegistry::ModelRegistry(const Config &config, size_t capacity)
+    : config(config), capacity(capacity == 0 ? 1 : capacity),
+      io(IoEngine::create(config.io_engine,
+                          static_cast<unsigned>(config.io_queue_depth))),
+      background(1), memory(config.memory_budget), tuner(config, memory) {}
+
+// the models removed while somebody still held them go on the way out
+ModelRegistry::~ModelRegistry() { reap(); }
+
+std::string ModelRegistry::model_dir(const std::string &model) const {
+  return config.data_dir + "/" + model;
+}
+
+// get (or lazily open) the engine of a model, nullptr if the model is unknown
+EngineHandle ModelRegistry::acquire(const std::string &model) {
+  reap();
+  std::shared_ptr<Slot> slot;
+  {
+    std::lock_guard lock(mu);
+    auto it = slots.find(model);
+    if (it != slots.end())
+      slot = it->second;
+  }
+
+  if (!slot) {
+    // checking the disk outside of the lock
+    std::error_code ec;
+    if (!fs::is_directory(model_dir(model), ec))
+      return nullptr;
+    std::lock_guard lock(mu);
+    auto &s = slots[model];
+    if (!s)
+      s = std::make_shared<Slot>();
+    slot = s;
+  }
+
+  // only the callers of this very model wait on the open
+  EngineHandle handle;
+  {
+    std::lock_guard open_lock(slot->open_mu);
+    if (slot->deleting)
+      return nullptr; // its files are about to go
+    if (!slot->engine) {
+      StorageOptions opts;
+      opts.segment_size = config.segment_size;
+      opts.checkpoint_interval = config.checkpoint_interval;
+      opts.compact_dead_ratio = config.compact_dead_ratio;
+      opts.change_feed_size = config.change_feed_size;
+      opts.blob_threshold = config.blob_threshold;
+      opts.preallocate = config.preallocate_segments;
+      opts.direct_io = config.direct_io;
+      opts.io = io;
+      opts.background = &background;
+      opts.memory = &memory;
+      tuner.prepare(model, opts);
+      slot->engine = StorageEngine::open(config.engine_of(model),
+                                         model_dir(model), opts);
+    }
+    handle = slot->engine;
+  }
+
+  std::list<std::shared_ptr<Slot>> victims;
+  touch(model, slot, victims);
+  close_idle(victims);
+  // once per interval a request pays for the tuning round, it is mostly
+  // arithmetic and only writes the files of the models whose settings change
+  if (tuner.due())
+    tuner.round(open_models());
+  return handle;
+}
+
+// mark the model as recently used and pick the idle engines over capacity
+void ModelRegistry::touch(const std::string &model,
+                          const std::shared_ptr<Slot> &slot,
+                          std::list<std::shared_ptr<Slot>> &victims) {
+  std::lock_guard lock(mu);
+  auto it = slots.find(model);
+  if (it == slots.end() || it->second != slot || slot->deleting)
+    return; // removed while we were opening it
+
+  if (slot->in_lru) {
+    lru.splice(lru.begin(), lru, slot->lru_pos);
+  } else {
+    lru.push_front(model);
+    slot->lru_pos = lru.begin();
+    slot->in_lru = true;
+  }
+
+  // walk from the cold end, skipping engines somebody is still using
+  auto pos = lru.end();
+  while (lru.size() > capacity && pos != lru.begin()) {
+    --pos;
+    auto &cand = slots[*pos];
+    // the map is the only owner of the slot and of the engine -> idle
+    if (cand.use_count() != 1 || cand->engine.use_count() != 1)
+      continue;
+    cand->in_lru = false;
+    victims.push_back(cand);
+    pos = lru.erase(pos);
+  }
+}
+
+// closes the picked engines, outside of the registry lock
+void ModelRegistry::close_idle(std::list<std::shared_ptr<Slot>> &victims) {
+  for (auto &slot : victims) {
+    std::lock_guard open_lock(slot->open_mu);
+    // somebody may have grabbed it in between, then it stays open and gets
+    // back in the lru on their touch
+    bool back_in_use;
+    {
+      std::lock_guard lock(mu); // lock order is always open_mu -> mu
+      back_in_use = slot->in_lru;
+    }
+    if (slot->engine && slot->engine.use_count() == 1 && !back_in_use)
+      slot->engine.reset(); // flushes the index and bloom filters
+  }
+}
+
+// deletes a model, false if there is none. handlers still holding it keep a
+// working engine and the files go once the last of them lets go (see reap),
+// until then the model can not be acquired
+bool ModelRegistry::remove(const std::string &model) {
+  std::shared_ptr<Slot> slot;
+  {
+    std::error_code ec;
+    bool on_disk = fs::is_directory(model_dir(model), ec);
+    std::lock_guard lock(mu);
+    auto it = slots.find(model);
+    if (it != slots.end())
+      slot = it->second;
+    else if (on_disk)
+      slot = slots[model] = std::make_shared<Slot>();
+    else
+      return false;
+  }
+
+  {
+    std::lock_guard open_lock(slot->open_mu);
+    std::lock_guard lock(mu);
+    auto it = slots.find(model);
+    if (slot->deleting || it == slots.end() || it->second != slot)
+      return false; // somebody else is removing it
+    slot->deleting = true;
+    if (slot->in_lru) {
+      lru.erase(slot->lru_pos);
+      slot->in_lru = false;
+    }
+    if (slot->engine)
+      slot->engine->retire();
+    removing.push_back(model);
+  }
+  tuner.forget(model);
+  reap(); // right away if nobody else holds it
+  return true;
+}
+
+// deletes the files of the removed models whose engines nobody holds any
+// more. the slot stays in the map until they are gone, so an acquire can not
+// open a second engine on them or on a directory recreated meanwhile
+void ModelRegistry::reap() {
+  std::vector<std::pair<std::string, std::shared_ptr<Slot>>> doomed;
+  {
+    std::lock_guard lock(mu);
+    for (const auto &name : removing)
+      doomed.emplace_back(name, slots[name]);
+  }
+  for (auto &[model, slot] : doomed) {
+    {
+      std::lock_guard open_lock(slot->open_mu);
+      if (slot->reaped || (slot->engine && slot->engine.use_count() != 1))
+        continue;
+      slot->engine.reset(); // flushes the index, then the files go
+      std::error_code ec;
+      fs::remove_all(model_dir(model), ec);
+      slot->reaped = true;
+    }
+    std::lock_guard lock(mu);
+    slots.erase(model);
+    removing.erase(std::find(removing.begin(), removing.end(), model));
+  }
+}
+
+// opens the models found on disk in parallel, up to the capacity
+void ModelRegistry::prewarm(size_t threads) {
+  std::vector<std::string> models;
+  std::error_code ec;
+  for (const auto &entry : fs::directory_iterator(config.data_dir, ec)) {
+    if (entry.is_directory())
+      models.push_back(entry.path().filename().string());
+    if (models.size() >= capacity)
+      break;
+  }
+
+  // the pool drains every queued job before its destructor returns
+  ThreadPool pool(threads == 0 ? 1 : threads);
+  std::vector<std::function<void()>> loads;
+  for (const auto &model : models) {
+    loads.push_back([this, model] { acquire(model); });
+  }
+  pool.enqueue_batch(std::move(loads), TaskPriority::Background);
+}
+
+// the engines open right now, kept open for as long as the list is around
+std::vector<OpenModel> ModelRegistry::open_models() {
+  std::vector<std::pair<std::string, std::shared_ptr<Slot>>> open;
+  {
+    std::lock_guard lock(mu);
+    for (const auto &name : lru)
+      open.emplace_back(name, slots[name]);
+  }
+  std::vector<OpenModel> out;
+  for (auto &[name, slot] : open) {
+    std::lock_guard open_lock(slot->open_mu);
+    if (slot->engine)
+      out.push_back({name, slot->engine});
+  }
+  return out;
+}
+
+size_t ModelRegistry::open_count() {
+  std::lock_guard lock(mu);
+  return lru.size();
+}
+
+} // namespace kv
@@ -0,0 +1,128 @@
+#include "../include/kv/net.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace kv {
+
+// frames bigger than this are garbage
+static constexpr uint32_t MAX_FRAME = 256u << 20;
+
+int connectTo(const std::string &host, const std::string &port,
+              int timeout_ms) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *res = nullptr;
+  if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+    return -1;
+  int fd = -1;
+  for (addrinfo *ai = res; ai; ai = ai->ai_next) {
+    fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                  ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    ::close(fd);
+    fd = -1;
+  }
+  ::freeaddrinfo(res);
+  if (fd < 0)
+    return -1;
+  // a peer that went quiet counts as gone
+  timeval tv{timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  int one = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+int listenOn(uint16_t port) {
+  int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  int one = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      ::listen(fd, 64) < 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool splitHostPort(const std::string &addr, std::string &host,
+                   std::string &port) {
+  size_t colon = addr.rfind(':');
+  if (colon == std::string::npos || colon == 0 || colon + 1 == addr.size())
+    return false;
+  host = addr.substr(0, colon);
+  port = addr.substr(colon + 1);
+  return true;
+}
+
+bool sendAll(int fd, const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = ::send(fd, p, n, MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    p += w;
+    n -= static_cast<size_t>(w);
+  }
+  return true;
+}
+
+bool recvAll(int fd, char *p, size_t n) {
+  while (n > 0) {
+    ssize_t r = ::recv(fd, p, n, 0);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false; // closed, broken or timed out
+    p += r;
+    n -= static_cast<size_t>(r);
+  }
+  return true;
+}
+
+bool sendFrame(int fd, char type, std::string_view head,
+               std::string_view body) {
+  std::string hdr(1, type);
+  putU32(hdr, static_cast<uint32_t>(head.size() + body.size()));
+  hdr += head;
+  return sendAll(fd, hdr.data(), hdr.size()) &&
+         sendAll(fd, body.data(), body.size());
+}
+
+bool recvFrame(int fd, char &type, std::string &payload) {
+  char hdr[5];
+  if (!recvAll(fd, hdr, sizeof(hdr)))
+    return false;
+  type = hdr[0];
+  uint32_t len;
+  std::memcpy(&len, hdr + 1, sizeof(len));
+  if (len > MAX_FRAME)
+    return false;
+  payload.resize(len);
+  return recvAll(fd, payload.data(), len);
+}
+
+} // namespace kv
@@ -0,0 +1,497 @@
+#include "../include/kv/replication.hpp"
+#include "../include/kv/hash_func.hpp"
+#include "../include/kv/net.hpp"
+#include "../include/kv/segment.hpp"
+#include "../include/kv/utils.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace kv {
+
+// bytes of records in one 'D' frame
+static constexpr size_t REPL_BATCH = 1 << 20;
+// how often the leader looks for new appends, and says so when there are none
+static constexpr uint64_t REPL_POLL_MS = 5;
+static constexpr uint64_t REPL_HEARTBEAT_MS = 200;
+// a replica that heard nothing for this long reconnects
+static constexpr int REPL_TIMEOUT_MS = 3000;
+static constexpr uint64_t REPL_RETRY_MS = 1000;
+// how often a replica asks for the models, and saves its positions
+static constexpr uint64_t REPL_LIST_MS = 2000;
+static constexpr uint64_t REPL_SAVE_MS = 1000;
+// [segment u64][offset u64][crc u32]
+static constexpr size_t POS_SIZE = 20;
+
+// ============================ WIRE ===========================================
+
+static void putPos(std::string &out, const LogPosition &pos) {
+  putU64(out, pos.segment_id);
+  putU64(out, pos.offset);
+  putU32(out, pos.crc);
+}
+
+static LogPosition getPos(const char *p) {
+  WireReader in(std::string_view(p, POS_SIZE));
+  LogPosition pos;
+  pos.segment_id = in.u64();
+  pos.offset = in.u64();
+  pos.crc = in.u32();
+  return pos;
+}
+
+// model names become directory names on both sides
+static bool validModel(const std::string &name) {
+  return !name.empty() && name != "." && name != ".." &&
+         name.find('/') == std::string::npos;
+}
+
+static void sleepMs(uint64_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// ============================ LEADER =========================================
+
+ReplicationServer::ReplicationServer(ModelRegistry &registry,
+                                     const Config &config)
+    : registry(registry), config(config) {}
+
+ReplicationServer::~ReplicationServer() {
+  stop = true;
+  if (listen_fd >= 0)
+    ::shutdown(listen_fd, SHUT_RDWR); // wakes up the accept
+  if (acceptor.joinable())
+    acceptor.join();
+  if (listen_fd >= 0)
+    ::close(listen_fd);
+  for (auto &c : conns)
+    ::shutdown(c.fd, SHUT_RDWR);
+  for (auto &c : conns) {
+    c.thread.join();
+    ::close(c.fd);
+  }
+}
+
+bool ReplicationServer::start(uint16_t port) {
+  listen_fd = listenOn(port);
+  if (listen_fd < 0) {
+    std::cerr << "replication: can not listen on port " << port << ": "
+              << std::strerror(errno) << '\n';
+    return false;
+  }
+  acceptor = std::thread([this] { accept_loop(); });
+  return true;
+}
+
+void ReplicationServer::accept_loop() {
+  while (!stop) {
+    sockaddr_in addr{};
+    socklen_t len = sizeof(addr);
+    int fd = ::accept4(listen_fd, reinterpret_cast<sockaddr *>(&addr), &len,
+                       SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (stop)
+        return;
+      if (errno != EINTR && errno != ECONNABORTED)
+        sleepMs(100); // out of fds or so, give it a moment
+      continue;
+    }
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    char ip[INET_ADDRSTRLEN] = "?";
+    ::inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+
+    std::lock_guard lock(mu);
+    // the connections that ended since the last one
+    for (auto it = conns.begin(); it != conns.end();) {
+      if (!it->done) {
+        ++it;
+        continue;
+      }
+      it->thread.join();
+      ::close(it->fd);
+      it = conns.erase(it);
+    }
+    Conn &c = conns.emplace_back();
+    c.fd = fd;
+    c.link.peer = std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port));
+    c.thread = std::thread([this, &c] {
+      serve(c);
+      c.done = true;
+    });
+  }
+}
+
+// a connection either lists the models (any number of times) or turns into
+// the stream of one model
+void ReplicationServer::serve(Conn &conn) {
+  char type;
+  std::string payload;
+  while (!stop && recvFrame(conn.fd, type, payload)) {
+    if (type == 'L') {
+      std::string names;
+      std::error_code ec;
+      for (const auto &entry : fs::directory_iterator(config.data_dir, ec)) {
+        if (entry.is_directory())
+          names += entry.path().filename().string() + "\n";
+      }
+      if (!sendFrame(conn.fd, 'M', names))
+        return;
+    } else if (type == 'T' && payload.size() > POS_SIZE) {
+      ship(conn, payload.substr(POS_SIZE), getPos(payload.data()));
+      return;
+    } else {
+      return;
+    }
+  }
+}
+
+// streams the appends of model from pos on until the replica goes away
+void ReplicationServer::ship(Conn &conn, const std::string &model,
+                             LogPosition pos) {
+  EngineHandle engine = validModel(model) ? registry.acquire(model) : nullptr;
+  if (!engine) {
+    sendFrame(conn.fd, 'G', {});
+    return;
+  }
+  {
+    std::lock_guard lock(mu);
+    conn.link.model = model;
+    conn.link.pos = pos;
+  }
+  std::string batch, head;
+  uint64_t last_sent = 0;
+  while (!stop) {
+    TailStatus st = engine->tail(pos, batch, REPL_BATCH);
+    if (st == TailStatus::Unsupported) {
+      // an lsm model has no log to ship, the replica goes without it
+      sendFrame(conn.fd, 'G', {});
+      return;
+    }
+    if (st == TailStatus::Lost) {
+      if (!sendFrame(conn.fd, 'R', {}))
+        return;
+      pos = {};
+      continue;
+    }
+    bool drained = st == TailStatus::Drained;
+    uint64_t now = utils::nowMs();
+    bool heartbeat = now - last_sent >= REPL_HEARTBEAT_MS;
+    if (!batch.empty() || heartbeat) {
+      head.assign(1, drained ? 1 : 0);
+      putPos(head, pos);
+      if (!sendFrame(conn.fd, 'D', head, batch))
+        return;
+      last_sent = now;
+      std::lock_guard lock(mu);
+      conn.link.pos = pos;
+    }
+    if (!drained)
+      continue;
+    // a deleted model keeps its engine open (and its files) as long as we
+    // hold it
+    if (engine->retired()) {
+      sendFrame(conn.fd, 'G', {});
+      return;
+    }
+    sleepMs(REPL_POLL_MS);
+  }
+}
+
+std::vector<ReplicaLink> ReplicationServer::replicas() {
+  std::vector<ReplicaLink> out;
+  std::lock_guard lock(mu);
+  for (auto &c : conns) {
+    if (!c.done && !c.link.model.empty())
+      out.push_back(c.link);
+  }
+  return out;
+}
+
+// ============================ REPLICA ========================================
+
+Replica::Replica(ModelRegistry &registry, const Config &config)
+    : registry(registry), config(config) {
+  if (!splitHostPort(config.replicate_from, host, port)) {
+    host = config.replicate_from;
+    port = "9008";
+  }
+  manager = std::thread([this] { manage(); });
+}
+
+Replica::~Replica() {
+  stop = true;
+  manager.join();
+  for (auto &[name, m] : models) {
+    std::lock_guard lock(m->mu);
+    if (m->fd >= 0)
+      ::shutdown(m->fd, SHUT_RDWR);
+  }
+  for (auto &[name, m] : models)
+    m->thread.join();
+}
+
+// a connection to the leader, -1 if it is not reachable
+int Replica::connect_leader() {
+  return connectTo(host, port, REPL_TIMEOUT_MS);
+}
+
+// keeps the set of followed models in line with the leader's
+void Replica::manage() {
+  while (!stop) {
+    std::set<std::string> names;
+    bool listed = false;
+    int fd = connect_leader();
+    if (fd >= 0) {
+      char type;
+      std::string payload;
+      if (sendFrame(fd, 'L', {}) && recvFrame(fd, type, payload) &&
+          type == 'M') {
+        std::istringstream in(payload);
+        std::string name;
+        while (std::getline(in, name)) {
+          if (validModel(name))
+            names.insert(name);
+        }
+        listed = true;
+      }
+      ::close(fd);
+    }
+
+    if (listed) {
+      std::lock_guard lock(mu);
+      for (auto it = models.begin(); it != models.end();) {
+        if (!it->second->done) {
+          ++it;
+          continue;
+        }
+        it->second->thread.join();
+        it = models.erase(it);
+      }
+      for (const auto &name : names) {
+        if (models.count(name))
+          continue;
+        std::error_code ec;
+        fs::create_directories(config.data_dir + "/" + name, ec);
+        auto m = std::make_unique<Model>();
+        m->name = name;
+        Model *raw = m.get();
+        m->thread = std::thread([this, raw] {
+          follow(*raw);
+          raw->done = true;
+        });
+        models.emplace(name, std::move(m));
+      }
+      // the models deleted on the leader go here too, their files once the
+      // readers still holding the engine are done (see ModelRegistry::remove)
+      std::vector<std::string> gone;
+      std::error_code ec;
+      for (const auto &entry : fs::directory_iterator(config.data_dir, ec)) {
+        std::string name = entry.path().filename().string();
+        if (entry.is_directory() && !names.count(name) && !models.count(name))
+          gone.push_back(name);
+      }
+      for (const auto &name : gone)
+        registry.remove(name);
+    }
+
+    for (uint64_t slept = 0; slept < REPL_LIST_MS && !stop; slept += 100)
+      sleepMs(100);
+  }
+}
+
+// follows one model, reconnecting until the leader says it is gone
+void Replica::follow(Model &m) {
+  {
+    // where the last run got to
+    std::ifstream in(config.data_dir + "/" + m.name + "/replica.pos",
+                     std::ios::binary);
+    char buf[POS_SIZE];
+    std::lock_guard lock(m.mu);
+    if (in.read(buf, sizeof(buf)))
+      m.pos = getPos(buf);
+  }
+  while (!stop) {
+    int fd = connect_leader();
+    if (fd >= 0) {
+      {
+        std::lock_guard lock(m.mu);
+        m.fd = fd;
+      }
+      bool gone = stream(m, fd);
+      {
+        std::lock_guard lock(m.mu);
+        m.fd = -1;
+        m.connected = false;
+        ::close(fd);
+      }
+      if (gone)
+        return;
+    }
+    for (uint64_t slept = 0; slept < REPL_RETRY_MS && !stop; slept += 100)
+      sleepMs(100);
+  }
+}
+
+// applies the frames of one connection, true if the model is gone
+bool Replica::stream(Model &m, int fd) {
+  LogPosition pos;
+  {
+    std::lock_guard lock(m.mu);
+    pos = m.pos;
+  }
+  std::string request;
+  putPos(request, pos);
+  request += m.name;
+  if (!sendFrame(fd, 'T', request))
+    return false;
+  EngineHandle engine = registry.acquire(m.name);
+  if (!engine)
+    return false;
+
+  // a copy made from the start of the log may hold keys the leader dropped
+  // in the meantime, they are swept once it caught up. until then the
+  // position is not saved, a restart starts over
+  bool resync = pos.segment_id == 0;
+  std::unordered_set<uint64_t> seen;
+  uint64_t last_save = utils::nowMs();
+  {
+    std::lock_guard lock(m.mu);
+    m.connected = true;
+    m.resyncing = resync;
+  }
+  char type;
+  std::string payload;
+  while (!stop && recvFrame(fd, type, payload)) {
+    if (type == 'G')
+      return true;
+    if (type == 'R') {
+      pos = {};
+      resync = true;
+      seen.clear();
+      save_pos(m.name, pos);
+      std::lock_guard lock(m.mu);
+      m.pos = pos;
+      m.resyncing = true;
+      continue;
+    }
+    if (type != 'D' || payload.size() < 1 + POS_SIZE)
+      return false;
+    bool caught_up = payload[0] != 0;
+    LogPosition next = getPos(payload.data() + 1);
+    std::string_view records(payload.data() + 1 + POS_SIZE,
+                             payload.size() - 1 - POS_SIZE);
+    if (resync) {
+      for (size_t at = 0; at < records.size();) {
+        RecordView view;
+        if (decodeRecord(records.data() + at, records.size() - at, view,
+                         false) != DecodeStatus::Ok)
+          break;
+        seen.insert(fnv1a(view.key));
+        at += view.size();
+      }
+    }
+    if (!engine->apply(records))
+      return false; // goes on from the last position after a reconnect
+    pos = next;
+    if (resync && caught_up) {
+      finish_resync(engine, seen);
+      resync = false;
+      seen.clear();
+    }
+
+    uint64_t now = utils::nowMs();
+    {
+      std::lock_guard lock(m.mu);
+      m.pos = pos;
+      m.resyncing = resync;
+      if (caught_up && !resync)
+        m.caught_up_at = now;
+    }
+    if (!resync && now - last_save >= REPL_SAVE_MS) {
+      save_pos(m.name, pos);
+      last_save = now;
+    }
+  }
+  if (!resync)
+    save_pos(m.name, pos);
+  return false;
+}
+
+// erases the local keys the leader's log did not have any more
+void Replica::finish_resync(const EngineHandle &engine,
+                            const std::unordered_set<uint64_t> &seen) {
+  std::vector<std::string> stale;
+  engine->scan([&](std::string_view key, std::string_view, uint8_t) {
+    if (!seen.count(fnv1a(key)))
+      stale.emplace_back(key);
+  });
+  for (const auto &key : stale)
+    engine->erase(key);
+}
+
+// the position is only a hint: replaying records that are applied already
+// ends in the same state, so it is not synced
+void Replica::save_pos(const std::string &model, const LogPosition &pos) {
+  std::string path = config.data_dir + "/" + model + "/replica.pos";
+  std::string data;
+  putPos(data, pos);
+  {
+    std::ofstream out(path + ".tmp", std::ios::binary | std::ios::trunc);
+    if (!out.write(data.data(), data.size()))
+      return;
+  }
+  std::error_code ec;
+  fs::rename(path + ".tmp", path, ec);
+}
+
+bool Replica::fresh(const std::string &model) {
+  if (config.replica_max_lag_ms == 0)
+    return true;
+  std::lock_guard lock(mu);
+  auto it = models.find(model);
+  if (it == models.end())
+    return false;
+  std::lock_guard model_lock(it->second->mu);
+  uint64_t at = it->second->caught_up_at;
+  return at && utils::nowMs() - at <= config.replica_max_lag_ms;
+}
+
+std::vector<ReplicaModelStatus> Replica::status() {
+  std::vector<ReplicaModelStatus> out;
+  uint64_t now = utils::nowMs();
+  std::lock_guard lock(mu);
+  for (auto &[name, m] : models) {
+    std::lock_guard model_lock(m->mu);
+    ReplicaModelStatus s;
+    s.model = name;
+    s.connected = m->connected;
+    s.resyncing = m->resyncing;
+    s.pos = m->pos;
+    s.lag_ms = m->caught_up_at ? now - m->caught_up_at : UINT64_MAX;
+    out.push_back(s);
+  }
+  return out;
+}
+
+} // namespace kv
@@ -0,0 +1,94 @@
+#include "../include/kv/request_scheduler.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <utility>
+
+namespace kv {
+
+RequestScheduler::RequestScheduler(ClassLimits scan, ClassLimits bulk)
+    // a class that may not run at all would queue forever
+    : pool(std::max<size_t>(scan.running, 1) +
+           std::max<size_t>(bulk.running, 1)) {
+  scan.running = std::max<size_t>(scan.running, 1);
+  bulk.running = std::max<size_t>(bulk.running, 1);
+  Class &s = classes[static_cast<size_t>(RequestClass::Scan)];
+  s.limits = scan;
+  s.prio = TaskPriority::Normal;
+  Class &b = classes[static_cast<size_t>(RequestClass::Bulk)];
+  b.limits = bulk;
+  b.prio = TaskPriority::Background;
+}
+
+bool RequestScheduler::submit(RequestClass c, std::function<void()> job) {
+  {
+    std::lock_guard lock(mu);
+    Class &cl = classes[static_cast<size_t>(c)];
+    if (cl.running >= cl.limits.running) {
+      if (cl.waiting.size() >= cl.limits.queued) {
+        ++cl.refused;
+        return false;
+      }
+      cl.waiting.push_back(std::move(job));
+      return true;
+    }
+    ++cl.running;
+  }
+  start(c, std::move(job));
+  return true;
+}
+
+// runs job, then hands its slot to the next one waiting in the class
+void RequestScheduler::start(RequestClass c, std::function<void()> job) {
+  Class &cl = classes[static_cast<size_t>(c)];
+  pool.enqueue(
+      [this, c, &cl, job = std::move(job)] {
+        auto begin = std::chrono::steady_clock::now();
+        try {
+          job();
+        } catch (const std::exception &e) {
+          std::cerr << "scheduled request failed: " << e.what() << '\n';
+        }
+        double ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - begin)
+                        .count();
+        std::function<void()> next;
+        {
+          std::lock_guard lock(mu);
+          ++cl.done;
+          cl.avg_ms = cl.done == 1 ? ms : 0.8 * cl.avg_ms + 0.2 * ms;
+          if (cl.waiting.empty()) {
+            --cl.running;
+            return;
+          }
+          next = std::move(cl.waiting.front());
+          cl.waiting.pop_front();
+        }
+        start(c, std::move(next));
+      },
+      cl.prio);
+}
+
+uint64_t RequestScheduler::retry_after(RequestClass c) {
+  std::lock_guard lock(mu);
+  const Class &cl = classes[static_cast<size_t>(c)];
+  // everything ahead of it has to finish, `running` at a time
+  double ms = cl.avg_ms * static_cast<double>(cl.running + cl.waiting.size()) /
+              static_cast<double>(cl.limits.running);
+  uint64_t secs = static_cast<uint64_t>(std::ceil(ms / 1000));
+  return secs == 0 ? 1 : secs;
+}
+
+RequestScheduler::Stats RequestScheduler::stats(RequestClass c) {
+  std::lock_guard lock(mu);
+  const Class &cl = classes[static_cast<size_t>(c)];
+  return {cl.running, cl.waiting.size(), cl.done, cl.refused};
+}
+
+} // namespace kv
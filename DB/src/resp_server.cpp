@@ -0,0 +1,750 @@
+#include "../include/kv/resp_server.hpp"
+#include "../include/kv/net.hpp"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+namespace kv {
+
+// read from a connection per turn of its loop, the others get theirs first
+static constexpr size_t READ_CHUNK = 64 * 1024;
+static constexpr size_t READ_MAX = 1024 * 1024;
+// replies waiting to be sent, no more commands run until they are out
+static constexpr size_t OUT_MAX = 1024 * 1024;
+// the most redis takes: an argument, the arguments of a command and a line
+// of an inline command
+static constexpr long long MAX_BULK = 512LL * 1024 * 1024;
+static constexpr long long MAX_ARGS = 1024 * 1024;
+static constexpr size_t MAX_INLINE = 64 * 1024;
+// SCAN iterations a connection keeps going at once, the oldest goes first
+static constexpr size_t MAX_CURSORS = 16;
+// the most one SCAN step does: keys (COUNT is a hint, as in redis) and bytes
+// of the log of a hash model read for them
+static constexpr uint64_t SCAN_MAX_COUNT = 1000;
+static constexpr size_t SCAN_STEP_BYTES = 1024 * 1024;
+
+// what SCAN keeps between the calls of one iteration
+struct RespCursor {
+  LogPosition pos;  // hash models: where their log is read on from
+  std::string from; // lsm models: the keys from this one on are left
+};
+
+// a SCAN step done on the pool, for the loop of its connection
+struct RespScanDone {
+  int fd = -1;
+  uint64_t conn = 0; // RespConn::id, the fd may be another one's by now
+  RespCursor cur;
+  std::vector<std::string> page;
+  bool more = false;
+};
+
+// what the pool hands back to one event loop
+struct RespLoop {
+  int done_fd = -1; // an eventfd, readable once done has some
+  std::mutex mu;    // guards done
+  std::vector<RespScanDone> done;
+};
+
+struct RespConn {
+  int fd = -1;
+  uint64_t id = 0;
+  RespLoop *loop = nullptr;
+  uint32_t events = 0; // what the loop waits for on fd
+  std::string in, out;
+  size_t parsed = 0, sent = 0;
+  bool closing = false; // QUIT or a protocol error, closed once out is sent
+  bool backlog = false; // complete commands left in, for once out is sent
+  bool scanning = false; // a SCAN step is on the pool, no commands run
+  std::string model = "0";
+  EngineHandle engine; // of model, held while the commands of one read run
+  uint64_t next_cursor = 1;
+  std::map<uint64_t, RespCursor> cursors;
+};
+
+enum class RespParse { Done, More, Bad };
+
+// the number from pos up to the \r\n after it, pos ends up past that
+static RespParse parseNumber(std::string_view in, size_t &pos,
+                             long long &n) {
+  size_t eol = in.find("\r\n", pos);
+  if (eol == std::string_view::npos)
+    return in.size() - pos > 32 ? RespParse::Bad : RespParse::More;
+  auto [end, ec] = std::from_chars(in.data() + pos, in.data() + eol, n);
+  if (ec != std::errc() || end != in.data() + eol)
+    return RespParse::Bad;
+  pos = eol + 2;
+  return RespParse::Done;
+}
+
+// one command off the front of in: an array of bulk strings, or a line of
+// words (what telnet sends). the args point into in, used is how much of it
+// the command took. no args for an empty one
+static RespParse parseCommand(std::string_view in, size_t &used,
+                              std::vector<std::string_view> &args,
+                              const char *&error) {
+  args.clear();
+  if (in.empty())
+    return RespParse::More;
+  if (in[0] != '*') {
+    size_t nl = in.find('\n');
+    if (nl == std::string_view::npos) {
+      error = "too big inline request";
+      return in.size() > MAX_INLINE ? RespParse::Bad : RespParse::More;
+    }
+    std::string_view line = in.substr(0, nl);
+    if (!line.empty() && line.back() == '\r')
+      line.remove_suffix(1);
+    size_t pos = 0;
+    while (pos < line.size()) {
+      size_t end = line.find_first_of(" \t", pos);
+      if (end == std::string_view::npos)
+        end = line.size();
+      if (end > pos)
+        args.push_back(line.substr(pos, end - pos));
+      pos = end + 1;
+    }
+    used = nl + 1;
+    return RespParse::Done;
+  }
+
+  size_t pos = 1;
+  long long n;
+  error = "invalid multibulk length";
+  RespParse st = parseNumber(in, pos, n);
+  if (st != RespParse::Done)
+    return st;
+  if (n > MAX_ARGS)
+    return RespParse::Bad;
+  for (long long i = 0; i < n; ++i) {
+    if (pos >= in.size())
+      return RespParse::More;
+    error = "expected '$'";
+    if (in[pos] != '$')
+      return RespParse::Bad;
+    ++pos;
+    long long len;
+    error = "invalid bulk length";
+    st = parseNumber(in, pos, len);
+    if (st != RespParse::Done)
+      return st;
+    if (len < 0 || len > MAX_BULK)
+      return RespParse::Bad;
+    size_t size = static_cast<size_t>(len);
+    if (in.size() - pos < size + 2)
+      return RespParse::More;
+    if (in[pos + size] != '\r' || in[pos + size + 1] != '\n')
+      return RespParse::Bad;
+    args.push_back(in.substr(pos, size));
+    pos += size + 2;
+  }
+  used = pos;
+  return RespParse::Done;
+}
+
+static void replySimple(std::string &out, std::string_view s) {
+  out.append("+").append(s).append("\r\n");
+}
+static void replyError(std::string &out, std::string_view s) {
+  out.append("-").append(s).append("\r\n");
+}
+static void replyInt(std::string &out, long long n) {
+  out.append(":").append(std::to_string(n)).append("\r\n");
+}
+static void replyArray(std::string &out, size_t n) {
+  out.append("*").append(std::to_string(n)).append("\r\n");
+}
+static void replyBulk(std::string &out, std::string_view s) {
+  out.append("$").append(std::to_string(s.size())).append("\r\n");
+  out.append(s).append("\r\n");
+}
+static void replyNil(std::string &out) { out.append("$-1\r\n"); }
+
+static std::string upper(std::string_view s) {
+  std::string u(s);
+  for (auto &ch : u)
+    ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+  return u;
+}
+
+static bool parseUint(std::string_view s, uint64_t &n) {
+  auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+  return ec == std::errc() && end == s.data() + s.size() && !s.empty();
+}
+
+// the same names as the http api takes
+static bool validModel(std::string_view name) {
+  return !name.empty() && name != "." && name != ".." &&
+         name.find('/') == std::string_view::npos;
+}
+
+// redis glob patterns: * ? [abc] [^a-z] and \ escapes
+static bool globMatch(std::string_view p, std::string_view s) {
+  size_t pi = 0, si = 0;
+  size_t star = std::string_view::npos, star_s = 0;
+  while (si < s.size()) {
+    bool ok = false;
+    size_t next = pi + 1;
+    if (pi < p.size() && p[pi] == '*') {
+      star = pi++;
+      star_s = si;
+      continue;
+    }
+    if (pi < p.size() && p[pi] == '?') {
+      ok = true;
+    } else if (pi < p.size() && p[pi] == '[') {
+      size_t i = pi + 1;
+      bool negate = i < p.size() && p[i] == '^';
+      if (negate)
+        ++i;
+      bool in = false;
+      for (; i < p.size() && p[i] != ']'; ++i) {
+        if (p[i] == '\\' && i + 1 < p.size()) {
+          in |= p[++i] == s[si];
+        } else if (i + 2 < p.size() && p[i + 1] == '-' && p[i + 2] != ']') {
+          char lo = std::min(p[i], p[i + 2]), hi = std::max(p[i], p[i + 2]);
+          in |= s[si] >= lo && s[si] <= hi;
+          i += 2;
+        } else {
+          in |= p[i] == s[si];
+        }
+      }
+      ok = in != negate;
+      next = std::min(i + 1, p.size());
+    } else if (pi < p.size()) {
+      if (p[pi] == '\\' && pi + 1 < p.size())
+        ++pi, ++next;
+      ok = p[pi] == s[si];
+    }
+    if (ok) {
+      pi = next;
+      ++si;
+    } else if (star != std::string_view::npos) {
+      pi = star + 1;
+      si = ++star_s;
+    } else {
+      return false;
+    }
+  }
+  while (pi < p.size() && p[pi] == '*')
+    ++pi;
+  return pi == p.size();
+}
+
+// sends what it can of out without blocking, false if the connection broke
+static bool flush(RespConn &c) {
+  while (c.sent < c.out.size()) {
+    ssize_t w = ::send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent,
+                       MSG_NOSIGNAL);
+    if (w > 0) {
+      c.sent += static_cast<size_t>(w);
+      continue;
+    }
+    if (w < 0 && errno == EINTR)
+      continue;
+    return w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+  c.sent = 0;
+  c.out.clear();
+  if (c.out.capacity() > 4 * OUT_MAX)
+    std::string().swap(c.out); // after a big value
+  return true;
+}
+
+RespServer::RespServer(ModelRegistry &registry, const Config &config,
+                       bool read_only)
+    : registry(registry), config(config), read_only(read_only) {}
+
+RespServer::~RespServer() {
+  stop = true;
+  if (wake_fd >= 0) {
+    uint64_t one = 1;
+    ssize_t n = ::write(wake_fd, &one, sizeof(one));
+    (void)n;
+  }
+  for (auto &t : loops)
+    t.join();
+  // runs the steps queued so far, nobody takes what they hand back
+  scans.reset();
+  if (listen_fd >= 0)
+    ::close(listen_fd);
+  if (wake_fd >= 0)
+    ::close(wake_fd);
+  for (auto &loop : loop_state) {
+    if (loop->done_fd >= 0)
+      ::close(loop->done_fd);
+  }
+}
+
+bool RespServer::start(uint16_t port, size_t threads) {
+  listen_fd = listenOn(port);
+  wake_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (listen_fd < 0 || wake_fd < 0) {
+    std::cerr << "resp: can not listen on port " << port << ": "
+              << std::strerror(errno) << '\n';
+    return false;
+  }
+  ::fcntl(listen_fd, F_SETFL, ::fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+  for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+    auto loop = std::make_unique<RespLoop>();
+    loop->done_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop->done_fd < 0) {
+      std::cerr << "resp: no eventfd: " << std::strerror(errno) << '\n';
+      return false;
+    }
+    loop_state.push_back(std::move(loop));
+  }
+  scans = std::make_unique<ThreadPool>(
+      std::max<size_t>(config.scan_concurrency, 1));
+  for (auto &loop : loop_state)
+    loops.emplace_back([this, l = loop.get()] { run(*l); });
+  return true;
+}
+
+// one event loop. every loop waits on the listening socket (only one of them
+// is woken per connection) and serves the connections it accepted
+void RespServer::run(RespLoop &loop) {
+  int ep = ::epoll_create1(EPOLL_CLOEXEC);
+  if (ep < 0)
+    return;
+  epoll_event ev{};
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.fd = listen_fd;
+  ::epoll_ctl(ep, EPOLL_CTL_ADD, listen_fd, &ev);
+  ev.events = EPOLLIN;
+  ev.data.fd = wake_fd;
+  ::epoll_ctl(ep, EPOLL_CTL_ADD, wake_fd, &ev);
+  ev.data.fd = loop.done_fd;
+  ::epoll_ctl(ep, EPOLL_CTL_ADD, loop.done_fd, &ev);
+
+  std::unordered_map<int, std::unique_ptr<RespConn>> conns;
+  uint64_t next_id = 1;
+  // a connection with replies left over waits until it can write, and is
+  // not read from until then. one with a SCAN step out waits for that
+  auto wants = [](const RespConn &c) -> uint32_t {
+    if (c.scanning)
+      return 0;
+    return c.out.empty() ? EPOLLIN : EPOLLOUT;
+  };
+  auto watch = [ep, &wants](RespConn &c, int op) {
+    epoll_event e{};
+    e.events = c.events = wants(c);
+    e.data.fd = c.fd;
+    ::epoll_ctl(ep, op, c.fd, &e);
+  };
+  // serves a connection, closes it once it is done
+  auto handle = [&](std::unordered_map<int, std::unique_ptr<RespConn>>::iterator
+                        it) {
+    RespConn &c = *it->second;
+    if (!serve(c)) {
+      ::close(c.fd);
+      conns.erase(it);
+    } else if (wants(c) != c.events) {
+      watch(c, EPOLL_CTL_MOD);
+    }
+  };
+  std::array<epoll_event, 64> events;
+  while (!stop) {
+    int n = ::epoll_wait(ep, events.data(), static_cast<int>(events.size()),
+                         -1);
+    if (n < 0 && errno != EINTR)
+      break;
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == wake_fd)
+        continue; // stop is set
+      if (fd == loop.done_fd) {
+        uint64_t woken;
+        ssize_t r = ::read(loop.done_fd, &woken, sizeof(woken));
+        (void)r;
+        std::vector<RespScanDone> done;
+        {
+          std::lock_guard lock(loop.mu);
+          done.swap(loop.done);
+        }
+        for (auto &d : done) {
+          auto it = conns.find(d.fd);
+          if (it == conns.end() || it->second->id != d.conn)
+            continue; // closed while the step ran
+          scanned(*it->second, d);
+          handle(it); // the commands that waited for it
+        }
+        continue;
+      }
+      if (fd == listen_fd) {
+        while (true) {
+          int cfd = ::accept4(listen_fd, nullptr, nullptr,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (cfd < 0) {
+            // out of fds, give the other loops a moment
+            if (errno == EMFILE || errno == ENFILE)
+              std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            break;
+          }
+          int one = 1;
+          ::setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+          auto c = std::make_unique<RespConn>();
+          c->fd = cfd;
+          c->id = next_id++;
+          c->loop = &loop;
+          watch(*c, EPOLL_CTL_ADD);
+          conns.emplace(cfd, std::move(c));
+        }
+        continue;
+      }
+      auto it = conns.find(fd);
+      if (it != conns.end())
+        handle(it);
+    }
+  }
+  for (auto &[fd, c] : conns)
+    ::close(fd);
+  ::close(ep);
+}
+
+// reads what the connection sent, runs the complete commands in it and
+// sends the replies of all of them together. false once it is done
+bool RespServer::serve(RespConn &c) {
+  // the replies of before go first
+  if (!flush(c))
+    return false;
+  if (!c.out.empty())
+    return true;
+  if (c.closing)
+    return false;
+
+  bool eof = false;
+  size_t got = 0;
+  while (got < READ_MAX && !c.backlog) {
+    size_t have = c.in.size();
+    c.in.resize(have + READ_CHUNK);
+    ssize_t r = ::recv(c.fd, c.in.data() + have, READ_CHUNK, 0);
+    c.in.resize(have + static_cast<size_t>(std::max<ssize_t>(r, 0)));
+    if (r > 0) {
+      got += static_cast<size_t>(r);
+      continue;
+    }
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+      return false;
+    eof = r == 0;
+    break;
+  }
+
+  thread_local std::vector<std::string_view> args;
+  while (true) {
+    bool full = false;
+    while (!c.closing && !c.scanning) {
+      if (c.out.size() >= OUT_MAX) {
+        full = true;
+        break;
+      }
+      size_t used = 0;
+      const char *error = "";
+      RespParse st = parseCommand(std::string_view(c.in).substr(c.parsed),
+                                  used, args, error);
+      if (st == RespParse::More)
+        break;
+      if (st == RespParse::Bad) {
+        replyError(c.out, std::string("ERR Protocol error: ") + error);
+        c.closing = true;
+        break;
+      }
+      c.parsed += used;
+      if (!args.empty())
+        execute(c, args);
+    }
+    if (!flush(c))
+      return false;
+    // the commands left over run once the socket took the replies
+    c.backlog = full && !c.out.empty();
+    if (!full || c.backlog)
+      break;
+  }
+  c.engine.reset();
+  c.in.erase(0, c.parsed);
+  c.parsed = 0;
+  if (c.in.capacity() > 4 * READ_MAX && c.in.size() < READ_MAX)
+    c.in.shrink_to_fit();
+
+  if (eof)
+    c.closing = true;
+  return !c.closing || !c.out.empty();
+}
+
+// the engine of the selected model, null if the model does not exist and
+// create is false
+EngineHandle RespServer::engine(RespConn &c, bool create) {
+  if (!c.engine && create) {
+    std::error_code ec;
+    fs::create_directories(config.data_dir + "/" + c.model, ec);
+  }
+  if (!c.engine)
+    c.engine = registry.acquire(c.model);
+  return c.engine;
+}
+
+void RespServer::execute(RespConn &c,
+                         const std::vector<std::string_view> &args) {
+  std::string cmd = upper(args[0]);
+  std::string &out = c.out;
+  size_t argc = args.size();
+  auto wrong = [&] {
+    std::string name(args[0]);
+    for (auto &ch : name)
+      ch = static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+    replyError(out, "ERR wrong number of arguments for '" + name +
+                        "' command");
+  };
+  bool writes = cmd == "SET" || cmd == "DEL" || cmd == "MSET";
+  if (writes && read_only) {
+    replyError(out, "READONLY You can't write against a read only replica.");
+    return;
+  }
+  thread_local Buffer buf;
+
+  if (cmd == "GET") {
+    if (argc != 2)
+      return wrong();
+    EngineHandle e = engine(c, false);
+    if (e && e->get_into(args[1], buf))
+      replyBulk(out, buf.value());
+    else
+      replyNil(out);
+  } else if (cmd == "MGET") {
+    if (argc < 2)
+      return wrong();
+    EngineHandle e = engine(c, false);
+    replyArray(out, argc - 1);
+    for (size_t i = 1; i < argc; ++i) {
+      if (e && e->get_into(args[i], buf))
+        replyBulk(out, buf.value());
+      else
+        replyNil(out);
+    }
+  } else if (cmd == "SET") {
+    if (argc < 3)
+      return wrong();
+    uint64_t ttl_ms = 0;
+    bool nx = false, xx = false;
+    for (size_t i = 3; i < argc; ++i) {
+      std::string opt = upper(args[i]);
+      uint64_t n;
+      if ((opt == "EX" || opt == "PX") && i + 1 < argc) {
+        if (!parseUint(args[++i], n) || n == 0)
+          return replyError(out, "ERR invalid expire time in 'set' command");
+        ttl_ms = opt == "EX" ? n * 1000 : n;
+      } else if (opt == "NX" && !xx) {
+        nx = true;
+      } else if (opt == "XX" && !nx) {
+        xx = true;
+      } else {
+        return replyError(out, "ERR syntax error");
+      }
+    }
+    std::string_view key = args[1], val = args[2];
+    // an empty value is how the engines erase a key
+    if (val.empty())
+      return replyError(out, "ERR empty values can not be stored");
+    EngineHandle e = engine(c, true);
+    if (!e)
+      return replyError(out, "ERR can not open the model");
+    bool ok;
+    if (nx) {
+      WriteResult r = e->put_if(key, val, 0, false, ttl_ms);
+      if (r.status == WriteStatus::Conflict)
+        return replyNil(out);
+      ok = r.status == WriteStatus::Ok;
+    } else if (xx) {
+      // a Conflict is a missing key
+      WriteStatus s = e->update(
+          key,
+          [val](std::optional<std::string_view> cur,
+                uint8_t) -> std::optional<std::string> {
+            if (!cur)
+              return std::nullopt;
+            return std::string(val);
+          },
+          false, ttl_ms);
+      if (s == WriteStatus::Conflict)
+        return replyNil(out);
+      ok = s == WriteStatus::Ok;
+    } else {
+      ok = e->put(key, val, false, ttl_ms) != 0;
+    }
+    if (ok)
+      replySimple(out, "OK");
+    else
+      replyError(out, "ERR write failed");
+  } else if (cmd == "MSET") {
+    if (argc < 3 || argc % 2 == 0)
+      return wrong();
+    std::vector<BatchOp> ops;
+    for (size_t i = 1; i < argc; i += 2) {
+      if (args[i + 1].empty())
+        return replyError(out, "ERR empty values can not be stored");
+      BatchOp op;
+      op.key = args[i];
+      op.val = args[i + 1];
+      ops.push_back(std::move(op));
+    }
+    EngineHandle e = engine(c, true);
+    if (!e)
+      return replyError(out, "ERR can not open the model");
+    if (e->write_batch(ops) == WriteStatus::Ok)
+      replySimple(out, "OK");
+    else
+      replyError(out, "ERR write failed");
+  } else if (cmd == "DEL") {
+    if (argc < 2)
+      return wrong();
+    EngineHandle e = engine(c, false);
+    long long n = 0;
+    for (size_t i = 1; e && i < argc; ++i)
+      n += e->erase(args[i]) ? 1 : 0;
+    replyInt(out, n);
+  } else if (cmd == "SCAN") {
+    if (argc < 2)
+      return wrong();
+    scan(c, args);
+  } else if (cmd == "SELECT") {
+    if (argc != 2)
+      return wrong();
+    if (!validModel(args[1]))
+      return replyError(out, "ERR invalid model name");
+    c.model = args[1];
+    c.engine.reset();
+    c.cursors.clear();
+    replySimple(out, "OK");
+  } else if (cmd == "PING") {
+    if (argc > 2)
+      return wrong();
+    if (argc == 2)
+      replyBulk(out, args[1]);
+    else
+      replySimple(out, "PONG");
+  } else if (cmd == "ECHO") {
+    if (argc != 2)
+      return wrong();
+    replyBulk(out, args[1]);
+  } else if (cmd == "QUIT") {
+    replySimple(out, "OK");
+    c.closing = true;
+  } else if (cmd == "COMMAND") {
+    replyArray(out, 0); // what the client libraries ask for on connect
+  } else {
+    replyError(out, "ERR unknown command '" + std::string(args[0]) + "'");
+  }
+}
+
+// SCAN cursor [MATCH pattern] [COUNT n]. a hash model goes through its log,
+// the cursor keeps the spot the next call reads on from. an lsm model goes on
+// in key order from the last key. either way a key that is there for the
+// whole iteration comes up (a hash model may give it twice), the ones
+// written or erased in between may or may not. the step runs on the pool,
+// the reply is written once it is back (see scanned)
+void RespServer::scan(RespConn &c, const std::vector<std::string_view> &args) {
+  std::string &out = c.out;
+  uint64_t id;
+  if (!parseUint(args[1], id))
+    return replyError(out, "ERR invalid cursor");
+  std::string match;
+  uint64_t count = 10;
+  for (size_t i = 2; i < args.size(); ++i) {
+    std::string opt = upper(args[i]);
+    if (opt == "MATCH" && i + 1 < args.size()) {
+      match = args[++i];
+    } else if (opt == "COUNT" && i + 1 < args.size()) {
+      if (!parseUint(args[++i], count) || count == 0)
+        return replyError(out, "ERR value is not an integer or out of range");
+    } else {
+      return replyError(out, "ERR syntax error");
+    }
+  }
+  count = std::min(count, SCAN_MAX_COUNT);
+  RespScanDone step;
+  step.fd = c.fd;
+  step.conn = c.id;
+  if (id != 0) {
+    auto it = c.cursors.find(id);
+    if (it == c.cursors.end())
+      return replyError(out, "ERR invalid cursor");
+    step.cur = std::move(it->second);
+    c.cursors.erase(it);
+  }
+  EngineHandle e = engine(c, false);
+  if (!e)
+    return scanned(c, step);
+
+  c.scanning = true;
+  scans->enqueue([e, count, match, step = std::move(step),
+                  loop = c.loop]() mutable {
+    TailStatus st = e->scan_keys(step.cur.pos, count, SCAN_STEP_BYTES,
+                                 step.page);
+    step.more = st == TailStatus::More;
+    if (st == TailStatus::Unsupported) {
+      e->scan_range(step.cur.from, {}, count,
+                    [&step](const RecordView &rec) {
+                      step.page.emplace_back(rec.key);
+                    });
+      step.more = step.page.size() == count;
+      if (step.more)
+        step.cur.from = step.page.back() + '\0'; // the next key after it
+    }
+    if (!match.empty())
+      step.page.erase(std::remove_if(step.page.begin(), step.page.end(),
+                                     [&match](const std::string &key) {
+                                       return !globMatch(match, key);
+                                     }),
+                      step.page.end());
+    {
+      std::lock_guard lock(loop->mu);
+      loop->done.push_back(std::move(step));
+    }
+    uint64_t one = 1;
+    ssize_t n = ::write(loop->done_fd, &one, sizeof(one));
+    (void)n;
+  });
+}
+
+// the reply to a SCAN step, on the loop of the connection once it is done
+void RespServer::scanned(RespConn &c, RespScanDone &done) {
+  c.scanning = false;
+  uint64_t next = 0;
+  if (done.more) {
+    next = c.next_cursor++;
+    c.cursors.emplace(next, std::move(done.cur));
+    if (c.cursors.size() > MAX_CURSORS)
+      c.cursors.erase(c.cursors.begin());
+  }
+  std::string &out = c.out;
+  replyArray(out, 2);
+  replyBulk(out, std::to_string(next));
+  replyArray(out, done.page.size());
+  for (const auto &key : done.page)
+    replyBulk(out, key);
+}
+
+} // namespace kv
@@ -1,107 +1,733 @@
 #include "../include/kv/segment.hpp"
+#include "../include/kv/hash_func.hpp"
 #include "../include/kv/utils.hpp"
+#include <algorithm>
+#include <cerrno>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <ios>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 #include <utility>
 #include <vector>
 
 namespace kv {
 
-Segment::Segment(size_t id, const std::string &dir, size_t seg_size)
+// ============================ RECORD FORMAT ==================================
+
+void encodeRecord(std::string &out, std::string_view key, std::string_view val,
+                  uint8_t flags, uint64_t expires_at, std::string_view clock,
+                  uint64_t version) {
+  // preparing the record header
+  RecordHeader header;
+  header.key_len = static_cast<uint32_t>(key.size());
+  header.val_len = static_cast<uint32_t>(val.size());
+  // empty value means tombstone, otherwise alive plus the caller's flags. a
+  // versioned record is always alive, a delete is a version of its own there
+  header.flags = (val.size() == 0 && clock.empty()) ? REC_TOMBSTONE
+                                                    : (REC_ALIVE | flags);
+  if (clock.size() > RECORD_MAX_CLOCK)
+    clock = clock.substr(0, RECORD_MAX_CLOCK);
+  header.reserved = 0; // extension length
+  if (expires_at) {
+    header.flags |= REC_TTL;
+    header.reserved += RECORD_TTL_SIZE;
+  }
+  if (!clock.empty()) {
+    header.flags |= REC_CLOCK;
+    header.reserved += static_cast<uint8_t>(1 + clock.size());
+  }
+  if (version) {
+    header.flags |= REC_VERSION;
+    header.reserved += RECORD_VERSION_SIZE;
+  }
+
+  // compute total length after header and everything
+  header.record_len = sizeof(header.key_len) + sizeof(header.val_len) +
+                      sizeof(header.flags) + sizeof(header.reserved) +
+                      header.reserved + header.key_len + header.val_len +
+                      sizeof(uint32_t); // for crc32
+
+  out.resize(sizeof(header.record_len) + header.record_len);
+  char *p = out.data();
+  std::memcpy(p, &header.record_len, sizeof(header.record_len));
+  p += sizeof(header.record_len);
+  std::memcpy(p, &header.key_len, sizeof(header.key_len));
+  p += sizeof(header.key_len);
+  std::memcpy(p, &header.val_len, sizeof(header.val_len));
+  p += sizeof(header.val_len);
+  *p++ = static_cast<char>(header.flags);
+  *p++ = static_cast<char>(header.reserved);
+  if (expires_at) {
+    std::memcpy(p, &expires_at, sizeof(expires_at));
+    p += sizeof(expires_at);
+  }
+  if (!clock.empty()) {
+    *p++ = static_cast<char>(clock.size());
+    std::memcpy(p, clock.data(), clock.size());
+    p += clock.size();
+  }
+  if (version) {
+    std::memcpy(p, &version, sizeof(version));
+    p += sizeof(version);
+  }
+  std::memcpy(p, key.data(), key.size());
+  p += key.size();
+  if (!val.empty()) // a tombstone has no value, val.data() may be null
+    std::memcpy(p, val.data(), val.size());
+  p += val.size();
+
+  // crc over everything after record_len, computed in memory
+  const char *crcStart = out.data() + sizeof(header.record_len);
+  uint32_t crc = utils::crc32(reinterpret_cast<const uint8_t *>(crcStart),
+                              static_cast<size_t>(p - crcStart));
+  std::memcpy(p, &crc, sizeof(crc));
+}
+
+DecodeStatus decodeRecord(const char *buf, size_t len, RecordView &view,
+                          bool verify) {
+  if (len < sizeof(uint32_t)) {
+    view.record_len = RECORD_HEADER_SIZE; // at least the header is needed
+    return DecodeStatus::Short;
+  }
+  std::memcpy(&view.record_len, buf, sizeof(view.record_len));
+  if (view.record_len < RECORD_HEADER_SIZE)
+    return DecodeStatus::Corrupt;
+  if (len < view.size())
+    return DecodeStatus::Short;
+
+  uint32_t keyLen, valLen;
+  std::memcpy(&keyLen, buf + 4, sizeof(keyLen));
+  std::memcpy(&valLen, buf + 8, sizeof(valLen));
+  view.flags = static_cast<uint8_t>(buf[12]);
+  size_t ext = static_cast<uint8_t>(buf[13]);
+  if (static_cast<uint64_t>(keyLen) + valLen + RECORD_HEADER_SIZE + ext !=
+      view.record_len)
+    return DecodeStatus::Corrupt;
+  // extension fields this version does not know about are skipped
+  view.expires_at = 0;
+  view.clock = {};
+  view.version = (view.flags & REC_ALIVE) ? 1 : 0;
+  size_t at = 0; // into the extension
+  if (view.flags & REC_TTL) {
+    if (ext < RECORD_TTL_SIZE)
+      return DecodeStatus::Corrupt;
+    std::memcpy(&view.expires_at, buf + RECORD_HEADER_SIZE,
+                sizeof(view.expires_at));
+    at += RECORD_TTL_SIZE;
+  }
+  if (view.flags & REC_CLOCK) {
+    if (ext < at + 1)
+      return DecodeStatus::Corrupt;
+    size_t len = static_cast<uint8_t>(buf[RECORD_HEADER_SIZE + at]);
+    if (ext < at + 1 + len)
+      return DecodeStatus::Corrupt;
+    view.clock = std::string_view(buf + RECORD_HEADER_SIZE + at + 1, len);
+    at += 1 + len;
+  }
+  if (view.flags & REC_VERSION) {
+    if (ext < at + RECORD_VERSION_SIZE)
+      return DecodeStatus::Corrupt;
+    std::memcpy(&view.version, buf + RECORD_HEADER_SIZE + at,
+                sizeof(view.version));
+    at += RECORD_VERSION_SIZE;
+  }
+  const char *keyStart = buf + RECORD_HEADER_SIZE + ext;
+  view.key = std::string_view(keyStart, keyLen);
+  view.val = std::string_view(keyStart + keyLen, valLen);
+
+  if (verify) {
+    uint32_t storedCrc;
+    size_t crcLen = view.record_len - sizeof(uint32_t);
+    std::memcpy(&storedCrc, buf + sizeof(uint32_t) + crcLen,
+                sizeof(storedCrc));
+    uint32_t computed = utils::crc32(
+        reinterpret_cast<const uint8_t *>(buf + sizeof(uint32_t)), crcLen);
+    if (computed != storedCrc)
+      return DecodeStatus::Corrupt;
+  }
+  return DecodeStatus::Ok;
+}
+
+// the old erase flipped the flags byte of a record in place without fixing
+// its crc, such a record is a tombstone and not a torn write
+bool legacyTombstone(const char *buf, const RecordView &view) {
+  if (view.flags != REC_TOMBSTONE)
+    return false;
+  std::vector<uint8_t> copy(buf + sizeof(uint32_t), buf + view.size());
+  size_t crcLen = view.record_len - sizeof(uint32_t);
+  uint32_t storedCrc;
+  std::memcpy(&storedCrc, copy.data() + crcLen, sizeof(storedCrc));
+  for (uint8_t was : {uint8_t(REC_ALIVE), uint8_t(REC_ALIVE | REC_JSON)}) {
+    copy[8] = was; // flags byte, after key_len and val_len
+    if (utils::crc32(copy.data(), crcLen) == storedCrc)
+      return true;
+  }
+  return false;
+}
+
+void encodeBatchHeader(std::string &out, uint32_t count,
+                       std::string_view records) {
+  uint32_t head[3] = {count, static_cast<uint32_t>(records.size()),
+                      utils::crc32(reinterpret_cast<const uint8_t *>(
+                                       records.data()),
+                                   records.size())};
+  // a live record first for the layout, then the flags and crc fixed up
+  encodeRecord(out, {}, {reinterpret_cast<const char *>(head), sizeof(head)},
+               0);
+  out[12] = static_cast<char>(REC_PADDING | REC_BATCH);
+  size_t crcLen = out.size() - 2 * sizeof(uint32_t);
+  uint32_t crc = utils::crc32(
+      reinterpret_cast<const uint8_t *>(out.data() + sizeof(uint32_t)), crcLen);
+  std::memcpy(out.data() + sizeof(uint32_t) + crcLen, &crc, sizeof(crc));
+}
+
+bool batchIntact(const RecordView &view, const char *body, size_t avail,
+                 size_t &len) {
+  len = 0;
+  if (view.val.size() != BATCH_HEADER_VALUE)
+    return false;
+  uint32_t head[3];
+  std::memcpy(head, view.val.data(), sizeof(head));
+  len = head[1];
+  return len <= avail &&
+         utils::crc32(reinterpret_cast<const uint8_t *>(body), len) == head[2];
+}
+
+// a record of exactly len bytes that readers skip, plugs a hole left by a
+// write that never happened so the records after it stay reachable
+static void encodePadding(std::string &out, size_t len) {
+  out.assign(len, '\0');
+  uint32_t recordLen = static_cast<uint32_t>(len - sizeof(uint32_t));
+  uint32_t keyLen = 0;
+  uint32_t valLen = static_cast<uint32_t>(len - sizeof(uint32_t) -
+                                          RECORD_HEADER_SIZE);
+  std::memcpy(out.data(), &recordLen, sizeof(recordLen));
+  std::memcpy(out.data() + 4, &keyLen, sizeof(keyLen));
+  std::memcpy(out.data() + 8, &valLen, sizeof(valLen));
+  out[12] = static_cast<char>(REC_PADDING);
+  size_t crcLen = recordLen - sizeof(uint32_t);
+  uint32_t crc = utils::crc32(
+      reinterpret_cast<const uint8_t *>(out.data() + sizeof(uint32_t)), crcLen);
+  std::memcpy(out.data() + sizeof(uint32_t) + crcLen, &crc, sizeof(crc));
+}
+
+// ============================ SEGMENT ========================================
+
+Segment::Segment(size_t id, const std::string &dir,
+                 std::shared_ptr<IoEngine> io, MemoryBudget *budget,
+                 size_t bloom_bits)
     : id(id), seg_file_path(dir + "/segment_" + std::to_string(id) + ".kv"),
       ind_file_path(dir + "/segment_" + std::to_string(id) + ".idx"),
       bf_file_path(dir + "/segment_" + std::to_string(id) + ".bf"), local_ind(),
-      bf(8 * 1024, 4) // 8KB bloom filter with 4 hashes
-{
-  // open (or create) data file for append + read
-  data.open(seg_file_path,
-            std::ios::in | std::ios::out | std::ios::app | std::ios::binary);
-  if (!data.is_open()) {
-    // create the file if not present
-    std::ofstream create(seg_file_path, std::ios::binary);
-    create.close();
-    data.open(seg_file_path,
-              std::ios::in | std::ios::out | std::ios::app | std::ios::binary);
-  }
-  // load current index map or bloom filter if present
+      io(std::move(io)), bf(bloom_bits ? bloom_bits : 8 * 1024, 4),
+      budget(budget), model(budget ? modelOfDir(dir) : std::string()) {
+  // open (or create) the data file, writes go to explicit offsets
+  fd = ::open(seg_file_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  struct stat st;
+  if (fd >= 0 && ::fstat(fd, &st) == 0)
+    end = static_cast<size_t>(st.st_size);
+  if (fd >= 0)
+    this->io->register_file(fd);
+  // a file written direct ends in padding, its footer knows where the
+  // records end. one that was not closed has none, recovery cuts the zeros
+  SegmentFooter footer;
+  if (end >= DIRECT_BLOCK && end % DIRECT_BLOCK == 0 &&
+      this->io->read_sync(fd, reinterpret_cast<char *>(&footer),
+                          sizeof(footer), end - sizeof(footer)) ==
+          static_cast<long>(sizeof(footer)) &&
+      footer.magic == SEGMENT_FOOTER_MAGIC &&
+      footer.end <= end - sizeof(footer))
+    end = footer.end;
+  // load the last checkpoint of the index and bloom filter if present, then
+  // bring them up to date from the records written after it
   loadBloom();
   loadIndex();
+  size_t covered = checkpointed;
+  if (fd >= 0 && covered < end) {
+    end = recover(covered);
+    checkpointed = 0; // the files on disk are behind, rewrite them on close
+  }
+  if (budget) {
+    budget->charge(model, MemoryKind::Bloom, bf.size() / 8);
+    chargeIndex();
+  }
 }
 
 Segment::~Segment() {
-  saveBloom();
-  saveIndex();
-  data.close();
+  waitIdle();
+  if (dfd >= 0 && !retired)
+    finishDirect();
+  if (tracked)
+    budget->untrack(this); // waits for an eviction of it in progress
+  if (map)
+    ::munmap(const_cast<char *>(map), map_len);
+  // a retired segment's files already belong to its compacted copy
+  if (checkpointed != end && !retired) {
+    SegmentCheckpoint cp;
+    fillCheckpoint(cp, end);
+    writeCheckpoint(cp);
+  }
+  if (fd >= 0) {
+    io->unregister_file(fd);
+    ::close(fd);
+  }
+  if (budget) {
+    budget->release(model, MemoryKind::Bloom, bf.size() / 8);
+    budget->release(model, MemoryKind::Index, index_charged);
+  }
 }
 
-// for inserting the data in the segment file
-size_t Segment::appendRecord(uint64_t hash, std::string_view key,
-                             std::string_view val) {
-  // move the file pointer to the end and note the offset
-  data.seekp(0, std::ios::end);
-  size_t offset = static_cast<size_t>(data.tellp());
+// runs fn with the index in memory, reading it back from the .idx first if it
+// was evicted. exclusive for the ones that change it
+template <typename Fn> auto Segment::withIndex(bool exclusive, Fn &&fn) {
+  if (!tracked.load(std::memory_order_acquire))
+    return fn(); // never evicted
+  last_used.store(utils::nowMs(), std::memory_order_relaxed);
+  if (!exclusive) {
+    std::shared_lock lock(res_mu);
+    if (resident)
+      return fn();
+  }
+  std::unique_lock lock(res_mu);
+  size_t grew = 0;
+  if (!resident) {
+    loadIndex(true);
+    resident = true;
+    size_t now = indexBytes();
+    grew = now > index_charged ? now - index_charged : 0;
+    index_charged += grew;
+  }
+  auto result = fn();
+  lock.unlock();
+  // outside the lock, the charge may evict others
+  budget->charge(model, MemoryKind::Index, grew);
+  return result;
+}
 
-  // preparing the record header
-  RecordHeader header;
-  header.key_len = static_cast<uint32_t>(key.size());
-  header.val_len = static_cast<uint32_t>(val.size());
-  header.flags = (val.size() == 0) ? 0 : 1; // 1 means alive, 0 means tombstone
-  header.reserved = 0;                      // for future
+// charges what the index grew by, the one adding to it calls this
+void Segment::chargeIndex() {
+  size_t now = indexBytes();
+  if (now <= index_charged)
+    return;
+  budget->charge(model, MemoryKind::Index, now - index_charged);
+  index_charged = now;
+}
 
-  // compute total length after header and everything
-  header.record_len = sizeof(header.key_len) + sizeof(header.val_len) +
-                      sizeof(header.flags) + sizeof(header.reserved) +
-                      header.key_len + header.val_len +
-                      sizeof(uint32_t); // for crc32
+// nothing writes into it and the .idx on disk has every record
+bool Segment::evictable() const {
+  return !retired && idle() && end > 0 && checkpointed.load() == end;
+}
 
-  // write the header
-  data.write(reinterpret_cast<char *>(&header.record_len),
-             sizeof(header.record_len));
-  data.write(reinterpret_cast<char *>(&header.key_len), sizeof(header.key_len));
-  data.write(reinterpret_cast<char *>(&header.val_len), sizeof(header.val_len));
-  data.write(reinterpret_cast<char *>(&header.flags), sizeof(header.flags));
-  data.write(reinterpret_cast<char *>(&header.reserved),
-             sizeof(header.reserved));
-
-  // writing the data in the file
-  data.write(key.data(), header.key_len);
-  data.write(val.data(), header.val_len);
-
-  // computing crc
-  size_t crcStart = offset + sizeof(header.record_len);
-  size_t crcLen = header.record_len - sizeof(uint32_t);
-  std::vector<char> buf(crcLen);
-  data.seekg(crcStart);
-  data.read(buf.data(), crcLen);
-  uint32_t crc = utils::crc32(reinterpret_cast<uint8_t *>(buf.data()), crcLen);
-
-  // Write CRC
-  data.write(reinterpret_cast<char *>(&crc), sizeof(crc));
-
-  data.flush();
-
-  // update the local index and bloom filter
-  bf.add(hash);
-  local_ind.put(hash, offset);
+uint64_t Segment::lastUsed() {
+  if (!resident || !evictable())
+    return 0;
+  return std::max<uint64_t>(last_used.load(), 1);
+}
+
+// drops the index, not while a lookup has it
+size_t Segment::evict() {
+  std::unique_lock lock(res_mu, std::try_to_lock);
+  if (!lock || !resident || !evictable())
+    return 0;
+  local_ind.reset();
+  expiry.reset();
+  resident = false;
+  size_t left = indexBytes();
+  size_t freed = index_charged > left ? index_charged - left : 0;
+  index_charged -= freed;
+  return freed;
+}
+
+// its files go to the compacted copy, so the index has to stay in memory
+void Segment::retire() {
+  withIndex(true, [this] {
+    retired = true;
+    return true;
+  });
+}
+
+// replays the records from `from` to the end of the file into the index and
+// the bloom filter, returns the new end of the file. a torn record at the end
+// gets truncated, a hole left by a write that never landed gets padded
+size_t Segment::recover(size_t from) {
+  std::vector<char> tail(end - from);
+  long res = io->read_sync(fd, tail.data(), tail.size(), from);
+  if (res < 0)
+    return end;
+  tail.resize(static_cast<size_t>(res));
 
+  size_t pos = 0;
+  while (pos < tail.size()) {
+    RecordView view;
+    auto st = decodeRecord(tail.data() + pos, tail.size() - pos, view);
+    bool valid = st == DecodeStatus::Ok;
+    if (!valid && st == DecodeStatus::Corrupt &&
+        decodeRecord(tail.data() + pos, tail.size() - pos, view, false) ==
+            DecodeStatus::Ok)
+      valid = legacyTombstone(tail.data() + pos, view);
+    if (valid && batchHeader(view.flags)) {
+      // a batch counts only as a whole: a torn one at the end is cut off
+      // with its header, one with later writes behind it is padded over
+      size_t len, body = pos + view.size();
+      if (!batchIntact(view, tail.data() + body, tail.size() - body, len) &&
+          len) {
+        if (body + len >= tail.size()) {
+          if (::ftruncate(fd, static_cast<off_t>(from + pos)) == 0)
+            return from + pos;
+          return end;
+        }
+        std::string pad;
+        encodePadding(pad, len);
+        io->write_sync(fd, pad.data(), pad.size(), from + body);
+      }
+      pos = body; // the records of an intact one are indexed one by one
+      continue;
+    }
+    if (valid) {
+      if (view.version > top_version)
+        top_version = view.version;
+      if (!(view.flags & REC_PADDING))
+        addToIndex(fnv1a(view.key), from + pos, view.size(),
+                   !(view.flags & REC_ALIVE), view.expires_at,
+                   view.flags & REC_MERGE);
+      pos += view.size();
+      continue;
+    }
+
+    // look for the next intact record, a later write may have landed
+    // before this one
+    size_t next = pos + 1;
+    for (; next + RECORD_HEADER_SIZE <= tail.size(); ++next) {
+      RecordView probe;
+      if (decodeRecord(tail.data() + next, tail.size() - next, probe) ==
+          DecodeStatus::Ok)
+        break;
+    }
+    if (next + RECORD_HEADER_SIZE > tail.size() ||
+        next - pos < sizeof(uint32_t) + RECORD_HEADER_SIZE) {
+      // nothing valid after it, cut the torn tail off
+      if (::ftruncate(fd, static_cast<off_t>(from + pos)) == 0)
+        return from + pos;
+      return end;
+    }
+    std::string pad;
+    encodePadding(pad, next - pos);
+    io->write_sync(fd, pad.data(), pad.size(), from + pos);
+    pos = next;
+  }
+  return from + pos;
+}
+
+// hands out the next len bytes of the file, the caller writes the record there
+// and then indexes (or abandons) it (called under the SegmentMgr lock)
+size_t Segment::reserve(size_t len) {
+  inflight.fetch_add(1);
+  size_t offset = end;
+  end += len;
   return offset;
 }
 
+bool preallocateFile(int fd, size_t len) {
+  return ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(len)) == 0;
+}
+
+// the blocks for the first len bytes, before the appends need them (the file
+// system may not do it, the appends work either way)
+bool Segment::preallocate(size_t len) {
+  if (fd < 0 || len <= preallocated || !preallocateFile(fd, len))
+    return false;
+  preallocated = len;
+  return true;
+}
+
+// an aligned buffer of at least len bytes for the direct writes, per thread
+static char *directBuffer(size_t len) {
+  thread_local std::unique_ptr<char, decltype(&std::free)> buf(nullptr,
+                                                               &std::free);
+  thread_local size_t cap = 0;
+  if (len > cap) {
+    buf.reset(static_cast<char *>(std::aligned_alloc(DIRECT_BLOCK, len)));
+    cap = buf ? len : 0;
+  }
+  return buf.get();
+}
+
+// writes the len bytes at offset past the page cache, in whole blocks: the
+// first starts with the bytes before offset (staged by the last write, or
+// read back from the file) and the last ends in zeros until the next write
+// covers them. the caller writes in order, one at a time. returns len, or -1
+// if it failed
+long Segment::writeDirect(const char *data, size_t len, size_t offset) {
+  if (dfd < 0) {
+    // a file system without O_DIRECT (tmpfs) gets the same writes through
+    // the page cache
+    dfd = ::open(seg_file_path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+    if (dfd < 0)
+      dfd = ::open(seg_file_path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (dfd < 0)
+      return -1;
+    io->register_file(dfd);
+  }
+  size_t start = offset & ~(DIRECT_BLOCK - 1), head = offset - start;
+  if (staged_at != offset) {
+    staged.resize(head);
+    if (head && io->read_sync(fd, staged.data(), head, start) !=
+                    static_cast<long>(head))
+      return -1;
+  }
+  size_t total = (head + len + DIRECT_BLOCK - 1) & ~(DIRECT_BLOCK - 1);
+  char *buf = directBuffer(total);
+  if (!buf)
+    return -1;
+  std::memcpy(buf, staged.data(), head);
+  std::memcpy(buf + head, data, len);
+  std::memset(buf + head + len, 0, total - head - len);
+  if (io->write_sync(dfd, buf, total, start) != static_cast<long>(total)) {
+    staged_at = 0;
+    return -1;
+  }
+  size_t done = offset + len, last = done & ~(DIRECT_BLOCK - 1);
+  staged.assign(buf + (last - start), done - last);
+  staged_at = done;
+  return static_cast<long>(len);
+}
+
+// the end of the direct appends: the footer goes behind the records, in the
+// last bytes of the block they end in (or the one after it)
+void Segment::finishDirect() {
+  SegmentFooter footer{SEGMENT_FOOTER_MAGIC, end};
+  size_t at = (end + sizeof(footer) + DIRECT_BLOCK - 1) & ~(DIRECT_BLOCK - 1);
+  std::string tail(at - end - sizeof(footer), '\0');
+  tail.append(reinterpret_cast<const char *>(&footer), sizeof(footer));
+  writeDirect(tail.data(), tail.size(), end);
+  io->unregister_file(dfd);
+  ::close(dfd);
+  dfd = -1;
+  staged.clear();
+  staged.shrink_to_fit();
+}
+
+// a closed segment that gets the appends again after an open: the padding
+// and footer of its direct writes go, the records continue at end
+void Segment::resume() {
+  struct stat st;
+  if (fd >= 0 && ::fstat(fd, &st) == 0 &&
+      static_cast<size_t>(st.st_size) > end &&
+      ::ftruncate(fd, static_cast<off_t>(end)) != 0) {
+    // the appends overwrite it, only a crash before that shows the footer
+  }
+}
+
+// update the local index and bloom filter once a reserved record is on disk
+// (deleted for a tombstone, expires_at for a record with a TTL)
+void Segment::indexRecord(uint64_t hash, size_t offset, size_t size,
+                          bool deleted, uint64_t expires_at, bool merge) {
+  addToIndex(hash, offset, size, deleted, expires_at, merge);
+  inflight.fetch_sub(1);
+}
+
+// the records of a batch were reserved with a single reserve: each is
+// indexed with indexBatched, then batchDone ends the reservation
+void Segment::indexBatched(uint64_t hash, size_t offset, size_t size,
+                           bool deleted, uint64_t expires_at) {
+  addToIndex(hash, offset, size, deleted, expires_at);
+}
+
+void Segment::batchDone() { inflight.fetch_sub(1); }
+
+// an older write finishing late never replaces a newer offset. tombstones
+// stay in the index (and the bloom filter) so they hide the older segments
+void Segment::addToIndex(uint64_t hash, size_t offset, size_t size,
+                         bool deleted, uint64_t expires_at, bool merge) {
+  bf.add(hash);
+  auto cur = local_ind.get(hash);
+  if (cur.has_value() && indexOffset(cur.value()) > offset) {
+    dead += size; // lost to the newer one right away
+    return;
+  }
+  // the record under a merge operand is still read, it is its base
+  if (cur.has_value() && !merge)
+    dead += indexSize(cur.value());
+  local_ind.put(hash, packIndex(offset, size, deleted, merge));
+  if (expires_at)
+    expiry.put(hash, expires_at);
+  else if (expiry.size())
+    expiry.erase(hash);
+  if (budget)
+    chargeIndex();
+}
+
+// fired by the timing wheel: if the key still has the TTL that set the timer
+// its entry turns into a tombstone and the record counts as garbage
+bool Segment::expire(uint64_t hash, uint64_t expires_at) {
+  return withIndex(true, [&] {
+    auto exp = expiry.get(hash);
+    if (!exp.has_value() || exp.value() != expires_at)
+      return false; // overwritten since, or already gone
+    expiry.erase(hash);
+    auto cur = local_ind.get(hash);
+    if (!cur.has_value() || indexDeleted(cur.value()))
+      return false;
+    // an eviction drops this, the reloaded expiry reads as deleted again
+    local_ind.put(hash, cur.value() | IDX_TOMBSTONE);
+    dead += indexSize(cur.value());
+    return true;
+  });
+}
+
+// the timers of the keys in this segment that still have a TTL
+void Segment::timers(std::vector<ExpiryTimer> &out) {
+  withIndex(false, [&] {
+    for (const auto &[hash, expires_at] : expiry.get_all())
+      out.push_back({hash, id, expires_at});
+    return true;
+  });
+}
+
+// a reserved record whose write failed. the hole gets a padding record if
+// possible, so the records after it can still be read in order (the replicas
+// tail the file). plain pwrite, this may run on the I/O completion thread
+// (the direct appends only fail under the append lock)
+void Segment::abandon(size_t offset, size_t len) {
+  std::string pad;
+  encodePadding(pad, len);
+  // the next direct write rewrites the block, so the padding goes that way
+  long res = dfd >= 0 ? writeDirect(pad.data(), pad.size(), offset)
+                      : ::pwrite(fd, pad.data(), pad.size(),
+                                 static_cast<off_t>(offset));
+  if (res < 0) {
+    // the hole stays, recovery pads it on the next open
+  }
+  inflight.fetch_sub(1);
+}
+
+// called once the segment is closed for appends: nothing writes into it any
+// more, so the point reads can be served from a read only mapping. the records
+// still in flight are below end, their bytes show up in the mapping once
+// written (both go through the page cache)
+void Segment::seal() {
+  if (budget && !tracked.exchange(true)) {
+    budget->track(this, model, MemoryKind::Index);
+    budget->settle(); // the closed ones of an open are evictable right away
+  }
+  if (dfd >= 0)
+    finishDirect();
+  // the blocks reserved past the records go back to the file system. a
+  // spare file made before the segment size was tuned down has more of them
+  struct stat st;
+  if (preallocated && ::fstat(fd, &st) == 0) {
+    size_t reserved =
+        std::max(preallocated, static_cast<size_t>(st.st_blocks) * 512);
+    if (static_cast<size_t>(st.st_size) < reserved)
+      ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, st.st_size,
+                  static_cast<off_t>(reserved) - st.st_size);
+  }
+  preallocated = 0;
+  if (map || fd < 0 || end == 0)
+    return;
+  void *p = ::mmap(nullptr, end, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return; // keeps reading through io
+  ::madvise(p, end, MADV_RANDOM);
+  map = static_cast<const char *>(p);
+  map_len = end;
+}
+
+// waits until every reserved record is indexed (or abandoned)
+void Segment::waitIdle() const {
+  while (inflight.load() != 0)
+    std::this_thread::yield();
+}
+
+// copies the index and bloom filter, the caller makes sure nobody appends or
+// indexes meanwhile. false if the last checkpoint is still current
+bool Segment::snapshot(SegmentCheckpoint &cp) {
+  if (checkpointed == end || retired)
+    return false;
+  fillCheckpoint(cp, end);
+  return true;
+}
+
+void Segment::fillCheckpoint(SegmentCheckpoint &cp, size_t covered) {
+  cp.covered = covered;
+  cp.version = std::max(top_version.load(), versions ? versions->load() : 0);
+  cp.entries = local_ind.get_all();
+  cp.expiry = expiry.get_all();
+  cp.bloom.resize(bf.size());
+  // pack bits
+  for (size_t i = 0; i < bf.size(); i++) {
+    cp.bloom[i] = bf.getBit(i);
+  }
+}
+
+// makes the records durable first, then atomically swaps in the new .bf and
+// .idx files, so the .idx on disk never claims records that are not there
+void Segment::writeCheckpoint(const SegmentCheckpoint &cp) {
+  if (fd >= 0)
+    ::fdatasync(fd);
+  writeBloomFile(cp);
+  writeIndexFile(cp);
+  checkpointed = cp.covered;
+  // a sealed segment is evictable once its checkpoint has everything
+  if (tracked)
+    budget->settle();
+}
+
+// writes path.tmp, syncs it and renames it over path
+void atomicWrite(const std::string &path,
+                 const std::vector<std::pair<const void *, size_t>> &parts) {
+  std::string tmp = path + ".tmp";
+  int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0)
+    return;
+  bool ok = true;
+  for (auto &[data, len] : parts) {
+    const char *p = static_cast<const char *>(data);
+    size_t done = 0;
+    while (ok && done < len) {
+      ssize_t w = ::write(out, p + done, len - done);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0)
+        ok = false;
+      else
+        done += static_cast<size_t>(w);
+    }
+  }
+  ok = ok && ::fsync(out) == 0;
+  ::close(out);
+  if (ok)
+    std::filesystem::rename(tmp, path);
+  else
+    std::filesystem::remove(tmp);
+}
+
 // load the bloom filter by the segment's .bf file
 void Segment::loadBloom() {
   if (!std::filesystem::exists(bf_file_path))
     return;
   std::ifstream in(bf_file_path, std::ios::binary);
   size_t bitsize;
-  in.read(reinterpret_cast<char *>(&bitsize), sizeof(bitsize));
-  bf = BloomFilter(bitsize, bf.getNumHashes());
+  if (!in.read(reinterpret_cast<char *>(&bitsize), sizeof(bitsize)) ||
+      bitsize == 0)
+    return;
   std::vector<char> raw(bitsize);
-  in.read(raw.data(), bitsize);
+  if (!in.read(raw.data(), bitsize))
+    return; // cut short, it gets rebuilt from the index
+  bf = BloomFilter(bitsize, bf.getNumHashes());
   // unpack bits
   for (size_t i = 0; i < bitsize; ++i) {
     bf.setBit(i, raw[i]);
@@ -110,53 +736,147 @@ void Segment::loadBloom() {
 
 // saves the bloom filter by writing it to the segment's specific .bf file
 void Segment::saveBloom() {
-  std::ofstream out(bf_file_path, std::ios::binary);
-  size_t bitsize = bf.size();
-  out.write(reinterpret_cast<char *>(&bitsize), sizeof(bitsize));
-  std::vector<char> raw(bitsize);
-  // pack bits
-  for (size_t i = 0; i < bitsize; i++) {
-    raw[i] = bf.getBit(i);
-  }
-  out.write(raw.data(), bitsize);
+  SegmentCheckpoint cp;
+  fillCheckpoint(cp, end);
+  writeBloomFile(cp);
 }
 
-// loads the index (.idx) file into the local index map
-void Segment::loadIndex() {
+static void writeBloom(const std::string &path, const SegmentCheckpoint &cp) {
+  size_t bitsize = cp.bloom.size();
+  atomicWrite(path, {{&bitsize, sizeof(bitsize)}, {cp.bloom.data(), bitsize}});
+}
+
+void Segment::writeBloomFile(const SegmentCheckpoint &cp) {
+  writeBloom(bf_file_path, cp);
+}
+
+// loads the index (.idx) file into the local index map. the checkpoint header
+// says up to which offset it is complete, older files without it cover nothing
+// for sure so the whole segment gets replayed
+void Segment::loadIndex(bool reload) {
   if (!std::filesystem::exists(ind_file_path))
     return;
   std::ifstream in(ind_file_path, std::ios::binary);
   uint64_t hash;
   uint64_t off;
+  bool first = true;
+  bool v1 = false;
+  bool ttl = false; // in the (hash, expiry) pairs
+  bool after_header = false;
   while (in.read(reinterpret_cast<char *>(&hash), sizeof(hash))) {
     in.read(reinterpret_cast<char *>(&off), sizeof(off));
-    local_ind.put(hash, static_cast<size_t>(off));
+    if (!in)
+      break;
+    if (first && (hash == IDX_MAGIC || hash == IDX_MAGIC_V1)) {
+      v1 = hash == IDX_MAGIC_V1;
+      if (!reload)
+        checkpointed = std::min<size_t>(off, end);
+      first = false;
+      after_header = true;
+      continue;
+    }
+    if (after_header && hash == IDX_VERSION_MAGIC) {
+      after_header = false;
+      if (off > top_version)
+        top_version = off;
+      continue;
+    }
+    after_header = false;
+    if (!first && hash == IDX_TTL_MAGIC && checkpointed) {
+      ttl = true;
+      continue;
+    }
+    first = false;
+    if (ttl) {
+      expiry.put(hash, off);
+      continue;
+    }
+    // a v1 size that runs into IDX_MERGE is too big for the field now
+    if (v1 && indexMerge(off))
+      off &= ~((2 * IDX_SIZE_MASK + 1) << IDX_OFFSET_BITS);
+    local_ind.put(hash, off);
+    // the bloom filter may be older than the index, never let it miss a key.
+    // a reload has it whole, and the lookups read it meanwhile
+    if (!reload)
+      bf.add(hash);
   }
 }
 
 // saves the local index onto the .idx file
 void Segment::saveIndex() {
-  std::ofstream out(ind_file_path, std::ios::binary | std::ios::trunc);
-  std::vector<std::pair<uint64_t, size_t>> indexList = local_ind.get_all();
-  for (auto &p : indexList) {
-    uint64_t hash = p.first;
-    uint64_t off = p.second;
-    out.write(reinterpret_cast<char *>(&hash), sizeof(hash));
-    out.write(reinterpret_cast<char *>(&off), sizeof(off));
-  }
+  SegmentCheckpoint cp;
+  fillCheckpoint(cp, end);
+  writeIndexFile(cp);
+}
+
+// layout: IDX_MAGIC, covered offset, IDX_VERSION_MAGIC, version, then
+// (hash, packIndex entry) pairs, then IDX_TTL_MAGIC, count and the
+// (hash, expiry) pairs
+static void writeIndex(const std::string &path, const SegmentCheckpoint &cp) {
+  uint64_t header[4] = {IDX_MAGIC, cp.covered, IDX_VERSION_MAGIC, cp.version};
+  uint64_t ttl_header[2] = {IDX_TTL_MAGIC, cp.expiry.size()};
+  atomicWrite(path,
+              {{header, sizeof(header)},
+               {cp.entries.data(), cp.entries.size() * sizeof(cp.entries[0])},
+               {ttl_header, cp.expiry.empty() ? 0 : sizeof(ttl_header)},
+               {cp.expiry.data(), cp.expiry.size() * sizeof(cp.expiry[0])}});
+}
+
+void Segment::writeIndexFile(const SegmentCheckpoint &cp) {
+  writeIndex(ind_file_path, cp);
+}
+
+void writeSegmentFiles(const std::string &path, const SegmentCheckpoint &cp) {
+  writeBloom(path + ".bf", cp);
+  writeIndex(path + ".idx", cp);
 }
 
 // a yes or no function whether the key is really there or not
-bool Segment::lookup(uint64_t hash, SegmentOffset &out) {
+bool Segment::lookup(uint64_t hash, SegmentOffset &out,
+                     uint64_t *false_hits) {
   // first a quick check in the bloom filter
   if (!bf.maybeContains(hash))
     return false;
-  auto opt = local_ind.get(hash);
-  if (opt.has_value()) {
-    out = {id, opt.value()};
+  return withIndex(false, [&] {
+    auto opt = local_ind.get(hash);
+    if (!opt.has_value()) {
+      if (false_hits)
+        ++*false_hits;
+      return false;
+    }
+    bool deleted = indexDeleted(opt.value());
+    // an expired key the wheel did not get to yet reads as deleted too
+    if (!deleted && expiry.size()) {
+      auto exp = expiry.get(hash);
+      deleted = exp.has_value() && exp.value() <= utils::nowMs();
+    }
+    out = {id,
+           indexOffset(opt.value()),
+           fd,
+           indexSize(opt.value()),
+           deleted,
+           std::string_view(map, map_len),
+           nullptr, // the manager fills in the owner
+           indexMerge(opt.value())};
     return true;
-  }
-  return false;
+  });
+}
+
+// the raw index entry of hash, tombstone bit included
+std::optional<uint64_t> Segment::indexEntry(uint64_t hash) {
+  if (!bf.maybeContains(hash))
+    return std::nullopt;
+  return withIndex(false, [&] { return local_ind.get(hash); });
+}
+
+void Segment::mergeEntries(std::vector<std::pair<uint64_t, uint64_t>> &out) {
+  withIndex(false, [&] {
+    for (const auto &[hash, entry] : local_ind.get_all()) {
+      if (indexMerge(entry) && !indexDeleted(entry))
+        out.emplace_back(hash, entry);
+    }
+    return true;
+  });
 }
 
 } // namespace kv
@@ -1,53 +1,832 @@
 #include "../include/kv/segment_manager.hpp"
+#include "../include/kv/hash_func.hpp"
+#include "../include/kv/trace.hpp"
+#include "../include/kv/utils.hpp"
+#include <algorithm>
+#include <cerrno>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <string>
 #include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
 
 namespace kv {
-SegmentMgr::SegmentMgr(const std::string &dir, size_t seg_size)
-    : max_size(seg_size), dir(dir) {
+
+// the file of the next segment, preallocated ahead of the rotation that
+// renames it into place
+static const char *const SPARE_FILE = "/segment.next";
+// the bloom filters sized by the tuning stay within these bits, the small
+// end is what every segment gets without it
+static constexpr size_t MIN_BLOOM_BITS = 8 * 1024;
+static constexpr size_t MAX_BLOOM_BITS = size_t{1} << 23;
+
+SegmentMgr::SegmentMgr(const std::string &dir, size_t seg_size,
+                       std::shared_ptr<IoEngine> io, MemoryBudget *budget,
+                       SegmentFiles files)
+    : max_size(seg_size), dir(dir), io(std::move(io)), budget(budget),
+      files(files), bloom_per_key(files.bloom_bits_per_key),
+      record_bytes(files.record_bytes) {
   // creating directory if that doesnt exist
   std::filesystem::create_directories(dir);
-  // start with segment id = 1
-  current = new Segment(next_id++, dir, seg_size);
+  finishAttach();
+
+  // reopen the segments already there, oldest first. each one replays the
+  // records written after its last checkpoint
+  std::vector<size_t> ids;
+  for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+    std::string name = entry.path().filename().string();
+    if (name.rfind(".bulk-", 0) == 0) {
+      // a bulk load that was not attached
+      std::error_code ec;
+      std::filesystem::remove_all(entry.path(), ec);
+      continue;
+    }
+    if (entry.path().extension() == ".compact" ||
+        name == std::string(SPARE_FILE + 1) + ".tmp") {
+      // a compaction that did not finish, the original is still there (or
+      // a spare file that was not done)
+      std::error_code ec;
+      std::filesystem::remove(entry.path(), ec);
+      continue;
+    }
+    if (entry.path().extension() != ".kv" || name.rfind("segment_", 0) != 0)
+      continue;
+    try {
+      ids.push_back(std::stoull(name.substr(8)));
+    } catch (const std::exception &) {
+    }
+  }
+  std::sort(ids.begin(), ids.end());
+  for (size_t id : ids) {
+    closed.push_back(std::make_shared<Segment>(id, dir, this->io, budget));
+    closed.back()->versionsFrom(files.versions);
+  }
+  if (!ids.empty())
+    next_id = ids.back() + 1;
+
+  // keep appending to the newest one while it has room, unless its file is
+  // linked into a snapshot too (or is one, restored) and has to stay as it is
+  struct stat st;
+  if (!closed.empty() && closed.back()->size() < max_size &&
+      ::fstat(closed.back()->fileDescriptor(), &st) == 0 &&
+      st.st_nlink == 1) {
+    current = closed.back();
+    closed.pop_back();
+    current->resume();
+    if (files.preallocate)
+      current->preallocate(max_size);
+  } else {
+    // start with segment id = 1
+    current = nextSegment();
+  }
+  for (auto &s : closed)
+    s->seal();
 }
 
-// destructor to delete all the segment objects
-SegmentMgr::~SegmentMgr() {
-  delete current;
-  for (auto *s : closed) {
-    delete s;
+// the segments close (and checkpoint) once the last reader lets go of them
+SegmentMgr::~SegmentMgr() = default;
+
+// reserving room for a record of len bytes at the end of the active segment,
+// the caller writes it and then indexes it
+AppendSlot SegmentMgr::reserve(size_t len) {
+  std::lock_guard lock(mu);
+  return place(len);
+}
+
+// reserve under mu. a record that does not fit the rest of the segment goes
+// to the next one, the files stay within what was preallocated for them
+AppendSlot SegmentMgr::place(size_t len) {
+  if (current->size() > 0 && current->size() + len > max_size)
+    rotate();
+  AppendSlot slot{current.get(), current->reserve(len)};
+  // half way through, the next file gets made in the background
+  if (files.preallocate && files.background &&
+      spare_for != current->getId() && current->size() >= max_size / 2 &&
+      !spare_busy->exchange(true)) {
+    spare_for = current->getId();
+    files.background->enqueue(
+        [path = dir + SPARE_FILE, size = max_size.load(),
+         busy = spare_busy] {
+          std::error_code ec;
+          if (!std::filesystem::exists(path, ec)) {
+            std::string tmp = path + ".tmp";
+            int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC |
+                                             O_CLOEXEC,
+                            0644);
+            bool ok = fd >= 0 && preallocateFile(fd, size);
+            if (fd >= 0)
+              ::close(fd);
+            if (ok)
+              std::filesystem::rename(tmp, path, ec);
+            else
+              std::filesystem::remove(tmp, ec);
+          }
+          *busy = false;
+        },
+        TaskPriority::Background);
   }
+  return slot;
 }
 
-// appending the record to the file
-size_t SegmentMgr::append(uint64_t hash, std::string_view key,
-                          std::string_view val) {
+// the segment the appends go to next, under mu (or in the constructor). it
+// takes the spare file if there is one
+std::shared_ptr<Segment> SegmentMgr::nextSegment() {
+  size_t id = next_id++;
+  if (files.preallocate && files.background) {
+    std::error_code ec;
+    std::filesystem::rename(dir + SPARE_FILE,
+                            dir + "/segment_" + std::to_string(id) + ".kv",
+                            ec);
+  }
+  auto seg =
+      std::make_shared<Segment>(id, dir, io, budget, bloomBits(max_size));
+  seg->versionsFrom(files.versions);
+  if (files.preallocate)
+    seg->preallocate(max_size); // a no-op for the blocks of the spare
+  return seg;
+}
+
+// bits of the bloom filter for a segment of about bytes of records, 0 (the
+// default filter) unless tuned
+size_t SegmentMgr::bloomBits(size_t bytes) const {
+  size_t per_key = bloom_per_key, rec = record_bytes;
+  if (per_key == 0 || rec == 0)
+    return 0;
+  return std::clamp(bytes / rec * per_key, MIN_BLOOM_BITS, MAX_BLOOM_BITS);
+}
+
+void SegmentMgr::tune(size_t segment_size, size_t bloom_bits_per_key,
+                      size_t record_bytes) {
   std::lock_guard lock(mu);
+  if (segment_size)
+    max_size = segment_size;
+  bloom_per_key = bloom_bits_per_key;
+  this->record_bytes = record_bytes;
+}
+
+// closes the current segment and starts the next one, the caller holds mu
+void SegmentMgr::rotate() {
+  auto next = nextSegment();
+  std::unique_lock list_lock(list_mu);
+  current->seal();
+  closed.push_back(std::move(current));
+  current = std::move(next);
+}
 
-  size_t off = current->appendRecord(hash, key, val);
+// appending an encoded record to the file, blocks until it is written. the
+// slot has no segment if the write failed
+AppendSlot SegmentMgr::append(std::string_view record) {
+  if (files.direct) {
+    // the direct writes rewrite the block the last one ended in, they go out
+    // one at a time in the order of their offsets
+    std::lock_guard lock(mu);
+    AppendSlot slot = place(record.size());
+    if (slot.seg->writeDirect(record.data(), record.size(), slot.offset) !=
+        static_cast<long>(record.size())) {
+      slot.seg->abandon(slot.offset, record.size());
+      slot.seg = nullptr;
+    }
+    return slot;
+  }
+  AppendSlot slot = reserve(record.size());
+  long res = io->write_sync(slot.seg->fileDescriptor(), record.data(),
+                            record.size(), slot.offset);
+  if (res != static_cast<long>(record.size())) {
+    slot.seg->abandon(slot.offset, record.size());
+    slot.seg = nullptr;
+  }
+  return slot;
+}
+
+// writes fresh index and bloom checkpoints of the segments that changed since
+// their last one. ind_mu is the owner's index lock, held shared while the
+// indexes are copied so no indexRecord runs meanwhile
+void SegmentMgr::checkpoint(std::shared_mutex &ind_mu) {
+  std::lock_guard maint_lock(maint_mu);
+  std::vector<std::pair<std::shared_ptr<Segment>, SegmentCheckpoint>> work;
+  {
+    // no new reservations while we wait for the in flight ones to land
+    std::lock_guard lock(mu);
+    std::vector<std::shared_ptr<Segment>> segs;
+    {
+      std::shared_lock list_lock(list_mu);
+      segs = closed;
+      segs.push_back(current);
+    }
+    for (auto &s : segs) {
+      if (s->checkpointedUpTo() != s->size())
+        s->waitIdle();
+    }
+    std::shared_lock ind_lock(ind_mu);
+    for (auto &s : segs) {
+      SegmentCheckpoint cp;
+      if (s->snapshot(cp))
+        work.emplace_back(s, std::move(cp));
+    }
+  }
+  // the file writes happen without holding anything
+  for (auto &[seg, cp] : work)
+    seg->writeCheckpoint(cp);
+}
 
-  // rotate if segment is too large
-  if (static_cast<size_t>(off) >= max_size) {
-    closed.push_back(current);
-    current = new Segment(next_id++, dir, max_size);
+// the renames of an attach that did not finish before a crash. its list was
+// written first, so either all of the segments show up or none of them
+void SegmentMgr::finishAttach() {
+  std::string list = dir + "/attach.list";
+  std::ifstream in(list);
+  if (!in)
+    return;
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t space = line.find(' ');
+    if (space == std::string::npos)
+      continue;
+    std::string from = line.substr(space + 1);
+    std::string to = dir + "/segment_" + line.substr(0, space);
+    for (const char *ext : {".kv", ".idx", ".bf"}) {
+      std::error_code ec; // the ones renamed already are gone
+      std::filesystem::rename(from + ext, to + ext, ec);
+    }
   }
-  return off;
+  in.close();
+  std::error_code ec;
+  std::filesystem::remove(list, ec);
 }
 
-// to check if certain element is present or not
+// adds whole segments built elsewhere (bulk_loader.hpp), paths without the
+// extension. they come after everything written so far and before anything
+// written from now on
+bool SegmentMgr::attach(const std::vector<std::string> &paths) {
+  std::lock_guard maint_lock(maint_mu); // no compaction renames meanwhile
+  std::lock_guard lock(mu);
+  std::string list;
+  size_t first = next_id;
+  for (size_t i = 0; i < paths.size(); ++i)
+    list += std::to_string(first + i) + ' ' + paths[i] + '\n';
+  atomicWrite(dir + "/attach.list", {{list.data(), list.size()}});
+  if (!std::filesystem::exists(dir + "/attach.list"))
+    return false;
+  next_id += paths.size();
+  finishAttach();
+
+  std::vector<std::shared_ptr<Segment>> added;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    added.push_back(std::make_shared<Segment>(first + i, dir, io, budget));
+    added.back()->versionsFrom(files.versions);
+  }
+  auto next = nextSegment();
+  std::unique_lock list_lock(list_mu);
+  // an empty current stays behind as an empty closed segment, a replica may
+  // be positioned in it
+  current->seal();
+  closed.push_back(std::move(current));
+  for (auto &s : added) {
+    s->seal();
+    closed.push_back(std::move(s));
+  }
+  current = std::move(next);
+  return true;
+}
+
+// hard links the files of every closed segment into dest, after closing the
+// current one so everything written so far is in there. a closed segment's
+// files are never written in place (compaction and checkpoints rename new
+// ones over them), so the links keep the data as it was
+bool SegmentMgr::snapshot(
+    std::shared_mutex &ind_mu, const std::string &dest,
+    const std::function<bool(const std::string &)> &also) {
+  std::lock_guard maint_lock(maint_mu); // no compaction swaps files meanwhile
+  std::vector<std::shared_ptr<Segment>> segs;
+  std::vector<std::pair<std::shared_ptr<Segment>, SegmentCheckpoint>> work;
+  {
+    std::lock_guard lock(mu);
+    if (current->size() > 0)
+      rotate();
+    {
+      std::shared_lock list_lock(list_mu);
+      segs = closed;
+    }
+    // the writes still landing in the segment just closed
+    for (auto &s : segs) {
+      if (s->checkpointedUpTo() != s->size())
+        s->waitIdle();
+    }
+    std::shared_lock ind_lock(ind_mu);
+    for (auto &s : segs) {
+      SegmentCheckpoint cp;
+      if (s->snapshot(cp))
+        work.emplace_back(s, std::move(cp));
+    }
+  }
+  for (auto &[seg, cp] : work)
+    seg->writeCheckpoint(cp);
+
+  // built next to it and renamed, a snapshot is there whole or not at all
+  std::error_code ec;
+  std::string tmp = dest + ".tmp";
+  std::filesystem::remove_all(tmp, ec);
+  std::filesystem::create_directories(tmp, ec);
+  if (ec)
+    return false;
+  for (auto &s : segs) {
+    if (s->size() == 0)
+      continue;
+    std::string name = "/segment_" + std::to_string(s->getId());
+    std::filesystem::create_hard_link(dir + name + ".kv", tmp + name + ".kv",
+                                      ec);
+    if (ec) {
+      std::filesystem::remove_all(tmp, ec);
+      return false;
+    }
+    // a missing checkpoint gets rebuilt from the records on open
+    for (const char *ext : {".idx", ".bf"}) {
+      std::error_code missing;
+      std::filesystem::create_hard_link(dir + name + ext, tmp + name + ext,
+                                        missing);
+    }
+  }
+  if (also && !also(tmp)) {
+    std::filesystem::remove_all(tmp, ec);
+    return false;
+  }
+  std::filesystem::rename(tmp, dest, ec);
+  return !ec;
+}
+
+// makes dir a model opened from the snapshot, by linking its files again
+bool restoreSnapshot(const std::string &snapshot, const std::string &dir) {
+  std::error_code ec;
+  if (!std::filesystem::is_directory(snapshot, ec) ||
+      std::filesystem::exists(dir, ec))
+    return false;
+  // built next to the snapshot, the data dir only ever sees whole models
+  std::string tmp = snapshot + ".restore";
+  std::filesystem::remove_all(tmp, ec);
+  std::filesystem::create_directories(tmp, ec);
+  if (ec)
+    return false;
+  for (const auto &entry : std::filesystem::directory_iterator(snapshot, ec)) {
+    std::filesystem::create_hard_link(entry.path(),
+                                      tmp + "/" +
+                                          entry.path().filename().string(),
+                                      ec);
+    if (ec)
+      break;
+  }
+  if (!ec)
+    std::filesystem::rename(tmp, dir, ec);
+  if (ec)
+    std::filesystem::remove_all(tmp, ec);
+  return std::filesystem::is_directory(dir, ec);
+}
+
+std::vector<ScanSegment> SegmentMgr::segments() {
+  // the end of the active segment moves under mu, seal() sets the mappings
+  // under the locks
+  std::lock_guard lock(mu);
+  std::shared_lock list_lock(list_mu);
+  std::vector<ScanSegment> out;
+  out.reserve(closed.size() + 1);
+  for (const auto &s : closed)
+    out.push_back({s, s->mapped(), s->size()});
+  out.push_back({current, current->mapped(), current->size()});
+  return out;
+}
+
+size_t SegmentMgr::liveBytes() {
+  std::shared_lock list_lock(list_mu);
+  size_t live = 0;
+  for (const auto &s : closed)
+    live += s->size() - std::min(s->size(), s->deadBytes());
+  return live + current->size() -
+         std::min(current->size(), current->deadBytes());
+}
+
+uint64_t SegmentMgr::topVersion() {
+  std::shared_lock list_lock(list_mu);
+  uint64_t top = current->topVersion();
+  for (const auto &s : closed)
+    top = std::max(top, s->topVersion());
+  return top;
+}
+
+// to check if certain element is present or not. the newest entry of the key
+// decides, a tombstone there means it was erased
 bool SegmentMgr::lookup(uint64_t hash, SegmentOffset &out) {
+  TraceSpan span("index lookup");
+  span.note("segments", 1);
+  std::shared_lock list_lock(list_mu);
+  uint64_t probed = 1, false_hits = 0;
+  bool found = false;
   // Check active segment first
-  if (current->lookup(hash, out))
+  if (current->lookup(hash, out, &false_hits)) {
+    out.owner = current;
+    found = true;
+  }
+  // Then check closed segments, newest first so an update wins over the
+  // version it replaced
+  for (auto it = closed.rbegin(); !found && it != closed.rend(); ++it) {
+    span.note("segments", ++probed);
+    if ((*it)->lookup(hash, out, &false_hits)) {
+      out.owner = *it;
+      found = true;
+    }
+  }
+  if (lookups)
+    lookups->bloom(probed, false_hits);
+  return found && !out.deleted;
+}
+
+bool SegmentMgr::locate(size_t id, uint64_t entry, SegmentOffset &out) {
+  std::shared_lock list_lock(list_mu);
+  std::shared_ptr<Segment> seg = current->getId() == id ? current : nullptr;
+  for (auto it = closed.begin(); !seg && it != closed.end(); ++it) {
+    if ((*it)->getId() == id)
+      seg = *it;
+  }
+  if (!seg)
+    return false;
+  out = {id,
+         indexOffset(entry),
+         seg->fileDescriptor(),
+         indexSize(entry),
+         indexDeleted(entry),
+         seg->mapped(),
+         seg,
+         indexMerge(entry)};
+  return true;
+}
+
+void SegmentMgr::mergeHeads(std::vector<SegmentOffset> &out) {
+  std::vector<std::shared_ptr<Segment>> segs;
+  {
+    std::shared_lock list_lock(list_mu);
+    segs = closed;
+    segs.push_back(current);
+  }
+  std::vector<std::pair<uint64_t, uint64_t>> entries;
+  for (auto &s : segs) {
+    entries.clear();
+    s->mergeEntries(entries);
+    for (const auto &[hash, entry] : entries) {
+      SegmentOffset off;
+      if (!newerHas(hash, s->getId()) && locate(s->getId(), entry, off))
+        out.push_back(std::move(off));
+    }
+  }
+}
+
+std::shared_ptr<Segment> SegmentMgr::find(size_t id) {
+  std::shared_lock list_lock(list_mu);
+  if (current->getId() == id)
+    return current;
+  for (auto &s : closed) {
+    if (s->getId() == id)
+      return s;
+  }
+  return nullptr;
+}
+
+// a timer of the timing wheel went off, the caller holds its index lock
+// exclusively. false if the key got a newer version since
+bool SegmentMgr::expire(const ExpiryTimer &t) {
+  auto seg = find(t.segment_id);
+  return seg && seg->expire(t.hash, t.expires_at);
+}
+
+// a record of the segment became unreachable, compaction goes by these
+void SegmentMgr::markDead(size_t segment_id, size_t bytes) {
+  if (auto seg = find(segment_id))
+    seg->markDead(bytes);
+}
+
+// the TTL timers of all the segments, to fill the wheel after a restart
+void SegmentMgr::timers(std::vector<ExpiryTimer> &out) {
+  std::shared_lock list_lock(list_mu);
+  for (auto &s : closed)
+    s->timers(out);
+  current->timers(out);
+}
+
+// whether a segment older than id has an index entry for hash
+bool SegmentMgr::olderHas(uint64_t hash, size_t id) {
+  std::shared_lock list_lock(list_mu);
+  for (auto &s : closed) {
+    if (s->getId() < id && s->indexEntry(hash).has_value())
+      return true;
+  }
+  return false;
+}
+
+// whether a segment newer than id has an index entry for hash
+bool SegmentMgr::newerHas(uint64_t hash, size_t id) {
+  std::shared_lock list_lock(list_mu);
+  if (current->getId() > id && current->indexEntry(hash).has_value())
     return true;
-  // Then check closed segments in order
-  for (auto *s : closed) {
-    if (s->lookup(hash, out))
+  for (auto &s : closed) {
+    if (s->getId() > id && s->indexEntry(hash).has_value())
       return true;
   }
   return false;
 }
 
+// rewrites the closed segments with at least min_dead_ratio of garbage,
+// returns how many it did. the appends keep going meanwhile
+size_t SegmentMgr::compact(std::shared_mutex &ind_mu, double min_dead_ratio) {
+  std::lock_guard maint_lock(maint_mu);
+  std::vector<std::shared_ptr<Segment>> picked;
+  {
+    std::shared_lock list_lock(list_mu);
+    for (auto &s : closed) {
+      if (s->size() && s->deadBytes() >= min_dead_ratio * s->size())
+        picked.push_back(s);
+    }
+  }
+  size_t done = 0;
+  for (auto &s : picked) {
+    if (compactSegment(s, ind_mu))
+      ++done;
+  }
+  return done;
+}
+
+// bytes [off, off + len) of a segment file, straight out of its mapping when
+// there is one. shorter at the end of the file, empty on errors
+static std::string_view readSpan(IoEngine &io, int fd, std::string_view map,
+                                 size_t off, size_t len,
+                                 std::vector<char> &buf) {
+  if (off + len <= map.size())
+    return map.substr(off, len);
+  buf.resize(len);
+  long r = io.read_sync(fd, buf.data(), len, off);
+  return r > 0 ? std::string_view(buf.data(), static_cast<size_t>(r))
+               : std::string_view();
+}
+
+// copies the records walk gets to out, for shipping them to a replica
+TailStatus SegmentMgr::tail(LogPosition &pos, std::string &out, size_t max) {
+  out.clear();
+  return walk(pos, max,
+              [&out](const RecordView &, std::string_view rec, size_t,
+                     size_t) {
+                out += rec;
+                return true;
+              });
+}
+
+// hands fn the whole records appended after pos, about max bytes of them, and
+// moves pos past them. the log runs through the segments oldest first; a
+// record still being written ends the walk, the next call gets it
+TailStatus SegmentMgr::walk(LogPosition &pos, size_t max, const LogFn &fn) {
+  std::vector<char> buf;
+  std::string tombstone;
+  size_t given = 0;
+  while (given < max) {
+    std::shared_ptr<Segment> seg;
+    std::string_view map; // seal() sets it under the locks
+    size_t end, next = 0;
+    bool active;
+    {
+      // the end of the active segment moves under mu
+      std::lock_guard lock(mu);
+      std::shared_lock list_lock(list_mu);
+      if (pos.segment_id == 0)
+        pos = {closed.empty() ? current->getId() : closed.front()->getId(), 0,
+               0};
+      for (auto &s : closed) {
+        if (s->getId() == pos.segment_id)
+          seg = s;
+        else if (s->getId() > pos.segment_id && !next)
+          next = s->getId();
+      }
+      active = current->getId() == pos.segment_id;
+      if (active)
+        seg = current;
+      else if (!next && current->getId() > pos.segment_id)
+        next = current->getId();
+      if (!seg)
+        return TailStatus::Lost; // compacted away
+      end = seg->size();
+      map = seg->mapped();
+    }
+    int fd = seg->fileDescriptor();
+    if (pos.offset > end)
+      return TailStatus::Lost;
+    if (pos.offset > 0) {
+      std::string_view last =
+          readSpan(*io, fd, map, pos.offset - sizeof(uint32_t),
+                   sizeof(uint32_t), buf);
+      if (last.size() != sizeof(uint32_t) ||
+          std::memcmp(last.data(), &pos.crc, sizeof(uint32_t)) != 0)
+        return TailStatus::Lost;
+    }
+    if (pos.offset == end) {
+      if (active || !next)
+        return TailStatus::Drained;
+      pos = {next, 0, 0};
+      continue;
+    }
+
+    std::string_view data = readSpan(*io, fd, map, pos.offset,
+                                     std::min(end - pos.offset, max), buf);
+    if (data.empty())
+      return TailStatus::Drained; // read error, try again later
+    size_t used = 0;
+    bool stuck = false;
+    bool more = true;
+    while (used < data.size() && given < max && more) {
+      const char *at = data.data() + used;
+      RecordView view;
+      auto st = decodeRecord(at, data.size() - used, view);
+      if (st == DecodeStatus::Short && pos.offset + view.size() <= end) {
+        if (used > 0)
+          break; // runs past the read, the next round starts with it
+        // bigger than the read, get exactly this one record
+        data = readSpan(*io, fd, map, pos.offset, view.size(), buf);
+        if (data.size() < view.size())
+          return TailStatus::Drained;
+        continue;
+      }
+      if (st == DecodeStatus::Corrupt &&
+          decodeRecord(at, data.size() - used, view, false) ==
+              DecodeStatus::Ok &&
+          legacyTombstone(at, view)) {
+        // goes on as a proper tombstone, the replicas check the crc
+        RecordView fixed;
+        encodeRecord(tombstone, view.key, {}, REC_TOMBSTONE);
+        decodeRecord(tombstone.data(), tombstone.size(), fixed);
+        given += tombstone.size();
+        more = fn(fixed, tombstone, pos.segment_id, pos.offset);
+      } else if (st != DecodeStatus::Ok) {
+        stuck = true; // not written yet (or torn)
+        break;
+      } else if (!(view.flags & REC_PADDING)) {
+        given += view.size();
+        more = fn(view, std::string_view(at, view.size()), pos.segment_id,
+                  pos.offset);
+      }
+      used += view.size();
+      pos.offset += view.size();
+      std::memcpy(&pos.crc, at + view.size() - sizeof(uint32_t),
+                  sizeof(uint32_t));
+    }
+    if (!more)
+      break;
+    if (!stuck)
+      continue;
+    // nothing writes into a closed segment that is idle, what is left there
+    // is a hole whose padding failed too. the replicas skip it
+    if (!active && seg->idle() && next) {
+      pos = {next, 0, 0};
+      continue;
+    }
+    return TailStatus::Drained;
+  }
+  return TailStatus::More;
+}
+
+static bool writeAll(int fd, const std::string &data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t w = ::write(fd, data.data() + done, data.size() - done);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    done += static_cast<size_t>(w);
+  }
+  return true;
+}
+
+// copies the records of seg that still matter into a new file and swaps it
+// in under the same id. dropped are the records replaced by a newer one and
+// the erased or expired ones with no older version left to hide, the other
+// erased or expired ones shrink to a tombstone
+bool SegmentMgr::compactSegment(const std::shared_ptr<Segment> &seg,
+                                std::shared_mutex &ind_mu) {
+  seg->waitIdle();
+  size_t id = seg->getId();
+  std::string data_path = dir + "/segment_" + std::to_string(id);
+  std::string tmp_path = data_path + ".kv.compact";
+
+  std::string_view data = seg->mapped();
+  std::vector<char> copy;
+  if (data.size() < seg->size()) {
+    copy.resize(seg->size());
+    long r = io->read_sync(seg->fileDescriptor(), copy.data(), copy.size(), 0);
+    if (r < 0)
+      return false;
+    data = std::string_view(copy.data(), static_cast<size_t>(r));
+  }
+
+  int out =
+      ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0)
+    return false;
+  constexpr size_t FLUSH_AT = 1 << 20;
+  std::string chunk, tombstone;
+  std::vector<std::string> blobs; // of the records dropped or shrunk
+  size_t written = 0;
+  bool ok = true;
+  uint64_t now = utils::nowMs();
+  size_t pos = 0;
+  while (ok && pos < data.size()) {
+    RecordView view;
+    if (decodeRecord(data.data() + pos, data.size() - pos, view, false) !=
+        DecodeStatus::Ok)
+      break;
+    size_t at = pos;
+    pos += view.size();
+    if (view.flags & REC_PADDING)
+      continue;
+
+    uint64_t hash = fnv1a(view.key);
+    bool keep = false, deleted = false;
+    {
+      std::shared_lock ind_lock(ind_mu);
+      auto entry = seg->indexEntry(hash);
+      // otherwise an older version
+      if (entry.has_value() && indexOffset(entry.value()) == at &&
+          !newerHas(hash, id)) {
+        deleted = indexDeleted(entry.value()) || !(view.flags & REC_ALIVE) ||
+                  view.expired(now);
+        keep = !deleted || olderHas(hash, id);
+      }
+    }
+    // the out of line value of a record that does not stay is garbage now
+    if ((view.flags & REC_BLOB) && (!keep || deleted))
+      blobs.emplace_back(view.val);
+    if (!keep)
+      continue;
+    if (deleted) {
+      encodeRecord(tombstone, view.key, {}, REC_TOMBSTONE);
+      chunk += tombstone;
+    } else {
+      chunk.append(data.data() + at, view.size());
+    }
+    if (chunk.size() >= FLUSH_AT) {
+      ok = writeAll(out, chunk);
+      written += chunk.size();
+      chunk.clear();
+    }
+  }
+  ok = ok && writeAll(out, chunk) && ::fdatasync(out) == 0;
+  written += chunk.size();
+  ::close(out);
+  if (!ok) {
+    std::error_code ec;
+    std::filesystem::remove(tmp_path, ec);
+    return false;
+  }
+
+  // the old checkpoint files go first: a crash from here on replays whichever
+  // .kv is in place, both hold the same live data
+  seg->retire();
+  std::error_code ec;
+  std::filesystem::remove(data_path + ".idx", ec);
+  std::filesystem::remove(data_path + ".bf", ec);
+  std::shared_ptr<Segment> fresh;
+  if (written == 0) {
+    std::filesystem::remove(tmp_path, ec);
+    std::filesystem::remove(data_path + ".kv", ec);
+  } else {
+    std::filesystem::rename(tmp_path, data_path + ".kv", ec);
+    if (ec)
+      return false; // the old file stays, it gets replayed on the next open
+    fresh = std::make_shared<Segment>(id, dir, io, budget, bloomBits(written));
+    fresh->versionsFrom(files.versions);
+    fresh->seal();
+    SegmentCheckpoint cp;
+    if (fresh->snapshot(cp))
+      fresh->writeCheckpoint(cp);
+  }
+
+  // readers still holding the old one keep it open until they are done
+  std::unique_lock ind_lock(ind_mu);
+  std::unique_lock list_lock(list_mu);
+  auto it = std::find(closed.begin(), closed.end(), seg);
+  if (it == closed.end())
+    return false;
+  if (fresh)
+    *it = std::move(fresh);
+  else
+    closed.erase(it);
+  ind_lock.unlock();
+  list_lock.unlock();
+  if (blobs_dropped && !blobs.empty())
+    blobs_dropped(blobs);
+  return true;
+}
+
 } // namespace kv
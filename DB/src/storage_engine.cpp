@@ -1,188 +1,281 @@
 #include "../include/kv/storage_engine.hpp"
+#include "../include/kv/hash_engine.hpp"
 #include "../include/kv/hash_func.hpp"
+#include "../include/kv/lsm_engine.hpp"
 #include "../include/kv/utils.hpp"
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <filesystem>
-#include <fstream>
-#include <ios>
-#include <iosfwd>
+#include <future>
+#include <iostream>
+#include <memory>
 #include <mutex>
 #include <optional>
-#include <shared_mutex>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 namespace kv {
 
-StorageEngine::StorageEngine(const std::string &dir, size_t seg_size)
-    : seg_mgr(dir, seg_size), dir(dir) {}
-
-// the put functtion implementation
-void StorageEngine::put(const std::string &key, const std::string &val) {
-  std::string_view k(key), v(val);
-  uint64_t hash = fnv1a(k);
-  // lock the that thing
-  std::unique_lock lock(ind_mu);
-  seg_mgr.append(hash, k, v);
-}
-
-// the get function
-std::optional<std::string> StorageEngine::get(const std::string &key) {
-  uint64_t hash = fnv1a(key);
-  SegmentOffset off;
-  {
-    // scope for shared lock
-    std::shared_lock lock(ind_mu);
-    if (!seg_mgr.lookup(hash, off)) {
-      return std::nullopt;
+StorageEngine::StorageEngine() : last_version(utils::nowMs() << 10) {}
+
+void StorageEngine::seed_version(uint64_t version) {
+  uint64_t last = last_version;
+  while (last < version && !last_version.compare_exchange_weak(last, version)) {
+  }
+}
+
+std::shared_ptr<StorageEngine> StorageEngine::open(const std::string &kind,
+                                                   const std::string &dir,
+                                                   const StorageOptions &opts) {
+  // the files of a model decide, a change of the config only applies to the
+  // models created after it
+  std::string found;
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    std::string name = entry.path().filename().string();
+    if (name == LSM_MANIFEST || name.rfind("wal_", 0) == 0) {
+      found = "lsm";
+      break;
+    }
+    if (name.rfind("segment_", 0) == 0) {
+      found = "hash";
+      break;
     }
   }
+  if (found.empty())
+    found = kind;
+  if (found == "lsm")
+    return std::make_shared<LsmEngine>(dir, opts);
+  if (found != "hash")
+    std::cerr << "unknown storage engine " << found << ", using hash" << '\n';
+  return std::make_shared<HashEngine>(dir, opts);
+}
 
-  // Build the filename for this segment
-  std::string path = dir + "/segment_" + std::to_string(off.segment_id) + ".kv";
+// the slow way for engines without an order: all the live records are copied
+// and sorted
+void StorageEngine::scan_range(std::string_view from, std::string_view to,
+                               size_t limit, const RecordFn &fn) {
+  struct Copy {
+    std::string key, val, clock;
+    uint8_t flags;
+    uint64_t expires_at, version;
+    uint32_t record_len;
+  };
+  std::vector<Copy> found;
+  scan_records([&](const RecordView &rec) {
+    if (rec.key < from || (!to.empty() && rec.key >= to))
+      return;
+    found.push_back({std::string(rec.key), std::string(rec.val),
+                     std::string(rec.clock), rec.flags, rec.expires_at,
+                     rec.version, rec.record_len});
+  });
+  std::sort(found.begin(), found.end(),
+            [](const Copy &a, const Copy &b) { return a.key < b.key; });
+  if (limit && found.size() > limit)
+    found.resize(limit);
+  for (const auto &c : found) {
+    RecordView view;
+    view.record_len = c.record_len;
+    view.flags = c.flags;
+    view.expires_at = c.expires_at;
+    view.version = c.version;
+    view.clock = c.clock;
+    view.key = c.key;
+    view.val = c.val;
+    fn(view);
+  }
+}
 
-  // Open for read
-  std::ifstream in(path, std::ios::binary);
-  if (!in)
-    return std::nullopt;
+bool StorageEngine::attach(const std::vector<std::string> &) { return false; }
 
-  // Seek to record start
-  in.seekg(off.offset);
-  if (!in)
-    return std::nullopt;
+// nothing to ship, the replicas do not follow the model
+TailStatus StorageEngine::tail(LogPosition &, std::string &out, size_t) {
+  out.clear();
+  return TailStatus::Unsupported;
+}
 
-  // Read recordLen, keyLen, valLen, flags, reserved
-  uint32_t recordLen, keyLen, valLen;
-  uint8_t flags, reserved;
-  in.read(reinterpret_cast<char *>(&recordLen), sizeof(recordLen));
-  in.read(reinterpret_cast<char *>(&keyLen), sizeof(keyLen));
-  in.read(reinterpret_cast<char *>(&valLen), sizeof(valLen));
-  in.read(reinterpret_cast<char *>(&flags), sizeof(flags));
-  in.read(reinterpret_cast<char *>(&reserved), sizeof(reserved));
-
-  // Read key and value
-  std::string keyBuf(keyLen, '\0');
-  std::string valBuf(valLen, '\0');
-  in.read(keyBuf.data(), keyLen);
-  in.read(valBuf.data(), valLen);
-
-  // If tombstone, treat as not found
-  if (flags == 0)
-    return std::nullopt;
+TailStatus StorageEngine::scan_keys(LogPosition &, size_t, size_t,
+                                    std::vector<std::string> &) {
+  return TailStatus::Unsupported;
+}
 
-  // Optionally verify key matches
-  if (keyBuf != key)
-    return std::nullopt;
+// values stored inline, the handle holds a copy
+bool StorageEngine::get_blob(std::string_view key, BlobHandle &out) {
+  thread_local Buffer buf;
+  if (!get_into(key, buf))
+    return false;
+  out = BlobHandle(std::string(buf.value()), buf.flags());
+  return true;
+}
 
-  // Read and verify CRC
-  uint32_t storedCrc;
-  in.read(reinterpret_cast<char *>(&storedCrc), sizeof(storedCrc));
-
-  // Recompute CRC over the record payload
-  in.seekg(off.offset + sizeof(recordLen));
-  std::vector<uint8_t> payload(recordLen - sizeof(storedCrc));
-  in.read(reinterpret_cast<char *>(payload.data()), payload.size());
-  uint32_t computed = utils::crc32(payload.data(), payload.size());
-  if (computed != storedCrc) {
-    // data corruption!
-    return std::nullopt;
-  }
+std::unique_ptr<BlobWriter> StorageEngine::open_blob(uint64_t) {
+  return nullptr;
+}
 
-  return valBuf;
+uint64_t StorageEngine::put_blob(std::string_view, BlobWriter &, bool,
+                                 uint64_t) {
+  return 0;
 }
 
-// erase functionality, makes the previosly appended record to 0, makes it
-// tombstone
-bool StorageEngine::erase(const std::string &key) {
-  uint64_t hash = fnv1a(key);
-  SegmentOffset off;
-  {
-    std::shared_lock lock(ind_mu);
-    if (!seg_mgr.lookup(hash, off)) {
-      return false;
-    }
-  }
+void StorageEngine::get_async(const std::string &key, GetCallback cb) {
+  thread_local Buffer buf;
+  if (!get_into(key, buf))
+    return cb(std::nullopt, 0);
+  cb(std::string(buf.value()), buf.flags());
+}
 
-  std::string path = dir + "/segment_" + std::to_string(off.segment_id) + ".kv";
+void StorageEngine::put_async(const std::string &key, const std::string &val,
+                              bool is_json, PutCallback cb) {
+  bool ok = put(key, val, is_json) != 0;
+  if (cb)
+    cb(ok);
+}
 
-  // Open for update (read + write)
-  std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
-  if (!file)
-    return false;
+std::future<std::optional<std::string>>
+StorageEngine::get_async(const std::string &key) {
+  auto done = std::make_shared<std::promise<std::optional<std::string>>>();
+  auto fut = done->get_future();
+  get_async(key, [done](std::optional<std::string> val, uint8_t) {
+    done->set_value(std::move(val));
+  });
+  return fut;
+}
 
-  // Seek to the record offset
-  file.seekg(off.offset);
-  if (!file)
-    return false;
+std::future<bool> StorageEngine::put_async(const std::string &key,
+                                           const std::string &val,
+                                           bool is_json) {
+  auto done = std::make_shared<std::promise<bool>>();
+  auto fut = done->get_future();
+  put_async(key, val, is_json, [done](bool ok) { done->set_value(ok); });
+  return fut;
+}
 
-  // Read header fields to locate the flag byte
-  uint32_t recordLen, keyLen, valLen;
-  uint8_t flags, reserved;
-  file.read(reinterpret_cast<char *>(&recordLen), sizeof(recordLen));
-  file.read(reinterpret_cast<char *>(&keyLen), sizeof(keyLen));
-  file.read(reinterpret_cast<char *>(&valLen), sizeof(valLen));
+// the get function, copies the value out of a per thread buffer
+std::optional<std::string> StorageEngine::get(std::string_view key,
+                                              bool *is_json) {
+  thread_local Buffer buf;
+  if (!get_into(key, buf))
+    return std::nullopt;
+  if (is_json)
+    *is_json = buf.flags() & REC_JSON;
+  return std::string(buf.value());
+}
 
-  std::streampos flag_pos = file.tellg(); // Position of the flag byte
-  file.read(reinterpret_cast<char *>(&flags), sizeof(flags));
-  file.read(reinterpret_cast<char *>(&reserved), sizeof(reserved));
+std::recursive_mutex &StorageEngine::key_lock(std::string_view key) {
+  return key_locks[fnv1a(key) % key_locks.size()];
+}
 
-  // Only set tombstone if not already set
-  if (flags == 0)
-    return true; // Already deleted
+WriteStatus StorageEngine::update(std::string_view key, const UpdateFn &fn,
+                                  bool is_json, uint64_t ttl_ms) {
+  std::lock_guard lock(key_lock(key));
+  thread_local Buffer buf;
+  bool found = get_into(key, buf);
+  auto next = found ? fn(buf.value(), buf.flags()) : fn(std::nullopt, 0);
+  if (!next)
+    return WriteStatus::Conflict;
+  uint64_t now = utils::nowMs();
+  if (!ttl_ms && found && buf.expires_at())
+    ttl_ms = buf.expires_at() > now ? buf.expires_at() - now : 1;
+  return put(key, *next, is_json, ttl_ms) ? WriteStatus::Ok
+                                          : WriteStatus::Failed;
+}
 
-  // Move file pointer back to flag position
-  file.seekp(flag_pos);
-  uint8_t tombstone = 0;
-  file.write(reinterpret_cast<char *>(&tombstone), sizeof(tombstone));
-  file.flush();
+bool StorageEngine::merge(std::string_view key, MergeOp op,
+                          std::string_view operand) {
+  std::lock_guard lock(key_lock(key));
+  thread_local Buffer buf;
+  thread_local std::string list, val;
+  list.clear();
+  appendOperand(list, op, operand);
+  std::optional<std::string_view> base;
+  if (get_into(key, buf))
+    base = buf.value();
+  bool is_json = foldOperands(base, {list}, val);
+  return put(key, val, is_json) != 0;
+}
 
-  return true;
+// 0 for a missing key, a key is always locked here
+uint64_t StorageEngine::current_version(std::string_view key) {
+  thread_local Buffer buf;
+  return get_into(key, buf) ? buf.version() : 0;
 }
 
-std::vector<std::pair<std::string, std::string>>
-StorageEngine::get_all() const {
-  std::vector<std::pair<std::string, std::string>> results;
+WriteResult StorageEngine::put_if(std::string_view key, std::string_view val,
+                                  uint64_t version, bool is_json,
+                                  uint64_t ttl_ms) {
+  if (val.empty())
+    return erase_if(key, version);
+  std::lock_guard lock(key_lock(key));
+  uint64_t cur = current_version(key);
+  if (cur != version)
+    return {WriteStatus::Conflict, cur};
+  uint64_t next = put(key, val, is_json, ttl_ms);
+  return {next ? WriteStatus::Ok : WriteStatus::Failed, next};
+}
 
-  // This is inefficient as we'll read all files - in a real implementation,
-  // you'd want this to be optimized with some form of index
-  std::filesystem::path data_path(dir);
-  for (const auto &entry : std::filesystem::directory_iterator(data_path)) {
-    if (entry.path().extension() == ".kv") {
-      std::ifstream file(entry.path(), std::ios::binary);
-
-      while (file) {
-        // Read record header
-        uint32_t recordLen, keyLen, valLen;
-        uint8_t flags, reserved;
-
-        // Try to read record length
-        if (!file.read(reinterpret_cast<char *>(&recordLen), sizeof(recordLen)))
-          break;
-
-        // Read the rest of the header
-        file.read(reinterpret_cast<char *>(&keyLen), sizeof(keyLen));
-        file.read(reinterpret_cast<char *>(&valLen), sizeof(valLen));
-        file.read(reinterpret_cast<char *>(&flags), sizeof(flags));
-        file.read(reinterpret_cast<char *>(&reserved), sizeof(reserved));
-
-        // Read key and value
-        std::string key(keyLen, '\0');
-        std::string val(valLen, '\0');
-        file.read(key.data(), keyLen);
-        file.read(val.data(), valLen);
-
-        // Skip CRC
-        file.seekg(sizeof(uint32_t), std::ios::cur);
-
-        // If it's not a tombstone, add to results
-        if (flags != 0) {
-          results.emplace_back(key, val);
-        }
-      }
-    }
+WriteResult StorageEngine::erase_if(std::string_view key, uint64_t version) {
+  std::lock_guard lock(key_lock(key));
+  uint64_t cur = current_version(key);
+  if (cur != version)
+    return {WriteStatus::Conflict, cur};
+  if (cur != 0 && !erase(key))
+    return {WriteStatus::Failed, cur};
+  return {WriteStatus::Ok, 0};
+}
+
+WriteResult StorageEngine::put_blob_if(std::string_view key, BlobWriter &blob,
+                                       uint64_t version, bool is_json,
+                                       uint64_t ttl_ms) {
+  std::lock_guard lock(key_lock(key));
+  uint64_t cur = current_version(key);
+  if (cur != version)
+    return {WriteStatus::Conflict, cur};
+  uint64_t next = put_blob(key, blob, is_json, ttl_ms);
+  return {next ? WriteStatus::Ok : WriteStatus::Failed, next};
+}
+
+WriteStatus StorageEngine::write_batch(std::vector<BatchOp> &ops) {
+  if (ops.empty())
+    return WriteStatus::Ok;
+  // the stripes in address order, so two batches never wait on each other
+  std::vector<std::recursive_mutex *> stripes;
+  for (const auto &op : ops)
+    stripes.push_back(&key_lock(op.key));
+  std::sort(stripes.begin(), stripes.end());
+  stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+  std::vector<std::unique_lock<std::recursive_mutex>> locks;
+  for (auto *m : stripes)
+    locks.emplace_back(*m);
+
+  bool conflict = false;
+  for (auto &op : ops) {
+    op.version = 0;
+    if (!op.if_version)
+      continue;
+    op.version = current_version(op.key);
+    conflict |= op.version != *op.if_version;
   }
+  if (conflict)
+    return WriteStatus::Conflict;
+  for (auto &op : ops)
+    op.version = op.val.empty() ? 0 : next_version();
+  return commit_batch(ops) ? WriteStatus::Ok : WriteStatus::Failed;
+}
 
+void StorageEngine::scan(const ScanFn &fn) {
+  scan_records([&fn](const RecordView &rec) {
+    fn(rec.key, rec.val, rec.flags);
+  });
+}
+
+std::vector<std::pair<std::string, std::string>> StorageEngine::get_all() {
+  std::vector<std::pair<std::string, std::string>> results;
+  scan([&results](std::string_view key, std::string_view val, uint8_t) {
+    results.emplace_back(key, val);
+  });
   return results;
 }
 
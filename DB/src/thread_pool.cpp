@@ -1,29 +1,30 @@
 #include "../include/kv/thread_pool.hpp"
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 namespace kv {
 
+// the pool and index of the worker running on this thread, so its own jobs
+// go to its own deque
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local size_t current_worker = 0;
+
 ThreadPool::ThreadPool(size_t threads) {
-  for (size_t i = 0; i < threads; ++i) {
-    workers.emplace_back([this] {
-      while (true) {
-        std::function<void()> job;
-        {
-          std::unique_lock lock(mu);
-          cv.wait(lock, [&] { return stop || !tasks.empty(); });
-          if (stop && tasks.empty())
-            return;
-          job = std::move(tasks.front());
-          tasks.pop();
-        }
-        job();
-      }
-    });
-  }
+  if (threads == 0)
+    threads = 1;
+  for (size_t i = 0; i < threads; ++i)
+    queues.push_back(std::make_unique<Queue>());
+  for (size_t i = 0; i < threads; ++i)
+    workers.emplace_back([this, i] { run(i); });
 }
 
 ThreadPool::~ThreadPool() {
   {
-    std::unique_lock lock(mu);
+    std::lock_guard lock(mu);
     stop = true;
   }
   cv.notify_all();
@@ -31,12 +32,103 @@ ThreadPool::~ThreadPool() {
     w.join();
 }
 
-void ThreadPool::enqueue(std::function<void()> job) {
+// the deque a new job goes to
+size_t ThreadPool::home() {
+  if (current_pool == this)
+    return current_worker;
+  return next.fetch_add(1, std::memory_order_relaxed) % queues.size();
+}
+
+void ThreadPool::enqueue(std::function<void()> job, TaskPriority prio) {
+  Queue &q = *queues[home()];
+  {
+    std::lock_guard lock(q.mu);
+    q.jobs[static_cast<size_t>(prio)].push_back(std::move(job));
+  }
+  queued.fetch_add(1);
+  wake(1);
+}
+
+void ThreadPool::enqueue_batch(std::vector<std::function<void()>> jobs,
+                               TaskPriority prio) {
+  if (jobs.empty())
+    return;
+  Queue &q = *queues[home()];
+  {
+    std::lock_guard lock(q.mu);
+    auto &dq = q.jobs[static_cast<size_t>(prio)];
+    for (auto &job : jobs)
+      dq.push_back(std::move(job));
+  }
+  queued.fetch_add(jobs.size());
+  // the ones that wake up steal the rest of the batch
+  wake(jobs.size());
+}
+
+// wakes up to n sleeping workers. the lock orders this after the check of a
+// worker that is about to sleep, so it can not miss the new jobs
+void ThreadPool::wake(size_t n) {
+  size_t idle;
   {
+    std::lock_guard lock(mu);
+    idle = sleeping;
+  }
+  if (idle == 0)
+    return;
+  if (n >= idle) {
+    cv.notify_all();
+    return;
+  }
+  for (size_t i = 0; i < n; ++i)
+    cv.notify_one();
+}
+
+// the first job by priority: the front of its own deque, then the back of
+// the others'
+bool ThreadPool::pop(size_t self, std::function<void()> &job) {
+  if (queued.load() == 0)
+    return false;
+  for (size_t p = 0; p < PRIORITIES; ++p) {
+    for (size_t i = 0; i < queues.size(); ++i) {
+      size_t at = (self + i) % queues.size();
+      Queue &q = *queues[at];
+      std::lock_guard lock(q.mu);
+      auto &dq = q.jobs[p];
+      if (dq.empty())
+        continue;
+      if (at == self) {
+        job = std::move(dq.front());
+        dq.pop_front();
+      } else {
+        job = std::move(dq.back());
+        dq.pop_back();
+      }
+      queued.fetch_sub(1);
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::run(size_t self) {
+  current_pool = this;
+  current_worker = self;
+  std::function<void()> job;
+  while (true) {
+    if (pop(self, job)) {
+      job();
+      job = nullptr;
+      continue;
+    }
     std::unique_lock lock(mu);
-    tasks.push(std::move(job));
+    if (queued.load() > 0)
+      continue;
+    if (stop)
+      return;
+    ++sleeping;
+    cv.wait(lock, [this] { return stop || queued.load() > 0; });
+    --sleeping;
   }
-  cv.notify_one();
 }
 
 } // namespace kv
@@ -0,0 +1,79 @@
+#include "../include/kv/timing_wheel.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace kv {
+
+TimingWheel::TimingWheel(uint64_t tick_ms, uint64_t start_ms)
+    : tick_ms(tick_ms ? tick_ms : 1), now_tick(start_ms / this->tick_ms) {}
+
+// puts a timer in the slot of its tick. the level is picked by how far away
+// the tick is, the slot inside the level by the tick itself
+void TimingWheel::place(const ExpiryTimer &t) {
+  uint64_t tick = (t.expires_at + tick_ms - 1) / tick_ms;
+  if (tick <= now_tick)
+    tick = now_tick + 1; // already due, fires on the next tick
+  uint64_t delta = tick - now_tick;
+  constexpr uint64_t span = 1ull << (SLOT_BITS * LEVELS);
+  if (delta >= span)
+    tick = now_tick + span - 1; // parked at the far end, placed again later
+
+  unsigned level = 0;
+  while (level + 1 < LEVELS && (tick - now_tick) >> (SLOT_BITS * (level + 1)))
+    ++level;
+  slots[level][(tick >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(t);
+}
+
+// spreads the current slot of level over the levels below it
+void TimingWheel::cascade(unsigned level) {
+  auto &slot = slots[level][(now_tick >> (SLOT_BITS * level)) & (SLOTS - 1)];
+  std::vector<ExpiryTimer> moving;
+  moving.swap(slot);
+  for (const auto &t : moving)
+    place(t);
+}
+
+void TimingWheel::add(const ExpiryTimer &t) {
+  std::lock_guard lock(mu);
+  place(t);
+  ++count;
+}
+
+void TimingWheel::advance(uint64_t now_ms, std::vector<ExpiryTimer> &due) {
+  std::lock_guard lock(mu);
+  uint64_t target = now_ms / tick_ms;
+  while (now_tick < target) {
+    if (count == 0) {
+      now_tick = target; // nothing to fire, skip the idle ticks
+      break;
+    }
+    ++now_tick;
+    // a level gets cascaded each time the one below wrapped around
+    for (unsigned level = 1; level < LEVELS; ++level) {
+      if (now_tick & ((1ull << (SLOT_BITS * level)) - 1))
+        break;
+      cascade(level);
+    }
+    auto &slot = slots[0][now_tick & (SLOTS - 1)];
+    std::vector<ExpiryTimer> firing;
+    firing.swap(slot);
+    for (const auto &t : firing) {
+      if (t.expires_at <= now_ms) {
+        due.push_back(t);
+        --count;
+      } else {
+        place(t); // a parked far away timer, or one later in this tick
+      }
+    }
+  }
+}
+
+size_t TimingWheel::size() {
+  std::lock_guard lock(mu);
+  return count;
+}
+
+} // namespace kv
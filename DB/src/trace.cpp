@@ -0,0 +1,149 @@
+#include "../include/kv/trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace kv {
+
+// spans kept per thread, the oldest are overwritten
+static constexpr size_t RING_EVENTS = 16384;
+
+struct TraceEvent {
+  const char *name;
+  const char *arg;
+  uint64_t start_ns, end_ns, request, value;
+};
+
+struct TraceRing {
+  std::mutex mu; // only a dump takes it from another thread
+  uint32_t tid = 0;
+  std::vector<TraceEvent> events;
+  size_t next = 0;
+  bool wrapped = false;
+};
+
+static std::mutex rings_mu;
+static std::vector<std::shared_ptr<TraceRing>> rings; // outlive their threads
+// sampled when a random 32 bit number is below it, 1 << 32 samples all
+static std::atomic<uint64_t> threshold{0};
+static std::atomic<uint64_t> next_request{1};
+
+static thread_local std::shared_ptr<TraceRing> ring;
+
+// xorshift, seeded per thread so the threads do not sample in step
+static uint32_t traceRandom() {
+  static std::atomic<uint64_t> seeds{0x9e3779b97f4a7c15ull};
+  thread_local uint64_t x = seeds.fetch_add(0x9e3779b97f4a7c15ull) | 1;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return static_cast<uint32_t>(x >> 32);
+}
+
+uint64_t traceNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void setTraceRate(double rate) {
+  rate = std::clamp(rate, 0.0, 1.0);
+  threshold = static_cast<uint64_t>(rate * 4294967296.0);
+}
+
+double traceRate() { return threshold.load() / 4294967296.0; }
+
+void traceRecord(const char *name, uint64_t start_ns, uint64_t end_ns,
+                 const char *arg, uint64_t value) {
+  if (!ring) {
+    auto r = std::make_shared<TraceRing>();
+    r->events.resize(RING_EVENTS);
+    std::lock_guard lock(rings_mu);
+    r->tid = static_cast<uint32_t>(rings.size() + 1);
+    rings.push_back(r);
+    ring = std::move(r);
+  }
+  std::lock_guard lock(ring->mu);
+  ring->events[ring->next] = {name,   arg,           start_ns,
+                              end_ns, trace_request, value};
+  if (++ring->next == RING_EVENTS) {
+    ring->next = 0;
+    ring->wrapped = true;
+  }
+}
+
+TraceRequest::TraceRequest(const char *name) : name(name) {
+  uint64_t t = threshold.load(std::memory_order_relaxed);
+  if (trace_request || t == 0 || traceRandom() >= t)
+    return;
+  trace_request = next_request.fetch_add(1);
+  start = traceNowNs();
+}
+
+TraceRequest::~TraceRequest() {
+  if (!start)
+    return;
+  traceRecord(name, start, traceNowNs(), nullptr, 0);
+  trace_request = 0;
+}
+
+// ts and dur are in microseconds, the nanoseconds go behind the dot
+static void appendUs(std::string &out, uint64_t ns) {
+  out += std::to_string(ns / 1000);
+  std::string frac = std::to_string(ns % 1000);
+  out += '.';
+  out.append(3 - frac.size(), '0');
+  out += frac;
+}
+
+std::string dumpTrace(bool clear) {
+  std::vector<std::shared_ptr<TraceRing>> all;
+  {
+    std::lock_guard lock(rings_mu);
+    all = rings;
+  }
+  std::string out = "{\"traceEvents\":[";
+  bool first = true;
+  for (auto &r : all) {
+    std::lock_guard lock(r->mu);
+    size_t n = r->wrapped ? RING_EVENTS : r->next;
+    for (size_t i = 0; i < n; ++i) {
+      const TraceEvent &e = r->events[i];
+      if (!first)
+        out += ',';
+      first = false;
+      // one complete event, chrome nests them by time per thread
+      out += "{\"name\":\"";
+      out += e.name;
+      out += "\",\"ph\":\"X\",\"pid\":1,\"tid\":";
+      out += std::to_string(r->tid);
+      out += ",\"ts\":";
+      appendUs(out, e.start_ns);
+      out += ",\"dur\":";
+      appendUs(out, e.end_ns - e.start_ns);
+      out += ",\"args\":{\"request\":";
+      out += std::to_string(e.request);
+      if (e.arg) {
+        out += ",\"";
+        out += e.arg;
+        out += "\":";
+        out += std::to_string(e.value);
+      }
+      out += "}}";
+    }
+    if (clear) {
+      r->next = 0;
+      r->wrapped = false;
+    }
+  }
+  out += "]}";
+  return out;
+}
+
+} // namespace kv
@@ -0,0 +1,116 @@
+#include "../include/kv/workload.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace kv {
+
+static size_t bucketOf(size_t len) {
+  size_t b = 0;
+  while (b + 1 < SIZE_BUCKETS && (size_t{1} << b) <= len)
+    ++b;
+  return b;
+}
+
+double WorkloadSnapshot::readShare() const {
+  return ops() ? static_cast<double>(reads) / ops() : 0;
+}
+
+double WorkloadSnapshot::missRate() const {
+  return reads ? static_cast<double>(misses) / reads : 0;
+}
+
+double WorkloadSnapshot::bloomFalseRate() const {
+  return bloom_checks ? static_cast<double>(bloom_false) / bloom_checks : 0;
+}
+
+size_t WorkloadSnapshot::meanKey() const {
+  return sized ? key_bytes / sized : 0;
+}
+
+size_t WorkloadSnapshot::meanValue() const {
+  return sized ? value_bytes / sized : 0;
+}
+
+size_t WorkloadSnapshot::quantile(const SizeHistogram &h, double q) {
+  uint64_t total = 0;
+  for (uint64_t n : h)
+    total += n;
+  if (total == 0)
+    return 0;
+  uint64_t seen = 0;
+  for (size_t b = 0; b < SIZE_BUCKETS; ++b) {
+    seen += h[b];
+    if (seen >= q * total)
+      return size_t{1} << b;
+  }
+  return size_t{1} << (SIZE_BUCKETS - 1);
+}
+
+WorkloadSnapshot
+WorkloadSnapshot::operator-(const WorkloadSnapshot &before) const {
+  WorkloadSnapshot d;
+  d.reads = reads - before.reads;
+  d.misses = misses - before.misses;
+  d.writes = writes - before.writes;
+  d.erases = erases - before.erases;
+  d.merges = merges - before.merges;
+  d.key_bytes = key_bytes - before.key_bytes;
+  d.value_bytes = value_bytes - before.value_bytes;
+  d.sized = sized - before.sized;
+  d.bloom_checks = bloom_checks - before.bloom_checks;
+  d.bloom_false = bloom_false - before.bloom_false;
+  for (size_t b = 0; b < SIZE_BUCKETS; ++b) {
+    d.key_sizes[b] = key_sizes[b] - before.key_sizes[b];
+    d.value_sizes[b] = value_sizes[b] - before.value_sizes[b];
+  }
+  return d;
+}
+
+void WorkloadStats::sizes(size_t key_len, size_t val_len) {
+  key_bytes.fetch_add(key_len, std::memory_order_relaxed);
+  value_bytes.fetch_add(val_len, std::memory_order_relaxed);
+  sized.fetch_add(1, std::memory_order_relaxed);
+  key_sizes[bucketOf(key_len)].fetch_add(1, std::memory_order_relaxed);
+  value_sizes[bucketOf(val_len)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void WorkloadStats::read(size_t key_len, bool found, size_t val_len) {
+  reads.fetch_add(1, std::memory_order_relaxed);
+  if (found)
+    sizes(key_len, val_len);
+  else
+    misses.fetch_add(1, std::memory_order_relaxed);
+}
+
+void WorkloadStats::write(size_t key_len, size_t val_len) {
+  writes.fetch_add(1, std::memory_order_relaxed);
+  sizes(key_len, val_len);
+}
+
+void WorkloadStats::bloom(uint64_t checks, uint64_t false_hits) {
+  bloom_checks.fetch_add(checks, std::memory_order_relaxed);
+  if (false_hits)
+    bloom_false.fetch_add(false_hits, std::memory_order_relaxed);
+}
+
+WorkloadSnapshot WorkloadStats::snapshot() const {
+  WorkloadSnapshot s;
+  s.reads = reads.load(std::memory_order_relaxed);
+  s.misses = misses.load(std::memory_order_relaxed);
+  s.writes = writes.load(std::memory_order_relaxed);
+  s.erases = erases.load(std::memory_order_relaxed);
+  s.merges = merges.load(std::memory_order_relaxed);
+  s.key_bytes = key_bytes.load(std::memory_order_relaxed);
+  s.value_bytes = value_bytes.load(std::memory_order_relaxed);
+  s.sized = sized.load(std::memory_order_relaxed);
+  s.bloom_checks = bloom_checks.load(std::memory_order_relaxed);
+  s.bloom_false = bloom_false.load(std::memory_order_relaxed);
+  for (size_t b = 0; b < SIZE_BUCKETS; ++b) {
+    s.key_sizes[b] = key_sizes[b].load(std::memory_order_relaxed);
+    s.value_sizes[b] = value_sizes[b].load(std::memory_order_relaxed);
+  }
+  return s;
+}
+
+} // namespace kv